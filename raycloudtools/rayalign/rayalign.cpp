@@ -13,11 +13,14 @@
 
 #include <nabo/nabo.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <complex>
+#include <fstream>
 #include <iostream>
+#include <memory>
 
 void usage(int exit_code = 1)
 {
@@ -29,19 +32,134 @@ void usage(int exit_code = 1)
   std::cout << "                             --nonrigid - nonrigid (quadratic) alignment" << std::endl;
   std::cout << "                             --verbose  - outputs FFT images and the coarse alignment cloud" << std::endl;
   std::cout << "                             --local    - fine alignment only, assumes clouds are already approximately aligned" << std::endl;
+  std::cout << "                             --pyramid  - coarse-to-fine alignment in bounded grids, for very large clouds" << std::endl;
+  std::cout << "rayalign batch raycloudB raycloudA1 raycloudA2 ... - aligns each raycloudA onto raycloudB, in parallel." << std::endl;
+  std::cout << "                             Outputs each raycloudA_aligned.ply and the transformations in raycloudB_transforms.txt" << std::endl;
   std::cout << "rayalign raycloud  - axis aligns to the walls, placing the major walls at (0,0,0), biggest along y." << std::endl;
   // clang-format on
   exit(exit_code);
 }
 
+/// Two distant points in the cloud, as an independent method of determining the total transformation applied
+class TransformationTracker
+{
+public:
+  explicit TransformationTracker(const ray::Cloud &cloud)
+    : min_i_(0)
+    , max_i_(0)
+  {
+    for (size_t i = 0; i < cloud.ends.size(); i++)
+    {
+      if (cloud.ends[i][0] < cloud.ends[min_i_][0])
+        min_i_ = i;
+      if (cloud.ends[i][0] > cloud.ends[max_i_][0])
+        max_i_ = i;
+    }
+    pos_ = cloud.ends[min_i_];
+    dir_ = Eigen::Vector3d(cloud.ends[max_i_][0] - pos_[0], cloud.ends[max_i_][1] - pos_[1], 0).normalized();
+  }
+
+  /// The yaw @c angle (in radians) then @c translation applied to @c cloud since construction
+  void getTransformation(const ray::Cloud &cloud, double &angle, Eigen::Vector3d &translation) const
+  {
+    Eigen::Vector3d pos2 = cloud.ends[min_i_];
+    Eigen::Vector3d dir2 =
+      Eigen::Vector3d(cloud.ends[max_i_][0] - pos2[0], cloud.ends[max_i_][1] - pos2[1], 0).normalized();
+    angle = std::atan2((dir_.cross(dir2))[2], dir_.dot(dir2));
+    Eigen::Vector3d rotated_pos1(pos_[0] * std::cos(angle) - pos_[1] * std::sin(angle),
+                                 pos_[0] * std::sin(angle) + pos_[1] * std::cos(angle), pos_[2]);
+    translation = pos2 - rotated_pos1;
+  }
+
+private:
+  size_t min_i_, max_i_;
+  Eigen::Vector3d pos_, dir_;
+};
+
+/// Aligns each of the @c cloud_files to @c reference_file. The reference is loaded and preprocessed once, then the
+/// clouds are aligned in parallel, one per thread
+bool batchAlign(const std::string &reference_file, const std::vector<ray::FileArgument> &cloud_files, bool local_only,
+                bool pyramid, bool non_rigid, bool verbose)
+{
+  std::unique_ptr<ray::AlignmentReference> coarse_reference;
+  std::shared_ptr<const ray::FineAlignment::Target> fine_target;
+  {
+    ray::Cloud reference;
+    if (!reference.load(reference_file))
+      return false;
+    if (!local_only)
+      coarse_reference = std::make_unique<ray::AlignmentReference>(reference, 0.5, pyramid ? 256 : 0, verbose);
+    fine_target = ray::FineAlignment::createTarget(reference, verbose);
+  }
+
+  std::vector<char> aligned(cloud_files.size(), false);  // not vector<bool>, which is unsafe to write concurrently
+  std::vector<double> angles(cloud_files.size(), 0.0);
+  std::vector<Eigen::Vector3d> translations(cloud_files.size(), Eigen::Vector3d(0, 0, 0));
+  // each thread holds one cloud in memory. Nested parallel regions within the alignment run on the calling thread
+  #pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < (int)cloud_files.size(); i++)
+  {
+    ray::Cloud cloud;
+    if (!cloud.load(cloud_files[i].name()))
+      continue;
+    TransformationTracker tracker(cloud);
+    if (coarse_reference)
+      coarse_reference->align(cloud);
+    ray::FineAlignment fine_align(&cloud, fine_target, non_rigid, false);
+    fine_align.align();
+    tracker.getTransformation(cloud, angles[i], translations[i]);
+    cloud.save(cloud_files[i].nameStub() + "_aligned.ply");
+    aligned[i] = true;
+  }
+
+  const std::string transforms_file = ray::getFileNameStub(reference_file) + "_transforms.txt";
+  std::ofstream ofs(transforms_file);
+  if (!ofs.is_open())
+  {
+    std::cerr << "Error: cannot open " << transforms_file << " for writing" << std::endl;
+    return false;
+  }
+  ofs << "# cloud, yaw rotation (degrees), then translation x y z" << std::endl;
+  if (non_rigid)
+    ofs << "# approximate, as a non-rigid transformation was applied" << std::endl;
+  bool all_aligned = true;
+  for (size_t i = 0; i < cloud_files.size(); i++)
+  {
+    if (!aligned[i])
+    {
+      std::cerr << "Error: could not align " << cloud_files[i].name() << std::endl;
+      all_aligned = false;
+      continue;
+    }
+    ofs << cloud_files[i].name() << " " << angles[i] * 180.0 / ray::kPi << " " << translations[i].transpose()
+        << std::endl;
+  }
+  std::cout << "Aligned " << std::count(aligned.begin(), aligned.end(), (char)true) << " of " << cloud_files.size()
+            << " clouds, transformations written to " << transforms_file << std::endl;
+  return all_aligned;
+}
+
 int rayAlign(int argc, char *argv[])
 {
   ray::FileArgument cloud_a, cloud_b;
-  ray::OptionalFlagArgument nonrigid("nonrigid", 'n'), is_verbose("verbose", 'v'), local("local", 'l');
-  bool cross_align = ray::parseCommandLine(argc, argv, { &cloud_a, &cloud_b }, { &nonrigid, &is_verbose, &local });
+  ray::OptionalFlagArgument nonrigid("nonrigid", 'n'), is_verbose("verbose", 'v'), local("local", 'l'),
+    pyramid("pyramid", 'p');
+  bool cross_align =
+    ray::parseCommandLine(argc, argv, { &cloud_a, &cloud_b }, { &nonrigid, &is_verbose, &local, &pyramid });
   bool self_align = ray::parseCommandLine(argc, argv, { &cloud_a });
-  if (!cross_align && !self_align)
+  ray::TextArgument batch("batch");
+  ray::FileArgumentList cloud_files(1);
+  bool batch_align = ray::parseCommandLine(argc, argv, { &batch, &cloud_b, &cloud_files },
+                                           { &nonrigid, &is_verbose, &local, &pyramid });
+  if (!cross_align && !self_align && !batch_align)
     usage();
+  if (batch_align)
+  {
+    if (!batchAlign(cloud_b.name(), cloud_files.files(), local.isSet(), pyramid.isSet(), nonrigid.isSet(),
+                    is_verbose.isSet()))
+      return 1;
+    return 0;
+  }
 
   std::string aligned_name = cloud_a.nameStub() + "_aligned.ply";
   if (self_align)
@@ -58,26 +176,17 @@ int rayAlign(int argc, char *argv[])
     if (!clouds[1].load(cloud_b.name()))
       usage();
 
-    // Here we pick two distant points in the cloud as an independent method of determining the total transformation
-    // applied
-    size_t min_i = 0, max_i = 0;
-    for (size_t i = 0; i < clouds[0].ends.size(); i++)
-    {
-      if (clouds[0].ends[i][0] < clouds[0].ends[min_i][0])
-        min_i = i;
-      if (clouds[0].ends[i][0] > clouds[0].ends[max_i][0])
-        max_i = i;
-    }
-    Eigen::Vector3d pos1 = clouds[0].ends[min_i];
-    Eigen::Vector3d dir1 =
-      Eigen::Vector3d(clouds[0].ends[max_i][0] - pos1[0], clouds[0].ends[max_i][1] - pos1[1], 0).normalized();
+    TransformationTracker tracker(clouds[0]);
 
     bool local_only = local.isSet();
     bool non_rigid = nonrigid.isSet();
     bool verbose = is_verbose.isSet();
     if (!local_only)
     {
-      alignCloud0ToCloud1(clouds, 0.5, verbose);
+      if (pyramid.isSet())
+        alignCloud0ToCloud1Pyramid(clouds, 0.5, 256, verbose);
+      else
+        alignCloud0ToCloud1(clouds, 0.5, verbose);
       if (verbose)
         clouds[0].save(cloud_a.nameStub() + "_coarse_aligned.ply");
     }
@@ -86,13 +195,9 @@ int rayAlign(int argc, char *argv[])
     fineAlign.align();
 
     // Now we calculate the rigid transformation from the change in the position of the two points:
-    Eigen::Vector3d pos2 = clouds[0].ends[min_i];
-    Eigen::Vector3d dir2 =
-      Eigen::Vector3d(clouds[0].ends[max_i][0] - pos2[0], clouds[0].ends[max_i][1] - pos2[1], 0).normalized();
-    double angle = std::atan2((dir1.cross(dir2))[2], dir1.dot(dir2));
-    Eigen::Vector3d rotated_pos1(pos1[0] * std::cos(angle) - pos1[1] * std::sin(angle),
-                                 pos1[0] * std::sin(angle) + pos1[1] * std::cos(angle), pos1[2]);
-    Eigen::Vector3d dif = pos2 - rotated_pos1;
+    double angle;
+    Eigen::Vector3d dif;
+    tracker.getTransformation(clouds[0], angle, dif);
     std::cout << "Transformation of " << cloud_a.nameStub() << ":" << std::endl;
     std::cout << "          rotation: (0, 0, " << angle * 180.0 / ray::kPi << ") degrees " << std::endl;
     std::cout << "  then translation: (" << dif.transpose() << ")" << std::endl;
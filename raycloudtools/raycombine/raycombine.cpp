@@ -33,6 +33,9 @@ void usage(int exit_code = 1)
   std::cout << "raycombine basecloud min raycloud1 raycloud2 20 rays - 3-way merge, choses the changed geometry (from basecloud) at any differences. " << std::endl;
   std::cout << "                                                       For merge conflicts it uses the specified merge type." << std::endl;
   std::cout << "        --output raycloud_combined.ply               - optionally specify the output file name." << std::endl;
+  std::cout << "        --incremental                                - for min/max/oldest/newest/order: raycloud1 is a previously merged cloud," << std::endl;
+  std::cout << "                                                       the others are merged into it incrementally, at a cost proportional to" << std::endl;
+  std::cout << "                                                       their size. The merge state is kept in raycloud1_merge.dat" << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -48,9 +51,11 @@ int rayCombine(int argc, char *argv[])
   // Below: false = allow unusual file extensions, for auto-merging, which occurs on non-standard temporary file names
   ray::FileArgument base_cloud(false), cloud_1(false), cloud_2(false), output_file(false);
   ray::OptionalKeyValueArgument output("output", 'o', &output_file);
+  ray::OptionalFlagArgument incremental("incremental", 'i');
 
   // three-way merge option
-  bool standard_format = ray::parseCommandLine(argc, argv, { &merge_type, &cloud_files, &num_rays, &rays_text }, { &output });
+  bool standard_format =
+    ray::parseCommandLine(argc, argv, { &merge_type, &cloud_files, &num_rays, &rays_text }, { &output, &incremental });
   bool concatenate_all = ray::parseCommandLine(argc, argv, { &all_text, &cloud_files }, { &output });
   bool threeway = ray::parseCommandLine(
     argc, argv, { &base_cloud, &merge_type, &cloud_1, &cloud_2, &num_rays, &rays_text }, { &output });
@@ -149,7 +154,37 @@ int rayCombine(int argc, char *argv[])
   ray::Cloud concatenated_cloud;
   const ray::Cloud *fixed_cloud = &merger.fixedCloud();
 
-  if (threeway || threeway_concatenate)
+  if (incremental.isSet())
+  {
+    // the first cloud is the merged cloud, which has its merge state saved alongside it
+    ray::MergeState state;
+    const std::string state_file = file_stub + "_merge.dat";
+    if (!state.load(state_file) || state.ellipsoids.size() != clouds[0].rayCount())
+    {
+      std::cout << "no valid merge state in " << state_file << ", generating it from " << cloud_files.files()[0].name()
+                << std::endl;
+      merger.generateMergeState(clouds[0], &state, &progress);
+    }
+    ray::Cloud merged = clouds[0];
+    ray::Cloud differences;
+    for (size_t c = 1; c < clouds.size(); c++)
+    {
+      std::cout << "incremental merge of " << clouds[c].rayCount() << " rays into the " << merged.rayCount()
+                << " ray merged cloud" << std::endl;
+      if (!merger.mergeIncremental(merged, &state, clouds[c], &progress))
+        usage();
+      merged = merger.fixedCloud();
+      const ray::Cloud &difference = merger.differenceCloud();
+      for (size_t i = 0; i < difference.rayCount(); i++) differences.addRay(difference, i);
+    }
+    progress_thread.join();
+    std::cout << differences.rayCount() << " transients, " << merged.rayCount() << " fixed rays." << std::endl;
+    differences.save(file_stub + "_differences.ply");
+    merged.save(combined_file);
+    state.save(ray::getFileNameStub(combined_file) + "_merge.dat");
+    return 0;
+  }
+  else if (threeway || threeway_concatenate)
   {
     ray::Cloud base_cloud;
     if (!base_cloud.load(argv[1], false))
@@ -19,7 +19,7 @@ void usage(int exit_code = 1)
   // clang-format off
   std::cout << "Export a ray cloud into a point cloud amd trajectory file" << std::endl;
   std::cout << "usage:" << std::endl;
-  std::cout << "rayexport raycloudfile.ply pointcloud.ply/.laz/.txt/.xyz trajectoryfile.ply/.txt - output in the chosen point cloud and trajectory formats" << std::endl;
+  std::cout << "rayexport raycloudfile.ply pointcloud.ply/.laz/.txt/.xyz trajectoryfile.ply/.txt/.bin - output in the chosen point cloud and trajectory formats" << std::endl;
   std::cout << "                           --traj_delta 0.1 - trajectory temporal decimation period in s. Default is 0.1" << std::endl;
   // clang-format on
   exit(exit_code);
@@ -139,7 +139,7 @@ int rayExport(int argc, char *argv[])
       usage();
     ray::writePointCloudChunkEnd(ofs);
   }
-  else if (trajectory_file.nameExt() == "txt")  // for text files we decimate and then sort
+  else if (trajectory_file.nameExt() == "txt" || trajectory_file.nameExt() == "bin")  // we decimate and then sort
   {
     std::cout << "traj: " << trajectory_file.name() << std::endl;
     std::vector<ray::TrajectoryNode> traj_nodes;
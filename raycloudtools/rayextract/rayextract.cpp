@@ -6,6 +6,7 @@
 #include "raylib/extraction/rayclusters.h"
 #include "raylib/extraction/rayforest.h"
 #include "raylib/extraction/rayterrain.h"
+#include "raylib/extraction/raytiles.h"
 #include "raylib/extraction/raytrees.h"
 #include "raylib/extraction/raytrunks.h"
 #include "raylib/extraction/rayleaves.h"
@@ -13,6 +14,7 @@
 #include "raylib/rayforestgen.h"
 #include "raylib/rayforeststructure.h"
 #include "raylib/raymesh.h"
+#include "raylib/raymeshwriter.h"
 #include "raylib/rayparse.h"
 #include "raylib/rayply.h"
 
@@ -31,13 +33,17 @@ void usage(int exit_code = 1)
   std::cout << "usage:" << std::endl;
   if (extract_type == "terrain" || none)
   {
-    std::cout << "rayextract terrain cloud.ply                - extract terrain undersurface to mesh. Slow, so consider decimating first." << std::endl;
+    std::cout << "rayextract terrain cloud.ply                - extract terrain undersurface to mesh." << std::endl;
     std::cout << "                            --gradient 1    - maximum gradient counted as terrain" << std::endl;
+    std::cout << "                            --tiles 50,10   - (-t) process in parallel tiles of width 50 m and 10 m overlap, welding the tile meshes" << std::endl;
+    std::cout << "                            --tile_memory 8 - (-r) maximum GB used by the tiles in progress" << std::endl;
   }
   if (extract_type == "trunks" || none)
   {
     std::cout << "rayextract trunks cloud.ply                 - extract tree trunk base locations and radii to text file" << std::endl;
     std::cout << "                            --exclude_rays  - does not use rays to exclude candidates with rays passing through" << std::endl;
+    std::cout << "                            --tiles 50,10   - (-t) process in parallel tiles of width 50 m and 10 m overlap, see raysplit grid" << std::endl;
+    std::cout << "                            --tile_memory 8 - (-r) maximum GB used by the tiles in progress" << std::endl;
   }
   if (extract_type == "forest" || none)
   {
@@ -62,6 +68,8 @@ void usage(int exit_code = 1)
     std::cout << "                            --branch_segmentation- (-b) _segmented.ply is per branch segment" << std::endl;
     std::cout << "                            --grid_width 10      - (-w) crops results assuming cloud has been gridded with given width" << std::endl;
     std::cout << "                            --use_rays           - (-u) use rays to reduce trunk radius overestimation in noisy cloud data" << std::endl;
+    std::cout << "                            --tiles 50,10        - (-t) process in parallel tiles of width 50 m and 10 m overlap, then stitch the results" << std::endl;
+    std::cout << "                            --tile_memory 8      - (-r) maximum GB used by the tiles in progress" << std::endl;
     std::cout << "                            (for internal constants -c -g -s see source file rayextract)" << std::endl;
   // These are the internal parameters that I don't expose as they are 'advanced' only, you shouldn't need to adjust them
   //  std::cout << "                            --cylinder_length_to_width 4- (-c) how slender the cylinders are" << std::endl;
@@ -121,6 +129,10 @@ int rayExtract(int argc, char *argv[])
   ray::OptionalKeyValueArgument leaf_option("leaf", 'l', &leaf_file);
   ray::OptionalKeyValueArgument leaf_area_option("leaf_area", 'a', &leaf_area);
   ray::OptionalKeyValueArgument leaf_droop_option("leaf_droop", 'd', &leaf_droop);
+  ray::Vector2dArgument tiles(0.01, 100000.0);
+  ray::DoubleArgument tile_memory(0.01, 100000.0, 8.0);
+  ray::OptionalKeyValueArgument tiles_option("tiles", 't', &tiles);
+  ray::OptionalKeyValueArgument tile_memory_option("tile_memory", 'r', &tile_memory);
 
   ray::IntArgument smooth(0, 50);
   ray::OptionalKeyValueArgument width_option("width", 'w', &width), smooth_option("smooth", 's', &smooth),
@@ -128,8 +140,8 @@ int rayExtract(int argc, char *argv[])
 
   ray::OptionalFlagArgument verbose("verbose", 'v');
 
-  bool extract_terrain = ray::parseCommandLine(argc, argv, { &terrain, &cloud_file }, { &gradient_option, &verbose });
-  bool extract_trunks = ray::parseCommandLine(argc, argv, { &trunks, &cloud_file }, { &exclude_rays, &verbose });
+  bool extract_terrain = ray::parseCommandLine(argc, argv, { &terrain, &cloud_file }, { &gradient_option, &tiles_option, &tile_memory_option, &verbose });
+  bool extract_trunks = ray::parseCommandLine(argc, argv, { &trunks, &cloud_file }, { &exclude_rays, &tiles_option, &tile_memory_option, &verbose });
   bool extract_forest = ray::parseCommandLine(
     argc, argv, { &forest, &cloud_file },
     { &groundmesh_option, &trunks_option, &width_option, &smooth_option, &drop_option, &verbose });
@@ -137,7 +149,7 @@ int rayExtract(int argc, char *argv[])
     argc, argv, { &trees, &cloud_file, &mesh_file },
     { &max_diameter_option, &distance_limit_option, &height_min_option, &crop_length_option, &girth_height_ratio_option,
       &cylinder_length_to_width_option, &gap_ratio_option, &span_ratio_option, &gravity_factor_option,
-      &segment_branches, &grid_width_option, &global_taper_option, &global_taper_factor_option, &use_rays, &verbose });
+      &segment_branches, &grid_width_option, &global_taper_option, &global_taper_factor_option, &use_rays, &tiles_option, &tile_memory_option, &verbose });
   bool extract_leaves = ray::parseCommandLine(argc, argv, { &leaves, &cloud_file, &trees_file }, { &leaf_option, &leaf_area_option, &leaf_droop_option, &stalks });
 
 
@@ -145,9 +157,46 @@ int rayExtract(int argc, char *argv[])
   {
     usage();
   }
+  // the tiles are split from the cloud on disk, in the same manner as raysplit grid
+  std::vector<ray::CloudTile> cloud_tiles;
+  const unsigned long long max_tile_memory = static_cast<unsigned long long>(tile_memory.value() * 1e9);
+  if ((extract_trunks || extract_trees || extract_terrain) && tiles_option.isSet())
+  {
+    if (tiles.value()[1] >= tiles.value()[0])
+    {
+      std::cerr << "Error: the tile overlap must be less than the tile width" << std::endl;
+      usage(true);
+    }
+    if (!ray::splitIntoTiles(cloud_file.name(), cloud_file.nameStub() + "_tile", tiles.value()[0], tiles.value()[1],
+                             cloud_tiles))
+    {
+      usage(true);
+    }
+  }
 
   // finds cylindrical trunks in the data and saves them to an _trunks.txt file
-  if (extract_trunks)
+  if (extract_trunks && tiles_option.isSet())
+  {
+    const double radius = 0.1;
+    const bool processed = ray::processTiles(cloud_tiles, max_tile_memory, [&](const ray::CloudTile &tile) {
+      ray::Cloud cloud;
+      if (!cloud.load(tile.stub + ".ply"))
+      {
+        return true;  // too few rays to contain any trunks
+      }
+      Eigen::Vector3d offset = cloud.removeStartPos();
+      ray::Trunks trunks(cloud, offset, radius, verbose.isSet(), exclude_rays.isSet());
+      return trunks.save(tile.stub + "_trunks.txt", offset);
+    });
+    const int num_trunks = processed ? ray::stitchTrunks(cloud_tiles, cloud_file.nameStub() + "_trunks.txt") : -1;
+    ray::removeTileFiles(cloud_tiles, { "_trunks.txt" });
+    if (num_trunks < 0)
+    {
+      return 1;
+    }
+    std::cout << num_trunks << " trunks saved from " << cloud_tiles.size() << " tiles" << std::endl;
+  }
+  else if (extract_trunks)
   {
     ray::Cloud cloud;
     if (!cloud.load(cloud_file.name()))
@@ -163,20 +212,12 @@ int rayExtract(int argc, char *argv[])
   // finds full tree structures (piecewise cylindrical representation) and saves to file
   else if (extract_trees)
   {
-    ray::Cloud cloud;
-    const int min_num_rays = 40;
-    if (!cloud.load(cloud_file.name(), true, min_num_rays))
-    {
-      usage(true);
-    }
-    Eigen::Vector3d offset = cloud.removeStartPos();
-
     ray::Mesh mesh;
     if (!ray::readPlyMesh(mesh_file.name(), mesh))
     {
       usage(true);
     }
-    mesh.translate(-offset);
+    const int min_num_rays = 40;
 
     ray::TreesParams params;
     if (max_diameter_option.isSet())
@@ -230,13 +271,60 @@ int rayExtract(int argc, char *argv[])
     params.use_rays = use_rays.isSet(); 
     params.segment_branches = segment_branches.isSet();
 
-    ray::Trees trees(cloud, offset, mesh, params, verbose.isSet());
+    if (tiles_option.isSet())
+    {
+      // each tile keeps only the trees based in its own cell
+      params.grid_width = tiles.value()[0];
+      params.use_grid_cell = true;
+      const bool processed = ray::processTiles(cloud_tiles, max_tile_memory, [&](const ray::CloudTile &tile) {
+        ray::Cloud cloud;
+        if (!cloud.load(tile.stub + ".ply", true, min_num_rays))
+        {
+          return true;  // too few rays to contain any trees
+        }
+        Eigen::Vector3d offset = cloud.removeStartPos();
+        ray::Mesh tile_mesh = mesh;
+        tile_mesh.translate(-offset);
+        ray::TreesParams tile_params = params;
+        tile_params.grid_cell = tile.index;
+        ray::Trees trees(cloud, offset, tile_mesh, tile_params, verbose.isSet());
+        if (!trees.save(tile.stub + "_trees.txt", offset, verbose.isSet()))
+        {
+          return false;
+        }
+        cloud.translate(offset);
+        cloud.save(tile.stub + "_segmented.ply");
+        return true;
+      });
+      const int num_trees =
+        processed ? ray::stitchTrees(cloud_tiles, cloud_file.nameStub() + "_trees.txt",
+                                     cloud_file.nameStub() + "_segmented.ply", params.segment_branches)
+                  : -1;
+      ray::removeTileFiles(cloud_tiles, { "_trees.txt", "_segmented.ply" });
+      if (num_trees < 0)  // an error, whereas no trees is a valid result, as in the untiled path
+      {
+        return 1;
+      }
+      std::cout << num_trees << " trees saved from " << cloud_tiles.size() << " tiles" << std::endl;
+    }
+    else
+    {
+      ray::Cloud cloud;
+      if (!cloud.load(cloud_file.name(), true, min_num_rays))
+      {
+        usage(true);
+      }
+      Eigen::Vector3d offset = cloud.removeStartPos();
+      mesh.translate(-offset);
 
-    // output the picewise cylindrical description of the trees
-    trees.save(cloud_file.nameStub() + "_trees.txt", offset, verbose.isSet());
-    // we also save a segmented (one colour per tree) file, as this is a useful output
-    cloud.translate(offset);
-    cloud.save(cloud_file.nameStub() + "_segmented.ply");
+      ray::Trees trees(cloud, offset, mesh, params, verbose.isSet());
+
+      // output the picewise cylindrical description of the trees
+      trees.save(cloud_file.nameStub() + "_trees.txt", offset, verbose.isSet());
+      // we also save a segmented (one colour per tree) file, as this is a useful output
+      cloud.translate(offset);
+      cloud.save(cloud_file.nameStub() + "_segmented.ply");
+    }
     // let's also save the trees out as a mesh
     // it is a bit inefficient to load from file just to convert it into the forest structure, but
     // it works OK for now. Better would be for ray::Trees so store the result as a ray::ForestStructure
@@ -245,9 +333,20 @@ int rayExtract(int argc, char *argv[])
     {
       usage();
     }
-    ray::Mesh tree_mesh;
-    forest.generateSmoothMesh(tree_mesh, -1, 1, 1, 1);
-    ray::writePlyMesh(cloud_file.nameStub() + "_trees_mesh.ply", tree_mesh, true);    
+    ray::MeshWriter mesh_writer;
+    if (!mesh_writer.begin(cloud_file.nameStub() + "_trees_mesh.ply", false, "", true))
+    {
+      return 1;
+    }
+    if (!forest.generateSmoothMesh(mesh_writer, -1, 1, 1, 1))
+    {
+      mesh_writer.abort();  // rather than saving a partial mesh
+      return 1;
+    }
+    if (!mesh_writer.end())
+    {
+      return 1;
+    }
   }
   // extract the tree locations from a larger, aerial view of a forest
   else if (extract_forest)
@@ -291,6 +390,36 @@ int rayExtract(int argc, char *argv[])
   // extract the terrain to a .ply mesh file
   // this uses a sand model (no terrain is sloped more than 'gradient') which is a
   // highest lower bound
+  else if (extract_terrain && tiles_option.isSet())
+  {
+    // the tiles share the offset and point spacing of the whole cloud, so that a ground point in the overlap between
+    // tiles is filtered alike and is meshed to the same vertex position in each tile
+    ray::Cloud::Info info;
+    if (!ray::Cloud::getInfo(cloud_file.name(), info))
+    {
+      usage(true);
+    }
+    const Eigen::Vector3d offset = info.ends_bound.min_bound_;
+    const double spacing = ray::Cloud::estimatePointSpacing(cloud_file.name(), info.ends_bound, info.num_bounded);
+    const bool processed = ray::processTiles(cloud_tiles, max_tile_memory, [&](const ray::CloudTile &tile) {
+      ray::Cloud cloud;
+      if (!cloud.load(tile.stub + ".ply"))
+      {
+        return true;  // too few rays to contain any terrain
+      }
+      cloud.translate(-offset);
+      ray::Terrain terrain;
+      terrain.extract(cloud, offset, tile.stub, gradient.value(), verbose.isSet(), spacing);
+      return true;
+    });
+    const int num_triangles = processed ? ray::stitchTerrain(cloud_tiles, cloud_file.nameStub() + "_mesh.ply") : -1;
+    ray::removeTileFiles(cloud_tiles, { "_mesh.ply", "_terrain.ply" });
+    if (num_triangles < 0)
+    {
+      return 1;
+    }
+    std::cout << num_triangles << " terrain triangles saved from " << cloud_tiles.size() << " tiles" << std::endl;
+  }
   else if (extract_terrain)
   {
     ray::Cloud cloud;
@@ -21,6 +21,7 @@ void usage(int exit_code = 1)
   std::cout << "usage:" << std::endl;
   std::cout << "rayimport pointcloudfile trajectoryfile  - pointcloudfile can be a .laz, .las or .ply file" << std::endl;
   std::cout << "                                           trajectoryfile is a text file using 'time x y z' format per line" << std::endl;
+  std::cout << "                                           or a binary .bin trajectory, as saved by rayexport" << std::endl;
   std::cout << "rayimport pointcloudfile 0,0,0           - use 0,0,0 as the sensor location" << std::endl;
   std::cout << "rayimport pointcloudfile ray 0,0,-10     - use 0,0,-10 as the constant ray vector from start to point" << std::endl;
   std::cout << "                                        --max_intensity 100 - specify maximum intensity value (default 100)." << std::endl;
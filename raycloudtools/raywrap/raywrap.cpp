@@ -37,14 +37,14 @@ int rayWrap(int argc, char *argv[])
   if (!ray::parseCommandLine(argc, argv, { &cloud_file, &direction, &curvature }, { &full }))
     usage();
 
-  ray::Cloud cloud;
-  if (!cloud.load(cloud_file.name()))
-    usage();
-  cloud.removeUnboundedRays();
-  Eigen::Vector3d offset = cloud.removeStartPos();
-
   if (full.isSet())
   {
+    ray::Cloud cloud;
+    if (!cloud.load(cloud_file.name()))
+      usage();
+    cloud.removeUnboundedRays();
+    Eigen::Vector3d offset = cloud.removeStartPos();
+
     ray::ConcaveHull concave_hull(cloud.ends);
     if (direction.selectedKey() == "inwards")
       concave_hull.growInwards(curvature.value());
@@ -62,7 +62,13 @@ int rayWrap(int argc, char *argv[])
   }
   else
   {
-    ray::ConvexHull convex_hull(cloud.ends);
+    // only the points that can lie on the hull are kept, so the whole cloud need not fit in memory
+    std::vector<Eigen::Vector3d> points;
+    Eigen::Vector3d offset, centre;
+    if (!ray::ConvexHull::loadCandidates(cloud_file.name(), direction.selectedKey(), curvature.value(), points, offset,
+                                         centre))
+      usage();
+    ray::ConvexHull convex_hull(points, centre);
     if (direction.selectedKey() == "inwards")
       convex_hull.growInwards(curvature.value());
     else if (direction.selectedKey() == "outwards")
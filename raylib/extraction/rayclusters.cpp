@@ -4,102 +4,157 @@
 //
 // Author: Thomas Lowe
 #include "rayclusters.h"
-#include <nabo/nabo.h>
+#include "../rayknn.h"
 
 namespace ray
 {
+namespace
+{
+// a neighbouring pair of points, with the lower index first
+struct PointPair
+{
+  double dist2;  // square distance
+  int id1, id2;
+};
+
+// a total order on the pairs, by distance, so that the agglomeration order does not depend on the sort method
+bool pairLess(const PointPair &a, const PointPair &b)
+{
+  if (a.dist2 != b.dist2)
+    return a.dist2 < b.dist2;
+  if (a.id1 != b.id1)
+    return a.id1 < b.id1;
+  return a.id2 < b.id2;
+}
+
+// sorts blocks of the pairs in parallel, then merges neighbouring blocks in parallel until one block remains.
+// Because pairLess is a total order, this gives the same result as a single std::sort
+void parallelSort(std::vector<PointPair> &pairs)
+{
+  const int block_size = 1 << 16;
+  const int num_blocks = (static_cast<int>(pairs.size()) + block_size - 1) / block_size;
+  #pragma omp parallel for schedule(dynamic)
+  for (int b = 0; b < num_blocks; b++)
+  {
+    const size_t start = static_cast<size_t>(b) * block_size;
+    const size_t end = std::min(start + block_size, pairs.size());
+    std::sort(pairs.begin() + start, pairs.begin() + end, pairLess);
+  }
+  for (size_t width = block_size; width < pairs.size(); width *= 2)
+  {
+    const int num_merges = static_cast<int>((pairs.size() + 2 * width - 1) / (2 * width));
+    #pragma omp parallel for schedule(dynamic)
+    for (int m = 0; m < num_merges; m++)
+    {
+      const size_t start = static_cast<size_t>(m) * 2 * width;
+      const size_t middle = std::min(start + width, pairs.size());
+      const size_t end = std::min(start + 2 * width, pairs.size());
+      std::inplace_merge(pairs.begin() + start, pairs.begin() + middle, pairs.begin() + end, pairLess);
+    }
+  }
+}
+}  // namespace
+
 // take the input points and separate into clusters based on a minimum and maximum separation diameter criterion
 // this is a form of agglomerative clustering
 void clustersAgglomerate(const std::vector<Eigen::Vector3d> &points, double min_diameter, double max_diameter,
                          std::vector<std::vector<int>> &point_clusters)
 {
   // 1. get nearest neighbours for each point
-  const int search_size = std::min(8, static_cast<int>(points.size()) - 1);
+  const int num_points = static_cast<int>(points.size());
+  const int search_size = std::min(8, num_points - 1);
   Eigen::MatrixXd points_p(3, points.size());
-  for (unsigned int i = 0; i < points.size(); i++)
+  for (int i = 0; i < num_points; i++)
   {
     points_p.col(i) = points[i];
   }
   Nabo::NNSearchD *nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
-  // Run the search
   Eigen::MatrixXi indices;
   Eigen::MatrixXd dists2;
-  indices.resize(search_size, points.size());
-  dists2.resize(search_size, points.size());
-  nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0, min_diameter);
+  parallelKnn(*nns, points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, min_diameter);
+  delete nns;
 
-  // temporary node structure in order to sort the neighbours by distance
-  struct Nd
+  // list each neighbouring pair once. A pair found from both of its points is a duplicate, which lands next to
+  // its twin once sorted
+  std::vector<int> pair_starts(num_points + 1, 0);
+  for (int i = 0; i < num_points; i++)
   {
-    Nd(int id1, int id2, double dist2)
-      : id1(id1)
-      , id2(id2)
-      , dist2(dist2)
-    {}
-    int id1, id2;
-    double dist2;  // square distance
-  };
-  std::vector<Nd> nds;
-  for (size_t i = 0; i < points.size(); i++)
+    int count = 0;
+    while (count < search_size && indices(count, i) != Nabo::NNSearchD::InvalidIndex)
+    {
+      count++;
+    }
+    pair_starts[i + 1] = pair_starts[i] + count;
+  }
+  std::vector<PointPair> pairs(pair_starts[num_points]);
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < num_points; i++)
   {
-    for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+    for (int j = 0; j < pair_starts[i + 1] - pair_starts[i]; j++)
     {
-      nds.push_back(Nd(static_cast<int>(i), indices(j, i), dists2(j, i)));
+      const int k = indices(j, i);
+      pairs[pair_starts[i] + j] = PointPair{ dists2(j, i), std::min(i, k), std::max(i, k) };
     }
   }
-  std::sort(nds.begin(), nds.end(), [](const Nd &nd1, const Nd &nd2) { return nd1.dist2 < nd2.dist2; });
+  parallelSort(pairs);
+  pairs.erase(std::unique(pairs.begin(), pairs.end(),
+                          [](const PointPair &a, const PointPair &b) { return a.id1 == b.id1 && a.id2 == b.id2; }),
+              pairs.end());
 
-  // temporary cluster structure
-  struct Cluster
-  {
-    Eigen::Vector3d min_bound, max_bound;
-    std::vector<int> ids;
-    bool active;
-  };
-  std::vector<Cluster> clusters(points.size());
-  std::vector<int> cluster_ids(points.size());
-  // initialise the clusters
-  for (size_t i = 0; i < points.size(); i++)
+  // the clusters are a union-find forest, whose root is the lowest point index in the cluster. The root holds the
+  // cluster bounds, and the start and end of a linked list of the cluster's point indices
+  std::vector<int> roots(num_points), heads(num_points), tails(num_points), nexts(num_points, -1);
+  std::vector<Eigen::Vector3d> min_bounds = points, max_bounds = points;
+  for (int i = 0; i < num_points; i++)
   {
-    clusters[i].min_bound = clusters[i].max_bound = points[i];
-    clusters[i].active = true;
-    clusters[i].ids.push_back(static_cast<int>(i));
-    cluster_ids[i] = static_cast<int>(i);
+    roots[i] = heads[i] = tails[i] = i;
   }
+  auto find_root = [&roots](int i) {
+    while (roots[i] != i)
+    {
+      roots[i] = roots[roots[i]];  // path halving
+      i = roots[i];
+    }
+    return i;
+  };
 
-  // 2. for each node in turn, from smallest to highest distance, agglomerate
-  for (auto &node : nds)
+  // 2. for each pair in turn, from smallest to highest distance, agglomerate. Each merge depends on the bounds from
+  // the previous merges, so this pass is sequential
+  for (auto &pair : pairs)
   {
-    if (cluster_ids[node.id1] == cluster_ids[node.id2])  // already part of same cluster
+    const int cl1 = find_root(pair.id1);
+    const int cl2 = find_root(pair.id2);
+    if (cl1 == cl2)  // already part of same cluster
     {
       continue;
     }
-    const int cl1 = cluster_ids[node.id1];
-    const int cl2 = cluster_ids[node.id2];
-    Eigen::Vector3d minb = minVector(clusters[cl1].min_bound, clusters[cl2].min_bound);
-    Eigen::Vector3d maxb = maxVector(clusters[cl1].max_bound, clusters[cl2].max_bound);
+    Eigen::Vector3d minb = minVector(min_bounds[cl1], min_bounds[cl2]);
+    Eigen::Vector3d maxb = maxVector(max_bounds[cl1], max_bounds[cl2]);
     Eigen::Vector3d dims = maxb - minb;
     double diam = std::max(dims[0], std::max(dims[1], dims[2]));
     if (diam < max_diameter)  // then merge
     {
       const int first = std::min(cl1, cl2);
       const int last = std::max(cl1, cl2);
-      clusters[first].min_bound = minb;
-      clusters[first].max_bound = maxb;
-      clusters[first].ids.insert(clusters[first].ids.begin(), clusters[last].ids.begin(), clusters[last].ids.end());
-      for (auto &id : clusters[last].ids)
-      {
-        cluster_ids[id] = first;
-      }
-      clusters[last].active = false;
+      min_bounds[first] = minb;
+      max_bounds[first] = maxb;
+      roots[last] = first;
+      // the last cluster's points go before the first cluster's points
+      nexts[tails[last]] = heads[first];
+      heads[first] = heads[last];
     }
   }
-  // convert the vector of clusters into a vector of sets of point indices
-  for (auto &cluster : clusters)
+  // convert the clusters into a vector of sets of point indices, in order of their root
+  for (int i = 0; i < num_points; i++)
   {
-    if (cluster.active)
+    if (roots[i] == i)
     {
-      point_clusters.push_back(cluster.ids);
+      std::vector<int> ids;
+      for (int id = heads[i]; id != -1; id = nexts[id])
+      {
+        ids.push_back(id);
+      }
+      point_clusters.push_back(ids);
     }
   }
 }
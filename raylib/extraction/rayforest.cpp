@@ -135,10 +135,11 @@ ray::ForestStructure Forest::extract(const std::string &cloud_name_stub, Mesh &m
   }
 
   // generate a 2D grid in order to fill in the 'space field' a 2D array of free space (where the rays are)
+  // this is reused from a previous run when it was generated from the same cloud, ground and grid
   OccupancyGrid2D grid2D;
-  if (!grid2D.load(cloud_name_stub + "_occupied.dat"))
+  grid2D.init(min_bounds_, max_bounds_, voxel_width);
+  if (!grid2D.load(cloud_name_stub + "_occupied.dat", cloud_name_stub + ".ply", lows, 1.0, 1.5))
   {
-    grid2D.init(min_bounds_, max_bounds_, voxel_width);
     // walk the rays to fill densities based on walking the rays through the grid
     grid2D.fillDensities(cloud_name_stub + ".ply", lows, 1.0, 1.5);
     grid2D.save(cloud_name_stub + "_occupied.dat");
@@ -204,11 +205,13 @@ void Forest::addTrunkHeights()
 void Forest::smoothHeightfield()
 {
   Eigen::ArrayXXd smooth_heights = heightfield_;
-  for (int x = 0; x < heightfield_.rows(); x++)
+  // each cell is smoothed from the previous iteration's heights, so the columns (contiguous in memory) are independent
+  #pragma omp parallel for schedule(static)
+  for (int y = 0; y < heightfield_.cols(); y++)
   {
-    for (int y = 0; y < heightfield_.cols(); y++)
+    for (int x = 0; x < heightfield_.rows(); x++)
     {
-      double &h = heightfield_(x, y);
+      const double &h = heightfield_(x, y);
       if (h == std::numeric_limits<double>::lowest())
       {
         continue;
@@ -231,7 +234,7 @@ void Forest::smoothHeightfield()
       smooth_heights(x, y) = mean / count;
     }
   }
-  heightfield_ = smooth_heights;
+  heightfield_.swap(smooth_heights);
 }
 
 /// extract tree locations from a set of three 2D arrays, a height field (the canopy) a low field (the ground)
@@ -292,20 +295,22 @@ ray::ForestStructure Forest::extract(const Eigen::ArrayXXd &highs, const Eigen::
 
   std::cout << "number of raw candidates: " << trees.size() << " number largest size: " << heads.size() << std::endl;
 
-  // calculate the area of pixels occupied by each index
-  for (int x = 0; x < indexfield_.rows(); x++)
+  // calculate the area of pixels occupied by each index. The watershed leaves each node attached directly to its head
+  #pragma omp parallel for schedule(static)
+  for (int y = 0; y < indexfield_.cols(); y++)
   {
-    for (int y = 0; y < indexfield_.cols(); y++)
+    for (int x = 0; x < indexfield_.rows(); x++)
     {
       int ind = indexfield_(x, y);
       if (ind == -1)
       {
         continue;
       }
-      while (trees[ind].attaches_to != -1)
+      if (trees[ind].attaches_to != -1)
       {
         ind = trees[ind].attaches_to;
       }
+      #pragma omp atomic
       trees[ind].area++;
     }
   }
@@ -70,6 +70,8 @@ private:
   void renderWatershed(const std::string &cloud_name_stub, std::vector<TreeNode> &trees, std::set<int> &indices);
   /// perform the hierarchical watershed algorithm to segment the trees based on convex crown shapes
   void hierarchicalWatershed(std::vector<TreeNode> &trees, std::set<int> &heads);
+  /// the head (unattached) tree node that the node at @c index is part of. Shortens the attachment path on the way
+  static int findHead(std::vector<TreeNode> &trees, int index);
 
   double voxel_width_;
   Eigen::ArrayXXd heightfield_;
@@ -116,6 +116,20 @@ struct PointCmp
   bool operator()(const Point &lhs, const Point &rhs) const { return lhs.height < rhs.height; }
 };
 
+int Forest::findHead(std::vector<TreeNode> &trees, int index)
+{
+  while (trees[index].attaches_to != -1)
+  {
+    const int parent = trees[index].attaches_to;
+    if (trees[parent].attaches_to != -1)  // path halving, so repeated lookups stay short
+    {
+      trees[index].attaches_to = trees[parent].attaches_to;
+    }
+    index = parent;
+  }
+  return index;
+}
+
 void Forest::hierarchicalWatershed(std::vector<TreeNode> &trees, std::set<int> &heads)
 {
   // fast array lookup of trunk centres:
@@ -133,17 +147,21 @@ void Forest::hierarchicalWatershed(std::vector<TreeNode> &trees, std::set<int> &
   }
 
   std::priority_queue<Point, std::vector<Point>, PointCmp> basins;
-  // 1. find highest points
-  for (int x = 0; x < heightfield_.rows(); x++)
+  // 1. find highest points. The rows are searched in parallel, then the peaks are indexed in row order
+  const int rows = static_cast<int>(heightfield_.rows());
+  const int cols = static_cast<int>(heightfield_.cols());
+  std::vector<std::vector<int>> row_peaks(rows);
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int x = 0; x < rows; x++)
   {
-    for (int y = 0; y < heightfield_.cols(); y++)
+    for (int y = 0; y < cols; y++)
     {
       // Moore neighbourhood
       const double height = heightfield_(x, y);
       double max_h = 0.0;
-      for (int i = std::max(0, x - 1); i <= std::min(x + 1, static_cast<int>(heightfield_.rows()) - 1); i++)
+      for (int i = std::max(0, x - 1); i <= std::min(x + 1, rows - 1); i++)
       {
-        for (int j = std::max(0, y - 1); j <= std::min(y + 1, static_cast<int>(heightfield_.cols()) - 1); j++)
+        for (int j = std::max(0, y - 1); j <= std::min(y + 1, cols - 1); j++)
         {
           if (!(i == x && j == y))
           {
@@ -153,18 +171,25 @@ void Forest::hierarchicalWatershed(std::vector<TreeNode> &trees, std::set<int> &
       }
       if (height > max_h && height > std::numeric_limits<double>::lowest())
       {
-        Point p;
-        p.x = x;
-        p.y = y;
-        p.height = height;
-        p.index = static_cast<int>(basins.size());
-        basins.push(p);
-        heads.insert(p.index);
-        indexfield_(x, y) = p.index;
-        trees.push_back(TreeNode(x, y, height, voxel_width_, trunkfield(x, y)));
+        row_peaks[x].push_back(y);
       }
     }
   }
+  for (int x = 0; x < rows; x++)
+  {
+    for (auto &y : row_peaks[x])
+    {
+      Point p;
+      p.x = x;
+      p.y = y;
+      p.height = heightfield_(x, y);
+      p.index = static_cast<int>(basins.size());
+      basins.push(p);
+      heads.insert(p.index);
+      indexfield_(x, y) = p.index;
+      trees.push_back(TreeNode(x, y, p.height, voxel_width_, trunkfield(x, y)));
+    }
+  }
 
   std::cout << "initial number of peaks: " << trees.size() << std::endl;
   int cnt = 0;
@@ -189,24 +214,13 @@ void Forest::hierarchicalWatershed(std::vector<TreeNode> &trees, std::set<int> &
       {
         continue;
       }
-      int p_head = p.index;
-      while (trees[p_head].attaches_to != -1)
-      {
-        p_head = trees[p_head].attaches_to;
-      }
+      int p_head = findHead(trees, p.index);
 
       const int xx = xs[i];
       const int yy = ys[i];
       int &ind = indexfield_(xx, yy);
 
-      int q_head = ind;
-      if (q_head != -1)
-      {
-        while (trees[q_head].attaches_to != -1)
-        {
-          q_head = trees[q_head].attaches_to;
-        }
-      }
+      const int q_head = ind == -1 ? -1 : findHead(trees, ind);
 
       if (ind != -1 && p_head != q_head)  // connecting separate trees, so trigger a future merge event
       {
@@ -285,6 +299,15 @@ void Forest::hierarchicalWatershed(std::vector<TreeNode> &trees, std::set<int> &
       }
     }
   }
+  // point every node directly at its head, so that the per-pixel lookups that follow are a single step
+  for (int i = 0; i < static_cast<int>(trees.size()); i++)
+  {
+    const int head = findHead(trees, i);
+    if (head != i)
+    {
+      trees[i].attaches_to = head;
+    }
+  }
 }
 
 }  // namespace ray
@@ -5,8 +5,43 @@
 // Author: Thomas Lowe
 #include "raygrid2d.h"
 
+#include <sys/stat.h>
+
 namespace ray
 {
+namespace
+{
+// identifies a saved occupancy grid file, and its format version
+const char kOccupancyFileTag[8] = { 'o', 'c', 'c', '2', 'd', 'v', '0', '1' };
+}  // namespace
+
+OccupancyGrid2D::Source OccupancyGrid2D::getSource(const std::string &cloudname, const Eigen::ArrayXXd &lows,
+                                                   double clip_min, double clip_max)
+{
+  Source source;
+  struct stat file_stat;
+  if (stat(cloudname.c_str(), &file_stat) == 0)
+  {
+    source.file_size = static_cast<unsigned long long>(file_stat.st_size);
+    source.modified_time = static_cast<long long>(file_stat.st_mtime);
+  }
+  else
+  {
+    source.file_size = 0;
+    source.modified_time = 0;
+  }
+  // FNV-1a hash of the ground heights, as a different ground mesh gives a different height window
+  source.lows_hash = 14695981039346656037ull;
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(lows.data());
+  for (size_t i = 0; i < sizeof(double) * static_cast<size_t>(lows.size()); i++)
+  {
+    source.lows_hash = (source.lows_hash ^ bytes[i]) * 1099511628211ull;
+  }
+  source.clip_min = clip_min;
+  source.clip_max = clip_max;
+  return source;
+}
+
 /// initialise for a given bounds and pixel width
 void OccupancyGrid2D::init(const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound, double pixel_width)
 {
@@ -21,30 +56,56 @@ void OccupancyGrid2D::init(const Eigen::Vector3d &min_bound, const Eigen::Vector
 
   pixels_.resize(dims_[0] * dims_[1]);
   memset(&pixels_[0], 0, sizeof(Pixel) * pixels_.size());
+  source_ = Source();
 }
 
 /// save the grid
 void OccupancyGrid2D::save(const std::string &filename)
 {
-  std::ofstream out(filename, std::ofstream::out);
-  writePlainOldDataArray(out, pixels_);
+  std::ofstream out(filename, std::ofstream::out | std::ofstream::binary);
+  out.write(kOccupancyFileTag, sizeof(kOccupancyFileTag));
+  writePlainOldData(out, source_);
   writePlainOldData(out, dims_);
   writePlainOldData(out, min_bound_);
   writePlainOldData(out, pixel_width_);
+  writePlainOldDataArray(out, pixels_);
 }
 
 /// load the grid
-bool OccupancyGrid2D::load(const std::string &filename)
+bool OccupancyGrid2D::load(const std::string &filename, const std::string &cloudname, const Eigen::ArrayXXd &lows,
+                           double clip_min, double clip_max)
 {
-  std::ifstream input(filename, std::ifstream::in);
+  std::ifstream input(filename, std::ifstream::in | std::ifstream::binary);
   if (!input.good())
   {
     return false;
   }
-  readPlainOldDataArray(input, pixels_);
-  readPlainOldData(input, dims_);
-  readPlainOldData(input, min_bound_);
-  readPlainOldData(input, pixel_width_);
+  char tag[sizeof(kOccupancyFileTag)];
+  input.read(tag, sizeof(tag));
+  Source source;
+  Eigen::Vector3i dims;
+  Eigen::Vector3d min_bound;
+  double pixel_width;
+  readPlainOldData(input, source);
+  readPlainOldData(input, dims);
+  readPlainOldData(input, min_bound);
+  readPlainOldData(input, pixel_width);
+  if (!input.good() || !std::equal(tag, tag + sizeof(tag), kOccupancyFileTag) ||
+      !(source == getSource(cloudname, lows, clip_min, clip_max)) || dims != dims_ || min_bound != min_bound_ ||
+      pixel_width != pixel_width_)
+  {
+    std::cout << "ignoring " << filename << " as it was generated from a different cloud or parameters" << std::endl;
+    return false;
+  }
+  std::vector<Pixel> pixels;
+  readPlainOldDataArray(input, pixels);
+  if (!input.good() || pixels.size() != pixels_.size())
+  {
+    std::cout << "ignoring " << filename << " as it is incomplete" << std::endl;
+    return false;
+  }
+  pixels_.swap(pixels);
+  source_ = source;
   return true;
 }
 
@@ -59,10 +120,14 @@ void OccupancyGrid2D::fillDensities(const std::string &cloudname, const Eigen::A
   bounds_.max_bound_ = min_bound_ + dims_.cast<double>() * pixel_width_ - Eigen::Vector3d(eps, eps, eps);
   const double scale = static_cast<double>(GRID2D_SUBPIXELS);
 
-  // filling in the free space per chunk of ray cloud
+  source_ = getSource(cloudname, lows, clip_min, clip_max);
+
+  // filling in the free space per chunk of ray cloud. The rays of a chunk are walked in parallel, and as the sub-pixel
+  // bits are only ever set in this pass, the atomic OR gives the same result in any order
   auto addFreeSpace = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                           std::vector<double> &, std::vector<ray::RGBA> &) {
-    for (size_t i = 0; i < ends.size(); ++i)
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < static_cast<int>(ends.size()); ++i)
     {
       Eigen::Vector3d start = starts[i];
       Eigen::Vector3d end = ends[i];
@@ -131,17 +196,20 @@ void OccupancyGrid2D::fillDensities(const std::string &cloudname, const Eigen::A
           // some bit trickery to fill in part of the 4x4 grid per pixel
           const Eigen::Vector3i rem = inds - GRID2D_SUBPIXELS * index;
           const uint16_t bit = uint16_t(GRID2D_SUBPIXELS * rem[0] + rem[1]);
-          pixel(index).bits |= uint16_t(1 << bit);
+          uint16_t &bits = pixel(index).bits;
+          #pragma omp atomic
+          bits |= uint16_t(1 << bit);
         }
       } while (depth <= maxDist);
     }
   };
   ray::Cloud::read(cloudname, addFreeSpace);
 
-  // wherever these is an end point, we want to remove it as free space
+  // wherever these is an end point, we want to remove it as free space. Likewise bits are only cleared in this pass
   auto removeOccupiedSpace = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends,
                                  std::vector<double> &, std::vector<ray::RGBA> &colours) {
-    for (size_t i = 0; i < ends.size(); ++i)
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < static_cast<int>(ends.size()); ++i)
     {
       if (colours[i].alpha == 0)
       {
@@ -164,8 +232,12 @@ void OccupancyGrid2D::fillDensities(const std::string &cloudname, const Eigen::A
       uint16_t bit = uint16_t(GRID2D_SUBPIXELS * rem[0] + rem[1]);
 
       double height = ends[i][2] - lows(index[0], index[1]);
-      if (height > clip_min && height < clip_max)               // if within the height window
-        pixel(index).bits &= (uint16_t) ~(uint16_t(1 << bit));  // then remove it
+      if (height > clip_min && height < clip_max)  // if within the height window
+      {
+        uint16_t &bits = pixel(index).bits;
+        #pragma omp atomic
+        bits &= (uint16_t) ~(uint16_t(1 << bit));  // then remove it
+      }
 #endif
     }
   };
@@ -173,8 +245,10 @@ void OccupancyGrid2D::fillDensities(const std::string &cloudname, const Eigen::A
 
   // convert the bit fields into subpixel counts
   unsigned long bitcount = 0;
-  for (auto &vox : pixels_)
+  #pragma omp parallel for schedule(static) reduction(+ : bitcount)
+  for (int p = 0; p < static_cast<int>(pixels_.size()); p++)
   {
+    Pixel &vox = pixels_[p];
     uint16_t count = 0;
     for (unsigned long i = 0; i < 16; i++)
     {
@@ -213,63 +287,81 @@ void RayIndexGrid2D::fillRays(const Cloud &cloud)
   bounds_.min_bound_ = min_bound_ + Eigen::Vector3d(eps, eps, eps);
   bounds_.max_bound_ = min_bound_ + dims_.cast<double>() * pixel_width_ - Eigen::Vector3d(eps, eps, eps);
 
-  for (size_t i = 0; i < cloud.ends.size(); ++i)
+  // walk the rays in parallel blocks, recording the filled pixels that they pass through. The blocks are then merged
+  // in order, so each pixel's ray_ids are in ray order
+  const int block_size = 65536;
+  const int num_blocks = static_cast<int>((cloud.ends.size() + block_size - 1) / block_size);
+  std::vector<std::vector<std::pair<int, int>>> block_hits(num_blocks);  // pixel index and ray id
+  #pragma omp parallel for schedule(dynamic)
+  for (int block = 0; block < num_blocks; block++)
   {
-    Eigen::Vector3d start = cloud.starts[i];
-    Eigen::Vector3d end = cloud.ends[i];
-    if (!bounds_.clipRay(start, end))
+    std::vector<std::pair<int, int>> &hits = block_hits[block];
+    const int block_end = std::min(static_cast<int>(cloud.ends.size()), (block + 1) * block_size);
+    for (int i = block * block_size; i < block_end; ++i)
     {
-      continue;
-    }
+      Eigen::Vector3d start = cloud.starts[i];
+      Eigen::Vector3d end = cloud.ends[i];
+      if (!bounds_.clipRay(start, end))
+      {
+        continue;
+      }
 
-    // now walk the pixels
-    const Eigen::Vector3d dir = end - start;
-    const Eigen::Vector3d source = (start - min_bound_) / pixel_width_;
-    const Eigen::Vector3d target = (end - min_bound_) / pixel_width_;
-    const double length = dir.norm();
-    const double eps = 1e-9;  // to stay away from edge cases
-    const double maxDist =
-      (target - source).norm() - 2.0;  // remove 2 subpixels to give a small buffer around the object
+      // now walk the pixels
+      const Eigen::Vector3d dir = end - start;
+      const Eigen::Vector3d source = (start - min_bound_) / pixel_width_;
+      const Eigen::Vector3d target = (end - min_bound_) / pixel_width_;
+      const double length = dir.norm();
+      const double eps = 1e-9;  // to stay away from edge cases
+      const double maxDist =
+        (target - source).norm() - 2.0;  // remove 2 subpixels to give a small buffer around the object
 
-    // cached values to speed up the loop below
-    Eigen::Vector3i adds;
-    Eigen::Vector3d offsets;
-    for (int k = 0; k < 3; ++k)
-    {
-      if (dir[k] > 0.0)
+      // cached values to speed up the loop below
+      Eigen::Vector3i adds;
+      Eigen::Vector3d offsets;
+      for (int k = 0; k < 3; ++k)
       {
-        adds[k] = 1;
-        offsets[k] = 0.5;
+        if (dir[k] > 0.0)
+        {
+          adds[k] = 1;
+          offsets[k] = 0.5;
+        }
+        else
+        {
+          adds[k] = -1;
+          offsets[k] = -0.5;
+        }
       }
-      else
+
+      Eigen::Vector3d p = source;  // our moving variable as we walk over the grid
+      Eigen::Vector3i inds = p.cast<int>();
+      double depth = 0;
+      // walk over the grid, one pixel at a time.
+      do
       {
-        adds[k] = -1;
-        offsets[k] = -0.5;
-      }
+        const double ls[2] = { (round(p[0] + offsets[0]) - p[0]) / dir[0], (round(p[1] + offsets[1]) - p[1]) / dir[1] };
+        const int axis = (ls[0] < ls[1]) ? 0 : 1;
+        inds[axis] += adds[axis];
+        if (inds[axis] < 0 || inds[axis] >= dims_[axis])
+        {
+          break;
+        }
+        const double minL = ls[axis] * length;
+        depth += minL + eps;
+        p = source + dir * (depth / length);
+        if (pixel(inds).filled)
+        {
+          hits.push_back(std::make_pair(dims_[1] * inds[0] + inds[1], i));
+        }
+      } while (depth <= maxDist);
     }
-
-    Eigen::Vector3d p = source;  // our moving variable as we walk over the grid
-    Eigen::Vector3i inds = p.cast<int>();
-    double depth = 0;
-    // walk over the grid, one pixel at a time.
-    do
+  }
+  for (auto &hits : block_hits)
+  {
+    for (auto &hit : hits)
     {
-      const double ls[2] = { (round(p[0] + offsets[0]) - p[0]) / dir[0], (round(p[1] + offsets[1]) - p[1]) / dir[1] };
-      const int axis = (ls[0] < ls[1]) ? 0 : 1;
-      inds[axis] += adds[axis];
-      if (inds[axis] < 0 || inds[axis] >= dims_[axis])
-      {
-        break;
-      }
-      const double minL = ls[axis] * length;
-      depth += minL + eps;
-      p = source + dir * (depth / length);
-      Pixel &pix = pixel(inds);
-      if (pix.filled)
-      {
-        pix.ray_ids.push_back(static_cast<int>(i));
-      }
-    } while (depth <= maxDist);
+      pixels_[hit.first].ray_ids.push_back(hit.second);
+    }
+    std::vector<std::pair<int, int>>().swap(hits);
   }
 }
 }  // namespace ray
@@ -22,11 +22,14 @@ public:
   /// initialise for a given bounds and pixel width
   void init(const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound, double pixel_width);
 
-  /// save the grid
+  /// save the grid, with a header recording the source cloud and parameters of the last fillDensities() call
   void save(const std::string &filename);
 
-  /// load the grid
-  bool load(const std::string &filename);
+  /// load a grid previously saved for the same bounds and pixel width (as set by init()), and filled from the
+  /// unmodified cloud @c cloudname with the same ground heights @c lows and height window @c clip_min to @c clip_max.
+  /// Returns false, leaving the grid unchanged, if the file is missing or stale
+  bool load(const std::string &filename, const std::string &cloudname, const Eigen::ArrayXXd &lows, double clip_min,
+            double clip_max);
 
   /// pixel structure that is used to estimate the density of free space
   struct Pixel
@@ -69,11 +72,27 @@ public:
   const Eigen::Vector3i &dims() const { return dims_; }
 
 private:
+  /// a record of the inputs to fillDensities(), to identify stale saved grids
+  struct Source
+  {
+    unsigned long long file_size;
+    long long modified_time;
+    unsigned long long lows_hash;
+    double clip_min, clip_max;
+    bool operator==(const Source &other) const
+    {
+      return file_size == other.file_size && modified_time == other.modified_time && lows_hash == other.lows_hash &&
+             clip_min == other.clip_min && clip_max == other.clip_max;
+    }
+  };
+  static Source getSource(const std::string &cloudname, const Eigen::ArrayXXd &lows, double clip_min, double clip_max);
+
   Eigen::Vector3i dims_;
   Eigen::Vector3d min_bound_;
   double pixel_width_;
   std::vector<Pixel> pixels_;
   Pixel dummy_pixel_;
+  Source source_;
 };
 
 // A similar 2d grid structure, but this stores the ray indices per pixel
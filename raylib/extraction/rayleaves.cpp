@@ -7,8 +7,10 @@
 #include "rayleaves.h"
 #include "../rayrenderer.h"
 #include "../raycuboid.h"
+#include "../rayknn.h"
 #include "../rayply.h"
 #include "../raymesh.h"
+#include "../raymeshwriter.h"
 #include "../rayforeststructure.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "raylib/imageread.h"
@@ -113,10 +115,8 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
     Nabo::NNSearchD *nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
     Eigen::MatrixXi indices;
     Eigen::MatrixXd dists2;
-    indices.resize(search_size, q_size);
-    dists2.resize(search_size, q_size);
     const double max_distance = 2.0; 
-    nns->knn(points_q, indices, dists2, search_size, kNearestNeighbourEpsilon, 0, max_distance);
+    parallelKnn(*nns, points_q, indices, dists2, search_size, kNearestNeighbourEpsilon, max_distance);
     delete nns;
 
     // Convert these set of nearest neighbours into surfels
@@ -142,7 +142,6 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
     Eigen::Vector3d origin;
     double grad0;
   };
-  std::vector<Leaf> leaves;
   std::vector<double> leaf_counter(grid.voxels().size());
   std::srand(1);
   for (size_t i = 0; i<grid.voxels().size(); i++)
@@ -150,88 +149,54 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
     leaf_counter[i] = (double)(std::rand()%10000) / 10000.0; // a random start stops regions of low density have 0 leaves
   }
 
-
-  // for each point in the cloud, possible add leaves...
-  auto add_leaves = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends,
-                      std::vector<double> &, std::vector<ray::RGBA> &colours) 
+  // place a leaf at @c end, directed away from the closest nearby branch. Returns false if inside a branch
+  auto place_leaf = [&](const Eigen::Vector3d &end, int index, Leaf &new_leaf)
   {
-    for (size_t i = 0; i<ends.size(); i++)
+    new_leaf.centre = end;
+
+    double min_dist = 1e10;
+    Eigen::Vector3d closest_point_on_branch(0,0,0);
+    for (auto &ind: neighbour_segments[index])
     {
-      if (colours[i].alpha == 0)
-        continue;
-      int index = grid.getIndexFromPos(ends[i]);
-      auto &voxel = grid.voxels()[index];
-      double leaf_area_per_voxel_volume = voxel.density();
-      if (leaf_area_per_voxel_volume <= 0.0)
+      auto &tree =  forest.trees[tree_ids[ind]];
+      // get a more accurate distance to each branch segment....
+      // e.g. point to branch surface.
+      Eigen::Vector3d line_closest;
+      Eigen::Vector3d closest = tree.closestPointOnSegment(segment_ids[ind], end, line_closest);
+      double dist = (closest - end).norm();
+      double radius = tree.segments()[segment_ids[ind]].radius;
+      if (dist <= radius) // if we're inside any branch then don't add a leaf for this point
       {
-        continue;
+        min_dist = 1e10;
+        break;
       }
-      double desired_leaf_area = leaf_area_per_voxel_volume * vox_width * vox_width * vox_width;
-      double num_leaves_d = desired_leaf_area / leaf_area;
-      double num_points = (double)voxel.numHits();
-      double &count = leaf_counter[index];
-      count += num_leaves_d / num_points;
-      bool add_leaf = false;
-      if (count >= 1.0)
+      if (dist < min_dist)
       {
-        add_leaf = true;
-        count--;
+        min_dist = dist;
+        closest_point_on_branch = closest;
       }
-
-      if (add_leaf)
-      {
-        Leaf new_leaf;
-        new_leaf.centre = ends[i];
-
-        double min_dist = 1e10;
-        Eigen::Vector3d closest_point_on_branch(0,0,0);
-        for (auto &ind: neighbour_segments[index])
-        {
-          auto &tree =  forest.trees[tree_ids[ind]];
-          // get a more accurate distance to each branch segment....
-          // e.g. point to branch surface.
-          Eigen::Vector3d line_closest;
-          Eigen::Vector3d closest = tree.closestPointOnSegment(segment_ids[ind], ends[i], line_closest);
-          double dist = (closest - ends[i]).norm();
-          double radius = tree.segments()[segment_ids[ind]].radius;
-          if (dist <= radius) // if we're inside any branch then don't add a leaf for this point
-          {
-            min_dist = 1e10;
-            break;
-          }
-          if (dist < min_dist)
-          {
-            min_dist = dist;
-            closest_point_on_branch = closest;
-          }
-        }
-        if (min_dist == 1e10)
-        {
-          continue;
-        }
-        // get leaf direction according to a droop factor. y=-droop * x^2
-        new_leaf.direction = new_leaf.centre - closest_point_on_branch;
-        Eigen::Vector3d flat = new_leaf.direction;
-        flat[2] = 0.0;
-        double dist_sqr = flat.squaredNorm();
-        double dist = std::sqrt(dist_sqr);
-        double h = new_leaf.direction[2];
-        new_leaf.direction /= dist;
-        double grad0 = (h+droop*dist_sqr)/dist;
-        double grad = grad0 + 2.0*-droop*dist;
-        new_leaf.direction[2] = grad;
-        new_leaf.direction.normalize();
-        new_leaf.origin = closest_point_on_branch;
-        new_leaf.grad0 = grad0;
-
-        leaves.push_back(new_leaf);
-      }  
     }
+    if (min_dist == 1e10)
+    {
+      return false;
+    }
+    // get leaf direction according to a droop factor. y=-droop * x^2
+    new_leaf.direction = new_leaf.centre - closest_point_on_branch;
+    Eigen::Vector3d flat = new_leaf.direction;
+    flat[2] = 0.0;
+    double dist_sqr = flat.squaredNorm();
+    double dist = std::sqrt(dist_sqr);
+    double h = new_leaf.direction[2];
+    new_leaf.direction /= dist;
+    double grad0 = (h+droop*dist_sqr)/dist;
+    double grad = grad0 + 2.0*-droop*dist;
+    new_leaf.direction[2] = grad;
+    new_leaf.direction.normalize();
+    new_leaf.origin = closest_point_on_branch;
+    new_leaf.grad0 = grad0;
+    return true;
   };
 
-  if (!ray::Cloud::read(cloud_name, add_leaves))
-    return false;
-
   Mesh leaf_mesh;
   // could read it from file at this point
   auto &leaf_verts = leaf_mesh.vertices();
@@ -324,42 +289,47 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
     std::cerr << "Error: leaf file type unsupported: " << leaf_file << std::endl;
     return false;
   }
-  Mesh mesh;
-  auto &verts = mesh.vertices();
-  auto &inds = mesh.indexList(); // one per triangle, gives the index into the vertices_ array for each corner   
-  auto &uvs = mesh.uvList();
-  mesh.textureName() = leaf_mesh.textureName();
-  
-  for (auto &leaf: leaves)
+  if (stalks && !leaf_uvs.empty())
   {
+    std::cerr << "Error: multiple textures in one mesh are unsupported, so either turn off stalks or remove uvs/texture from leaves" << std::endl;
+    return false;
+  }
+  // every leaf has the same number of vertices and triangles, so each leaf's part of a mesh chunk is known in advance
+  const int num_stalk_segs = 4;
+  const int verts_per_leaf = (int)leaf_verts.size() + (stalks ? 2*num_stalk_segs : 0);
+  const int tris_per_leaf = (int)leaf_inds.size() + (stalks ? 2*(num_stalk_segs - 1) : 0);
+  const int uvs_per_leaf = (int)leaf_uvs.size();
+
+  // convert a leaf into the mesh, from vertex @c v, triangle @c t and uv @c u onwards
+  auto add_leaf_mesh = [&](const Leaf &leaf, Mesh &mesh, int v, int t, int u)
+  {
+    auto &verts = mesh.vertices();
+    auto &inds = mesh.indexList(); // one per triangle, gives the index into the vertices_ array for each corner   
+    auto &uvs = mesh.uvList();
+    auto &colours = mesh.colours();
     // 1. convert direction into a transformation matrix...
     Eigen::Matrix3d mat;
     mat.col(1) = leaf.direction;
     mat.col(0) = leaf.direction.cross(Eigen::Vector3d(0,0,1)).normalized();
     mat.col(2) = mat.col(0).cross(mat.col(1));
 
-    int num_verts = (int)verts.size();
+    int num_verts = v;
     for (auto &tri: leaf_inds)
     {
-      inds.push_back(tri + Eigen::Vector3i(num_verts, num_verts, num_verts));
+      inds[t++] = tri + Eigen::Vector3i(num_verts, num_verts, num_verts);
     }
     for (auto &uv: leaf_uvs)
     {
-      uvs.push_back(uv); // if UVs are present in the input, they are unchanged
+      uvs[u++] = uv; // if UVs are present in the input, they are unchanged
     }
     for (auto &vert: leaf_verts)
     {
-      verts.push_back(mat * vert + leaf.centre);
-      mesh.colours().push_back(RGBA::leaves());
+      verts[v] = mat * vert + leaf.centre;
+      colours[v++] = RGBA::leaves();
     }
-    num_verts = (int)verts.size();
+    num_verts = v;
     if (stalks)
     {
-      if (!uvs.empty())
-      {
-        std::cerr << "Error: multiple textures in one mesh are unsupported, so either turn off stalks or remove uvs/texture from leaves" << std::endl;
-        return false;
-      }
       Eigen::Vector3d start = leaf.origin;
       Eigen::Vector3d leaf_start = mat * leaf_root + leaf.centre;
       Eigen::Vector3d flat = (leaf_start - leaf.origin);
@@ -368,27 +338,105 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
       flat /= length;
       Eigen::Vector3d side(-flat[1], flat[0], flat[2]);
       side *= leaf_width / 16.0;
-      const int num_segs = 4;
-      for (int i = 0; i<num_segs; i++)
+      for (int i = 0; i<num_stalk_segs; i++)
       {
-        double x = (double)i / (double)(num_segs - 1);
+        double x = (double)i / (double)(num_stalk_segs - 1);
         x *= length;
         double h = leaf.grad0*x - droop*x*x;
-        Eigen::Vector3d pos = (i==num_segs-1) ? leaf_start : start + Eigen::Vector3d(0,0,h) + flat*x;
-        verts.push_back(pos - side);
-        verts.push_back(pos + side);
-        mesh.colours().push_back(RGBA::treetrunk());
-        mesh.colours().push_back(RGBA::treetrunk());
-        if (i != num_segs-1)
+        Eigen::Vector3d pos = (i==num_stalk_segs-1) ? leaf_start : start + Eigen::Vector3d(0,0,h) + flat*x;
+        verts[v] = pos - side;
+        colours[v++] = RGBA::treetrunk();
+        verts[v] = pos + side;
+        colours[v++] = RGBA::treetrunk();
+        if (i != num_stalk_segs-1)
         {
           int j = 2*i;
-          inds.push_back(Eigen::Vector3i(num_verts, num_verts, num_verts) + Eigen::Vector3i(j, j+2, j+1));
-          inds.push_back(Eigen::Vector3i(num_verts, num_verts, num_verts) + Eigen::Vector3i(j+3, j+1, j+2));
+          inds[t++] = Eigen::Vector3i(num_verts, num_verts, num_verts) + Eigen::Vector3i(j, j+2, j+1);
+          inds[t++] = Eigen::Vector3i(num_verts, num_verts, num_verts) + Eigen::Vector3i(j+3, j+1, j+2);
         }
       }
     }
-  }          
-  writePlyMesh(cloud_stub + "_leaves.ply", mesh);
-  return true;
+  };
+
+  // the leaves are generated and written one chunk of the cloud at a time, so memory does not grow with leaf count
+  MeshWriter writer;
+  if (!writer.begin(cloud_stub + "_leaves.ply", !leaf_uvs.empty(), leaf_mesh.textureName()))
+  {
+    return false;
+  }
+  std::vector<int> candidates;
+  std::vector<Leaf> leaves;
+  std::vector<char> placed;
+  Mesh chunk_mesh;
+  bool write_failed = false;
+  // for each point in the cloud, possible add leaves...
+  auto add_leaves = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &, std::vector<ray::RGBA> &colours) 
+  {
+    if (write_failed)  // skip the remaining chunks, the mesh file is discarded
+    {
+      return;
+    }
+    // 1. the points that are due a leaf. Each voxel's counter follows the order of the cloud, so this is sequential
+    candidates.clear();
+    for (size_t i = 0; i<ends.size(); i++)
+    {
+      if (colours[i].alpha == 0)
+        continue;
+      int index = grid.getIndexFromPos(ends[i]);
+      auto &voxel = grid.voxels()[index];
+      double leaf_area_per_voxel_volume = voxel.density();
+      if (leaf_area_per_voxel_volume <= 0.0)
+      {
+        continue;
+      }
+      double desired_leaf_area = leaf_area_per_voxel_volume * vox_width * vox_width * vox_width;
+      double num_leaves_d = desired_leaf_area / leaf_area;
+      double num_points = (double)voxel.numHits();
+      double &count = leaf_counter[index];
+      count += num_leaves_d / num_points;
+      if (count >= 1.0)
+      {
+        count--;
+        candidates.push_back((int)i);
+      }
+    }
+    // 2. place these leaves in parallel, independent of thread count
+    const int num_candidates = (int)candidates.size();
+    leaves.resize(num_candidates);
+    placed.assign(num_candidates, 0);
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (int c = 0; c < num_candidates; c++)
+    {
+      const int i = candidates[c];
+      placed[c] = place_leaf(ends[i], grid.getIndexFromPos(ends[i]), leaves[c]) ? 1 : 0;
+    }
+    int num_leaves = 0;
+    for (int c = 0; c < num_candidates; c++)
+    {
+      if (placed[c])
+      {
+        leaves[num_leaves++] = leaves[c];
+      }
+    }
+    // 3. generate the leaf meshes in parallel, in cloud order, and write them out
+    chunk_mesh.vertices().resize((size_t)num_leaves * verts_per_leaf);
+    chunk_mesh.colours().resize((size_t)num_leaves * verts_per_leaf);
+    chunk_mesh.indexList().resize((size_t)num_leaves * tris_per_leaf);
+    chunk_mesh.uvList().resize((size_t)num_leaves * uvs_per_leaf);
+    #pragma omp parallel for schedule(static)
+    for (int l = 0; l < num_leaves; l++)
+    {
+      add_leaf_mesh(leaves[l], chunk_mesh, l * verts_per_leaf, l * tris_per_leaf, l * uvs_per_leaf);
+    }
+    write_failed = !writer.writeChunk(chunk_mesh);
+  };
+
+  if (!ray::Cloud::read(cloud_name, add_leaves) || write_failed)
+  {
+    writer.abort();  // rather than saving a partial mesh
+    return false;
+  }
+  return writer.end();
 }
 }  // namespace ray
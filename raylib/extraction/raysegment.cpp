@@ -4,35 +4,33 @@
 //
 // Author: Thomas Lowe
 #include "raysegment.h"
-#include <nabo/nabo.h>
+#include "../rayknn.h"
 #include "rayterrain.h"
 #include <queue>
 
 namespace ray
 {
-/// nodes of priority queue used in shortest path algorithm
+/// nodes of priority queue used in shortest path algorithm. The rest of the path's attributes are read from the
+/// point when popped, as the first pop of each point is always its latest (lowest scoring) push
 struct QueueNode
 {
-//  QueueNode() {}
-  QueueNode(double distance_to_ground, double score, double radius, int root, int index)
-    : distance_to_ground(distance_to_ground)
-    , score(score)
-    , radius(radius)
-    , root(root)
+  QueueNode(double score, int index)
+    : score(score)
     , id(index)
   {}
 
-  double distance_to_ground; // path distance to the ground
-  double score;              // score is the modified edge length metric being minimised
-  double radius;             // radius of the tree base, this acts as a score scale coefficient
-  int root;                  // index of the root of the path
-  int id;                    // index into the points_ array for this node
+  double score;  // score is the modified edge length metric being minimised
+  int id;        // index into the points_ array for this node
 };
 
 class QueueNodeComparator
 {
 public:
-  bool operator()(const QueueNode &p1, const QueueNode &p2) { return p1.score > p2.score; }
+  // equal scores are popped in index order, so that ties are resolved independently of the order of the pushes
+  bool operator()(const QueueNode &p1, const QueueNode &p2) const
+  {
+    return p1.score > p2.score || (p1.score == p2.score && p1.id > p2.id);
+  }
 };
 
 /// Connect the supplied set of points @c points according to the shortest path to the ground, by filling in their
@@ -40,12 +38,13 @@ public:
 /// @c distance_limit maximum distance between points that can be connected
 /// @c gravity_factor controls how far laterally the shortest paths can travel
 /// @c closest_node a priority queue
+/// @c root_radii the radius of the tree base for each root point, from @c roots_start onwards
 void connectPointsShortestPath(
   std::vector<Vertex> &points,
   std::priority_queue<QueueNode, std::vector<QueueNode>, QueueNodeComparator> &closest_node, double distance_limit,
-  double gravity_factor)
+  double gravity_factor, int roots_start, const std::vector<double> &root_radii)
 {
-  // 1. get nearest neighbours
+  // 1. get nearest neighbours. This is independent per point, so is run in parallel
   const int search_size = std::min(20, static_cast<int>(points.size()) - 1);
   Eigen::MatrixXd points_p(3, points.size());
   for (unsigned int i = 0; i < points.size(); i++)
@@ -56,73 +55,78 @@ void connectPointsShortestPath(
   // Run the search
   Eigen::MatrixXi indices;
   Eigen::MatrixXd dists2;
-  indices.resize(search_size, points.size());
-  dists2.resize(search_size, points.size());
-  nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0, distance_limit);
+  parallelKnn(*nns, points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, distance_limit);
+  delete nns;
 
-  // 2. climb up from lowest points, this part is based on Djikstra's algorithm
+  // 2. climb up from lowest points, this part is based on Djikstra's algorithm.
+  // Each point's edge scores depend on its path to the ground, which is only final once the point is popped. So this
+  // part is inherently ordered, and label-correcting parallel methods (e.g. delta-stepping) would change the result
   while (!closest_node.empty())
   {
-    QueueNode node = closest_node.top();
+    const int node_id = closest_node.top().id;
     closest_node.pop();
-    if (!points[node.id].visited)
+    const Vertex &node = points[node_id];
+    if (node.visited)
     {
-      // for each unvisited point, look at its nearest neighbours
-      for (int i = 0; i < search_size && indices(i, node.id) != Nabo::NNSearchD::InvalidIndex; i++)
+      continue;
+    }
+    // the path direction and the penalties are the same for each neighbour
+    Eigen::Vector3d dir(0, 0, 1);
+    // estimate direction of path from parent of parent if possible
+    const int ppar = node.parent;
+    if (ppar != -1)
+    {
+      if (points[ppar].parent != -1)  // this is a bit smoother than...
       {
-        const int child = indices(i, node.id);
-        const double dist2 = dists2(i, node.id);  // square distance to neighbour
-        const double dist = std::sqrt(dist2);
-        double new_score = 0;
-        const Eigen::Vector3d dif = (points[child].pos - points[node.id].pos).normalized();
-        Eigen::Vector3d dir(0, 0, 1);
-        // estimate direction of path from parent of parent if possible
-        const int ppar = points[node.id].parent;
-        if (ppar != -1)
-        {
-          if (points[ppar].parent != -1)  // this is a bit smoother than...
-          {
-            dir = (points[node.id].pos - points[points[ppar].parent].pos).normalized();
-          }
-          else  // ..just this
-          {
-            dir = (points[node.id].pos - points[ppar].pos).normalized();
-          }
-        }
-        const double d = std::max(0.001, dif.dot(dir));
-        // we are looking for a minimum score, so large distances are bad, but new points in line with the
-        // path direction are good
-        double score = dist2 / (d * d);
-
-        if (gravity_factor > 0.0)  // penalise paths that are hard to hold up against gravity (lateral direction)
-        {
-          Eigen::Vector3d to_node = points[node.id].pos - points[node.root].pos;
-          to_node[2] = 0.0;
-          const double lateral_sqr = to_node.squaredNorm();
-          const double gravity_scale =
-            1.0 + gravity_factor * lateral_sqr;  // the squaring means gravity plays little role for normal trees,
-                                                 // kicking in stronger on outlier lateral ones
-          score *= gravity_scale;
-        }
+        dir = (node.pos - points[points[ppar].parent].pos).normalized();
+      }
+      else  // ..just this
+      {
+        dir = (node.pos - points[ppar].pos).normalized();
+      }
+    }
+    double gravity_scale = 1.0;
+    if (gravity_factor > 0.0)  // penalise paths that are hard to hold up against gravity (lateral direction)
+    {
+      Eigen::Vector3d to_node = node.pos - points[node.root].pos;
+      to_node[2] = 0.0;
+      const double lateral_sqr = to_node.squaredNorm();
+      gravity_scale = 1.0 + gravity_factor * lateral_sqr;  // the squaring means gravity plays little role for normal
+                                                           // trees, kicking in stronger on outlier lateral ones
+    }
+    // scale score according to size of each tree, this prevents small trees from
+    // capturing the branches of larger trees
+    const double radius = root_radii[node.root - roots_start];
 
-        // scale score according to size of each tree, this prevents small trees from
-        // capturing the branches of larger trees
-        score /= node.radius;
+    // for each unvisited point, look at its nearest neighbours
+    for (int i = 0; i < search_size && indices(i, node_id) != Nabo::NNSearchD::InvalidIndex; i++)
+    {
+      const int child = indices(i, node_id);
+      const double dist2 = dists2(i, node_id);  // square distance to neighbour
+      const double dist = std::sqrt(dist2);
+      const Eigen::Vector3d dif = (points[child].pos - node.pos).normalized();
+      const double d = std::max(0.001, dif.dot(dir));
+      // we are looking for a minimum score, so large distances are bad, but new points in line with the
+      // path direction are good
+      double score = dist2 / (d * d);
+      if (gravity_factor > 0.0)
+      {
+        score *= gravity_scale;
+      }
+      score /= radius;
 
-        new_score = node.score + score;
-        if (new_score < points[child].score)
-        {
-          points[child].score = new_score;
-          // we also maintain the distance to ground value
-          points[child].distance_to_ground = node.distance_to_ground + dist;
-          points[child].parent = node.id;
-          points[child].root = node.root;
-          closest_node.push(
-            QueueNode(points[child].distance_to_ground, points[child].score, node.radius, node.root, child));
-        }
+      const double new_score = node.score + score;
+      if (new_score < points[child].score)
+      {
+        points[child].score = new_score;
+        // we also maintain the distance to ground value
+        points[child].distance_to_ground = node.distance_to_ground + dist;
+        points[child].parent = node_id;
+        points[child].root = node.root;
+        closest_node.push(QueueNode(new_score, child));
       }
-      points[node.id].visited = true;
     }
+    points[node_id].visited = true;
   }
 }
 
@@ -180,17 +184,19 @@ std::vector<std::vector<int>> getRootsAndSegment(std::vector<Vertex> &points, co
 
   // create an initial priority queue node for each root point (mesh vertex) using the
   // observed height as a scaling parameter
+  std::vector<double> root_radii(points.size() - roots_start);
   for (int ind = roots_start; ind < static_cast<int>(points.size()); ind++)
   {
     points[ind].distance_to_ground = 0.0;
     points[ind].score = 0.0;
     points[ind].root = ind;
     const Eigen::Vector3i index = ((points[ind].pos - box_min) / pixel_width).cast<int>();
-    closest_node.push(QueueNode(0, 0, heightfield(index[0], index[1]), ind, ind));
+    root_radii[ind - roots_start] = heightfield(index[0], index[1]);
+    closest_node.push(QueueNode(0, ind));
   }
 
   // perform Djikstra's shortest path to ground algorithm to fill in the parent indices in 'points'
-  connectPointsShortestPath(points, closest_node, distance_limit, gravity_factor);
+  connectPointsShortestPath(points, closest_node, distance_limit, gravity_factor, roots_start, root_radii);
 
   // next we want to segment the paths into separate trees. To do this we find the number of points and
   // the maximum height of points that come from each cell index
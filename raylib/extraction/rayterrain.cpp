@@ -10,191 +10,172 @@
 #include "../rayprogress.h"
 #include "../rayprogressthread.h"
 
-#if RAYLIB_WITH_TBB
-#include <tbb/enumerable_thread_specific.h>
-#include <tbb/parallel_for.h>
-#endif  // RAYLIB_WITH_TBB
-static int num_visits = 0;
-static int num_cone_tests = 0;
-
+#include <numeric>
 
 namespace ray
 {
-/// The node structure used in calculating the pareto front
-struct Node
+namespace
+{
+/// whether @c lower dominates @c upper in the (tilted) Pareto front calculation. This checks in a cone rather than
+/// just the corner of a cube shape that you would get from a raw Pareto front calculation. The cone lies within the
+/// corner, so @c lower must also be smaller than @c upper in each axis
+inline bool dominates(const Vector4d &lower, const Vector4d &upper)
 {
-  Node()
+  static const double root_third = std::sqrt(1.0 / 3.0);
+  static const double cos_ang = std::sqrt(2.0 / 3.0);
+  static const Eigen::Vector3d diagonal(root_third, root_third, root_third);
+  const Eigen::Vector3d dif(upper[0] - lower[0], upper[1] - lower[1], upper[2] - lower[2]);
+  if (dif[0] <= 0.0 || dif[1] <= 0.0 || dif[2] <= 0.0)
   {
-    pos.setZero();
-    found = 0;
-    is_set = 0;
-    for (int i = 0; i < 2; i++)
+    return false;
+  }
+  return dif.normalized().dot(diagonal) > cos_ang;
+}
+
+/// A balanced k-d tree over the points, bulk built by median splits, for the dominance queries of the Pareto front.
+/// It is a complete binary tree stored as an array, with node k's children at 2k+1 and 2k+2
+class DominanceTree
+{
+public:
+  explicit DominanceTree(const std::vector<Vector4d> &points)
+    : points_(points)
+  {
+    const int leaf_size = 8;
+    const int num_points = static_cast<int>(points.size());
+    depth_ = 0;
+    while ((num_points >> depth_) > leaf_size)
+    {
+      depth_++;
+    }
+    first_leaf_ = (1 << depth_) - 1;
+    nodes_.resize(2 * first_leaf_ + 1);
+    ids_.resize(points.size());
+    std::iota(ids_.begin(), ids_.end(), 0);
+    nodes_[0].begin = 0;
+    nodes_[0].end = num_points;
+
+    // split each level of the tree in parallel, at the median along the cycling axes
+    for (int level = 0; level < depth_; level++)
     {
-      for (int j = 0; j < 2; j++)
+      const int first = (1 << level) - 1;
+      const int axis = level % 3;
+      #pragma omp parallel for schedule(dynamic)
+      for (int k = first; k < 2 * first + 1; k++)
       {
-        for (int k = 0; k < 2; k++)
-        {
-          dir_ids[i][j][k] = -1;
-        }
+        const int begin = nodes_[k].begin, end = nodes_[k].end;
+        const int mid = (begin + end) / 2;
+        std::nth_element(ids_.begin() + begin, ids_.begin() + mid, ids_.begin() + end,
+                         [&points, axis](int a, int b) { return points[a][axis] < points[b][axis]; });
+        nodes_[2 * k + 1].begin = begin;
+        nodes_[2 * k + 1].end = mid;
+        nodes_[2 * k + 2].begin = mid;
+        nodes_[2 * k + 2].end = end;
       }
     }
-  }
-  Vector4d pos;
-  int found;
-  int is_set;
-  int dir_ids[2][2][2];
-
-  // returns whether there is a smaller node than the supplied @c corner point
-  bool somethingSmaller(std::vector<Node> &nodes, const Vector4d &corner)
-  {
-    num_visits++;
-// This checks in a cone rather than just the corner of a cube shape that you would get
-// from a raw Pareto front calculation    
-#define CONE_CHECK  
-    Vector4d dif = corner - pos;
-    if (dif == Vector4d(0, 0, 0, 0))
+    // then the minimum bound of each node, from the leaves up
+    #pragma omp parallel for
+    for (int k = first_leaf_; k < static_cast<int>(nodes_.size()); k++)
     {
-#if defined CONE_CHECK
-      if (dir_ids[0][0][0] == -1)
+      Eigen::Vector3d &min_bound = nodes_[k].min_bound;
+      min_bound.setConstant(std::numeric_limits<double>::max());
+      for (int i = nodes_[k].begin; i < nodes_[k].end; i++)
       {
-        return false;
+        min_bound = minVector(min_bound, Eigen::Vector3d(points[ids_[i]][0], points[ids_[i]][1], points[ids_[i]][2]));
       }
-      return nodes[dir_ids[0][0][0]].somethingSmaller(nodes, corner);
-#else
-      return dir_ids[0][0][0] != -1;
-#endif
     }
-    const int i = static_cast<int>(dif[0] > 0.0);
-    const int j = static_cast<int>(dif[1] > 0.0);
-    const int k = static_cast<int>(dif[2] > 0.0);
-#if defined CONE_CHECK
-    static const double root_third = std::sqrt(1.0 / 3.0);
-    static const double cos_ang = std::sqrt(2.0 / 3.0);
-    static const Eigen::Vector3d diagonal(root_third, root_third, root_third);
-#endif
-    if (i == 0 && j == 0 && k == 0)  // corner is smaller, so deactivate current node
+    for (int k = first_leaf_ - 1; k >= 0; k--)
     {
-#if defined CONE_CHECK
-      num_cone_tests++;
-      const Eigen::Vector3d dir = -Eigen::Vector3d(dif[0], dif[1], dif[2]).normalized();
-      if (dir.dot(diagonal) > cos_ang)
-        found = 1;
-#else
-      found = 1;
-#endif
+      nodes_[k].min_bound = minVector(nodes_[2 * k + 1].min_bound, nodes_[2 * k + 2].min_bound);
     }
-    else if (i == 1 && j == 1 && k == 1)  // corner is larger, so this node is indeed smaller
+  }
+
+  /// returns whether any point dominates @c corner. @c visits is incremented for each node visited
+  bool somethingSmaller(const Vector4d &corner, long long &visits) const
+  {
+    int stack[64];  // deeper than any tree that fits in memory
+    int size = 0;
+    stack[size++] = 0;
+    while (size > 0)
     {
-#if defined CONE_CHECK
-      num_cone_tests++;
-      const Eigen::Vector3d dir = Eigen::Vector3d(dif[0], dif[1], dif[2]).normalized();
-      if (dir.dot(diagonal) > cos_ang)
+      const int k = stack[--size];
+      const Node &node = nodes_[k];
+      visits++;
+      // only points in the corner below @c corner can dominate it
+      if (node.min_bound[0] >= corner[0] || node.min_bound[1] >= corner[1] || node.min_bound[2] >= corner[2])
       {
-        return true;
+        continue;
       }
-#else
-      return true;  // needs a cone check
-#endif
-    }
-    for (int I = 0; I <= i; I++)
-    {
-      for (int J = 0; J <= j; J++)
+      if (k >= first_leaf_)
       {
-        for (int K = 0; K <= k; K++)
+        for (int i = node.begin; i < node.end; i++)
         {
-          if (dir_ids[I][J][K] != -1)
+          if (dominates(points_[ids_[i]], corner))
           {
-            if (nodes[dir_ids[I][J][K]].somethingSmaller(nodes, corner))
-            {
-              return true;
-            }
+            return true;
           }
         }
+        continue;
       }
+      // visit the lower child first, as it is more likely to contain a dominating point
+      const Eigen::Vector3d &min1 = nodes_[2 * k + 1].min_bound, &min2 = nodes_[2 * k + 2].min_bound;
+      const bool first_lower = min1[0] + min1[1] + min1[2] <= min2[0] + min2[1] + min2[2];
+      stack[size++] = first_lower ? 2 * k + 2 : 2 * k + 1;
+      stack[size++] = first_lower ? 2 * k + 1 : 2 * k + 2;
     }
     return false;
   }
-};
 
-/// construct an octal space partition tree
-void constructOctalSpacePartition(std::vector<Node> &nodes, std::vector<Vector4d> points)
-{
-  nodes.resize(points.size());
-  int i = 0;
-  while (points.size() > 0)
+private:
+  struct Node
   {
-    const int ind = rand() % static_cast<int>(points.size());
-    nodes[i++].pos = points[ind];
-    points[ind] = points.back();
-    points.pop_back();
-  }
-  // n log n on average, for each node, trace the tree to add correct direction ids
-  for (size_t n = 1; n < nodes.size(); n++)
-  {
-    const Eigen::Vector4d &pos = nodes[n].pos;
-    int head = 0;
-    for (;;)
-    {
-      const Vector4d dif = pos - nodes[head].pos;
-      const int i = static_cast<int>(dif[0] > 0.0);
-      const int j = static_cast<int>(dif[1] > 0.0);
-      const int k = static_cast<int>(dif[2] > 0.0);
-      const int new_head = nodes[head].dir_ids[i][j][k];
-      if (new_head == -1)
-      {
-        nodes[head].dir_ids[i][j][k] = static_cast<int>(n);
-        break;
-      }
-      head = new_head;
-    }
-  }
-}
+    Eigen::Vector3d min_bound;
+    int begin, end;  // the node's points are ids_[begin] to ids_[end - 1]
+  };
+  const std::vector<Vector4d> &points_;
+  std::vector<int> ids_;
+  std::vector<Node> nodes_;
+  int depth_;
+  int first_leaf_;
+};
+}  // namespace
 
 // get 3D pareto front, the 4D vectors' last element is its index, to aid with book keeping
 void Terrain::getParetoFront(const std::vector<Vector4d> &points, std::vector<Vector4d> &front)
 {
   // this is an acceleration structure for faster lookup
-  std::vector<Node> nodes;
-  constructOctalSpacePartition(nodes, points);
-  Node &root = nodes[0];
+  const DominanceTree tree(points);
 
   Progress progress;
   ProgressThread progress_thread(progress);
-  progress.begin("rays processed:", nodes.size());
+  progress.begin("rays processed:", points.size());
 
-  const auto process_rays = [&nodes, &root, &front, &progress](size_t n) {
-    progress.increment();
-    if (nodes[n].found == 1)
-    {
-      return;
-    }
-    bool dominated = root.somethingSmaller(nodes, nodes[n].pos);
-    if (dominated)
-      nodes[n].found = 1;
-    else
-      nodes[n].is_set = 1;
-  };
-#if RAYLIB_WITH_TBB
-  tbb::parallel_for<size_t>(0, nodes.size(), process_rays);
-#else
-  #pragma omp parallel for
-  for (size_t n = 0; n < nodes.size(); n++)
+  const int num_points = static_cast<int>(points.size());
+  std::vector<char> in_front(points.size(), false);  // not vector<bool>, which is unsafe to write concurrently
+  long long num_visits = 0;
+  #pragma omp parallel for schedule(dynamic, 256) reduction(+ : num_visits)
+  for (int n = 0; n < num_points; n++)
   {
-    process_rays(n);
+    progress.increment();
+    in_front[n] = !tree.somethingSmaller(points[n], num_visits);
   }
-#endif
-  for (auto &node : nodes)
+  // list the front in a pseudo-random order, the same permutation as earlier versions, so the triangulation of the
+  // front is unchanged
+  std::vector<int> ids(points.size());
+  std::iota(ids.begin(), ids.end(), 0);
+  while (ids.size() > 0)
   {
-    if (node.is_set)
+    const int ind = rand() % static_cast<int>(ids.size());
+    if (in_front[ids[ind]])
     {
-      front.push_back(node.pos);
+      front.push_back(points[ids[ind]]);
     }
+    ids[ind] = ids.back();
+    ids.pop_back();
   }
   progress.end();
   progress_thread.requestQuit();
   progress_thread.join();
-  std::cout << "number of rays: " << points.size() << ", number of visits: " << num_visits
-            << ", number of cone tests: " << num_cone_tests << std::endl;
+  std::cout << "number of rays: " << points.size() << ", number of visits: " << num_visits << std::endl;
 }
 
 void Terrain::growUpwards(const std::vector<Eigen::Vector3d> &positions, double gradient)
@@ -353,14 +334,24 @@ void Terrain::growUpwardsFast(const std::vector<Eigen::Vector3d> &ends, double p
 }
 
 // Convert the @c cloud input to the mesh_ member variable. 
-void Terrain::extract(const Cloud &cloud, const Eigen::Vector3d &offset, const std::string &file_prefix, double gradient, bool verbose)
+void Terrain::extract(const Cloud &cloud, const Eigen::Vector3d &offset, const std::string &file_prefix, double gradient,
+                      bool verbose, double spacing)
 {
 #if RAYLIB_WITH_QHULL
   // preprocessing to make the cloud smaller.
   Eigen::Vector3d min_bound, max_bound;
   cloud.calcBounds(&min_bound, &max_bound);
-  const double spacing = cloud.estimatePointSpacing();
+  const bool global_grid = spacing > 0.0;
+  if (!global_grid)
+  {
+    spacing = cloud.estimatePointSpacing();
+  }
   const double pixel_width = 2.0 * spacing;
+  if (global_grid)  // snap the grid to the frame origin, so that overlapping tiles use the same cells
+  {
+    min_bound[0] = std::floor(min_bound[0] / pixel_width) * pixel_width;
+    min_bound[1] = std::floor(min_bound[1] / pixel_width) * pixel_width;
+  }
   std::vector<Eigen::Vector3d> ends;
   for (size_t i = 0; i < cloud.ends.size(); i++)
   {
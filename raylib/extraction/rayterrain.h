@@ -27,7 +27,11 @@ public:
   /// it treats ground like sand, being incapable of having a gradient beyond the specified value
   /// The input is the @c cloud and its @c file_prefix (to name debug outputs), and a specified @c gradient
   /// The output is the stored mesh, which is accessed with the mesh() accessor.
-  void extract(const Cloud &cloud, const Eigen::Vector3d &offset, const std::string &file_prefix, double gradient, bool verbose);
+  /// The pre-filtering grid uses the point @c spacing, which is estimated from the cloud when zero. Tiles of a larger
+  /// cloud should pass the spacing of the whole cloud, and share its @c offset. A given spacing also aligns the grid
+  /// cells to the origin of the cloud's frame, rather than to its bounds, so the tiles share one global grid
+  void extract(const Cloud &cloud, const Eigen::Vector3d &offset, const std::string &file_prefix, double gradient,
+               bool verbose, double spacing = 0.0);
 
   /// Direct extraction of the pareto front points
   void growUpwards(const std::vector<Eigen::Vector3d> &positions, double gradient);
@@ -0,0 +1,374 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raytiles.h"
+#include "raytrees.h"
+#include "../raycloud.h"
+#include "../raycloudwriter.h"
+#include "../rayforeststructure.h"
+#include "../raymesh.h"
+#include "../rayply.h"
+#include "../raysplitter.h"
+
+#include <array>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <set>
+
+namespace ray
+{
+namespace
+{
+// working memory of tree extraction per byte of ray cloud file, a conservative estimate
+const double kMemoryPerFileByte = 20.0;
+
+unsigned long long fileSize(const std::string &file_name)
+{
+  std::ifstream ifs(file_name, std::ios::binary | std::ios::ate);
+  if (!ifs.is_open())
+    return 0;
+  return static_cast<unsigned long long>(ifs.tellg());
+}
+}  // namespace
+
+bool splitIntoTiles(const std::string &file_name, const std::string &tile_stub, double width, double overlap,
+                    std::vector<CloudTile> &tiles)
+{
+  Cloud::Info info;
+  if (!Cloud::getInfo(file_name, info))
+    return false;
+  if (!splitGrid(file_name, tile_stub, Eigen::Vector3d(width, width, 0.0), overlap))
+    return false;
+
+  // the same cell range as splitGrid, but only the cells that received rays have a file
+  const Eigen::Vector3d &min_bound = info.rays_bound.min_bound_;
+  const Eigen::Vector3d &max_bound = info.rays_bound.max_bound_;
+  const Eigen::Vector2i min_index(static_cast<int>(std::floor(0.5 + min_bound[0] / width)),
+                                  static_cast<int>(std::floor(0.5 + min_bound[1] / width)));
+  const Eigen::Vector2i max_index(static_cast<int>(std::ceil(0.5 + max_bound[0] / width)),
+                                  static_cast<int>(std::ceil(0.5 + max_bound[1] / width)));
+  tiles.clear();
+  for (int x = min_index[0]; x < max_index[0]; x++)
+  {
+    for (int y = min_index[1]; y < max_index[1]; y++)
+    {
+      CloudTile tile;
+      tile.index = Eigen::Vector2i(x, y);
+      tile.stub = tile_stub + "_" + std::to_string(x) + "_" + std::to_string(y);
+      const unsigned long long size = fileSize(tile.stub + ".ply");
+      if (size == 0)
+        continue;
+      tile.memory_size = static_cast<unsigned long long>(kMemoryPerFileByte * static_cast<double>(size));
+      const double inf = std::numeric_limits<double>::max();
+      tile.min_bound = Eigen::Vector3d(width * (x - 0.5), width * (y - 0.5), -inf);
+      tile.max_bound = Eigen::Vector3d(width * (x + 0.5), width * (y + 0.5), inf);
+      tiles.push_back(tile);
+    }
+  }
+  std::cout << "split into " << tiles.size() << " tiles of width " << width << " m and overlap " << overlap << " m"
+            << std::endl;
+  return true;
+}
+
+bool processTiles(const std::vector<CloudTile> &tiles, unsigned long long max_memory,
+                  const std::function<bool(const CloudTile &tile)> &process)
+{
+  // the queue of waiting tiles, largest first so the long-running tiles don't finish last
+  std::vector<int> waiting(tiles.size());
+  for (size_t i = 0; i < tiles.size(); i++)
+    waiting[i] = static_cast<int>(i);
+  std::stable_sort(waiting.begin(), waiting.end(),
+                   [&tiles](int a, int b) { return tiles[a].memory_size > tiles[b].memory_size; });
+
+  std::mutex mutex;
+  std::condition_variable finished;
+  unsigned long long memory_in_use = 0;
+  int num_running = 0;
+  bool success = true;
+  #pragma omp parallel
+  {
+    for (;;)
+    {
+      int tile_id = -1;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        // take the largest waiting tile that fits in the remaining memory, or wait for a running tile to finish
+        for (;;)
+        {
+          if (waiting.empty())
+            break;
+          auto it = std::find_if(waiting.begin(), waiting.end(), [&](int i) {
+            return num_running == 0 || memory_in_use + tiles[i].memory_size <= max_memory;
+          });
+          if (it != waiting.end())
+          {
+            tile_id = *it;
+            waiting.erase(it);
+            memory_in_use += tiles[tile_id].memory_size;
+            num_running++;
+            break;
+          }
+          finished.wait(lock);
+        }
+      }
+      if (tile_id == -1)
+        break;
+
+      const bool processed = process(tiles[tile_id]);
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!processed)
+        {
+          std::cerr << "Error: failed to process tile " << tiles[tile_id].stub << std::endl;
+          success = false;
+        }
+        memory_in_use -= tiles[tile_id].memory_size;
+        num_running--;
+      }
+      finished.notify_all();
+    }
+  }
+  return success;
+}
+
+int stitchTrees(const std::vector<CloudTile> &tiles, const std::string &trees_file, const std::string &segmented_file,
+                bool segment_branches)
+{
+  std::ofstream ofs(trees_file.c_str(), std::ios::out);
+  if (!ofs.is_open())
+  {
+    std::cerr << "Error: cannot open " << trees_file << " for writing." << std::endl;
+    return -1;
+  }
+  // the tree files are stitched as text, so the trees are output exactly as Trees::save formats them
+  bool header_written = false;
+  int num_trees = 0;
+  int section_offset = 0;
+  std::vector<int> colour_offsets(tiles.size());
+  for (size_t t = 0; t < tiles.size(); t++)
+  {
+    // the segment colours are 0-based per-tile tree (or branch section) ids
+    colour_offsets[t] = segment_branches ? section_offset : num_trees;
+    std::ifstream ifs(tiles[t].stub + "_trees.txt", std::ios::in);
+    int section_end = section_offset;
+    int fields_per_segment = 0;
+    int section_field = -1;
+    for (std::string line; std::getline(ifs, line);)
+    {
+      if (line.empty())
+        continue;
+      if (line[0] == '#' || fields_per_segment == 0)  // the comments then the format line
+      {
+        if (line[0] != '#')
+        {
+          const std::vector<std::string> fields = split(line, ',');
+          fields_per_segment = static_cast<int>(fields.size());
+          auto found = std::find(fields.begin(), fields.end(), "section_id");
+          section_field = found == fields.end() ? -1 : static_cast<int>(found - fields.begin());
+        }
+        if (!header_written)
+          ofs << line << std::endl;
+        continue;
+      }
+      std::vector<std::string> fields = split(line, ',');
+      for (size_t i = section_field; section_field >= 0 && i < fields.size(); i += fields_per_segment)
+      {
+        const int id = std::stoi(fields[i]) + section_offset;
+        section_end = std::max(section_end, id + 1);
+        fields[i] = std::to_string(id);
+      }
+      for (size_t i = 0; i < fields.size(); i++)
+        ofs << (i > 0 ? "," : "") << fields[i];
+      ofs << std::endl;
+      num_trees++;
+    }
+    header_written = header_written || fields_per_segment > 0;
+    section_offset = section_end;
+  }
+
+  // A bounded ray is in the segmented cloud of the tile owning its end point, unless it was segmented into a tree
+  // owned by a neighbouring tile, in which case that tile has it instead (or as well). So the rays ending outside
+  // their tile's cell are collected first, and each ray is output once, with a tree colour if either tile has one
+  typedef std::array<long long, 4> RayKey;
+  auto rayKey = [](const Eigen::Vector3d &end, double time) {
+    const double mm = 1000.0;  // the tiles' own offsets can differ the positions by rounding errors
+    return RayKey{ { std::llround(end[0] * mm), std::llround(end[1] * mm), std::llround(end[2] * mm),
+                     std::llround(time * 1e6) } };
+  };
+  auto globalColour = [](RGBA colour, int colour_offset) {
+    const int id = convertColourToInt(colour);
+    if (id != -1)  // black is unsegmented
+      convertIntToColour(id + colour_offset, colour);
+    return colour;
+  };
+  struct ForeignRay
+  {
+    Eigen::Vector3d start, end;
+    double time;
+    RGBA colour;
+    bool output;
+  };
+  std::map<RayKey, ForeignRay> foreign_rays;
+  for (size_t t = 0; t < tiles.size(); t++)
+  {
+    const CloudTile &tile = tiles[t];
+    auto collect = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                       std::vector<double> &times, std::vector<RGBA> &colours) {
+      for (size_t i = 0; i < ends.size(); i++)
+      {
+        if (colours[i].alpha > 0 && !tile.owns(ends[i]))
+          foreign_rays.insert({ rayKey(ends[i], times[i]),
+                                ForeignRay{ starts[i], ends[i], times[i], globalColour(colours[i], colour_offsets[t]), false } });
+      }
+    };
+    if (fileSize(tile.stub + "_segmented.ply") > 0 && !Cloud::read(tile.stub + "_segmented.ply", collect))
+      return -1;
+  }
+
+  CloudWriter writer;
+  if (!writer.begin(segmented_file))
+    return -1;
+  for (size_t t = 0; t < tiles.size(); t++)
+  {
+    const CloudTile &tile = tiles[t];
+    std::set<RayKey> segmented_rays;
+    auto stitch = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<RGBA> &colours) {
+      Cloud chunk;
+      for (size_t i = 0; i < ends.size(); i++)
+      {
+        // unbounded rays are clipped to the tile, so are only owned by the tile where they end
+        if (!tile.owns(ends[i]))
+          continue;
+        RGBA colour = globalColour(colours[i], colour_offsets[t]);
+        if (colour.alpha > 0)
+        {
+          const RayKey key = rayKey(ends[i], times[i]);
+          segmented_rays.insert(key);
+          auto foreign = foreign_rays.find(key);
+          if (foreign != foreign_rays.end())
+          {
+            if (colour.red == 0 && colour.green == 0 && colour.blue == 0)
+              colour = foreign->second.colour;
+            foreign->second.output = true;
+          }
+        }
+        chunk.addRay(starts[i], ends[i], times[i], colour);
+      }
+      writer.writeChunk(chunk);
+    };
+    if (fileSize(tile.stub + "_segmented.ply") > 0 && !Cloud::read(tile.stub + "_segmented.ply", stitch))
+    {
+      writer.end();
+      return -1;
+    }
+    // the tile's rays that are in no segmented cloud, as the tiles disagree on their tree, are output unsegmented
+    auto unsegmented = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                           std::vector<double> &times, std::vector<RGBA> &colours) {
+      Cloud chunk;
+      for (size_t i = 0; i < ends.size(); i++)
+      {
+        if (colours[i].alpha == 0 || !tile.owns(ends[i]))
+          continue;
+        const RayKey key = rayKey(ends[i], times[i]);
+        if (segmented_rays.count(key) || foreign_rays.count(key))
+          continue;
+        RGBA colour = colours[i];
+        colour.red = colour.green = colour.blue = 0;
+        chunk.addRay(starts[i], ends[i], times[i], colour);
+      }
+      writer.writeChunk(chunk);
+    };
+    if (!Cloud::read(tile.stub + ".ply", unsegmented))
+    {
+      writer.end();
+      return -1;
+    }
+  }
+  // the remaining rays are those removed from their own tile, for belonging to a neighbouring tile's tree
+  Cloud chunk;
+  for (auto &foreign : foreign_rays)
+  {
+    const ForeignRay &ray = foreign.second;
+    if (!ray.output)
+      chunk.addRay(ray.start, ray.end, ray.time, ray.colour);
+  }
+  writer.writeChunk(chunk);
+  writer.end();
+  if (num_trees == 0)
+    std::cout << "no trees found" << std::endl;
+  return num_trees;
+}
+
+int stitchTrunks(const std::vector<CloudTile> &tiles, const std::string &trunks_file)
+{
+  std::ofstream ofs(trunks_file.c_str(), std::ios::out);
+  if (!ofs.is_open())
+  {
+    std::cerr << "Error: cannot open " << trunks_file << " for writing." << std::endl;
+    return -1;
+  }
+  // same format as Trunks::save
+  ofs << "# tree trunks file:" << std::endl;
+  ofs << "x,y,z,radius" << std::endl;
+  int num_trunks = 0;
+  for (auto &tile : tiles)
+  {
+    ForestStructure tile_forest;
+    if (fileSize(tile.stub + "_trunks.txt") == 0 || !tile_forest.load(tile.stub + "_trunks.txt"))
+      continue;
+    for (auto &tree : tile_forest.trees)
+    {
+      const TreeStructure::Segment &base = tree.segments()[0];
+      if (!tile.owns(base.tip))  // the trunk is owned by a neighbouring tile
+        continue;
+      ofs << base.tip[0] << ", " << base.tip[1] << ", " << base.tip[2] << ", " << base.radius << std::endl;
+      num_trunks++;
+    }
+  }
+  return num_trunks;
+}
+
+int stitchTerrain(const std::vector<CloudTile> &tiles, const std::string &mesh_file)
+{
+  Mesh mesh;
+  for (auto &tile : tiles)
+  {
+    Mesh tile_mesh;
+    if (fileSize(tile.stub + "_mesh.ply") == 0 || !readPlyMesh(tile.stub + "_mesh.ply", tile_mesh))
+      continue;
+    const std::vector<Eigen::Vector3d> &vertices = tile_mesh.vertices();
+    const int offset = static_cast<int>(mesh.vertices().size());
+    mesh.vertices().insert(mesh.vertices().end(), vertices.begin(), vertices.end());
+    for (auto &triangle : tile_mesh.indexList())
+    {
+      const Eigen::Vector3d centroid = (vertices[triangle[0]] + vertices[triangle[1]] + vertices[triangle[2]]) / 3.0;
+      if (!tile.owns(centroid))  // the triangle is owned by a neighbouring tile
+        continue;
+      mesh.indexList().push_back(triangle + Eigen::Vector3i(offset, offset, offset));
+    }
+  }
+  // the tiles share a common offset, so a ground point in the overlap has the same position in each tile's mesh, and
+  // welding these merges the tiles. This also removes the vertices of the triangles owned by neighbouring tiles
+  mesh.weld(0.0);
+  mesh.colours() = std::vector<RGBA>(mesh.vertices().size(), RGBA::terrain());
+  // the tile meshes are already stored with flipped normals, so their winding is kept as is
+  if (!writePlyMesh(mesh_file, mesh, false))
+    return -1;
+  return static_cast<int>(mesh.indexList().size());
+}
+
+void removeTileFiles(const std::vector<CloudTile> &tiles, const std::vector<std::string> &suffixes)
+{
+  for (auto &tile : tiles)
+  {
+    std::remove((tile.stub + ".ply").c_str());
+    for (auto &suffix : suffixes)
+      std::remove((tile.stub + suffix).c_str());
+  }
+}
+}  // namespace ray
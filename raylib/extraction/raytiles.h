@@ -0,0 +1,63 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYEXTRACT_TILES_H
+#define RAYLIB_RAYEXTRACT_TILES_H
+
+#include "../rayutils.h"
+#include "raylib/raylibconfig.h"
+
+#include <functional>
+
+namespace ray
+{
+/// A cell of a horizontal grid over a ray cloud, whose rays are stored clipped to the cell, expanded by an overlap
+struct RAYLIB_EXPORT CloudTile
+{
+  Eigen::Vector2i index;           // grid coordinates, cell 0,0 is centred at 0,0
+  std::string stub;                // file name stub of the tile cloud, and of any per-tile outputs
+  Eigen::Vector3d min_bound;       // bounds of the tile's own (non-overlapping) cell. Objects based in this cell
+  Eigen::Vector3d max_bound;       // are owned by the tile
+  unsigned long long memory_size;  // estimated working memory to process the tile, in bytes
+
+  /// whether the horizontal position of @c pos lies within the tile's own cell
+  bool owns(const Eigen::Vector3d &pos) const
+  {
+    return pos[0] >= min_bound[0] && pos[0] < max_bound[0] && pos[1] >= min_bound[1] && pos[1] < max_bound[1];
+  }
+};
+
+/// Splits the ray cloud @c file_name into tile files named @c tile_stub_X_Y.ply, matching raysplit grid with a cell
+/// width of @c width and an @c overlap between neighbouring cells. Empty cells are omitted from the returned @c tiles
+bool RAYLIB_EXPORT splitIntoTiles(const std::string &file_name, const std::string &tile_stub, double width,
+                                  double overlap, std::vector<CloudTile> &tiles);
+
+/// Calls @c process on each of the @c tiles in parallel. Largest tiles are started first, and a tile is only started
+/// when the estimated memory of the tiles in progress stays within @c max_memory bytes. A tile larger than this is
+/// processed on its own. Returns false if any call to @c process returns false
+bool RAYLIB_EXPORT processTiles(const std::vector<CloudTile> &tiles, unsigned long long max_memory,
+                                const std::function<bool(const CloudTile &tile)> &process);
+
+/// Concatenates the per-tile @c stub_trees.txt files into @c trees_file and the @c stub_segmented.ply files into
+/// @c segmented_file. The tree and section ids are offset per tile to be globally unique, including the per-tree (or
+/// per-branch if @c segment_branches) colours of the segmented cloud. Unbounded rays are kept by the tile owning
+/// their end point. Returns the number of trees
+int RAYLIB_EXPORT stitchTrees(const std::vector<CloudTile> &tiles, const std::string &trees_file,
+                              const std::string &segmented_file, bool segment_branches);
+
+/// Concatenates the per-tile @c stub_trunks.txt files into @c trunks_file, keeping each trunk in only the tile that
+/// owns its base. Returns the number of trunks
+int RAYLIB_EXPORT stitchTrunks(const std::vector<CloudTile> &tiles, const std::string &trunks_file);
+
+/// Welds the per-tile @c stub_mesh.ply terrain meshes into @c mesh_file. Each tile keeps only the triangles whose
+/// centroid it owns, and vertices at the same position in neighbouring tiles are merged into one. The tile meshes are
+/// read one at a time. Returns the number of triangles, or -1 on failure
+int RAYLIB_EXPORT stitchTerrain(const std::vector<CloudTile> &tiles, const std::string &mesh_file);
+
+/// Deletes the tile clouds and any per-tile outputs with the given file @c suffixes
+void RAYLIB_EXPORT removeTileFiles(const std::vector<CloudTile> &tiles, const std::vector<std::string> &suffixes);
+}  // namespace ray
+
+#endif  // RAYLIB_RAYEXTRACT_TILES_H
@@ -20,6 +20,8 @@ TreesParams::TreesParams()
   , span_ratio(4.5)
   , gravity_factor(0.3)
   , grid_width(0.0)
+  , use_grid_cell(false)
+  , grid_cell(0, 0)
   , segment_branches(false)
   , global_taper(0.012)
   , global_taper_factor(0.3)
@@ -29,6 +31,7 @@ TreesParams::TreesParams()
 /// It is based on finding the shortest paths using Djikstra's algorithm, followed
 /// by an agglomeration of paths, with repeated splitting from root to tips
 Trees::Trees(Cloud &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, const TreesParams &params, bool verbose)
+  : points_(vertices_)
 {
   // firstly, get the full set of shortest paths from ground to tips, and the set of roots
   params_ = &params;
@@ -178,6 +181,7 @@ Trees::Trees(Cloud &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, cons
     sections_[sec_].ends.clear();
     extractNodesAndEndsFromRoots(nodes, base, children, 0.0, best_dist/2.0); // make it lower
     estimateCylinderTaper(estimated_radius, best_accuracy, false); // update the expected taper
+    addForestTaper(sections_[sec_]);
   }
   if (verbose)
   {
@@ -186,7 +190,122 @@ Trees::Trees(Cloud &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, cons
   }
 
   // now trace from root tree nodes upwards, getting node centroids
-  // create new BranchSections as we go
+  // create new BranchSections as we go. Each tree is reconstructed independently
+  growTrees(children);
+
+  // Now calculate the section ids for all of the points, for the segmented cloud
+  std::vector<int> section_ids(points_.size(), -1);
+  calculateSectionIds(section_ids, children);
+
+  generateLocalSectionIds();
+
+  Eigen::Vector3d min_bound(0, 0, 0), max_bound(0, 0, 0);
+  // remove all sections with a root out of bounds, if we have gridded the cloud with an overlap
+  if (params_->grid_width)
+  {
+    removeOutOfBoundSections(cloud, min_bound, max_bound, offset);
+  }
+
+  std::vector<int> root_segs(cloud.ends.size(), -1);
+  // now colour the ray cloud based on the segmentation
+  segmentCloud(cloud, root_segs, section_ids);
+
+  if (params_->grid_width)  // also remove rays from the segmented cloud
+  {
+    removeOutOfBoundRays(cloud, min_bound, max_bound, root_segs);
+  }
+
+  std::cout << "cloud's estimated mean taper ratio (diameter / length): " << 2.0 * forest_taper_ / forest_weight_ << std::endl;
+}
+
+Trees::Trees(const Trees &forest, const BranchSection &root_section)
+  : sec_(0)
+  , params_(forest.params_)
+  , points_(forest.points_)
+  , forest_taper_(forest.forest_taper_)
+  , forest_weight_(forest.forest_weight_)
+  , forest_weight_squared_(forest.forest_weight_squared_)
+{
+  sections_.push_back(root_section);
+  sections_[0].root = 0;
+}
+
+// Grow the branch sections of every tree independently, in parallel. The trees share the read-only points_ and
+// children, and all see the same forest taper estimate, from the trunks. The resulting sections are merged and
+// renumbered to the order that growSections() creates them for the whole forest, and their tapers are then added to
+// the forest estimate in that order, so the result does not depend on the number of threads
+void Trees::growTrees(std::vector<std::vector<int>> &children)
+{
+  const int num_trees = static_cast<int>(sections_.size());
+  std::vector<std::vector<BranchSection>> tree_sections(num_trees);
+  std::vector<std::vector<int>> tree_creators(num_trees);
+  std::vector<std::vector<char>> tree_tapered(num_trees);
+  for (int i = 0; i < num_trees; i++)
+  {
+    if (sections_[i].ends.empty())
+    {
+      std::cout << "weird, a trunk without end points! " << i << std::endl;
+    }
+  }
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < num_trees; i++)
+  {
+    Trees tree(*this, sections_[i]);
+    tree.growSections(children, tree_creators[i], tree_tapered[i]);
+    tree_sections[i] = std::move(tree.sections_);
+  }
+
+  // replay the forest-wide processing order, where each section appends the sections that it creates
+  std::vector<std::vector<int>> global_ids(num_trees);
+  std::vector<size_t> next_created(num_trees, 1);  // the first local section created by a later section
+  std::vector<Eigen::Vector2i> order;              // the tree and local index of each global section
+  for (int i = 0; i < num_trees; i++)
+  {
+    global_ids[i].resize(tree_sections[i].size(), -1);
+    global_ids[i][0] = i;
+    order.push_back(Eigen::Vector2i(i, 0));
+  }
+  for (size_t j = 0; j < order.size(); j++)
+  {
+    const int tree = order[j][0], local = order[j][1];
+    size_t &next = next_created[tree];
+    while (next < tree_sections[tree].size() && tree_creators[tree][next] == local)
+    {
+      global_ids[tree][next] = static_cast<int>(order.size());
+      order.push_back(Eigen::Vector2i(tree, static_cast<int>(next++)));
+    }
+  }
+
+  sections_.resize(order.size());
+  for (size_t j = 0; j < order.size(); j++)
+  {
+    const int tree = order[j][0];
+    BranchSection &section = sections_[j];
+    section = std::move(tree_sections[tree][order[j][1]]);
+    section.root = tree;
+    if (tree_tapered[tree][order[j][1]])  // in the order that a serial growth would add it
+    {
+      addForestTaper(section);
+    }
+    if (section.parent != -1)
+    {
+      section.parent = global_ids[tree][section.parent];
+    }
+    for (auto &child : section.children)
+    {
+      child = global_ids[tree][child];
+    }
+  }
+}
+
+// trace from the root sections upwards, getting node centroids
+// create new BranchSections as we go
+void Trees::growSections(std::vector<std::vector<int>> &children, std::vector<int> &creators,
+                         std::vector<char> &tapered)
+{
+  creators.assign(sections_.size(), -1);
+  tapered.assign(sections_.size(), 0);
   for (sec_ = 0; sec_ < (int)sections_.size(); sec_++)
   {
     const int par = sections_[sec_].parent;
@@ -196,22 +315,15 @@ Trees::Trees(Cloud &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, cons
       if (sections_[sec_].ends.size() > 0)
       {
         addChildSection();
+        creators.resize(sections_.size(), sec_);
+        tapered.resize(sections_.size(), 0);
         for (const auto &i: sections_[sec_].roots)
         {
           sections_[sec_].tip[2] = std::min(sections_[sec_].tip[2], points_[i].pos[2]);
         }
-      }      
-      else
-      {
-        std::cout << "weird, a trunk without end points! " << sec_ << std::endl;
       }
       continue;
     }
-    if (!(sec_ % 10000))
-    {
-      std::cout << "generating segment " << sec_ << std::endl;
-    }
-
     // this branch can come to an end as it is now too small
     if (sections_[sec_].max_distance_to_end < params_->crop_length)
     {
@@ -262,37 +374,16 @@ Trees::Trees(Cloud &cloud, const Eigen::Vector3d &offset, const Mesh &mesh, cons
     double rad = estimateCylinderRadius(nodes, dir, accuracy);
     // and estimate taper
     estimateCylinderTaper(rad / sections_[sec_].radius_scale, accuracy, extract_from_ends);
+    tapered[sec_] = 1;
 
     // now add the single child for this particular tree node, assuming there are still ends
     if (sections_[sec_].ends.size() > 0)
     {
       addChildSection();
     }
+    creators.resize(sections_.size(), sec_);
+    tapered.resize(sections_.size(), 0);
   }  // end of loop. We now have created all of the BranchSections
-
-  // Now calculate the section ids for all of the points, for the segmented cloud
-  std::vector<int> section_ids(points_.size(), -1);
-  calculateSectionIds(section_ids, children);
-
-  generateLocalSectionIds();
-
-  Eigen::Vector3d min_bound(0, 0, 0), max_bound(0, 0, 0);
-  // remove all sections with a root out of bounds, if we have gridded the cloud with an overlap
-  if (params_->grid_width)
-  {
-    removeOutOfBoundSections(cloud, min_bound, max_bound, offset);
-  }
-
-  std::vector<int> root_segs(cloud.ends.size(), -1);
-  // now colour the ray cloud based on the segmentation
-  segmentCloud(cloud, root_segs, section_ids);
-
-  if (params_->grid_width)  // also remove rays from the segmented cloud
-  {
-    removeOutOfBoundRays(cloud, min_bound, max_bound, root_segs);
-  }
-
-  std::cout << "cloud's estimated mean taper ratio (diameter / length): " << 2.0 * forest_taper_ / forest_weight_ << std::endl;
 }
 
 // If 1 tree plus some low lying foliage is in the node, then it won't be split if the foliage doesn't reach to the 
@@ -902,10 +993,6 @@ void Trees::estimateCylinderTaper(double radius, double accuracy, bool extract_f
  // weight *= weight; // preference the strongest weight sections
   double taper = (radius/L) * weight;
 
-  forest_taper_ += taper;
-  forest_weight_ += weight;
-  forest_weight_squared_ += weight*weight;
-
   sections_[root].total_taper += taper;
   sections_[root].total_weight += weight;
   if (sections_[root].total_weight == 0.0)
@@ -921,6 +1008,13 @@ void Trees::estimateCylinderTaper(double radius, double accuracy, bool extract_f
   sections_[sec_].junction_weight = junction_weight;
 }
 
+void Trees::addForestTaper(const BranchSection &section)
+{
+  forest_taper_ += section.taper;
+  forest_weight_ += section.weight;
+  forest_weight_squared_ += section.weight * section.weight;
+}
+
 // add a child section to continue reconstructing the tree segments
 void Trees::addChildSection()
 {
@@ -1051,7 +1145,9 @@ void Trees::removeOutOfBoundSections(const Cloud &cloud, Eigen::Vector3d &min_bo
   const double width = params_->grid_width;
   cloud.calcBounds(&min_bound, &max_bound);
   const Eigen::Vector3d mid = (min_bound + max_bound)/2.0 + offset;
-  const Eigen::Vector2d inds(std::round(mid[0] / width), std::round(mid[1] / width));
+  // the cloud's bounds only approximate the cell's when it is sparse or off-centre in the cell
+  const Eigen::Vector2d inds = params_->use_grid_cell ? params_->grid_cell.cast<double>()
+                                                      : Eigen::Vector2d(std::round(mid[0] / width), std::round(mid[1] / width));
   min_bound[0] = width * (inds[0] - 0.5) - offset[0];
   min_bound[1] = width * (inds[1] - 0.5) - offset[1];
   max_bound[0] = width * (inds[0] + 0.5) - offset[0];
@@ -1201,7 +1297,7 @@ bool Trees::save(const std::string &filename, const Eigen::Vector3d &offset, boo
     {
       continue;
     }
-    ofs << section.tip[0]+offset[0] << "," << section.tip[1]+offset[1] << "," << section.tip[2]+offset[2] << "," << radius(section) << ",-1," << sec;
+    ofs << section.tip[0]+offset[0] << "," << section.tip[1]+offset[1] << "," << section.tip[2]+offset[2] << "," << radius(section) << ",-1," << contiguous_section_ids_[sec];
     if (verbose)
     {
       ofs << "," << section.weight << "," << section.len << "," << section.accuracy << "," << section.junction_weight;
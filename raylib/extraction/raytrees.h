@@ -28,6 +28,8 @@ struct RAYLIB_EXPORT TreesParams
   double span_ratio;                // points that span a larger width determine that a branch has become two
   double gravity_factor;   // preferences branches that are less lateral, so penalises implausable horizontal branches
   double grid_width;       // used on a grid cell with overlap, to remove trees with a base in the overlap zone
+  bool use_grid_cell;      // use grid_cell as the cell index, rather than estimating it from the cloud's bounds
+  Eigen::Vector2i grid_cell; // index of the grid cell, with cell 0,0 centred at 0,0
   bool segment_branches;   // flag to output the ray cloud coloured by branch segment index rather than by tree index
   double global_taper;     // forced global taper, uses global_taper_factor to define how much it is applied
   double global_taper_factor; // 0 estimates per-tree tapering, 1 uses per-scan tapering, 0.5 is mid-way on mid-weight trees
@@ -50,10 +52,24 @@ public:
   /// save the trees representation to a text file
   bool save(const std::string &filename, const Eigen::Vector3d &offset, bool verbose) const;
 
+  Trees(const Trees &) = delete;
+  Trees &operator=(const Trees &) = delete;
+
 private:
+  /// Constructs the reconstruction of the single tree @c root_section, which shares the points of @c forest
+  Trees(const Trees &forest, const BranchSection &root_section);
+
   /// The piecewise cylindrical represenation of all of the trees
   std::vector<BranchSection> sections_;
 
+  /// reconstruct the branch sections from the root sections up to the tips. @c creators is filled with the index of
+  /// the section that was being reconstructed when each section was created, or -1 for the initial sections, and
+  /// @c tapered with whether each section estimated a taper
+  void growSections(std::vector<std::vector<int>> &children, std::vector<int> &creators, std::vector<char> &tapered);
+  /// reconstruct each tree's branch sections in parallel, then merge them in the order that @c growSections()
+  /// would create them over the whole forest
+  void growTrees(std::vector<std::vector<int>> &children);
+
   /// calculate the distance to farthest connected branch tip, for each point in the cloud
   void calculatePointDistancesToEnd();
   /// create the start branch segments at the root positions
@@ -80,6 +96,8 @@ private:
   double estimateCylinderRadius(const std::vector<int> &nodes, const Eigen::Vector3d &dir, double &accuracy);
   /// estimate the cylinder's taper rate from its centre, @c dir and set of nodes
   void estimateCylinderTaper(double radius, double accuracy, bool extract_from_ends);
+  /// add the taper estimated for @c section to the forest's mean taper
+  void addForestTaper(const BranchSection &section);
   /// add a new section to continue reconstructing the branch
   void addChildSection();
   /// calculate the ownership, what branch section does each point belong to
@@ -103,7 +121,8 @@ private:
   // cached data that is used throughout the processing method
   int sec_;
   const TreesParams *params_;
-  std::vector<Vertex> points_;
+  std::vector<Vertex> vertices_;  // storage for points_, which are shared with the single tree reconstructions
+  std::vector<Vertex> &points_;
   double forest_taper_{0};
   double forest_weight_{0};
   double forest_weight_squared_{0};
@@ -27,7 +27,7 @@ Trunk::Trunk()
 {}
 
 // return the points that overlap this trunk, using the grid as an acceleration structure
-std::vector<Eigen::Vector3d> Trunk::getOverlappingPoints(const Grid<Eigen::Vector3d> &grid, double spacing)
+std::vector<Eigen::Vector3d> Trunk::getOverlappingPoints(const PointGrid &grid, double spacing) const
 {
   std::vector<Eigen::Vector3d> points;
   // get grid bounds
@@ -42,31 +42,27 @@ std::vector<Eigen::Vector3d> Trunk::getOverlappingPoints(const Grid<Eigen::Vecto
   const Eigen::Vector3i min_dims = grid.dims - Eigen::Vector3i(1, 1, 1);
   maxs = minVector(maxs, min_dims);
 
-  // iterate over the cells in the bounds
-  Eigen::Vector3i ind;
-  for (ind[0] = mins[0]; ind[0] <= maxs[0]; ind[0]++)
+  // iterate over the columns of cells in the bounds
+  for (int x = mins[0]; x <= maxs[0]; x++)
   {
-    for (ind[1] = mins[1]; ind[1] <= maxs[1]; ind[1]++)
+    for (int y = mins[1]; y <= maxs[1]; y++)
     {
-      for (ind[2] = mins[2]; ind[2] <= maxs[2]; ind[2]++)
+      // the points in the column's cells are contiguous
+      const auto range = grid.cells(x, y, mins[2], maxs[2]);
+      for (const Eigen::Vector3d *pos = range.first; pos != range.second; ++pos)
       {
-        auto &cell = grid.cell(ind);
-        // iterate over the points in the cell
-        for (auto &pos : cell.data)
+        // intersect against the trunk cylinder
+        Eigen::Vector3d p = *pos - centre;
+        const double h = p.dot(dir);
+        if (std::abs(h) > length * 0.5)
         {
-          // intersect against the trunk cylinder
-          Eigen::Vector3d p = pos - centre;
-          const double h = p.dot(dir);
-          if (std::abs(h) > length * 0.5)
-          {
-            continue;
-          }
-          p -= dir * h;
-          const double dist2 = p.squaredNorm();
-          if (dist2 <= outer_radius * outer_radius)
-          {
-            points.push_back(pos);
-          }
+          continue;
+        }
+        p -= dir * h;
+        const double dist2 = p.squaredNorm();
+        if (dist2 <= outer_radius * outer_radius)
+        {
+          points.push_back(*pos);
         }
       }
     }
@@ -33,7 +33,7 @@ struct RAYLIB_EXPORT Trunk
   bool active;
 
   /// return the overlapping points to the trunk using the @c grid of points
-  std::vector<Eigen::Vector3d> getOverlappingPoints(const Grid<Eigen::Vector3d> &grid, double spacing);
+  std::vector<Eigen::Vector3d> getOverlappingPoints(const PointGrid &grid, double spacing) const;
 
   /// estimate the centre and direction of the trunk from the shape of the points
   void estimatePose(const std::vector<Eigen::Vector3d> &points);
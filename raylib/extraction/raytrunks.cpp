@@ -352,16 +352,8 @@ Trunks::Trunks(const Cloud &cloud, const Eigen::Vector3d &offset, double midRadi
 
   // 1. voxel grid of points (an acceleration structure)
   const double voxel_width = midRadius * 2.0;
-  Grid<Eigen::Vector3d> grid(min_bound, max_bound, voxel_width);
-  for (size_t i = 0; i < cloud.ends.size(); i++)
-  {
-    if (!cloud.rayBounded(i))
-    {
-      continue;
-    }
-    const Eigen::Vector3d pos = cloud.ends[i];
-    grid.insert(grid.index(pos), pos);
-  }
+  PointGrid grid(min_bound, max_bound, voxel_width);
+  grid.fill(cloud.ends, cloud.colours);
   const int min_num_points = 6;
 
   // 2. initialise one trunk candidate for each occupied voxel
@@ -379,6 +371,8 @@ Trunks::Trunks(const Cloud &cloud, const Eigen::Vector3d &offset, double midRadi
   {
     double above_count = 0;
     double active_count = 0;
+    // each candidate is refined independently
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+ : above_count, active_count)
     for (int trunk_id = 0; trunk_id < static_cast<int>(trunks.size()); trunk_id++)
     {
       auto &trunk = trunks[trunk_id];
@@ -500,21 +494,23 @@ void Trunks::removePermeableTrunks(bool verbose, const Cloud &cloud, const Eigen
   // set the grid's occupancy from the rays
   grid2D.fillRays(cloud);
 
-  std::vector<Eigen::Vector3d> closest_approach_points, pass_through_points;
-  int num_removed = 0;
-  // now check how occupied the pixels are that overlap each trunk
-  for (auto &trunk : trunks)
+  // now check how occupied the pixels are that overlap each trunk, in parallel
+  std::vector<std::vector<Eigen::Vector3d>> trunk_nearest_points(trunks.size());
+  std::vector<char> passed_through(trunks.size(), false);  // not vector<bool>, which is unsafe to write concurrently
+  #pragma omp parallel for schedule(dynamic)
+  for (int trunk_id = 0; trunk_id < static_cast<int>(trunks.size()); trunk_id++)
   {
+    const Trunk &trunk = trunks[trunk_id];
     if (!trunk.active)
     {
       continue;
     }
 
     Eigen::Vector3d base = trunk.centre - trunk.length * 0.5 * trunk.dir;
-    auto &ray_ids = grid2D.pixel(trunk.centre).ray_ids;
+    const auto &ray_ids = grid2D.pixel(trunk.centre).ray_ids;
     double mean_rad = 0.0;
     double mean_num = 0.0;
-    std::vector<Eigen::Vector3d> nearest_points;
+    std::vector<Eigen::Vector3d> &nearest_points = trunk_nearest_points[trunk_id];
     for (size_t i = 0; i < ray_ids.size(); i++)
     {
       // check whether ray passes through trunk...
@@ -543,16 +539,28 @@ void Trunks::removePermeableTrunks(bool verbose, const Cloud &cloud, const Eigen
     if (mean_num > 1)
     {
       mean_rad /= mean_num;
-      if (mean_rad < 0.7 * trunk.radius)  // too many pass through the trunk
-      {
-        trunk.active = false;
-        num_removed++;
-        pass_through_points.insert(pass_through_points.begin(), nearest_points.begin(), nearest_points.end());
-      }
-      else
-      {
-        closest_approach_points.insert(closest_approach_points.begin(), nearest_points.begin(), nearest_points.end());
-      }
+      passed_through[trunk_id] = mean_rad < 0.7 * trunk.radius;  // too many pass through the trunk
+    }
+    else
+    {
+      nearest_points.clear();
+    }
+  }
+
+  std::vector<Eigen::Vector3d> closest_approach_points, pass_through_points;
+  int num_removed = 0;
+  for (size_t trunk_id = 0; trunk_id < trunks.size(); trunk_id++)
+  {
+    std::vector<Eigen::Vector3d> &nearest_points = trunk_nearest_points[trunk_id];
+    if (passed_through[trunk_id])
+    {
+      trunks[trunk_id].active = false;
+      num_removed++;
+      pass_through_points.insert(pass_through_points.begin(), nearest_points.begin(), nearest_points.end());
+    }
+    else
+    {
+      closest_approach_points.insert(closest_approach_points.begin(), nearest_points.begin(), nearest_points.end());
     }
   }
   if (verbose)
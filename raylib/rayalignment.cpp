@@ -4,13 +4,12 @@
 //
 // Author: Thomas Lowe
 #include "rayalignment.h"
+#include "rayfft.h"
 #include "rayply.h"
 #include "rayunused.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "imagewrite.h"
 
-#include "simple_fft/fft.h"
-
 #include <cinttypes>
 #include <complex>
 #include <iostream>
@@ -18,13 +17,14 @@
 using Complex = std::complex<double>;
 static const double kHighPassPower = 0.25;  // This fixes inout->inout11, inoutD->inoutB2 and house_inside->house3.
                                             // Doesn't break any. power=0.25. 0 is turned off.
+static const int kMinWindowPoints = 100;    // the fewest cloud points in a window for refining the translation in it
 namespace ray
 {
 struct Array1D
 {
   void init(int length);
-  void fft();
-  void inverseFft();
+  void fft(const FFTPlan &plan);
+  void inverseFft(const FFTPlan &plan);
 
   void operator*=(const Array1D &other);
   inline Complex &operator()(const int &x) { return cells_[x]; }
@@ -33,11 +33,13 @@ struct Array1D
   {
     for (int i = 0; i < (int)cells_.size(); i++) cells_[i] += other.cells_[i];
   }
-  void polarCrossCorrelation(const Array3D *arrays, bool verbose);
+  /// Cross-correlates the @c polar spectra with the conjugated @c reference spectra, summed over all rings.
+  /// This modifies @c polar
+  void polarCrossCorrelation(std::vector<Array1D> &polar, const std::vector<Array1D> &reference);
 
   int maxRealIndex() const;
   void conjugate();
-  int numCells() { return (int)cells_.size(); }
+  int numCells() const { return (int)cells_.size(); }
   Complex &cell(int i) { return cells_[i]; }
   const Complex &cell(int i) const { return cells_[i]; }
 
@@ -45,6 +47,14 @@ private:
   std::vector<Complex> cells_;
 };
 
+/// The fixed side of the cross-correlations: the high-pass filtered and conjugated spectrum of the reference cloud's
+/// density grid, and optionally its conjugated polar spectra for estimating the yaw
+struct ReferenceGrid
+{
+  Array3D spectrum;
+  std::vector<Array1D> polar;  // empty when the yaw is not estimated
+};
+
 struct Col
 {
   uint8_t r, g, b, a;
@@ -55,17 +65,17 @@ void Array3D::init(const Eigen::Vector3d &box_min, double voxel_width, const Eig
   box_min_ = box_min;
   voxel_width_ = voxel_width;
   dims_ = dimensions;
-  cells_.resize(dims_[0] * dims_[1] * dims_[2]);
-  memset(&cells_[0], 0, cells_.size() * sizeof(Complex));
+  spectrum_width_ = dims_[0] / 2 + 1;
+  cells_.assign((size_t)spectrum_width_ * dims_[1] * dims_[2], Complex(0, 0));
   null_cell_ = 0;
 }
 
 void Array3D::init(const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_max, double voxel_width)
 {
   Eigen::Vector3d diff = (box_max - box_min) / voxel_width;
-  // HERE we need to make it a power of two
+  // the FFT is fastest on dimensions that factor into 2s, 3s and 5s, which are much less padded than powers of two
   Eigen::Vector3i d;
-  for (int i = 0; i < 3; i++) d[i] = 1 << (int)ceil(log2(ceil(diff[i])));  // next power of two larger than diff
+  for (int i = 0; i < 3; i++) d[i] = fftGoodSize((int)ceil(diff[i]), i == 0);  // x must be even for the real FFT
   init(box_min, voxel_width, d);
 }
 
@@ -81,30 +91,33 @@ void Array3D::conjugate()
 
 void Array3D::fft()
 {
-  const char *error = nullptr;
-  // TODO: change to in-place (cells not repeated)
-  if (!simple_fft::FFT(*this, *this, dims_[0], dims_[1], dims_[2], error))
-    std::cout << "failed to calculate FFT: " << error << std::endl;
+  RealFFT3D transform(dims_);
+  transform.forward(cells_.data());
 }
 
 void Array3D::inverseFft()
 {
-  const char *error = nullptr;
-  if (!simple_fft::IFFT(*this, *this, dims_[0], dims_[1], dims_[2], error))
-    std::cout << "failed to calculate inverse FFT: " << error << std::endl;
+  RealFFT3D transform(dims_);
+  transform.inverse(cells_.data());
 }
 
 Eigen::Vector3i Array3D::maxRealIndex() const
 {
-  Eigen::Vector3i index;
+  Eigen::Vector3i index(0, 0, 0);
   double highest = std::numeric_limits<double>::lowest();
-  for (int i = 0; i < (int)cells_.size(); i++)
+  for (int z = 0; z < dims_[2]; z++)
   {
-    const double &score = cells_[i].real();
-    if (score > highest)
+    for (int y = 0; y < dims_[1]; y++)
     {
-      index = Eigen::Vector3i(i % dims_[0], (i / dims_[0]) % dims_[1], i / (dims_[0] * dims_[1]));
-      highest = score;
+      for (int x = 0; x < dims_[0]; x++)
+      {
+        const double &score = (*this)(x, y, z);
+        if (score > highest)
+        {
+          index = Eigen::Vector3i(x, y, z);
+          highest = score;
+        }
+      }
     }
   }
   return index;
@@ -129,7 +142,7 @@ void Array3D::fillWithRays(const Cloud &cloud)
     {
       if (index[0] >= 0 && index[0] < dims_[0] && index[1] >= 0 && index[1] < dims_[1] && index[2] >= 0 &&
           index[2] < dims_[2])
-        (*this)(index[0], index[1], index[2]) += Complex(1, 0);  // add weight to these areas...
+        (*this)(index[0], index[1], index[2]) += 1.0;  // add weight to these areas...
 
       Eigen::Vector3d mid = box_min_ + voxel_width_ * Eigen::Vector3d(index[0] + 0.5, index[1] + 0.5, index[2] + 0.5);
       Eigen::Vector3d next_boundary = mid + 0.5 * voxel_width_ * dir_sign;
@@ -149,8 +162,7 @@ void Array3D::fillWithRays(const Cloud &cloud)
 
 void Array1D::init(int length)
 {
-  cells_.resize(length);
-  memset(&cells_[0], 0, cells_.size() * sizeof(Complex));
+  cells_.assign(length, Complex(0, 0));
 }
 
 void Array1D::operator*=(const Array1D &other)
@@ -163,19 +175,16 @@ void Array1D::conjugate()
   for (int i = 0; i < (int)cells_.size(); i++) cells_[i] = conj(cells_[i]);
 }
 
-void Array1D::fft()
+void Array1D::fft(const FFTPlan &plan)
 {
-  const char *error = nullptr;
-  // TODO: change to in-place (cells not repeated)
-  if (!simple_fft::FFT(*this, *this, cells_.size(), error))
-    std::cout << "failed to calculate FFT: " << error << std::endl;
+  std::vector<Complex> work(cells_.size());
+  plan.transform(cells_.data(), work.data(), 1, false);
 }
 
-void Array1D::inverseFft()
+void Array1D::inverseFft(const FFTPlan &plan)
 {
-  const char *error = nullptr;
-  if (!simple_fft::IFFT(*this, *this, cells_.size(), error))
-    std::cout << "failed to calculate inverse FFT: " << error << std::endl;
+  std::vector<Complex> work(cells_.size());
+  plan.transform(cells_.data(), work.data(), 1, true);
 }
 
 int Array1D::maxRealIndex() const
@@ -204,7 +213,7 @@ void drawArray(const Array3D &array, const Eigen::Vector3i &dims, const std::str
     for (int y = 0; y < height; y++)
     {
       double val = 0.0;
-      for (int z = 0; z < dims[2]; z++) val += abs(array(x, y, z));
+      for (int z = 0; z < dims[2]; z++) val += std::abs(array.spectrumValue(x, y, z));
       max_val = std::max(max_val, val);
     }
   }
@@ -222,7 +231,7 @@ void drawArray(const Array3D &array, const Eigen::Vector3i &dims, const std::str
         col[0] = 1.0 - h;
         col[2] = h;
         col[1] = 3.0 * col[0] * col[2];
-        colour += std::abs(array(x, y, z)) * col;
+        colour += std::abs(array.spectrumValue(x, y, z)) * col;
       }
       colour *= 15.0 * 255.0 / max_val;
       Col col;
@@ -282,192 +291,239 @@ void drawArray(const std::vector<Array1D> &arrays, const Eigen::Vector3i &dims,
   stbi_write_png(str.str().c_str(), width, height, 4, (void *)&pixels[0], 4 * width);
 }
 
-void Array1D::polarCrossCorrelation(const Array3D *arrays, bool verbose)
+/// Polar dimensions for the spectrum of a grid of dimensions @c dims
+Eigen::Vector3i polarDimensions(const Eigen::Vector3i &dims)
 {
-  // OK cool, so next I need to re-map the two arrays into 4x1 grids...
-  int max_rad = std::max(arrays[0].dimensions()[0], arrays[0].dimensions()[1]) / 2;
-  Eigen::Vector3i polar_dims = Eigen::Vector3i(4 * max_rad, max_rad, arrays[0].dimensions()[2]);
-  std::vector<Array1D> polars[2];
-  for (int c = 0; c < 2; c++)
+  int max_rad = std::max(dims[0], dims[1]) / 2;
+  return Eigen::Vector3i(fftGoodSize(4 * max_rad), max_rad, dims[2]);
+}
+
+/// Re-maps the magnitude of the spectrum of @c a into polar rings, and transforms each ring. A yaw of the grid is then a
+/// shift along the rings, independent of any translation of the grid
+void polarSpectra(const Array3D &a, std::vector<Array1D> &polar, bool verbose, int index)
+{
+  Eigen::Vector3i polar_dims = polarDimensions(a.dimensions());
+  FFTPlan plan(polar_dims[0]);  // shared by all of the polar rows
+  polar.resize(polar_dims[1] * polar_dims[2]);
+  for (int j = 0; j < polar_dims[1]; j++)
+    for (int k = 0; k < polar_dims[2]; k++) polar[j + polar_dims[1] * k].init(polar_dims[0]);
+
+  // now map...
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < polar_dims[0]; i++)
   {
-    std::vector<Array1D> &polar = polars[c];
-    const Array3D &a = arrays[c];
-    polar.resize(polar_dims[1] * polar_dims[2]);
+    double angle = 2.0 * kPi * (double)(i + 0.5) / (double)polar_dims[0];
     for (int j = 0; j < polar_dims[1]; j++)
-      for (int k = 0; k < polar_dims[2]; k++) polar[j + polar_dims[1] * k].init(polar_dims[0]);
-
-    // now map...
-    for (int i = 0; i < polar_dims[0]; i++)
     {
-      double angle = 2.0 * kPi * (double)(i + 0.5) / (double)polar_dims[0];
-      for (int j = 0; j < polar_dims[1]; j++)
+      double radius = (0.5 + (double)j) / (double)polar_dims[1];
+      Eigen::Vector2d pos =
+        radius * 0.5 * Eigen::Vector2d((double)a.dimensions()[0] * sin(angle), (double)a.dimensions()[1] * cos(angle));
+      if (pos[0] < 0.0)
+        pos[0] += a.dimensions()[0];
+      if (pos[1] < 0.0)
+        pos[1] += a.dimensions()[1];
+      int x = pos.cast<int>()[0];
+      int y = pos.cast<int>()[1];
+      int x2 = (x + 1) % a.dimensions()[0];
+      int y2 = (y + 1) % a.dimensions()[1];
+      double blend_x = pos[0] - (double)x;
+      double blend_y = pos[1] - (double)y;
+      for (int z = 0; z < polar_dims[2]; z++)
       {
-        double radius = (0.5 + (double)j) / (double)polar_dims[1];
-        Eigen::Vector2d pos =
-          radius * 0.5 *
-          Eigen::Vector2d((double)a.dimensions()[0] * sin(angle), (double)a.dimensions()[1] * cos(angle));
-        if (pos[0] < 0.0)
-          pos[0] += a.dimensions()[0];
-        if (pos[1] < 0.0)
-          pos[1] += a.dimensions()[1];
-        int x = pos.cast<int>()[0];
-        int y = pos.cast<int>()[1];
-        int x2 = (x + 1) % a.dimensions()[0];
-        int y2 = (y + 1) % a.dimensions()[1];
-        double blend_x = pos[0] - (double)x;
-        double blend_y = pos[1] - (double)y;
-        for (int z = 0; z < polar_dims[2]; z++)
-        {
-          // bilinear interpolation -- for some reason LERP after abs is better than before abs
-          double val = abs(a(x, y, z)) * (1.0 - blend_x) * (1.0 - blend_y) +
-                       abs(a(x2, y, z)) * blend_x * (1.0 - blend_y) + abs(a(x, y2, z)) * (1.0 - blend_x) * blend_y +
-                       abs(a(x2, y2, z)) * blend_x * blend_y;
-          polar[j + polar_dims[1] * z](i) = Complex(radius * val, 0);
-        }
+        // bilinear interpolation -- for some reason LERP after abs is better than before abs
+        double val = std::abs(a.spectrumValue(x, y, z)) * (1.0 - blend_x) * (1.0 - blend_y) +
+                     std::abs(a.spectrumValue(x2, y, z)) * blend_x * (1.0 - blend_y) +
+                     std::abs(a.spectrumValue(x, y2, z)) * (1.0 - blend_x) * blend_y +
+                     std::abs(a.spectrumValue(x2, y2, z)) * blend_x * blend_y;
+        polar[j + polar_dims[1] * z](i) = Complex(radius * val, 0);
       }
     }
-    if (verbose)
-      drawArray(polar, polar_dims, "translationInvPolar", c);
-    for (int j = 0; j < polar_dims[1]; j++)
+  }
+  if (verbose)
+    drawArray(polar, polar_dims, "translationInvPolar", index);
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < (int)polar.size(); i++)
+  {
+    polar[i].fft(plan);
+    if (kHighPassPower > 0.0)
     {
-      for (int k = 0; k < polar_dims[2]; k++)
-      {
-        int i = j + polar_dims[1] * k;
-        polar[i].fft();
-        if (kHighPassPower > 0.0)
-        {
-          for (int l = 0; l < polar[i].numCells(); l++)
-            polar[i].cell(l) *= std::pow(std::min((double)l, (double)(polar[i].numCells() - l)), kHighPassPower);
-        }
-      }
+      for (int l = 0; l < polar[i].numCells(); l++)
+        polar[i].cell(l) *= std::pow(std::min((double)l, (double)(polar[i].numCells() - l)), kHighPassPower);
     }
-    if (verbose)
-      drawArray(polar, polar_dims, "euclideanInvariant", c);
   }
+  if (verbose)
+    drawArray(polar, polar_dims, "euclideanInvariant", index);
+}
 
+void Array1D::polarCrossCorrelation(std::vector<Array1D> &polar, const std::vector<Array1D> &reference)
+{
+  FFTPlan plan(polar[0].numCells());
   // now get the inverse fft in place:
-  init(polar_dims[0]);
-  for (size_t i = 0; i < polars[0].size(); i++)
+  init(polar[0].numCells());
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < (int)polar.size(); i++)
   {
-    polars[1][i].conjugate();
-    polars[0][i] *= polars[1][i];
-    polars[0][i].inverseFft();
-    (*this) += polars[0][i];  // add all the results together into the first array
+    polar[i] *= reference[i];
+    polar[i].inverseFft(plan);
   }
+  // add all the results together into the first array
+  for (size_t i = 0; i < polar.size(); i++) (*this) += polar[i];
 }
 
 /************************************************************************************/
-void alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose)
+namespace
 {
-  // first we need to decimate the clouds into intensity grids..
-  // I need to get a maximum box width, and individual box_min, boxMaxs
-  Eigen::Vector3d box_mins[2], box_width(0, 0, 0);
-  for (int c = 0; c < 2; c++)
+/// Fills the density grid with the @c points, transformed by @c pose
+void fillArray(Array3D &array, const std::vector<Eigen::Vector3d> &points, const Pose &pose)
+{
+  for (const auto &point : points) array(pose * point) += 1.0;
+}
+
+/// Axis-aligned bounds of the @c points transformed by @c pose
+void getBounds(const std::vector<Eigen::Vector3d> &points, const Pose &pose, Eigen::Vector3d &box_min,
+               Eigen::Vector3d &box_max)
+{
+  const double mx = std::numeric_limits<double>::max();
+  const double mn = std::numeric_limits<double>::lowest();
+  box_min = Eigen::Vector3d(mx, mx, mx);
+  box_max = Eigen::Vector3d(mn, mn, mn);
+  for (const auto &point : points)
   {
-    const double mx = std::numeric_limits<double>::max();
-    const double mn = std::numeric_limits<double>::lowest();
-    Eigen::Vector3d box_min(mx, mx, mx), box_max(mn, mn, mn);
-    for (int i = 0; i < (int)clouds[c].ends.size(); i++)
-    {
-      if (clouds[c].rayBounded(i))
-      {
-        box_min = minVector(box_min, clouds[c].ends[i]);
-        box_max = maxVector(box_max, clouds[c].ends[i]);
-      }
-    }
-    box_mins[c] = box_min;
-    Eigen::Vector3d width = box_max - box_min;
-    box_width = maxVector(box_width, width);
+    Eigen::Vector3d pos = pose * point;
+    box_min = minVector(box_min, pos);
+    box_max = maxVector(box_max, pos);
   }
+}
 
-  bool rotation_to_estimate = true;  // If we know there is no rotation between the clouds then we can save some cost
-
-  Array3D arrays[2];
-  // Now fill in the arrays with point density
-  for (int c = 0; c < 2; c++)
+/// The number of the @c points, transformed by @c pose, within the box @c box_min, @c box_max
+int numPointsInBox(const std::vector<Eigen::Vector3d> &points, const Pose &pose, const Eigen::Vector3d &box_min,
+                   const Eigen::Vector3d &box_max)
+{
+  int count = 0;
+  for (const auto &point : points)
   {
-    arrays[c].init(box_mins[c], box_mins[c] + box_width, voxel_width);
-    for (int i = 0; i < (int)clouds[c].ends.size(); i++)
-      if (clouds[c].rayBounded(i))
-        arrays[c](clouds[c].ends[i]) += Complex(1, 0);
-    arrays[c].fft();
-    if (verbose)
-      drawArray(arrays[c], arrays[c].dimensions(), "translationInvariant", c);
+    Eigen::Vector3d pos = pose * point;
+    if ((pos.array() >= box_min.array()).all() && (pos.array() < box_max.array()).all())
+      count++;
   }
+  return count;
+}
 
-  if (rotation_to_estimate)
+/// The window for refining the translation at voxel @c width: the overlap of the transformed cloud's bounds
+/// @c min0, @c max0 with the reference's bounds @c min1, @c max1, limited to @c max_grid_width voxels about its centre.
+/// On any axis where the bounds do not overlap, the window covers the reference
+void overlapWindow(const Eigen::Vector3d &min0, const Eigen::Vector3d &max0, const Eigen::Vector3d &min1,
+                   const Eigen::Vector3d &max1, double width, int max_grid_width, Eigen::Vector3d &window_min,
+                   Eigen::Vector3d &window_max)
+{
+  Eigen::Vector3d overlap_min = maxVector(min0, min1);
+  Eigen::Vector3d overlap_max = minVector(max0, max1);
+  Eigen::Vector3d centre = 0.5 * (overlap_min + overlap_max);
+  Eigen::Vector3d window_width = overlap_max - overlap_min;
+  for (int i = 0; i < 3; i++)
   {
-    Array1D polar;
-    polar.polarCrossCorrelation(arrays, verbose);
-
-    // get the angle of rotation
-    int index = polar.maxRealIndex();
-    // add a little bit of sub-pixel accuracy:
-    double angle;
-    int dim = polar.numCells();
-    int back = (index + dim - 1) % dim;
-    int fwd = (index + 1) % dim;
-    double y0 = polar(back).real();
-    double y1 = polar(index).real();
-    double y2 = polar(fwd).real();
-    angle = index + 0.5 * (y0 - y2) / (y0 + y2 - 2.0 * y1);  // just a quadratic maximum -b/2a for heights y0,y1,y2
-    // but the FFT wraps around, so:
-    if (angle > dim / 2)
-      angle -= dim;
-    angle *= 2.0 * kPi / (double)polar.numCells();
-    if (verbose)
-      std::cout << "Coarse align: estimated yaw rotation: " << angle << std::endl;
-
-    // ok, so let's rotate A towards B, and re-run the translation FFT
-    Pose pose(Eigen::Vector3d(0, 0, 0), Eigen::Quaterniond(Eigen::AngleAxisd(angle, Eigen::Vector3d(0, 0, 1))));
-    clouds[0].transform(pose, 0.0);
-
-    const double mx = std::numeric_limits<double>::max();
-    box_mins[0] = Eigen::Vector3d(mx, mx, mx);
-    for (int i = 0; i < (int)clouds[0].ends.size(); i++)
-      if (clouds[0].rayBounded(i))
-        box_mins[0] = minVector(box_mins[0], clouds[0].ends[i]);
-    arrays[0].clearCells();
-    arrays[0].init(box_mins[0], box_mins[0] + box_width, voxel_width);
-
-    for (int i = 0; i < (int)clouds[0].ends.size(); i++)
-      if (clouds[0].rayBounded(i))
-        arrays[0](clouds[0].ends[i]) += Complex(1, 0);
-
-    arrays[0].fft();
-    if (verbose)
-      drawArray(arrays[0], arrays[0].dimensions(), "translationInvariantWeighted", 0);
+    if (!(window_width[i] > 0.0))  // the estimated clouds do not overlap, so the window covers the target cloud
+    {
+      centre[i] = 0.5 * (min1[i] + max1[i]);
+      window_width[i] = max1[i] - min1[i];
+    }
+    window_width[i] = std::min(window_width[i], width * (double)max_grid_width);
   }
+  window_min = centre - 0.5 * window_width;
+  window_max = centre + 0.5 * window_width;
+}
 
-  if (kHighPassPower > 0.0)
+/// Weights the spectrum of @c array by a power of the frequency, which sharpens the cross-correlation peak
+void highPass(Array3D &array, bool verbose, int index)
+{
+  if (kHighPassPower <= 0.0)
+    return;
+  // only the stored half spectrum is filtered, the filter is symmetric so the other half follows
+  for (int x = 0; x < array.spectrumWidth(); x++)
   {
-    for (int c = 0; c < 2; c++)
+    double coord_x = x;
+    for (int y = 0; y < array.dimensions()[1]; y++)
     {
-      for (int x = 0; x < arrays[c].dimensions()[0]; x++)
+      double coord_y = y < array.dimensions()[1] / 2 ? y : array.dimensions()[1] - y;
+      for (int z = 0; z < array.dimensions()[2]; z++)
       {
-        double coord_x = x < arrays[c].dimensions()[0] / 2 ? x : arrays[c].dimensions()[0] - x;
-        for (int y = 0; y < arrays[c].dimensions()[1]; y++)
-        {
-          double coord_y = y < arrays[c].dimensions()[1] / 2 ? y : arrays[c].dimensions()[1] - y;
-          for (int z = 0; z < arrays[c].dimensions()[2]; z++)
-          {
-            double coord_z = z < arrays[c].dimensions()[2] / 2 ? z : arrays[c].dimensions()[2] - z;
-            arrays[c](x, y, z) *= pow(sqr(coord_x) + sqr(coord_y) + sqr(coord_z), kHighPassPower);
-          }
-        }
+        double coord_z = z < array.dimensions()[2] / 2 ? z : array.dimensions()[2] - z;
+        array.spectrum(x, y, z) *= pow(sqr(coord_x) + sqr(coord_y) + sqr(coord_z), kHighPassPower);
       }
-      if (verbose)
-        drawArray(arrays[c], arrays[c].dimensions(), "normalised", c);
     }
   }
-  /****************************************************************************************************/
+  if (verbose)
+    drawArray(array, array.dimensions(), "normalised", index);
+}
+
+/// Fills the @c reference grid with the density of the @c points within the bounds, and prepares its spectra
+void makeReferenceGrid(const std::vector<Eigen::Vector3d> &points, const Eigen::Vector3d &box_min,
+                       const Eigen::Vector3d &box_max, double voxel_width, bool estimate_yaw, bool verbose,
+                       ReferenceGrid &reference)
+{
+  Array3D &array = reference.spectrum;
+  array.init(box_min, box_max, voxel_width);
+  fillArray(array, points, Pose::identity());
+  array.fft();
+  if (verbose)
+    drawArray(array, array.dimensions(), "translationInvariant", 1);
+  if (estimate_yaw)
+  {
+    polarSpectra(array, reference.polar, verbose, 1);
+    for (auto &ring : reference.polar) ring.conjugate();
+  }
+  highPass(array, verbose, 1);
+  array.conjugate();
+}
+
+/// Estimates the yaw of the transformed (translation invariant) grid @c array onto the @c reference, using a polar
+/// cross-correlation
+double estimateYaw(const Array3D &array, const ReferenceGrid &reference, bool verbose)
+{
+  std::vector<Array1D> polar_spectra;
+  polarSpectra(array, polar_spectra, verbose, 0);
+  Array1D polar;
+  polar.polarCrossCorrelation(polar_spectra, reference.polar);
+
+  // get the angle of rotation
+  int index = polar.maxRealIndex();
+  // add a little bit of sub-pixel accuracy:
+  double angle;
+  int dim = polar.numCells();
+  int back = (index + dim - 1) % dim;
+  int fwd = (index + 1) % dim;
+  double y0 = polar(back).real();
+  double y1 = polar(index).real();
+  double y2 = polar(fwd).real();
+  angle = index + 0.5 * (y0 - y2) / (y0 + y2 - 2.0 * y1);  // just a quadratic maximum -b/2a for heights y0,y1,y2
+  // but the FFT wraps around, so:
+  if (angle > dim / 2)
+    angle -= dim;
+  angle *= 2.0 * kPi / (double)polar.numCells();
+  if (verbose)
+    std::cout << "Coarse align: estimated yaw rotation: " << angle << std::endl;
+  return angle;
+}
+
+/// Estimates the translation of the @c points, transformed by @c pose, onto the @c reference. The points are gridded
+/// from @c box_min, with the reference's voxel width and dimensions
+Eigen::Vector3d estimateTranslation(const std::vector<Eigen::Vector3d> &points, const Pose &pose,
+                                    const Eigen::Vector3d &box_min, const ReferenceGrid &reference, bool verbose)
+{
+  const Array3D &reference_array = reference.spectrum;
+  Array3D array;
+  array.init(box_min, reference_array.voxel_width_, reference_array.dimensions());
+  fillArray(array, points, pose);
+  array.fft();
+  if (verbose)
+    drawArray(array, array.dimensions(), "translationInvariantWeighted", 0);
+  highPass(array, verbose, 0);
+
   // now get the the translation part
-  arrays[1].conjugate();
-  arrays[0] *= arrays[1];
-  arrays[0].inverseFft();
+  array *= reference_array;
+  array.inverseFft();
 
   // find the peak
-  Array3D &array = arrays[0];
   Eigen::Vector3i ind = array.maxRealIndex();
   // add a little bit of sub-pixel accuracy:
   Eigen::Vector3d pos;
@@ -477,21 +533,208 @@ void alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose)
     int &dim = array.dimensions()[axis];
     back[axis] = (ind[axis] + dim - 1) % dim;
     fwd[axis] = (ind[axis] + 1) % dim;
-    double y0 = array(back).real();
-    double y1 = array(ind).real();
-    double y2 = array(fwd).real();
-    pos[axis] =
-      ind[axis] + 0.5 * (y0 - y2) / (y0 + y2 - 2.0 * y1);  // just a quadratic maximum -b/2a for heights y0,y1,y2
+    double y0 = array(back);
+    double y1 = array(ind);
+    double y2 = array(fwd);
+    // just a quadratic maximum -b/2a for heights y0,y1,y2. A flat peak, such as from an empty grid, has no maximum
+    double curvature = y0 + y2 - 2.0 * y1;
+    pos[axis] = ind[axis] + (curvature < 0.0 ? 0.5 * (y0 - y2) / curvature : 0.0);
     // but the FFT wraps around, so:
     if (pos[axis] >= dim / 2)
       pos[axis] -= dim;
   }
-  pos *= -array.voxelWidth();
-  pos += box_mins[1] - box_mins[0];
+  return reference_array.box_min_ - box_min - reference_array.voxel_width_ * pos;
+}
+
+/// Coarse alignment of the whole of the @c points onto the @c reference, as a yaw around the origin followed by a
+/// translation. The yaw is only estimated when the reference has polar spectra
+Pose alignToReference(const std::vector<Eigen::Vector3d> &points, const ReferenceGrid &reference, bool verbose)
+{
+  Eigen::Vector3d box_min, box_max;
+  Pose rotation = Pose::identity();
+  if (!reference.polar.empty())
+  {
+    getBounds(points, rotation, box_min, box_max);
+    Array3D array;
+    array.init(box_min, reference.spectrum.voxel_width_, reference.spectrum.dimensions());
+    fillArray(array, points, rotation);
+    array.fft();
+    if (verbose)
+      drawArray(array, array.dimensions(), "translationInvariant", 0);
+    double angle = estimateYaw(array, reference, verbose);
+
+    // ok, so let's rotate A towards B, and re-run the translation FFT
+    rotation = Pose(Eigen::Vector3d(0, 0, 0), Eigen::Quaterniond(Eigen::AngleAxisd(angle, Eigen::Vector3d(0, 0, 1))));
+  }
+  getBounds(points, rotation, box_min, box_max);
+  Eigen::Vector3d pos = estimateTranslation(points, rotation, box_min, reference, verbose);
   if (verbose)
     std::cout << "Coarse align: estimated translation: " << pos.transpose() << std::endl;
 
-  Pose transform(pos, Eigen::Quaterniond::Identity());
+  return Pose(pos, Eigen::Quaterniond::Identity()) * rotation;
+}
+
+/// Coarse alignment of the whole of the two point sets, as a yaw around the origin followed by a translation
+Pose coarseAlignment(const std::vector<Eigen::Vector3d> *points, double voxel_width, bool verbose)
+{
+  // first we need to decimate the clouds into intensity grids..
+  // I need to get a maximum box width, and individual box_min, boxMaxs
+  Eigen::Vector3d box_mins[2], box_width(0, 0, 0);
+  for (int c = 0; c < 2; c++)
+  {
+    Eigen::Vector3d box_max;
+    getBounds(points[c], Pose::identity(), box_mins[c], box_max);
+    Eigen::Vector3d width = box_max - box_mins[c];
+    box_width = maxVector(box_width, width);
+  }
+
+  bool rotation_to_estimate = true;  // If we know there is no rotation between the clouds then we can save some cost
+
+  ReferenceGrid reference;
+  makeReferenceGrid(points[1], box_mins[1], box_mins[1] + box_width, voxel_width, rotation_to_estimate, verbose,
+                    reference);
+  return alignToReference(points[0], reference, verbose);
+}
+
+/// The end points of the bounded rays, optionally subsampled to one per voxel of width @c decimation_width
+void boundedEnds(const Cloud &cloud, std::vector<Eigen::Vector3d> &points, double decimation_width = 0.0)
+{
+  for (size_t i = 0; i < cloud.ends.size(); i++)
+    if (cloud.rayBounded(i))
+      points.push_back(cloud.ends[i]);
+  if (decimation_width > 0.0)
+  {
+    std::vector<int64_t> indices;
+    voxelSubsample(points, decimation_width, indices);
+    for (size_t i = 0; i < indices.size(); i++) points[i] = points[indices[i]];
+    points.resize(indices.size());
+  }
+}
+}  // namespace
+
+void alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose)
+{
+  std::vector<Eigen::Vector3d> points[2];
+  for (int c = 0; c < 2; c++) boundedEnds(clouds[c], points[c]);
+  Pose transform = coarseAlignment(points, voxel_width, verbose);
   clouds[0].transform(transform, 0.0);
 }
+
+void alignCloud0ToCloud1Pyramid(Cloud *clouds, double voxel_width, int max_grid_width, bool verbose)
+{
+  // ends are decimated to half the finest voxel width, which bounds the cost of each level
+  std::vector<Eigen::Vector3d> points[2];
+  Eigen::Vector3d box_mins[2], box_maxs[2];
+  double extent = 0.0;
+  for (int c = 0; c < 2; c++)
+  {
+    boundedEnds(clouds[c], points[c], 0.5 * voxel_width);
+    getBounds(points[c], Pose::identity(), box_mins[c], box_maxs[c]);
+    extent = std::max(extent, (box_maxs[c] - box_mins[c]).maxCoeff());
+  }
+  // double the voxel width until the whole scene fits within the grid width
+  double coarse_width = voxel_width;
+  while (extent / coarse_width > (double)max_grid_width) coarse_width *= 2.0;
+  if (verbose)
+    std::cout << "Coarse align: pyramid from " << coarse_width << " m to " << voxel_width << " m voxels" << std::endl;
+
+  // solve the rotation and translation over the whole scene at the coarsest level
+  Pose pose = coarseAlignment(points, coarse_width, verbose);
+
+  // then refine the translation in successively finer grids, windowed on the estimated overlap of the clouds
+  for (double width = 0.5 * coarse_width; width > 0.75 * voxel_width; width *= 0.5)
+  {
+    Eigen::Vector3d min0, max0, window_min, window_max;
+    getBounds(points[0], pose, min0, max0);
+    overlapWindow(min0, max0, box_mins[1], box_maxs[1], width, max_grid_width, window_min, window_max);
+
+    ReferenceGrid reference;
+    makeReferenceGrid(points[1], window_min, window_max, width, false, false, reference);
+    Eigen::Vector3d shift = estimateTranslation(points[0], pose, window_min, reference, false);
+    pose = Pose(shift, Eigen::Quaterniond::Identity()) * pose;
+    if (verbose)
+      std::cout << "Coarse align: " << width << " m voxels, refined translation by: " << shift.transpose()
+                << std::endl;
+  }
+  if (verbose)
+    std::cout << "Coarse align: estimated transformation: " << pose << std::endl;
+  clouds[0].transform(pose, 0.0);
+}
+
+AlignmentReference::AlignmentReference(const Cloud &reference, double voxel_width, int max_grid_width, bool verbose)
+{
+  const bool pyramid = max_grid_width > 0;
+  decimation_width_ = pyramid ? 0.5 * voxel_width : 0.0;
+  max_grid_width_ = max_grid_width;
+  std::vector<Eigen::Vector3d> &points = points_;
+  boundedEnds(reference, points, decimation_width_);
+  Eigen::Vector3d &box_min = box_min_, &box_max = box_max_;
+  getBounds(points, Pose::identity(), box_min, box_max);
+  double coarse_width = voxel_width;
+  while (pyramid && (box_max - box_min).maxCoeff() / coarse_width > (double)max_grid_width) coarse_width *= 2.0;
+  if (verbose)
+    std::cout << "Coarse align: reference pyramid from " << coarse_width << " m to " << voxel_width << " m voxels"
+              << std::endl;
+
+  levels_.push_back(std::make_unique<ReferenceGrid>());
+  makeReferenceGrid(points, box_min, box_max, coarse_width, true, verbose, *levels_.back());
+  Eigen::Vector3d centre = 0.5 * (box_min + box_max);
+  for (double width = 0.5 * coarse_width; width > 0.75 * voxel_width; width *= 0.5)
+  {
+    Eigen::Vector3d window_width = (box_max - box_min).cwiseMin(width * (double)max_grid_width);
+    levels_.push_back(std::make_unique<ReferenceGrid>());
+    makeReferenceGrid(points, centre - 0.5 * window_width, centre + 0.5 * window_width, width, false, false,
+                      *levels_.back());
+  }
+  if (levels_.size() == 1)  // the reference points are only needed for the finer levels
+  {
+    std::vector<Eigen::Vector3d>().swap(points_);
+  }
+}
+
+AlignmentReference::~AlignmentReference() = default;
+
+Pose AlignmentReference::align(Cloud &cloud, bool verbose) const
+{
+  std::vector<Eigen::Vector3d> points;
+  boundedEnds(cloud, points, decimation_width_);
+  Pose pose = alignToReference(points, *levels_[0], verbose);
+  for (size_t i = 1; i < levels_.size(); i++)
+  {
+    const ReferenceGrid *reference = levels_[i].get();
+    const double width = reference->spectrum.voxel_width_;
+    Eigen::Vector3d window_min = reference->spectrum.box_min_;
+    Eigen::Vector3d window_max = window_min + width * reference->spectrum.dimensions().cast<double>();
+    int num_inside = numPointsInBox(points, pose, window_min, window_max);
+
+    // a cloud with most of its overlap outside the cached window is refined in a window on the overlap instead
+    Eigen::Vector3d min0, max0, overlap_min, overlap_max;
+    getBounds(points, pose, min0, max0);
+    overlapWindow(min0, max0, box_min_, box_max_, width, max_grid_width_, overlap_min, overlap_max);
+    const int num_overlap = numPointsInBox(points, pose, overlap_min, overlap_max);
+    ReferenceGrid overlap_reference;
+    if (num_inside < num_overlap / 2)
+    {
+      makeReferenceGrid(points_, overlap_min, overlap_max, width, false, false, overlap_reference);
+      reference = &overlap_reference;
+      num_inside = num_overlap;
+    }
+    if (num_inside < kMinWindowPoints)  // too little to correlate, so keep the current estimate
+    {
+      if (verbose)
+        std::cout << "Coarse align: " << width << " m voxels, skipped with only " << num_inside
+                  << " points in the window" << std::endl;
+      continue;
+    }
+    Eigen::Vector3d shift = estimateTranslation(points, pose, reference->spectrum.box_min_, *reference, false);
+    pose = Pose(shift, Eigen::Quaterniond::Identity()) * pose;
+    if (verbose)
+      std::cout << "Coarse align: " << width << " m voxels, refined translation by: " << shift.transpose()
+                << std::endl;
+  }
+  if (verbose)
+    std::cout << "Coarse align: estimated transformation: " << pose << std::endl;
+  cloud.transform(pose, 0.0);
+  return pose;
+}
 }  // namespace ray
@@ -12,6 +12,7 @@
 #include "rayutils.h"
 
 #include <complex>
+#include <memory>
 
 typedef std::complex<double> Complex;
 
@@ -25,10 +26,45 @@ namespace ray
 /// densities. NOTE @c clouds is a pair of clouds, it should point to an array with at least 2 elements
 void RAYLIB_EXPORT alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose = false);
 
-/// 3D grid structure of complex numbers, for performing fast Fourier transforms (FFTs)
+/// Multi-resolution version of @c alignCloud0ToCloud1, for scenes too large to fit a single grid of @c voxel_width.
+/// The rotation and translation are solved on decimated end points at the coarsest voxel width that fits the scene
+/// in @c max_grid_width cells, then the translation is refined at successively halved voxel widths down to
+/// @c voxel_width, in grids windowed on the estimated overlap. So the grid size is bounded regardless of scene extent
+void RAYLIB_EXPORT alignCloud0ToCloud1Pyramid(Cloud *clouds, double voxel_width, int max_grid_width = 256,
+                                              bool verbose = false);
+
+struct ReferenceGrid;
+
+/// Coarse alignment of many clouds onto a single reference cloud, such as repeat scans of one site.
+/// The reference's density spectra are computed once on construction, for each level of the pyramid described in
+/// @c alignCloud0ToCloud1Pyramid, after which @c align() can be called concurrently on different clouds.
+/// The finer levels are cached in windows on the centre of the reference. A cloud that has too few points in a cached
+/// window is refined in a window on its estimated overlap instead, as in @c alignCloud0ToCloud1Pyramid, and a level is
+/// skipped if that window also has too few points. Any parts of the aligned clouds beyond the reference's extent are
+/// ignored. A @c max_grid_width of 0 solves in a single grid of @c voxel_width, as in @c alignCloud0ToCloud1
+class RAYLIB_EXPORT AlignmentReference
+{
+public:
+  AlignmentReference(const Cloud &reference, double voxel_width, int max_grid_width = 0, bool verbose = false);
+  ~AlignmentReference();
+
+  /// Transforms @c cloud to align with the reference, returning the transformation applied
+  Pose align(Cloud &cloud, bool verbose = false) const;
+
+private:
+  std::vector<std::unique_ptr<ReferenceGrid>> levels_;  // coarsest first
+  double decimation_width_;
+  int max_grid_width_;
+  std::vector<Eigen::Vector3d> points_;  // the decimated reference end points, for windows on the overlap
+  Eigen::Vector3d box_min_, box_max_;    // bounds of points_
+};
+
+/// 3D grid of real values, transformed in place to its half spectrum of complex values by fast Fourier transforms
+/// (FFTs). The spatial domain is accessed through operator(), and the frequency domain through spectrum()
 struct Array3D
 {
-  /// Initialise the grid with bounds, cell width and either a maximum bound or a dimensions vector
+  /// Initialise the grid with bounds, cell width and either a maximum bound or a dimensions vector.
+  /// dimensions[0] must be even
   void init(const Eigen::Vector3d &box_min, double voxel_width, const Eigen::Vector3i &dimensions);
   void init(const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_max, double voxel_width);
 
@@ -39,15 +75,15 @@ struct Array3D
 
   void operator*=(const Array3D &other);
 
-  // Accessors and modifiers
-  inline Complex &operator()(int x, int y, int z) { return cells_[x + dims_[0] * y + dims_[0] * dims_[1] * z]; }
-  inline const Complex &operator()(int x, int y, int z) const
+  // Accessors and modifiers of the real values, in the spatial domain
+  inline double &operator()(int x, int y, int z) { return realCells()[x + 2 * spectrum_width_ * (y + dims_[1] * z)]; }
+  inline const double &operator()(int x, int y, int z) const
   {
-    return cells_[x + dims_[0] * y + dims_[0] * dims_[1] * z];
+    return realCells()[x + 2 * spectrum_width_ * (y + dims_[1] * z)];
   }
-  inline Complex &operator()(const Eigen::Vector3i &index) { return (*this)(index[0], index[1], index[2]); }
-  inline const Complex &operator()(const Eigen::Vector3i &index) const { return (*this)(index[0], index[1], index[2]); }
-  Complex &operator()(const Eigen::Vector3d &pos)
+  inline double &operator()(const Eigen::Vector3i &index) { return (*this)(index[0], index[1], index[2]); }
+  inline const double &operator()(const Eigen::Vector3i &index) const { return (*this)(index[0], index[1], index[2]); }
+  double &operator()(const Eigen::Vector3d &pos)
   {
     Eigen::Vector3d index = (pos - box_min_) / voxel_width_;
     if (index[0] >= 0.0 && index[1] >= 0.0 && index[2] >= 0.0 && index[0] < (double)dims_[0] &&
@@ -55,7 +91,7 @@ struct Array3D
       return (*this)(Eigen::Vector3i(index.cast<int>()));
     return null_cell_;
   }
-  const Complex &operator()(const Eigen::Vector3d &pos) const
+  const double &operator()(const Eigen::Vector3d &pos) const
   {
     Eigen::Vector3d index = (pos - box_min_) / voxel_width_;
     if (index[0] >= 0.0 && index[1] >= 0.0 && index[2] >= 0.0 && index[0] < (double)dims_[0] &&
@@ -63,6 +99,22 @@ struct Array3D
       return (*this)(Eigen::Vector3i(index.cast<int>()));
     return null_cell_;
   }
+
+  // Accessors of the stored half spectrum, valid for 0 <= x <= dimensions()[0]/2
+  inline Complex &spectrum(int x, int y, int z) { return cells_[x + spectrum_width_ * (y + dims_[1] * z)]; }
+  inline const Complex &spectrum(int x, int y, int z) const
+  {
+    return cells_[x + spectrum_width_ * (y + dims_[1] * z)];
+  }
+  /// Spectrum value at any x, using the Hermitian symmetry of the transform of real values
+  inline Complex spectrumValue(int x, int y, int z) const
+  {
+    if (x < spectrum_width_)
+      return spectrum(x, y, z);
+    return std::conj(spectrum(dims_[0] - x, (dims_[1] - y) % dims_[1], (dims_[2] - z) % dims_[2]));
+  }
+  inline int spectrumWidth() const { return spectrum_width_; }
+
   inline Eigen::Vector3i &dimensions() { return dims_; }
   inline const Eigen::Vector3i &dimensions() const { return dims_; }
   inline double voxelWidth() { return voxel_width_; }
@@ -70,7 +122,7 @@ struct Array3D
 
   void conjugate();
 
-  // Location in the grid of the cell wiith the largest real part
+  // Location in the grid of the cell with the largest real value
   Eigen::Vector3i maxRealIndex() const;
 
   // Fill grid based on the rays in the ray cloud
@@ -80,9 +132,13 @@ struct Array3D
   double voxel_width_;
 
 private:
+  inline double *realCells() { return reinterpret_cast<double *>(cells_.data()); }
+  inline const double *realCells() const { return reinterpret_cast<const double *>(cells_.data()); }
+
   Eigen::Vector3i dims_;
-  std::vector<Complex> cells_;
-  Complex null_cell_;
+  int spectrum_width_;
+  std::vector<Complex> cells_;  // the real values are stored in place, with x rows padded to 2*spectrum_width_
+  double null_cell_;
 };
 
 }  // namespace ray
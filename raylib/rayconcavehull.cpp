@@ -14,6 +14,7 @@
 #include <libqhullcpp/QhullPoints.h>
 #include <libqhullcpp/QhullRidge.h>
 #include <libqhullcpp/QhullVertexSet.h>
+#include <algorithm>
 #include <map>
 #include <unordered_map>
 
@@ -34,7 +35,11 @@ static const double deadFace = 1e10;
 class Hasher
 {
 public:
-  size_t operator()(const Eigen::Vector2i &key) const { return key[0] + key[1]; }
+  // the sum of the two vertex ids collides for every edge with the same sum, so mix the ids instead
+  size_t operator()(const Eigen::Vector2i &key) const
+  {
+    return static_cast<size_t>(key[0]) * 83492791u ^ static_cast<size_t>(key[1]) * 2654435761u;
+  }
 };
 
 ConcaveHull::ConcaveHull(const std::vector<Eigen::Vector3d> &points)
@@ -83,7 +88,6 @@ ConcaveHull::ConcaveHull(const std::vector<Eigen::Vector3d> &points)
       continue;
     int i = 0;
     Tetrahedron tetra;
-    tetra.id = f.id();
     orgQhull::QhullVertexSet verts = f.vertices();
     for (const orgQhull::QhullVertex &v : verts)
     {
@@ -155,6 +159,7 @@ ConcaveHull::ConcaveHull(const std::vector<Eigen::Vector3d> &points)
     c++;
   }
   std::cout << "number of tetrahedrons: " << c << std::endl;
+  edge_has_had_face_.resize(edges_.size(), false);
 }
 
 double ConcaveHull::circumcurvature(const ConcaveHull::Tetrahedron &tetra, int triangleID)
@@ -230,7 +235,9 @@ static int newTriCount = 0;
 
 bool ConcaveHull::growFront(double maxCurvature)
 {
-  SurfaceFace face = *surface_.begin();
+  if (surface_.empty())
+    return false;
+  SurfaceFace face = surface_.top();
   if (face.curvature == deadFace || face.curvature > maxCurvature)
     return false;
   int vertexI = 0;
@@ -262,7 +269,7 @@ bool ConcaveHull::growFront(double maxCurvature)
     }
   }
 
-  surface_.erase(surface_.begin());
+  surface_.pop();
   if (numFaceIntersects == 1)
   {
     intersects = false;
@@ -281,8 +288,9 @@ bool ConcaveHull::growFront(double maxCurvature)
     int v1 = std::max(otherVertex, newVertex);
     for (int i = 0; i < 3; i++)
     {
-      Edge &edge = edges_[triangles_[tri2].edges[i]];
-      if (edge.vertices[0] == v0 && edge.vertices[1] == v1 && edge.has_had_face)
+      const int edge_id = triangles_[tri2].edges[i];
+      const Edge &edge = edges_[edge_id];
+      if (edge.vertices[0] == v0 && edge.vertices[1] == v1 && edge_has_had_face_[edge_id])
         intersects = true;
     }
     if (!intersects)
@@ -312,7 +320,7 @@ bool ConcaveHull::growFront(double maxCurvature)
     else
       newFace.curvature = circumcurvature(tetrahedra_[newFace.tetrahedron], newFace.triangle);
     triangles_[newFace.triangle].surface_face_cached = newFace;
-    for (int j = 0; j < 3; j++) edges_[triangles_[newFace.triangle].edges[j]].has_had_face = true;
+    for (int j = 0; j < 3; j++) edge_has_had_face_[triangles_[newFace.triangle].edges[j]] = true;
     surface_.insert(newFace);
   }
   return true;
@@ -322,16 +330,9 @@ void ConcaveHull::growSurface(double maxCurvature)
 {
   do
   {
-    if (!(newTriCount % 1600))
+    if (!(newTriCount % 1600) && !surface_.empty())
     {
-      std::cout << "max curvature of structure: " << surface_.begin()->curvature << std::endl;
-      std::vector<std::vector<Eigen::Vector3d>> tris;
-      for (auto &tri : surface_)
-      {
-        std::vector<Eigen::Vector3d> corners(3);
-        for (int i = 0; i < 3; i++) corners[i] = vertices_[triangles_[tri.triangle].vertices[i]];
-        tris.push_back(corners);
-      }
+      std::cout << "max curvature of structure: " << surface_.top().curvature << std::endl;
     }
   } while (growFront(maxCurvature));
 }
@@ -418,7 +419,7 @@ void ConcaveHull::growInDirection(double maxCurvature, const Eigen::Vector3d &di
       for (int j = 0; j < 3; j++)
       {
         vertex_on_surface_[tri.vertices[j]] = true;
-        edges_[tri.edges[j]].has_had_face = true;
+        edge_has_had_face_[tri.edges[j]] = true;
       }
       face.curvature = circumcurvature(tetrahedra_[face.tetrahedron], face.triangle);
       triangles_[i].surface_face_cached = face;
@@ -433,7 +434,7 @@ void ConcaveHull::convertToMesh()
 {
   mesh_.vertices() = vertices_;
   int num_bads = 0;
-  for (auto &face : surface_)
+  for (auto &face : surface_.sorted())
   {
     Eigen::Vector3d centroid(0, 0, 0);
     ray::ConcaveHull::Tetrahedron &tetra = tetrahedra_[face.tetrahedron];
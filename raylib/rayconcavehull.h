@@ -6,8 +6,8 @@
 #ifndef RAYLIB_RAYCONCAVEHULL_H
 #define RAYLIB_RAYCONCAVEHULL_H
 
-#include <set>
 #include "raylib/raylibconfig.h"
+#include "raylib/rayheapset.h"
 #include "raylib/raymesh.h"
 #include "rayutils.h"
 
@@ -56,10 +56,8 @@ private:
     {
       vertices[0] = v1;
       vertices[1] = v2;
-      has_had_face = false;
     }
     int vertices[2];
-    bool has_had_face;
   };
   class Triangle
   {
@@ -69,11 +67,9 @@ private:
       vertices[0] = vertices[1] = vertices[2] = -1;
       edges = Eigen::Vector3i(-1, -1, -1);
       is_surface = false;
-      used = false;
     }
     bool valid() { return vertices[0] != -1; }
     bool is_surface;
-    bool used;
     Eigen::Vector3i vertices;
     Eigen::Vector3i edges;
     int tetrahedra[2];
@@ -85,15 +81,11 @@ private:
     Tetrahedron()
     {
       vertices[0] = vertices[1] = vertices[2] = vertices[3] = -1;
-      seen = false;
-      id = -1;
     }
     bool valid() { return vertices[0] != -1; }
     int vertices[4];
     int triangles[4];
     int neighbours[4];
-    int id;
-    bool seen;
   };
   class FaceComp
   {
@@ -109,6 +101,15 @@ private:
       return lhs.curvature < rhs.curvature;
     }
   };
+  class FaceHash
+  {
+  public:
+    size_t operator()(const SurfaceFace &face) const
+    {
+      return std::hash<double>()(face.curvature) ^ static_cast<size_t>(face.triangle) * 83492791u ^
+             static_cast<size_t>(face.tetrahedron) * 2654435761u;
+    }
+  };
 
   inline bool insideTetrahedron(const Eigen::Vector3d &pos, const Tetrahedron &tetra)
   {
@@ -136,10 +137,11 @@ private:
   std::vector<bool> vertex_on_surface_;
   std::vector<Eigen::Vector3d> vertices_;
   std::vector<Edge> edges_;
+  std::vector<bool> edge_has_had_face_;  // per edge, kept apart from the connectivity as it changes during growth
   std::vector<Triangle> triangles_;
   std::vector<Tetrahedron> tetrahedra_;
   Eigen::Vector3d centre_;
-  std::set<SurfaceFace, FaceComp> surface_;
+  HeapSet<SurfaceFace, FaceComp, FaceHash> surface_;  // the faces on the growth front
   Mesh mesh_;
 };
 }  // namespace ray
@@ -18,6 +18,8 @@
 
 #include <map>
 
+#include "raycloud.h"
+
 namespace ray
 {
 class lessThan
@@ -29,6 +31,76 @@ public:
   }
 };
 
+namespace
+{
+enum class Growth
+{
+  Inwards,
+  Outwards,
+  InDirection
+};
+
+// the non-linear transformation of a point, under which the wrapping of maximum curvature becomes a convex hull
+Eigen::Vector3d wrapTransform(const Eigen::Vector3d &point, const Eigen::Vector3d &centre, double maxCurvature,
+                              Growth growth, const Eigen::Vector3d &dir = Eigen::Vector3d(0, 0, 0))
+{
+  Eigen::Vector3d p = point;
+  if (growth == Growth::InDirection)
+  {
+    Eigen::Vector3d flat = p - centre;
+    flat -= dir * dir.dot(flat);
+    p += dir * 0.5 * flat.squaredNorm() *
+         maxCurvature;  // 0.5 * curv * x^2 means the second differential (the curvature) w.r.t. x is curv
+    return p;
+  }
+  const double power = growth == Growth::Inwards ? 1.0 / (1.0 + maxCurvature) : -1.0 / (1.0 + maxCurvature);
+  p -= centre;
+  p *= std::pow(p.squaredNorm(), (power - 1.0) * 0.5);
+  return p;
+}
+
+// the subset of @c points that are vertices of the convex hull of their transformed positions. Small or degenerate
+// sets that qhull cannot process are returned whole
+std::vector<Eigen::Vector3d> hullVertices(const std::vector<Eigen::Vector3d> &points, const Eigen::Vector3d &centre,
+                                          double maxCurvature, Growth growth, const Eigen::Vector3d &dir)
+{
+  const size_t min_points = 16;
+  if (points.size() < min_points)
+  {
+    return points;
+  }
+  std::vector<double> coordinates(points.size() * 3);
+  for (size_t i = 0; i < points.size(); i++)
+  {
+    Eigen::Vector3d p = wrapTransform(points[i], centre, maxCurvature, growth, dir);
+    coordinates[3 * i + 0] = p[0];
+    coordinates[3 * i + 1] = p[1];
+    coordinates[3 * i + 2] = p[2];
+  }
+  std::vector<bool> on_hull(points.size(), false);
+  try
+  {
+    orgQhull::Qhull hull;
+    hull.runQhull("", 3, int(points.size()), coordinates.data(), "Qt");
+    for (const orgQhull::QhullFacet &f : hull.facetList())
+    {
+      for (const orgQhull::QhullVertex &v : f.vertices()) on_hull[v.point().id()] = true;
+    }
+  }
+  catch (const std::exception &)
+  {
+    return points;
+  }
+  std::vector<Eigen::Vector3d> vertices;
+  for (size_t i = 0; i < points.size(); i++)
+  {
+    if (on_hull[i])
+      vertices.push_back(points[i]);
+  }
+  return vertices;
+}
+}  // namespace
+
 void ConvexHull::construct(const std::vector<Eigen::Vector3d> &points, const Eigen::Vector3d ignoreDirection)
 {
   if (points.size() < 3)  // two or fewer points generate an empty mesh
@@ -75,16 +147,21 @@ void ConvexHull::construct(const std::vector<Eigen::Vector3d> &points, const Eig
 ConvexHull::ConvexHull(const std::vector<Eigen::Vector3d> &points)
 {
   mesh_.vertices() = points;
+  centre_ = mean(points);
+}
+
+ConvexHull::ConvexHull(const std::vector<Eigen::Vector3d> &points, const Eigen::Vector3d &centre)
+{
+  mesh_.vertices() = points;
+  centre_ = centre;
 }
 
 void ConvexHull::growOutwards(double maxCurvature)
 {
-  Eigen::Vector3d centre = mean(mesh_.vertices());
   std::vector<Eigen::Vector3d> points = mesh_.vertices();
   for (auto &p : points)
   {
-    p -= centre;
-    p *= std::pow(p.squaredNorm(), (-1.0 / (1.0 + maxCurvature) - 1.0) * 0.5);
+    p = wrapTransform(p, centre_, maxCurvature, Growth::Outwards);
   }
 
   construct(points, Eigen::Vector3d(0, 0, 0));
@@ -92,12 +169,10 @@ void ConvexHull::growOutwards(double maxCurvature)
 
 void ConvexHull::growInwards(double maxCurvature)
 {
-  Eigen::Vector3d centre = mean(mesh_.vertices());
   std::vector<Eigen::Vector3d> points = mesh_.vertices();
   for (auto &p : points)
   {
-    p -= centre;
-    p *= std::pow(p.squaredNorm(), (1.0 / (1.0 + maxCurvature) - 1.0) * 0.5);
+    p = wrapTransform(p, centre_, maxCurvature, Growth::Inwards);
   }
 
   construct(points, Eigen::Vector3d(0, 0, 0));
@@ -105,18 +180,93 @@ void ConvexHull::growInwards(double maxCurvature)
 
 void ConvexHull::growInDirection(double maxCurvature, const Eigen::Vector3d &dir)
 {
-  Eigen::Vector3d centre = mean(mesh_.vertices());
   std::vector<Eigen::Vector3d> points = mesh_.vertices();
 
   for (auto &p : points)
   {
-    Eigen::Vector3d flat = p - centre;
-    flat -= dir * dir.dot(flat);
-    p += dir * 0.5 * flat.squaredNorm() *
-         maxCurvature;  // 0.5 * curv * x^2 means the second differential (the curvature) w.r.t. x is curv
+    p = wrapTransform(p, centre_, maxCurvature, Growth::InDirection, dir);
   }
 
   construct(points, dir);
 }
+
+bool ConvexHull::loadCandidates(const std::string &cloud_name, const std::string &direction, double maxCurvature,
+                                std::vector<Eigen::Vector3d> &candidates, Eigen::Vector3d &offset,
+                                Eigen::Vector3d &centre)
+{
+  Growth growth = Growth::InDirection;
+  Eigen::Vector3d dir(0, 0, 0);
+  if (direction == "inwards")
+    growth = Growth::Inwards;
+  else if (direction == "outwards")
+    growth = Growth::Outwards;
+  else if (direction == "upwards")
+    dir = Eigen::Vector3d(0, 0, 1);
+  else if (direction == "downwards")
+    dir = Eigen::Vector3d(0, 0, -1);
+  else
+  {
+    std::cerr << "Error: unknown wrap direction " << direction << std::endl;
+    return false;
+  }
+
+  // the mean of all the bounded end points, relative to the first of them
+  offset.setZero();
+  centre.setZero();
+  bool has_offset = false;
+  size_t num_points = 0;
+  Eigen::Vector3d sum(0, 0, 0);
+  auto add_to_mean = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
+                         std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      if (colours[i].alpha == 0)
+        continue;
+      if (!has_offset)
+      {
+        offset = ends[i];
+        has_offset = true;
+      }
+      sum += ends[i] - offset;
+      num_points++;
+    }
+  };
+  // the points are transformed about their mean, so it is found in a first pass. The candidates must be filtered with
+  // exactly the transformed coordinates that the final hull uses, or qhull can judge near-coplanar points differently
+  if (!Cloud::read(cloud_name, add_to_mean))
+    return false;
+  centre = sum / (double)std::max(num_points, (size_t)1);
+
+  // keep the points on the hull of each block of points in parallel, then those on the hull of these and the previous
+  // candidates. The vertices of the hull of a union of points are always vertices of the hulls of its parts
+  candidates.clear();
+  auto filter_chunk = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
+                          std::vector<RGBA> &colours) {
+    std::vector<Eigen::Vector3d> points;
+    points.reserve(ends.size());
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      if (colours[i].alpha > 0)
+        points.push_back(ends[i] - offset);
+    }
+    const int block_size = 1 << 16;
+    const int num_blocks = (int)((points.size() + block_size - 1) / block_size);
+    std::vector<std::vector<Eigen::Vector3d>> survivors(num_blocks);
+    #pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < num_blocks; b++)
+    {
+      const size_t first = (size_t)b * block_size;
+      std::vector<Eigen::Vector3d> block(points.begin() + first,
+                                         points.begin() + std::min(points.size(), first + block_size));
+      survivors[b] = hullVertices(block, centre, maxCurvature, growth, dir);
+    }
+    for (auto &block : survivors) candidates.insert(candidates.end(), block.begin(), block.end());
+    candidates = hullVertices(candidates, centre, maxCurvature, growth, dir);
+  };
+  if (!Cloud::read(cloud_name, filter_chunk))
+    return false;
+  std::cout << "kept " << candidates.size() << " of " << num_points << " points as hull candidates" << std::endl;
+  return true;
+}
 }  // namespace ray
 #endif
\ No newline at end of file
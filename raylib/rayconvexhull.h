@@ -25,6 +25,17 @@ class RAYLIB_EXPORT ConvexHull
 public:
   /// construct the hull from the end points of a ray cloud
   ConvexHull(const std::vector<Eigen::Vector3d> &points);
+  /// construct the hull from a subset of points, such as from @c loadCandidates, where @c centre is the mean of the
+  /// full set of points
+  ConvexHull(const std::vector<Eigen::Vector3d> &points, const Eigen::Vector3d &centre);
+
+  /// Stream the bounded end points of the ray cloud @c cloud_name in chunks, keeping only the @c candidates that can
+  /// lie on the hull grown in @c direction ("inwards", "outwards", "upwards" or "downwards") to @c maxCurvature.
+  /// This allows clouds larger than memory to be wrapped. The points are relative to @c offset, the first end point,
+  /// and @c centre is the mean of all of these relative points
+  static bool loadCandidates(const std::string &cloud_name, const std::string &direction, double maxCurvature,
+                             std::vector<Eigen::Vector3d> &candidates, Eigen::Vector3d &offset,
+                             Eigen::Vector3d &centre);
 
   /// inwards growth is for wrapping an object from the outside, such as a plane
   void growInwards(double maxCurvature);
@@ -43,6 +54,7 @@ public:
 
 private:
   Mesh mesh_;
+  Eigen::Vector3d centre_;
   void construct(const std::vector<Eigen::Vector3d> &points, const Eigen::Vector3d ignoreDirection);
 };
 }  // namespace ray
@@ -0,0 +1,351 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "rayfft.h"
+
+namespace ray
+{
+namespace
+{
+using Complex = std::complex<double>;
+
+// std::complex multiplication checks for NaNs and infinities, which is too slow for the inner loops
+inline Complex mul(const Complex &a, const Complex &b)
+{
+  return Complex(a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real());
+}
+// multiply by +i (sign = 1) or -i (sign = -1)
+inline Complex mulI(const Complex &a, double sign)
+{
+  return Complex(-sign * a.imag(), sign * a.real());
+}
+
+inline Complex rootOfUnity(int k, int n, bool inverse)
+{
+  const double angle = 2.0 * kPi * (double)k / (double)n;
+  return Complex(std::cos(angle), inverse ? std::sin(angle) : -std::sin(angle));
+}
+
+/// One Stockham stage: for each of the @c m sub-sequence elements @c k, and each of the @c s interleaved sequences @c q,
+/// the radix-p butterfly of x[q + s*(k + t*m)] over t, is twiddled and written to y[q + s*(p*k + r)]
+template <int P>
+void butterflies(const Complex *x, Complex *y, int s, int m, const Complex *twiddles, bool inverse);
+
+template <>
+void butterflies<2>(const Complex *x, Complex *y, int s, int m, const Complex *twiddles, bool)
+{
+  for (int k = 0; k < m; k++)
+  {
+    const Complex w1 = twiddles[2 * k + 1];
+    for (int q = 0; q < s; q++)
+    {
+      const Complex a0 = x[q + s * k];
+      const Complex a1 = x[q + s * (k + m)];
+      y[q + s * (2 * k)] = a0 + a1;
+      y[q + s * (2 * k + 1)] = mul(a0 - a1, w1);
+    }
+  }
+}
+
+template <>
+void butterflies<3>(const Complex *x, Complex *y, int s, int m, const Complex *twiddles, bool inverse)
+{
+  const double sign = inverse ? 1.0 : -1.0;
+  const double sin60 = std::sqrt(3.0) / 2.0;
+  for (int k = 0; k < m; k++)
+  {
+    const Complex w1 = twiddles[3 * k + 1], w2 = twiddles[3 * k + 2];
+    for (int q = 0; q < s; q++)
+    {
+      const Complex a0 = x[q + s * k];
+      const Complex a1 = x[q + s * (k + m)];
+      const Complex a2 = x[q + s * (k + 2 * m)];
+      const Complex t1 = a1 + a2;
+      const Complex t2 = a0 - 0.5 * t1;
+      const Complex t3 = mulI(sin60 * (a1 - a2), sign);
+      y[q + s * (3 * k)] = a0 + t1;
+      y[q + s * (3 * k + 1)] = mul(t2 + t3, w1);
+      y[q + s * (3 * k + 2)] = mul(t2 - t3, w2);
+    }
+  }
+}
+
+template <>
+void butterflies<4>(const Complex *x, Complex *y, int s, int m, const Complex *twiddles, bool inverse)
+{
+  const double sign = inverse ? 1.0 : -1.0;
+  for (int k = 0; k < m; k++)
+  {
+    const Complex w1 = twiddles[4 * k + 1], w2 = twiddles[4 * k + 2], w3 = twiddles[4 * k + 3];
+    for (int q = 0; q < s; q++)
+    {
+      const Complex a0 = x[q + s * k];
+      const Complex a1 = x[q + s * (k + m)];
+      const Complex a2 = x[q + s * (k + 2 * m)];
+      const Complex a3 = x[q + s * (k + 3 * m)];
+      const Complex t0 = a0 + a2, t1 = a0 - a2;
+      const Complex t2 = a1 + a3, t3 = mulI(a1 - a3, sign);
+      y[q + s * (4 * k)] = t0 + t2;
+      y[q + s * (4 * k + 1)] = mul(t1 + t3, w1);
+      y[q + s * (4 * k + 2)] = mul(t0 - t2, w2);
+      y[q + s * (4 * k + 3)] = mul(t1 - t3, w3);
+    }
+  }
+}
+
+template <>
+void butterflies<5>(const Complex *x, Complex *y, int s, int m, const Complex *twiddles, bool inverse)
+{
+  const double sign = inverse ? 1.0 : -1.0;
+  const double c1 = std::cos(2.0 * kPi / 5.0), c2 = std::cos(4.0 * kPi / 5.0);
+  const double s1 = std::sin(2.0 * kPi / 5.0), s2 = std::sin(4.0 * kPi / 5.0);
+  for (int k = 0; k < m; k++)
+  {
+    const Complex *w = &twiddles[5 * k];
+    for (int q = 0; q < s; q++)
+    {
+      const Complex a0 = x[q + s * k];
+      const Complex a1 = x[q + s * (k + m)];
+      const Complex a2 = x[q + s * (k + 2 * m)];
+      const Complex a3 = x[q + s * (k + 3 * m)];
+      const Complex a4 = x[q + s * (k + 4 * m)];
+      const Complex t1 = a1 + a4, t2 = a2 + a3, t3 = a1 - a4, t4 = a2 - a3;
+      const Complex r1 = a0 + c1 * t1 + c2 * t2, r2 = a0 + c2 * t1 + c1 * t2;
+      const Complex i1 = mulI(s1 * t3 + s2 * t4, sign), i2 = mulI(s2 * t3 - s1 * t4, sign);
+      y[q + s * (5 * k)] = a0 + t1 + t2;
+      y[q + s * (5 * k + 1)] = mul(r1 + i1, w[1]);
+      y[q + s * (5 * k + 2)] = mul(r2 + i2, w[2]);
+      y[q + s * (5 * k + 3)] = mul(r2 - i2, w[3]);
+      y[q + s * (5 * k + 4)] = mul(r1 - i1, w[4]);
+    }
+  }
+}
+
+// direct DFT for any other prime factor
+void genericButterflies(const Complex *x, Complex *y, int s, int m, int p, const Complex *twiddles, bool inverse)
+{
+  std::vector<Complex> roots(p);
+  for (int i = 0; i < p; i++) roots[i] = rootOfUnity(i, p, inverse);
+  for (int k = 0; k < m; k++)
+  {
+    for (int q = 0; q < s; q++)
+    {
+      for (int r = 0; r < p; r++)
+      {
+        Complex sum(0, 0);
+        for (int t = 0; t < p; t++) sum += mul(x[q + s * (k + t * m)], roots[(r * t) % p]);
+        y[q + s * (p * k + r)] = mul(sum, twiddles[p * k + r]);
+      }
+    }
+  }
+}
+}  // namespace
+
+int fftGoodSize(int n, bool even)
+{
+  for (int size = std::max(n, even ? 2 : 1);; size++)
+  {
+    if (even && (size % 2))
+      continue;
+    int remainder = size;
+    for (int factor : { 2, 3, 5 })
+      while (remainder % factor == 0) remainder /= factor;
+    if (remainder == 1)
+      return size;
+  }
+}
+
+FFTPlan::FFTPlan(int length)
+  : length_(length)
+{
+  // radix 4 stages are cheapest, so pull those out first
+  std::vector<int> radices;
+  int remainder = length;
+  while (remainder % 4 == 0)
+  {
+    radices.push_back(4);
+    remainder /= 4;
+  }
+  for (int factor = 2; remainder > 1; factor++)
+  {
+    while (remainder % factor == 0)
+    {
+      radices.push_back(factor);
+      remainder /= factor;
+    }
+  }
+
+  int stride = 1;
+  int sub_length = length;
+  for (const auto &radix : radices)
+  {
+    Stage stage;
+    stage.radix = radix;
+    stage.stride = stride;
+    stage.sub_length = sub_length / radix;
+    stage.twiddles.resize(sub_length);
+    stage.inverse_twiddles.resize(sub_length);
+    for (int k = 0; k < stage.sub_length; k++)
+    {
+      for (int r = 0; r < radix; r++)
+      {
+        stage.twiddles[radix * k + r] = rootOfUnity(k * r, sub_length, false);
+        stage.inverse_twiddles[radix * k + r] = rootOfUnity(k * r, sub_length, true);
+      }
+    }
+    stages_.push_back(stage);
+    stride *= radix;
+    sub_length /= radix;
+  }
+}
+
+void FFTPlan::transform(Complex *data, Complex *work, int batch, bool inverse) const
+{
+  Complex *x = data, *y = work;
+  for (const auto &stage : stages_)
+  {
+    const Complex *twiddles = inverse ? stage.inverse_twiddles.data() : stage.twiddles.data();
+    const int s = stage.stride * batch;
+    switch (stage.radix)
+    {
+      case 2:
+        butterflies<2>(x, y, s, stage.sub_length, twiddles, inverse);
+        break;
+      case 3:
+        butterflies<3>(x, y, s, stage.sub_length, twiddles, inverse);
+        break;
+      case 4:
+        butterflies<4>(x, y, s, stage.sub_length, twiddles, inverse);
+        break;
+      case 5:
+        butterflies<5>(x, y, s, stage.sub_length, twiddles, inverse);
+        break;
+      default:
+        genericButterflies(x, y, s, stage.sub_length, stage.radix, twiddles, inverse);
+        break;
+    }
+    std::swap(x, y);
+  }
+  const int size = length_ * batch;
+  if (inverse)
+  {
+    const double scale = 1.0 / (double)length_;
+    for (int i = 0; i < size; i++) data[i] = x[i] * scale;
+  }
+  else if (x != data)
+    std::copy(x, x + size, data);
+}
+
+/**************************************************************************************************/
+
+RealFFT3D::RealFFT3D(const Eigen::Vector3i &dims)
+  : dims_(dims)
+  , plan_x_(dims[0] / 2)
+  , plan_y_(dims[1])
+  , plan_z_(dims[2])
+{
+  ASSERT(dims[0] % 2 == 0);
+  row_twiddles_.resize(dims[0] / 2 + 1);
+  for (int k = 0; k <= dims[0] / 2; k++) row_twiddles_[k] = rootOfUnity(k, dims[0], false);
+}
+
+void RealFFT3D::forward(Complex *data) const
+{
+  transformRows(data, false);
+  transformColumns(data, 1, false);
+  transformColumns(data, 2, false);
+}
+
+void RealFFT3D::inverse(Complex *data) const
+{
+  transformColumns(data, 2, true);
+  transformColumns(data, 1, true);
+  transformRows(data, true);
+}
+
+// Each real row of length n is transformed as n/2 packed complex values (even, odd), which are then separated into the
+// n/2+1 spectrum values. The inverse reverses this
+void RealFFT3D::transformRows(Complex *data, bool inverse) const
+{
+  const int half = dims_[0] / 2;
+  const int width = spectrumWidth();
+  const int num_rows = dims_[1] * dims_[2];
+  #pragma omp parallel
+  {
+    std::vector<Complex> work(half), temp(width);
+    #pragma omp for schedule(static)
+    for (int row = 0; row < num_rows; row++)
+    {
+      Complex *cells = data + (size_t)row * width;
+      if (!inverse)
+      {
+        plan_x_.transform(cells, work.data(), 1, false);
+        for (int k = 0; k <= half; k++)
+        {
+          const Complex z = cells[k % half];
+          const Complex z_mirror = std::conj(cells[(half - k) % half]);
+          const Complex even = 0.5 * (z + z_mirror);
+          const Complex odd = mulI(0.5 * (z - z_mirror), -1.0);
+          temp[k] = even + mul(row_twiddles_[k], odd);
+        }
+        std::copy(temp.begin(), temp.end(), cells);
+      }
+      else
+      {
+        for (int k = 0; k < half; k++)
+        {
+          const Complex x = cells[k];
+          const Complex x_mirror = std::conj(cells[half - k]);
+          const Complex even = 0.5 * (x + x_mirror);
+          const Complex odd = mul(0.5 * (x - x_mirror), std::conj(row_twiddles_[k]));
+          temp[k] = even + mulI(odd, 1.0);
+        }
+        std::copy(temp.begin(), temp.begin() + half, cells);
+        cells[half] = 0.0;
+        plan_x_.transform(cells, work.data(), 1, true);
+      }
+    }
+  }
+}
+
+// The y columns of each z slab are already interleaved, so are transformed directly as a batch. The z columns are
+// gathered into blocks of adjacent x, so that the transform runs on contiguous memory
+void RealFFT3D::transformColumns(Complex *data, int axis, bool inverse) const
+{
+  const int width = spectrumWidth();
+  if (axis == 1)
+  {
+    #pragma omp parallel
+    {
+      std::vector<Complex> work((size_t)width * dims_[1]);
+      #pragma omp for schedule(static)
+      for (int z = 0; z < dims_[2]; z++)
+        plan_y_.transform(data + (size_t)z * width * dims_[1], work.data(), width, inverse);
+    }
+    return;
+  }
+  const int block_width = 16;
+  const int blocks_per_row = (width + block_width - 1) / block_width;
+  const int num_blocks = blocks_per_row * dims_[1];
+  const size_t slab_size = (size_t)width * dims_[1];
+  #pragma omp parallel
+  {
+    std::vector<Complex> block((size_t)block_width * dims_[2]), work((size_t)block_width * dims_[2]);
+    #pragma omp for schedule(static)
+    for (int b = 0; b < num_blocks; b++)
+    {
+      const int y = b / blocks_per_row;
+      const int x0 = (b % blocks_per_row) * block_width;
+      const int count = std::min(block_width, width - x0);
+      Complex *column = data + x0 + (size_t)width * y;
+      for (int z = 0; z < dims_[2]; z++)
+        for (int i = 0; i < count; i++) block[i + count * z] = column[i + slab_size * z];
+      plan_z_.transform(block.data(), work.data(), count, inverse);
+      for (int z = 0; z < dims_[2]; z++)
+        for (int i = 0; i < count; i++) column[i + slab_size * z] = block[i + count * z];
+    }
+  }
+}
+}  // namespace ray
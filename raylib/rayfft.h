@@ -0,0 +1,77 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYFFT_H
+#define RAYLIB_RAYFFT_H
+
+#include "raylib/raylibconfig.h"
+
+#include "rayutils.h"
+
+#include <complex>
+
+namespace ray
+{
+/// The FFT backend used by the alignment code. All transforms in raylib go through these two classes, so an external
+/// library (e.g. FFTW) can be substituted here without changing the callers.
+
+/// Returns the smallest length no smaller than @c n that factors into only 2s, 3s and 5s. These lengths are transformed
+/// efficiently by @c FFTPlan. If @c even is set then the result is also a multiple of 2, as needed by @c RealFFT3D
+int RAYLIB_EXPORT fftGoodSize(int n, bool even = false);
+
+/// A precomputed mixed-radix (Stockham autosort) complex FFT of a fixed length. Radices 2, 3, 4 and 5 have dedicated
+/// butterflies, other prime factors use a slower direct DFT, so any length is supported.
+/// The plan is immutable after construction, so one plan can be shared between threads.
+class RAYLIB_EXPORT FFTPlan
+{
+public:
+  explicit FFTPlan(int length);
+
+  /// Transforms @c batch interleaved sequences in place, where element @c i of sequence @c b is at data[b + batch*i].
+  /// @c work must have space for length*batch elements. The inverse transform is normalised by 1/length.
+  void transform(std::complex<double> *data, std::complex<double> *work, int batch, bool inverse) const;
+
+  inline int length() const { return length_; }
+
+private:
+  struct Stage
+  {
+    int radix;
+    int stride;                                  // the product of the previous stages' radices
+    int sub_length;                              // remaining transform length after this stage
+    std::vector<std::complex<double>> twiddles;  // sub_length x radix
+    std::vector<std::complex<double>> inverse_twiddles;
+  };
+  int length_;
+  std::vector<Stage> stages_;
+};
+
+/// Real-to-complex 3D FFT, multithreaded across slabs. The data is transformed in place, using the padded layout:
+/// in the spatial domain each x row holds dims[0] doubles, padded to 2*spectrumWidth() doubles, and in the frequency
+/// domain each x row holds spectrumWidth() = dims[0]/2 + 1 complex values, the remaining half of the spectrum being
+/// given by Hermitian symmetry. dims[0] must be even.
+class RAYLIB_EXPORT RealFFT3D
+{
+public:
+  explicit RealFFT3D(const Eigen::Vector3i &dims);
+
+  /// Forward transform from the real spatial grid to the half spectrum
+  void forward(std::complex<double> *data) const;
+  /// Inverse transform from the half spectrum back to the real spatial grid, normalised to be the exact inverse
+  void inverse(std::complex<double> *data) const;
+
+  inline int spectrumWidth() const { return dims_[0] / 2 + 1; }
+
+private:
+  void transformRows(std::complex<double> *data, bool inverse) const;
+  void transformColumns(std::complex<double> *data, int axis, bool inverse) const;
+
+  Eigen::Vector3i dims_;
+  FFTPlan plan_x_, plan_y_, plan_z_;  // plan_x_ is half length, real rows are transformed as packed complex pairs
+  std::vector<std::complex<double>> row_twiddles_;
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYFFT_H
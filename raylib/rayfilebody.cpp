@@ -0,0 +1,69 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "rayfilebody.h"
+
+#include <fstream>
+#include <iostream>
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ray
+{
+FileBody::~FileBody()
+{
+#ifdef __unix__
+  if (mapped_)
+  {
+    munmap(mapped_, mapped_size_);
+  }
+#endif
+}
+
+bool FileBody::open(const std::string &file_name, size_t offset, size_t size)
+{
+#ifdef __unix__
+  int fd = ::open(file_name.c_str(), O_RDONLY);
+  struct stat file_stat;
+  if (fd != -1 && fstat(fd, &file_stat) == 0 && (size_t)file_stat.st_size >= offset + size)
+  {
+    mapped_size_ = (size_t)file_stat.st_size;
+    void *mapped = mapped_size_ > 0 ? mmap(nullptr, mapped_size_, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (mapped != MAP_FAILED)
+    {
+      mapped_ = mapped;
+      data_ = static_cast<const unsigned char *>(mapped_) + offset;
+      madvise(mapped_, mapped_size_, MADV_SEQUENTIAL);
+    }
+  }
+  if (fd != -1)
+  {
+    close(fd);
+  }
+  if (data_ || size == 0)
+  {
+    return true;
+  }
+#endif
+  std::ifstream input(file_name.c_str(), std::ios::in | std::ios::binary);
+  input.seekg((std::streamoff)offset);
+  buffer_.resize(size);
+  if (size > 0)
+  {
+    input.read(reinterpret_cast<char *>(buffer_.data()), (std::streamsize)size);
+  }
+  if (input.fail())
+  {
+    std::cerr << "Error: file " << file_name << " is shorter than its header specifies" << std::endl;
+    return false;
+  }
+  data_ = buffer_.data();
+  return true;
+}
+}  // namespace ray
@@ -0,0 +1,42 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYFILEBODY_H
+#define RAYLIB_RAYFILEBODY_H
+
+#include "raylib/raylibconfig.h"
+
+#include <string>
+#include <vector>
+
+namespace ray
+{
+/// Read-only access to the body of a file, following its header. The file is memory mapped where possible, so that
+/// large files are decoded straight from the page cache, otherwise the body is read into memory
+class RAYLIB_EXPORT FileBody
+{
+public:
+  FileBody()
+    : data_(nullptr)
+    , mapped_(nullptr)
+    , mapped_size_(0)
+  {}
+  FileBody(const FileBody &) = delete;
+  FileBody &operator=(const FileBody &) = delete;
+  ~FileBody();
+
+  /// open the @c size bytes of file @c file_name from @c offset onwards
+  bool open(const std::string &file_name, size_t offset, size_t size);
+  const unsigned char *data() const { return data_; }
+
+private:
+  const unsigned char *data_;
+  void *mapped_;
+  size_t mapped_size_;
+  std::vector<unsigned char> buffer_;
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYFILEBODY_H
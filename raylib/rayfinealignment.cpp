@@ -4,7 +4,7 @@
 //
 // Author: Thomas Lowe
 #include "rayfinealignment.h"
-#include <nabo/nabo.h>
+#include "rayknn.h"
 
 namespace ray
 {
@@ -38,167 +38,242 @@ void getSurfel(const std::vector<Eigen::Vector3d> &points, const std::vector<int
     mat.col(0) = -mat.col(0);  // make right-handed, so that we can convert to a quaternion for rendering
 }
 
+namespace
+{
+// Parallel equivalent of voxelSubsample. Each thread subsamples a contiguous block of points, then the blocks are
+// merged in order, so the result is identical to the serial version
+void voxelSubsampleParallel(const std::vector<Eigen::Vector3d> &points, double voxel_width,
+                            std::vector<int64_t> &indices)
+{
+  auto voxel_of = [voxel_width](const Eigen::Vector3d &point) {
+    return Eigen::Vector3i(int(std::floor(point[0] / voxel_width)), int(std::floor(point[1] / voxel_width)),
+                           int(std::floor(point[2] / voxel_width)));
+  };
+  const int64_t block_size = 1 << 16;
+  const int64_t num_blocks = ((int64_t)points.size() + block_size - 1) / block_size;
+  std::vector<std::vector<int64_t>> block_indices(num_blocks);
+  #pragma omp parallel for schedule(dynamic)
+  for (int64_t b = 0; b < num_blocks; b++)
+  {
+    std::set<Eigen::Vector3i, Vector3iLess> vox_set;
+    const int64_t end = std::min((int64_t)points.size(), (b + 1) * block_size);
+    for (int64_t i = b * block_size; i < end; i++)
+      if (vox_set.insert(voxel_of(points[i])).second)
+        block_indices[b].push_back(i);
+  }
+  std::set<Eigen::Vector3i, Vector3iLess> vox_set;
+  for (const auto &block : block_indices)
+    for (const auto &i : block)
+      if (vox_set.insert(voxel_of(points[i])).second)
+        indices.push_back(i);
+}
+}  // namespace
+
+struct FineAlignment::Target
+{
+  /// Build the 7D (position, normal, is_plane) search structure over the surfels
+  void generateTree(double weight);
+
+  std::vector<Surfel> surfels;
+  Eigen::Vector3d centre;
+  double translation_weight;  // smaller finds matches further away
+  Eigen::MatrixXd points;     // must outlive the tree, which references it
+  std::unique_ptr<Nabo::NNSearchD> tree;
+};
+
+void FineAlignment::Target::generateTree(double weight)
+{
+  translation_weight = weight;
+  size_t p_size = surfels.size();
+  points.resize(7, p_size);
+  for (size_t i = 0; i < p_size; i++)
+  {
+    const Surfel &s = surfels[i];
+    Eigen::Vector3d p = s.centroid * translation_weight;
+    p[2] *= 2.0;
+    points.col(i) << p, s.normal, s.is_plane ? 1.0 : 0.0;
+  }
+  tree.reset(Nabo::NNSearchD::createKDTreeLinearHeap(points, 7));
+}
+
+FineAlignment::FineAlignment(Cloud *clouds, bool non_rigid, bool verbose)
+  : clouds_(clouds)
+  , non_rigid_(non_rigid)
+  , verbose_(verbose)
+{}
+
+FineAlignment::FineAlignment(Cloud *cloud, std::shared_ptr<const Target> target, bool non_rigid, bool verbose)
+  : clouds_(cloud)
+  , non_rigid_(non_rigid)
+  , verbose_(verbose)
+  , target_(target)
+{}
+
+FineAlignment::~FineAlignment() = default;
+
+std::shared_ptr<const FineAlignment::Target> FineAlignment::createTarget(const Cloud &cloud, bool verbose)
+{
+  auto target = std::make_shared<Target>();
+  double max_spacing = generateSurfels(cloud, true, target->surfels, target->centre, verbose);
+  target->generateTree(0.4 / max_spacing);
+  return target;
+}
+
 // Convert clouds_[] into sets of surfels.
 void FineAlignment::generateSurfels()
 {
-  double point_spacings[2];
-  double avg_max_spacing = 0.0;
-  for (int c = 0; c < 2; c++)
+  double max_spacing = generateSurfels(clouds_[0], false, surfels_, centre_, verbose_);
+  if (target_)
+    return;
+  // cloud 1 is fixed, so its search structure is shared by all iterations
+  auto target = std::make_shared<Target>();
+  double target_max_spacing = generateSurfels(clouds_[1], true, target->surfels, target->centre, verbose_);
+  target->generateTree(0.4 / (0.5 * (max_spacing + target_max_spacing)));
+  target_ = target;
+}
+
+double FineAlignment::generateSurfels(const Cloud &cloud, bool is_target, std::vector<Surfel> &surfels,
+                                      Eigen::Vector3d &centre, bool verbose)
+{
+  double point_spacing = cloud.estimatePointSpacing();
+  ASSERT(point_spacing >= 0.0);
+  const double min_spacing_scale = 2.0;
+  const double max_spacing_scale = 20.0;
+  double min_spacing = min_spacing_scale * point_spacing;
+  double max_spacing = max_spacing_scale * point_spacing;
+  if (verbose)
+    std::cout << "fine alignment min voxel size: " << min_spacing << "m and maximum voxel size: " << max_spacing
+              << "m" << std::endl;
+
+  // 1. decimate quite fine
+  std::vector<int64_t> decimated;
+  voxelSubsampleParallel(cloud.ends, min_spacing, decimated);
+  std::vector<Eigen::Vector3d> decimated_points;
+  decimated_points.reserve(decimated.size());
+  std::vector<Eigen::Vector3d> decimated_starts;
+  decimated_starts.reserve(decimated.size());
+  centre.setZero();
+  for (size_t i = 0; i < decimated.size(); i++)
   {
-    point_spacings[c] = clouds_[c].estimatePointSpacing();
-    ASSERT(point_spacings[c] >= 0.0);
-    const double min_spacing_scale = 2.0;
-    const double max_spacing_scale = 20.0;
-    double min_spacing = min_spacing_scale * point_spacings[c];
-    double max_spacing = max_spacing_scale * point_spacings[c];
-    avg_max_spacing += 0.5 * max_spacing;
-    if (verbose_)
-      std::cout << "fine alignment min voxel size: " << min_spacing << "m and maximum voxel size: " << max_spacing
-                << "m" << std::endl;
-
-    // 1. decimate quite fine
-    std::vector<int64_t> decimated;
-    ray::voxelSubsample(clouds_[c].ends, min_spacing, decimated);
-    std::vector<Eigen::Vector3d> decimated_points;
-    decimated_points.reserve(decimated.size());
-    std::vector<Eigen::Vector3d> decimated_starts;
-    decimated_starts.reserve(decimated.size());
-    centres_[c].setZero();
-    for (size_t i = 0; i < decimated.size(); i++)
+    if (cloud.rayBounded((int)decimated[i]))
     {
-      if (clouds_[c].rayBounded((int)decimated[i]))
-      {
-        decimated_points.push_back(clouds_[c].ends[decimated[i]]);
-        centres_[c] += decimated_points.back();
-        decimated_starts.push_back(clouds_[c].starts[decimated[i]]);
-      }
-    }
-    centres_[c] /= (double)decimated_points.size();
-
-    // 2. find the coarser random candidate points. We just want a fairly even spread but not the voxel centres
-    std::vector<int64_t> candidates;
-    ray::voxelSubsample(decimated_points, max_spacing, candidates);
-    std::vector<Eigen::Vector3d> candidate_points(candidates.size());
-    std::vector<Eigen::Vector3d> candidate_starts(candidates.size());
-    for (int64_t i = 0; i < (int64_t)candidates.size(); i++)
-    {
-      candidate_points[i] = decimated_points[candidates[i]];
-      candidate_starts[i] = decimated_starts[candidates[i]];
+      decimated_points.push_back(cloud.ends[decimated[i]]);
+      centre += decimated_points.back();
+      decimated_starts.push_back(cloud.starts[decimated[i]]);
     }
+  }
+  centre /= (double)decimated_points.size();
 
-    // Now find all the finely decimated points that are close neighbours of each coarse candidate point
-    size_t q_size = candidates.size();
-    size_t p_size = decimated_points.size();
-    const int search_size = std::min(20, (int)p_size - 1);
-    Nabo::NNSearchD *nns;
-    Eigen::MatrixXd points_q(3, q_size);
-    for (size_t i = 0; i < q_size; i++) points_q.col(i) = candidate_points[i];
-    Eigen::MatrixXd points_p(3, p_size);
-    for (size_t i = 0; i < p_size; i++) points_p.col(i) = decimated_points[i];
-    nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
-
-    // Run the search
-    Eigen::MatrixXi indices;
-    Eigen::MatrixXd dists2;
-    indices.resize(search_size, q_size);
-    dists2.resize(search_size, q_size);
-    nns->knn(points_q, indices, dists2, search_size, 0.01 * max_spacing, 0, max_spacing);
-    delete nns;
-
-    // Convert these set of nearest neighbours into surfels
-    surfels_[c].reserve(q_size);
+  // 2. find the coarser random candidate points. We just want a fairly even spread but not the voxel centres
+  std::vector<int64_t> candidates;
+  ray::voxelSubsample(decimated_points, max_spacing, candidates);
+  std::vector<Eigen::Vector3d> candidate_points(candidates.size());
+  std::vector<Eigen::Vector3d> candidate_starts(candidates.size());
+  for (int64_t i = 0; i < (int64_t)candidates.size(); i++)
+  {
+    candidate_points[i] = decimated_points[candidates[i]];
+    candidate_starts[i] = decimated_starts[candidates[i]];
+  }
+
+  // Now find all the finely decimated points that are close neighbours of each coarse candidate point
+  size_t q_size = candidates.size();
+  size_t p_size = decimated_points.size();
+  const int search_size = std::min(20, (int)p_size - 1);
+  Eigen::MatrixXd points_q(3, q_size);
+  for (size_t i = 0; i < q_size; i++) points_q.col(i) = candidate_points[i];
+  Eigen::MatrixXd points_p(3, p_size);
+  for (size_t i = 0; i < p_size; i++) points_p.col(i) = decimated_points[i];
+  std::unique_ptr<Nabo::NNSearchD> nns(Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3));
+
+  // Run the search
+  Eigen::MatrixXi indices;
+  Eigen::MatrixXd dists2;
+  parallelKnn(*nns, points_q, indices, dists2, search_size, 0.01 * max_spacing, max_spacing);
+  nns.reset();
+
+  // Convert these set of nearest neighbours into surfels. Each candidate makes at most two surfels, these are
+  // generated in parallel into fixed slots, then compacted in candidate order
+  std::vector<Surfel> slots(2 * q_size);
+  std::vector<int> slot_counts(q_size, 0);
+  const size_t min_points_per_ellipsoid = 5;
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int64_t i = 0; i < (int64_t)q_size; i++)
+  {
     std::vector<int> ids;
     ids.reserve(search_size);
-    const size_t min_points_per_ellipsoid = 5;
-    for (size_t i = 0; i < q_size; i++)
+    for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+      ids.push_back(indices(j, i));
+    if (ids.size() < min_points_per_ellipsoid)  // not dense enough
+      continue;
+
+    Eigen::Vector3d centroid;
+    Eigen::Vector3d width;
+    Eigen::Matrix3d mat;
+    getSurfel(decimated_points, ids, centroid, width, mat);
+    double q1 = width[0] / width[1];
+    double q2 = width[1] / width[2];
+    if (q2 < q1)  // cylindrical
     {
-      ids.clear();
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++) ids.push_back(indices(j, i));
-      if (ids.size() < min_points_per_ellipsoid)  // not dense enough
+      if (q2 > 0.5)  // not cylinderical enough
         continue;
-
-      Eigen::Vector3d centroid;
-      Eigen::Vector3d width;
-      Eigen::Matrix3d mat;
-      getSurfel(decimated_points, ids, centroid, width, mat);
-      double q1 = width[0] / width[1];
-      double q2 = width[1] / width[2];
-      if (q2 < q1)  // cylindrical
-      {
-        if (q2 > 0.5)  // not cylinderical enough
-          continue;
-        // register two ellipsoids as the normal is ambiguous
-        surfels_[c].push_back(Surfel(centroid, mat, width, mat.col(2), false));
-        if (c == 1)
-          surfels_[c].push_back(Surfel(centroid, mat, width, -mat.col(2), false));
-      }
-      else  // planar
+      // register two ellipsoids as the normal is ambiguous
+      slots[2 * i + slot_counts[i]++] = Surfel(centroid, mat, width, mat.col(2), false);
+      if (is_target)
+        slots[2 * i + slot_counts[i]++] = Surfel(centroid, mat, width, -mat.col(2), false);
+    }
+    else  // planar
+    {
+      Eigen::Vector3d normal = mat.col(0);
+      if ((centroid - candidate_starts[i]).dot(normal) > 0.0)
+        normal = -normal;
+      // now repeat but removing back facing points. This deals better with double walls, which are quite common
+      for (int j = (int)ids.size() - 1; j >= 0; j--)
       {
-        Eigen::Vector3d normal = mat.col(0);
-        if ((centroid - candidate_starts[i]).dot(normal) > 0.0)
-          normal = -normal;
-        // now repeat but removing back facing points. This deals better with double walls, which are quite common
-        for (int j = (int)ids.size() - 1; j >= 0; j--)
+        int id = ids[j];
+        if ((decimated_points[id] - decimated_starts[id]).dot(normal) > 0.0)
         {
-          int id = ids[j];
-          if ((decimated_points[id] - decimated_starts[id]).dot(normal) > 0.0)
-          {
-            ids[j] = ids.back();
-            ids.pop_back();
-          }
+          ids[j] = ids.back();
+          ids.pop_back();
         }
-        if (ids.size() < min_points_per_ellipsoid)  // not dense enough
-          continue;
-        getSurfel(decimated_points, ids, centroid, width, mat);
-        normal = mat.col(0);
-        double q1 = width[0] / width[1];
-
-        if (q1 > 0.5)  // not planar enough
-          continue;
-        if ((centroid - candidate_starts[i]).dot(normal) > 0.0)
-          normal = -normal;
-        surfels_[c].push_back(Surfel(centroid, mat, width, normal, true));
       }
+      if (ids.size() < min_points_per_ellipsoid)  // not dense enough
+        continue;
+      getSurfel(decimated_points, ids, centroid, width, mat);
+      normal = mat.col(0);
+      double q1 = width[0] / width[1];
+
+      if (q1 > 0.5)  // not planar enough
+        continue;
+      if ((centroid - candidate_starts[i]).dot(normal) > 0.0)
+        normal = -normal;
+      slots[2 * i + slot_counts[i]++] = Surfel(centroid, mat, width, normal, true);
     }
   }
-  translation_weight_ = 0.4 / avg_max_spacing;  // smaller finds matches further away
+  surfels.reserve(q_size);
+  for (size_t i = 0; i < q_size; i++)
+    for (int j = 0; j < slot_counts[i]; j++) surfels.push_back(slots[2 * i + j]);
+  return max_spacing;
 }
 
-// Match surfels_[0] to surfels_[1] based on proximity, normal difference and whether it is a plane or cylinder
+// Match surfels_ to the target surfels based on proximity, normal difference and whether it is a plane or cylinder
 void FineAlignment::generateSurfelMatches(std::vector<Match> &matches)
 {
-  std::vector<Eigen::Vector3d> line_starts;
-  std::vector<Eigen::Vector3d> line_ends;
   int search_size = 1;
-  size_t q_size = surfels_[0].size();
-  size_t p_size = surfels_[1].size();
-  Nabo::NNSearchD *nns;
+  size_t q_size = surfels_.size();
   Eigen::MatrixXd points_q(7, q_size);
   for (size_t i = 0; i < q_size; i++)
   {
-    Surfel &s = surfels_[0][i];
-    Eigen::Vector3d p = s.centroid * translation_weight_;
+    Surfel &s = surfels_[i];
+    Eigen::Vector3d p = s.centroid * target_->translation_weight;
     p[2] *= 2.0;  // doen't make much difference...
     points_q.col(i) << p, s.normal, s.is_plane ? 1.0 : 0.0;
   }
-  Eigen::MatrixXd points_p(7, p_size);
-  for (size_t i = 0; i < p_size; i++)
-  {
-    Surfel &s = surfels_[1][i];
-    Eigen::Vector3d p = s.centroid * translation_weight_;
-    p[2] *= 2.0;
-    points_p.col(i) << p, s.normal, s.is_plane ? 1.0 : 0.0;
-  }
-  nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 7);
 
   // Run the search
   Eigen::MatrixXi indices;
   Eigen::MatrixXd dists2;
-  indices.resize(search_size, q_size);
-  dists2.resize(search_size, q_size);
-  nns->knn(points_q, indices, dists2, search_size, ray::kNearestNeighbourEpsilon * max_normal_difference_, 0,
-           max_normal_difference_);
-  delete nns;
+  parallelKnn(*target_->tree, points_q, indices, dists2, search_size,
+              ray::kNearestNeighbourEpsilon * max_normal_difference_, max_normal_difference_);
 
   for (int i = 0; i < (int)q_size; i++)
   {
@@ -207,8 +282,8 @@ void FineAlignment::generateSurfelMatches(std::vector<Match> &matches)
       Match match;
       match.ids[0] = i;
       match.ids[1] = indices(j, i);
-      Surfel &s0 = surfels_[0][i];
-      Surfel &s1 = surfels_[1][indices(j, i)];
+      const Surfel &s0 = surfels_[i];
+      const Surfel &s1 = target_->surfels[indices(j, i)];
       if (s0.is_plane != s1.is_plane)
         continue;
       Eigen::Vector3d mid_norm = (s0.normal + s1.normal).normalized();
@@ -225,62 +300,76 @@ void FineAlignment::generateSurfelMatches(std::vector<Match> &matches)
         match.normal = mid_norm.cross(match.normal);
         matches.push_back(match);
       }
-      line_starts.push_back(s0.centroid);
-      line_ends.push_back(s1.centroid);
     }
   }
 }
 
-// Convert the correspondences into a linear system to solve
+// Convert the correspondences into a linear system to solve. Fixed size blocks of matches are accumulated in parallel
+// into their own systems, which are then summed in block order, so the result does not depend on the thread count
 void FineAlignment::buildLinearSystem(const std::vector<Match> &matches, double d, FineAlignment::LinearSystem &system)
 {
-  // don't go above 30*... or below 10*...
-  double square_error = 0.0;
-  for (size_t i = 0; i < matches.size(); i++)
+  const int block_size = 4096;
+  const int num_blocks = ((int)matches.size() + block_size - 1) / block_size;
+  std::vector<LinearSystem> block_systems(num_blocks);
+  std::vector<double> block_square_errors(num_blocks, 0.0);
+  #pragma omp parallel for schedule(static)
+  for (int b = 0; b < num_blocks; b++)
   {
-    auto &match = matches[i];
-    Surfel &s0 = surfels_[0][match.ids[0]];
-    Surfel &s1 = surfels_[1][match.ids[1]];
-    Eigen::Vector3d positions[2] = { s0.centroid, s1.centroid };
-    double error = (positions[1] - positions[0]).dot(match.normal);  // mahabolonis instead?
-    double error_sqr;
-    if (s0.is_plane)
-      error_sqr = ray::sqr(error * translation_weight_);
-    else
+    LinearSystem &block_system = block_systems[b];
+    const size_t end = std::min(matches.size(), (size_t)(b + 1) * block_size);
+    for (size_t i = (size_t)b * block_size; i < end; i++)
     {
-      Eigen::Vector3d flat = positions[1] - positions[0];
-      Eigen::Vector3d norm = s0.normal;
-      flat -= norm * flat.dot(norm);
-      error_sqr = (flat * translation_weight_).squaredNorm();
-    }
-    // the normal difference is part of the error,
-    error_sqr += (s0.normal - s1.normal).squaredNorm();
-    double weight = pow(std::max(1.0 - error_sqr / ray::sqr(max_normal_difference_), 0.0), d * d);
-    square_error += ray::sqr(error);
-    Eigen::Matrix<double, 1, LinearSystem::state_size> a;  // the Jacobian
-    a.setZero();
-
-    for (int i = 0; i < 3; i++)  // change in error with change in raycloud translation
-      a[i] = match.normal[i];
-    for (int i = 0; i < 3; i++)  // change in error with change in raycloud orientation
-    {
-      Eigen::Vector3d axis(0, 0, 0);
-      axis[i] = 1.0;
-      a[3 + i] = -(positions[0].cross(axis)).dot(match.normal);
-    }
-    if (non_rigid_)
-    {
-      positions[0] -= centres_[0];
-      positions[1] -= centres_[1];
-      a[6] = ray::sqr(positions[0][0]) * match.normal[0];
-      a[7] = ray::sqr(positions[0][0]) * match.normal[1];
-      a[8] = ray::sqr(positions[0][1]) * match.normal[0];
-      a[9] = ray::sqr(positions[0][1]) * match.normal[1];
-      a[10] = positions[0][0] * positions[0][1] * match.normal[0];
-      a[11] = positions[0][0] * positions[0][1] * match.normal[1];
+      auto &match = matches[i];
+      const Surfel &s0 = surfels_[match.ids[0]];
+      const Surfel &s1 = target_->surfels[match.ids[1]];
+      Eigen::Vector3d positions[2] = { s0.centroid, s1.centroid };
+      double error = (positions[1] - positions[0]).dot(match.normal);  // mahabolonis instead?
+      double error_sqr;
+      if (s0.is_plane)
+        error_sqr = ray::sqr(error * target_->translation_weight);
+      else
+      {
+        Eigen::Vector3d flat = positions[1] - positions[0];
+        Eigen::Vector3d norm = s0.normal;
+        flat -= norm * flat.dot(norm);
+        error_sqr = (flat * target_->translation_weight).squaredNorm();
+      }
+      // the normal difference is part of the error,
+      error_sqr += (s0.normal - s1.normal).squaredNorm();
+      double weight = pow(std::max(1.0 - error_sqr / ray::sqr(max_normal_difference_), 0.0), d * d);
+      block_square_errors[b] += ray::sqr(error);
+      Eigen::Matrix<double, 1, LinearSystem::state_size> a;  // the Jacobian
+      a.setZero();
+
+      for (int i = 0; i < 3; i++)  // change in error with change in raycloud translation
+        a[i] = match.normal[i];
+      for (int i = 0; i < 3; i++)  // change in error with change in raycloud orientation
+      {
+        Eigen::Vector3d axis(0, 0, 0);
+        axis[i] = 1.0;
+        a[3 + i] = -(positions[0].cross(axis)).dot(match.normal);
+      }
+      if (non_rigid_)
+      {
+        positions[0] -= centre_;
+        positions[1] -= target_->centre;
+        a[6] = ray::sqr(positions[0][0]) * match.normal[0];
+        a[7] = ray::sqr(positions[0][0]) * match.normal[1];
+        a[8] = ray::sqr(positions[0][1]) * match.normal[0];
+        a[9] = ray::sqr(positions[0][1]) * match.normal[1];
+        a[10] = positions[0][0] * positions[0][1] * match.normal[0];
+        a[11] = positions[0][0] * positions[0][1] * match.normal[1];
+      }
+      block_system.At_A += a.transpose() * weight * a;
+      block_system.At_b += a.transpose() * weight * error;
     }
-    system.At_A += a.transpose() * weight * a;
-    system.At_b += a.transpose() * weight * error;
+  }
+  double square_error = 0.0;
+  for (int b = 0; b < num_blocks; b++)
+  {
+    system.At_A += block_systems[b].At_A;
+    system.At_b += block_systems[b].At_b;
+    square_error += block_square_errors[b];
   }
   if (verbose_)
     std::cout << "rmse: " << sqrt(square_error / (double)matches.size()) << std::endl;
@@ -295,27 +384,31 @@ Eigen::Matrix<double, FineAlignment::LinearSystem::state_size, 1> FineAlignment:
   return x;
 }
 
-// Update clouds_[0] and surfels_[0] from the specified transformation
+// Update clouds_[0] and surfels_ from the specified transformation
 void FineAlignment::updateLinearSystem(std::vector<Match> &matches, const QuadraticTransformation &trans)
 {
   Pose shift = trans.getEuclideanPart();
-  for (size_t i = 0; i < surfels_[0].size(); i++)
+  #pragma omp parallel for schedule(static)
+  for (int64_t i = 0; i < (int64_t)surfels_.size(); i++)
   {
-    Eigen::Vector3d &pos = surfels_[0][i].centroid;
-    Eigen::Vector3d relPos = pos - centres_[0];
+    Eigen::Vector3d &pos = surfels_[i].centroid;
+    Eigen::Vector3d relPos = pos - centre_;
     if (non_rigid_)
       pos += trans.a * ray::sqr(relPos[0]) + trans.b * ray::sqr(relPos[1]) + trans.c * relPos[0] * relPos[1];
     pos = shift * pos;
-    surfels_[0][i].normal = shift.rotation * surfels_[0][i].normal;
+    surfels_[i].normal = shift.rotation * surfels_[i].normal;
   }
   Eigen::Quaterniond half_rot(Eigen::AngleAxisd(trans.rotation.norm() / 2.0, trans.rotation.normalized()));
   for (auto &match : matches) match.normal = half_rot * match.normal;
 
   // NOTE: transforming the whole cloud each time is a bit slow,
   // we should be able to concatenate these transforms and only apply them once at the end
-  for (auto &end : clouds_[0].ends)
+  std::vector<Eigen::Vector3d> &ends = clouds_[0].ends;
+  #pragma omp parallel for schedule(static)
+  for (int64_t i = 0; i < (int64_t)ends.size(); i++)
   {
-    Eigen::Vector3d relPos = end - centres_[0];
+    Eigen::Vector3d &end = ends[i];
+    Eigen::Vector3d relPos = end - centre_;
     if (non_rigid_)
       end += trans.a * ray::sqr(relPos[0]) + trans.b * ray::sqr(relPos[1]) + trans.c * relPos[0] * relPos[1];
     end = shift * end;
@@ -328,19 +421,24 @@ void FineAlignment::align()
   // For each cloud: decimate the cloud to make it even, but still quite detailed, e.g. one point per cubic 10cm
   // Decimate again to pick one point per cubic 1m (for instance)
   // Now match the closest X points in 1 to those in 2, and generate surfel per point in 2.
+  auto start_time = std::chrono::steady_clock::now();
   generateSurfels();
+  if (verbose_)
+    std::cout << "fine alignment surfels: " << surfels_.size() << ", " << target_->surfels.size() << " generated in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count() << " s"
+              << std::endl;
 
   // Iteratively reweighted least squares. Iteration loop:
-  int max_iterations = 8;
-  for (int it = 0; it < max_iterations; it++)
+  for (int it = 0; it < max_iterations_; it++)
   {
+    auto iteration_start = std::chrono::steady_clock::now();
     // Match surfels in cloud0 to those in cloud1
     std::vector<Match> matches;
     generateSurfelMatches(matches);
 
     // Convert the match constraints into a linear system
     LinearSystem system;
-    double d = 20.0 * (double)it / (double)max_iterations;
+    double d = 20.0 * (double)it / (double)max_iterations_;
     buildLinearSystem(matches, d, system);
 
     // Solve as a weighted least squares problem, to find the transformation of best fit
@@ -348,6 +446,19 @@ void FineAlignment::align()
 
     // Update the ray cloud and surfels from on the transformation of best fit
     updateLinearSystem(matches, perturbation);
+    if (verbose_)
+      std::cout << "fine alignment iteration " << it << ": " << matches.size() << " matches in "
+                << std::chrono::duration<double>(std::chrono::steady_clock::now() - iteration_start).count() << " s"
+                << std::endl;
+
+    bool converged = perturbation.translation.norm() < convergence_translation_ &&
+                     perturbation.rotation.norm() < convergence_rotation_;
+    if (converged && !non_rigid_)  // the quadratic terms have no convergence threshold, so always run in full
+    {
+      if (verbose_)
+        std::cout << "fine alignment converged after " << it + 1 << " iterations" << std::endl;
+      break;
+    }
   }
 }
 
@@ -11,6 +11,7 @@
 #include "raycloud.h"
 #include "rayutils.h"
 
+#include <memory>
 
 namespace ray
 {
@@ -21,18 +22,25 @@ namespace ray
 class RAYLIB_EXPORT FineAlignment
 {
 public:
+  /// The surfels and search structure of the fixed cloud, which can be shared by several alignments to that cloud
+  struct Target;
+
   /// Constructor takes two clouds as input @c clouds, also:
   /// @c non_rigid denotes whether the alignment transformation is quadratic or linear (Euclidean)
   /// @c verbose outputs debug text
-  FineAlignment(Cloud *clouds, bool non_rigid, bool verbose)
-    : clouds_(clouds)
-    , non_rigid_(non_rigid)
-    , verbose_(verbose)
-  {}
+  FineAlignment(Cloud *clouds, bool non_rigid, bool verbose);
+  /// Constructor for aligning the single cloud @c cloud to a precomputed @c target, see @c createTarget()
+  FineAlignment(Cloud *cloud, std::shared_ptr<const Target> target, bool non_rigid, bool verbose);
+  ~FineAlignment();
+
+  /// Precomputes the target data of @c cloud, so it is generated once when aligning many clouds to it. Its search
+  /// structure is scaled by the target's surfel spacing alone, rather than the average with the aligned cloud's
+  static std::shared_ptr<const Target> createTarget(const Cloud &cloud, bool verbose);
 
-  /// This function modifies clouds[0] (supplied in constructor) to match clouds[1]
+  /// This function modifies clouds[0] (supplied in constructor) to match clouds[1], or the precomputed target
   /// The alignment is either a rigid (Euclidean) transformation, or it contains some quadratic components to account
   /// for slight bend or warping within the cloud.
+  /// Iteration stops early once the per-iteration change falls below the convergence thresholds.
   void align();
 
 private:
@@ -98,25 +106,32 @@ private:
     }
   };
 
-  /// Create surfels per voxel of a vexelisation of the ray end points
+  /// Create surfels per voxel of a vexelisation of the ray end points, and the target if it is not precomputed
   void generateSurfels();
-  /// Find the list of correspondences between the two surfel sets surfels_[0] and surfels_[1]
+  /// Create @c surfels for @c cloud, returns the maximum voxel spacing used. Target clouds register two surfels for
+  /// each cylinder, as its normal is ambiguous
+  static double generateSurfels(const Cloud &cloud, bool is_target, std::vector<Surfel> &surfels,
+                                Eigen::Vector3d &centre, bool verbose);
+  /// Find the list of correspondences between the surfels_ and the target surfels
   void generateSurfelMatches(std::vector<Match> &matches);
   /// Convert the matches into a linear system
   void buildLinearSystem(const std::vector<Match> &matches, double d, FineAlignment::LinearSystem &system);
-  /// adjust the ray cloud 0 (and surfels_[0]) from the specified transformation @c trans
+  /// adjust the ray cloud 0 (and surfels_) from the specified transformation @c trans
   void updateLinearSystem(std::vector<Match> &matches, const QuadraticTransformation &trans);
 
   /// Primary data:
-  Cloud *clouds_;
+  Cloud *clouds_;  // clouds_[1] is only used when the target is not precomputed
   double non_rigid_;
   double verbose_;
   const double max_normal_difference_ = 0.5;
+  const int max_iterations_ = 8;
+  const double convergence_translation_ = 0.001;  // metres
+  const double convergence_rotation_ = 0.0001;    // radians
 
   /// Derived data
-  std::vector<Surfel> surfels_[2];
-  double translation_weight_;
-  Eigen::Vector3d centres_[2];
+  std::vector<Surfel> surfels_;  // of clouds_[0], these move with the cloud during the alignment
+  Eigen::Vector3d centre_;
+  std::shared_ptr<const Target> target_;  // fixed during the alignment
 };
 }  // namespace ray
 
@@ -4,6 +4,7 @@
 //
 // Author: Thomas Lowe
 #include "rayforeststructure.h"
+#include "raymeshwriter.h"
 // #define OUTPUT_MOMENTS  // used in unit tests
 #include <unordered_map>
 #include <complex>
@@ -454,22 +455,38 @@ void ForestStructure::splitCloud(const Cloud &cloud, double offset, Cloud &insid
   }
 }
 
-// add a single section of a capsule. Each one is like a node in the polyline with a radius.
-void addCapsulePiece(Mesh &mesh, int wind, const Eigen::Vector3d &pos, const Eigen::Vector3d &side1,
-                     const Eigen::Vector3d &side2, double radius, const RGBA &rgba, bool cap_start, bool cap_end, bool add_uvs)
+namespace
+{
+/// A single section of a capsule. Each one is like a node in the polyline with a radius.
+struct CapsulePiece
+{
+  Eigen::Vector3d pos, side1, side2;
+  double radius;
+  RGBA rgba;
+  int wind;
+  bool cap_start, cap_end;
+  int numVertices() const { return 6 + (cap_start ? 1 : 0) + (cap_end ? 1 : 0); }
+  int numTriangles() const { return (cap_start ? 6 : 12) + (cap_end ? 6 : 0); }
+};
+
+// write a capsule piece into the mesh arrays, which are sized for it. The vertices start at index @c start_index, and
+// the ring connects to the previous piece's ring, immediately before it. @c uvs is null when there are no uvs
+void addCapsulePiece(const CapsulePiece &piece, int start_index, Eigen::Vector3d *vertices, RGBA *colours,
+                     Eigen::Vector3i *indices, Eigen::Vector3cf *uvs)
 {
   // this is the square root of the volume of a cylinder divided by the volume of the 14 sided polyhderon
   // representing the cylinder (a kind of twisted hexagonal prism). This constant only works for this hexagonal polyhedron
   const double radius_scale = 1.07234; // to keep the volume about equal to that of the cylinder
-  const int start_index = static_cast<int>(mesh.vertices().size());
   const Eigen::Vector3i start_indices(start_index, start_index, start_index);  // start indices
-  std::vector<Eigen::Vector3i> &indices = mesh.indexList();
-  std::vector<Eigen::Vector3cf> &uvs = mesh.uvList();
-  std::vector<Eigen::Vector3d> vertices;
-  vertices.reserve(7);
+  const Eigen::Vector3d &pos = piece.pos;
+  const Eigen::Vector3d &side1 = piece.side1;
+  const Eigen::Vector3d &side2 = piece.side2;
+  const double radius = piece.radius;
+  const int wind = piece.wind;
+  int num_vertices = 0;
   Eigen::Vector3d dir = side2.cross(side1);
-  if (cap_start)
-    vertices.push_back(pos - radius_scale * radius * dir);
+  if (piece.cap_start)
+    vertices[num_vertices++] = pos - radius_scale * radius * dir;
 
   // add the six vertices in the circumferential ring for this point along the branch
   Eigen::Vector3cf uv;
@@ -478,168 +495,255 @@ void addCapsulePiece(Mesh &mesh, int wind, const Eigen::Vector3d &pos, const Eig
     const double pi = 3.14156;
     double angle = (static_cast<double>(i) * 2.0 + static_cast<double>(wind)) * pi / 6.0;
 
-    vertices.push_back(pos + radius_scale * radius * (side1 * std::sin(angle) + side2 * std::cos(angle)));
+    vertices[num_vertices++] = pos + radius_scale * radius * (side1 * std::sin(angle) + side2 * std::cos(angle));
     // the indexing is a bit more complicated, to connect the vertices with triangles
-    if (cap_start)
+    if (piece.cap_start)
     {
-      indices.push_back(start_indices + Eigen::Vector3i(0, 1 + i, 1 + ((i + 1) % 6)));
-      if (add_uvs)
+      *indices++ = start_indices + Eigen::Vector3i(0, 1 + i, 1 + ((i + 1) % 6));
+      if (uvs)
       {
         uv[0] = uv[1] = uv[2] = Comp(0.0f,0.0f);
-        uvs.push_back(uv);
+        *uvs++ = uv;
       }
     }
     else
     {
-      if (add_uvs)
+      if (uvs)
       {
         double I = ((double)i + 0.5*(double)wind) / 6.0;
         uv[2] = Comp(I + 0.0/6.0, 0.0);
         uv[1] = Comp(I + 0.5/6.0, 1.0);
         uv[0] = Comp(I + 1.0/6.0, 0.0);
-        uvs.push_back(uv);
+        *uvs++ = uv;
         uv[2] = Comp(I + 1.5/6.0, 1.0);
         uv[1] = Comp(I + 1.0/6.0, 0.0);
         uv[0] = Comp(I + 0.5/6.0, 1.0);
-        uvs.push_back(uv);
+        *uvs++ = uv;
       }
-      indices.push_back(start_indices + Eigen::Vector3i(i - 6, i, ((i + 1) % 6) - 6));
-      indices.push_back(start_indices + Eigen::Vector3i((i + 1) % 6, ((i + 1) % 6) - 6, i));
+      *indices++ = start_indices + Eigen::Vector3i(i - 6, i, ((i + 1) % 6) - 6);
+      *indices++ = start_indices + Eigen::Vector3i((i + 1) % 6, ((i + 1) % 6) - 6, i);
     }
   }
-  if (cap_end)
+  if (piece.cap_end)
   {
-    vertices.push_back(pos + radius_scale * radius * dir);
+    vertices[num_vertices++] = pos + radius_scale * radius * dir;
     for (int i = 0; i < 6; i++)
     {
-      if (add_uvs)
+      if (uvs)
       {
         uv[0] = uv[1] = uv[2] = Comp(0.0f,1.0f);
-        uvs.push_back(uv);
+        *uvs++ = uv;
       }
-      indices.push_back(start_indices + Eigen::Vector3i(6, (i + 1) % 6, i));
+      *indices++ = start_indices + Eigen::Vector3i(6, (i + 1) % 6, i);
     }
   }
-  // add these vertices into the mesh
-  mesh.vertices().insert(mesh.vertices().end(), vertices.begin(), vertices.end());
-  for (size_t i = 0; i < vertices.size(); i++)
+  for (int i = 0; i < num_vertices; i++)
   {
-    mesh.colours().push_back(rgba);
+    colours[i] = piece.rgba;
   }
 }
 
-/// @brief This converts the piecewise cylindrical model into a smoother mesh than individual capsule meshes
-///        Specifically, each branch (from its base up through the widest radius at each bifurcation) is a continuous
-///        mesh with 6 vertices around its circumference. This is equivalent to the capsules being connected
-///        wherever it is a continuation of the branch. The result is fewer triangles and a smoother result.
-/// @param mesh the mesh object to generate into
-/// @param red_id the first colour channel id, used to colour the trees
-/// @param red_scale scale on the red colour component
-/// @param green_scale scale on the green channel
-/// @param blue_scale scale on the blue channel
-void ForestStructure::generateSmoothMesh(Mesh &mesh, int red_id, double red_scale,
-                        double green_scale, double blue_scale, bool add_uvs)
+// list the capsule pieces of a single tree's smooth mesh, in the order that they are meshed
+void addTreePieces(const TreeStructure &tree, std::vector<CapsulePiece> &pieces, int red_id, double red_scale,
+                   double green_scale, double blue_scale)
 {
-  for (const auto &tree : trees)
+  auto add_piece = [&pieces](int wind, const Eigen::Vector3d &pos, const Eigen::Vector3d &side1,
+                             const Eigen::Vector3d &side2, double radius, const RGBA &rgba, bool cap_start,
+                             bool cap_end) {
+    CapsulePiece piece;
+    piece.pos = pos;
+    piece.side1 = side1;
+    piece.side2 = side2;
+    piece.radius = radius;
+    piece.rgba = rgba;
+    piece.wind = wind;
+    piece.cap_start = cap_start;
+    piece.cap_end = cap_end;
+    pieces.push_back(piece);
+  };
+  const auto &segments = tree.segments();
+  // first generate the list of children for each segment
+  std::vector<std::vector<int>> children(segments.size());
+  for (size_t i = 0; i < segments.size(); i++)
+  {
+    const auto &segment = segments[i];
+    int parent = segment.parent_id;
+    if (parent != -1)
+    {
+      children[parent].push_back(static_cast<int>(i));
+    }
+  }
+  // now generate the set of root segments
+  std::vector<int> roots;
+  for (int i = 1; i < static_cast<int>(segments.size()); i++)
   {
-    const auto &segments = tree.segments();
-    // first generate the list of children for each segment
-    std::vector<std::vector<int>> children(segments.size());
-    for (size_t i = 0; i < segments.size(); i++)
+    if (segments[i].parent_id > 0)
     {
-      const auto &segment = segments[i];
-      int parent = segment.parent_id;
-      if (parent != -1)
-      {
-        children[parent].push_back(static_cast<int>(i));
-      }
+      break;
     }
-    // now generate the set of root segments
-    std::vector<int> roots;
-    for (int i = 1; i < static_cast<int>(segments.size()); i++)
+    roots.push_back(i);
+  }
+
+  RGBA rgba;
+  // for each root, we follow up through the largest child to make a contiguous branch
+  for (size_t i = 0; i < roots.size(); i++)
+  {
+    int root_id = roots[i];
+    Eigen::Vector3d normal(1, 2, 3);  // unspecial 'up' direction for placing vertices along the circumference
+
+    // we iterate through this list and grow it at the same time
+    std::vector<int> childlist = { root_id };
+    int wind = 0;  // this is what rotates the vertices half a triangle width at each segment, to keep the triangles isoceles
+    for (size_t j = 0; j < childlist.size(); j++)
     {
-      if (segments[i].parent_id > 0)
+      int child_id = childlist[j];
+      int par_id = segments[child_id].parent_id;
+      // generate an orthogonal frame for each ring of vertices to sit on
+      Eigen::Vector3d dir = (segments[child_id].tip - segments[par_id].tip).normalized();
+      Eigen::Vector3d axis1 = normal.cross(dir).normalized();
+      Eigen::Vector3d axis2 = axis1.cross(dir);
+      rgba = RGBA::treetrunk();  // standardised colour in raycloudtools
+      if (red_id != -1)               // use the per-segment colour if it exists (e.g. from treecolour)
       {
-        break;
+        rgba.red = uint8_t(std::min(red_scale * segments[child_id].attributes[red_id], 255.0));
+        rgba.green = uint8_t(std::min(green_scale * segments[child_id].attributes[red_id + 1], 255.0));
+        rgba.blue = uint8_t(std::min(blue_scale * segments[child_id].attributes[red_id + 2], 255.0));
       }
-      roots.push_back(i);
-    }
 
-    RGBA rgba;
-    // for each root, we follow up through the largest child to make a contiguous branch
-    for (size_t i = 0; i < roots.size(); i++)
-    {
-      int root_id = roots[i];
-      Eigen::Vector3d normal(1, 2, 3);  // unspecial 'up' direction for placing vertices along the circumference
+      if (child_id == root_id)  // add the base cap of the cylinder if we are at the root of the branch
+      {
+        add_piece(wind, segments[par_id].tip, axis1, axis2, segments[child_id].radius, rgba, true, false);
+      }
 
-      // we iterate through this list and grow it at the same time
-      std::vector<int> childlist = { root_id };
-      int wind = 0;  // this is what rotates the vertices half a triangle width at each segment, to keep the triangles isoceles
-      for (size_t j = 0; j < childlist.size(); j++)
+      wind++;
+      std::vector<int> kids = children[child_id];
+      if (kids.empty())  // add the end cap of the cylinder if we are at the end of the whole branch
+      {
+        add_piece(wind, segments[child_id].tip, axis1, axis2, segments[child_id].radius, rgba, false, true);
+        break;
+      }
+      // now find the maximum radius subbranch
+      double max_rad = 0.0;
+      int max_k = 0;
+      for (int k = 0; k < static_cast<int>(kids.size()); k++)
       {
-        int child_id = childlist[j];
-        int par_id = segments[child_id].parent_id;
-        // generate an orthogonal frame for each ring of vertices to sit on
-        Eigen::Vector3d dir = (segments[child_id].tip - segments[par_id].tip).normalized();
-        Eigen::Vector3d axis1 = normal.cross(dir).normalized();
-        Eigen::Vector3d axis2 = axis1.cross(dir);
-        rgba = RGBA::treetrunk();  // standardised colour in raycloudtools
-        if (red_id != -1)               // use the per-segment colour if it exists (e.g. from treecolour)
+        double rad = segments[kids[k]].radius;
+        if (rad > max_rad)
         {
-          rgba.red = uint8_t(std::min(red_scale * segments[child_id].attributes[red_id], 255.0));
-          rgba.green = uint8_t(std::min(green_scale * segments[child_id].attributes[red_id + 1], 255.0));
-          rgba.blue = uint8_t(std::min(blue_scale * segments[child_id].attributes[red_id + 2], 255.0));
+          max_rad = rad;
+          max_k = k;
         }
-
-        if (child_id == root_id)  // add the base cap of the cylinder if we are at the root of the branch
+      }
+      for (int k = 0; k < static_cast<int>(kids.size()); k++)
+      {
+        if (k != max_k)
         {
-          addCapsulePiece(mesh, wind, segments[par_id].tip, axis1, axis2, segments[child_id].radius, rgba, true, false, add_uvs);
+          roots.push_back(kids[k]);  // all other subbranches get added to the list, to be iterated over on their turn
         }
+      }
 
-        wind++;
-        std::vector<int> kids = children[child_id];
-        if (kids.empty())  // add the end cap of the cylinder if we are at the end of the whole branch
-        {
-          addCapsulePiece(mesh, wind, segments[child_id].tip, axis1, axis2, segments[child_id].radius, rgba, false, true, add_uvs);
-          break;
-        }
-        // now find the maximum radius subbranch
-        double max_rad = 0.0;
-        int max_k = 0;
-        for (int k = 0; k < static_cast<int>(kids.size()); k++)
-        {
-          double rad = segments[kids[k]].radius;
-          if (rad > max_rad)
-          {
-            max_rad = rad;
-            max_k = k;
-          }
-        }
-        for (int k = 0; k < static_cast<int>(kids.size()); k++)
-        {
-          if (k != max_k)
-          {
-            roots.push_back(kids[k]);  // all other subbranches get added to the list, to be iterated over on their turn
-          }
-        }
+      int next_id = kids[max_k];
+      Eigen::Vector3d dir2 = (segments[next_id].tip - segments[child_id].tip).normalized();
+
+      Eigen::Vector3d top_dir = (dir2 + dir).normalized();  // here we average the directions of the two segments
+      // and generate an orthogonal basis for the ring of points on the branch
+      Eigen::Vector3d mid_axis1 = normal.cross(top_dir).normalized();
+      Eigen::Vector3d mid_axis2 = mid_axis1.cross(top_dir);
+      normal = -mid_axis2;
+      // add the ring of points
+      add_piece(wind, segments[child_id].tip, mid_axis1, mid_axis2, segments[child_id].radius, rgba, false, false);
+      // add the biggest subbranch to the list, so we continue to build the branch
+      childlist.push_back(kids[max_k]);
+    }
+  }
+}
 
-        int next_id = kids[max_k];
-        Eigen::Vector3d dir2 = (segments[next_id].tip - segments[child_id].tip).normalized();
-
-        Eigen::Vector3d top_dir = (dir2 + dir).normalized();  // here we average the directions of the two segments
-        // and generate an orthogonal basis for the ring of points on the branch
-        Eigen::Vector3d mid_axis1 = normal.cross(top_dir).normalized();
-        Eigen::Vector3d mid_axis2 = mid_axis1.cross(top_dir);
-        normal = -mid_axis2;
-        // add the ring of points
-        addCapsulePiece(mesh, wind, segments[child_id].tip, mid_axis1, mid_axis2, segments[child_id].radius, rgba,
-                        false, false, add_uvs);
-        // add the biggest subbranch to the list, so we continue to build the branch
-        childlist.push_back(kids[max_k]);
+// Generate the trees' meshes in parallel, a batch of trees at a time. A first pass lists each tree's capsule pieces,
+// which sizes its slice of @c dest, then each tree's mesh is written straight into its slice. Each batch is appended
+// to @c dest in tree order, then @c batch_done is called
+void generateTreeMeshes(const std::vector<TreeStructure> &trees, Mesh &dest, int red_id, double red_scale,
+                        double green_scale, double blue_scale, bool add_uvs, std::function<bool()> batch_done)
+{
+  const size_t batch_size = 1024;
+  std::vector<std::vector<CapsulePiece>> tree_pieces;
+  for (size_t first = 0; first < trees.size(); first += batch_size)
+  {
+    const int num = static_cast<int>(std::min(batch_size, trees.size() - first));
+    tree_pieces.resize(num);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < num; i++)
+    {
+      tree_pieces[i].clear();
+      addTreePieces(trees[first + i], tree_pieces[i], red_id, red_scale, green_scale, blue_scale);
+    }
+    // where each tree's slice starts
+    std::vector<size_t> vertex_starts(num + 1, dest.vertices().size());
+    std::vector<size_t> index_starts(num + 1, dest.indexList().size());
+    for (int i = 0; i < num; i++)
+    {
+      vertex_starts[i + 1] = vertex_starts[i];
+      index_starts[i + 1] = index_starts[i];
+      for (const auto &piece : tree_pieces[i])
+      {
+        vertex_starts[i + 1] += piece.numVertices();
+        index_starts[i + 1] += piece.numTriangles();
+      }
+    }
+    dest.vertices().resize(vertex_starts[num]);
+    dest.colours().resize(vertex_starts[num]);
+    dest.indexList().resize(index_starts[num]);
+    if (add_uvs)
+    {
+      dest.uvList().resize(index_starts[num]);
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < num; i++)
+    {
+      size_t vertex_id = vertex_starts[i];
+      size_t index_id = index_starts[i];
+      for (const auto &piece : tree_pieces[i])
+      {
+        addCapsulePiece(piece, static_cast<int>(vertex_id), &dest.vertices()[vertex_id], &dest.colours()[vertex_id],
+                        &dest.indexList()[index_id], add_uvs ? &dest.uvList()[index_id] : nullptr);
+        vertex_id += piece.numVertices();
+        index_id += piece.numTriangles();
       }
     }
+    if (!batch_done())
+    {
+      return;
+    }
   }
 }
+}  // namespace
+
+/// @brief This converts the piecewise cylindrical model into a smoother mesh than individual capsule meshes
+///        Specifically, each branch (from its base up through the widest radius at each bifurcation) is a continuous
+///        mesh with 6 vertices around its circumference. This is equivalent to the capsules being connected
+///        wherever it is a continuation of the branch. The result is fewer triangles and a smoother result.
+/// @param mesh the mesh object to generate into
+/// @param red_id the first colour channel id, used to colour the trees
+/// @param red_scale scale on the red colour component
+/// @param green_scale scale on the green channel
+/// @param blue_scale scale on the blue channel
+void ForestStructure::generateSmoothMesh(Mesh &mesh, int red_id, double red_scale,
+                        double green_scale, double blue_scale, bool add_uvs)
+{
+  generateTreeMeshes(trees, mesh, red_id, red_scale, green_scale, blue_scale, add_uvs, []() { return true; });
+}
+
+bool ForestStructure::generateSmoothMesh(MeshWriter &writer, int red_id, double red_scale, double green_scale,
+                                         double blue_scale, bool add_uvs)
+{
+  Mesh chunk;
+  bool success = true;
+  generateTreeMeshes(trees, chunk, red_id, red_scale, green_scale, blue_scale, add_uvs, [&]() {
+    success = writer.writeChunk(chunk);
+    chunk = Mesh();
+    return success;
+  });
+  return success;
+}
 
 void ForestStructure::reindex()
 {
@@ -26,6 +26,10 @@ struct RAYLIB_EXPORT ForestStructure
   void splitCloud(const Cloud &cloud, double offset, Cloud &inside, Cloud &outside);
   void generateSmoothMesh(Mesh &mesh, int red_id, double red_scale,
                           double green_scale, double blue_scale, bool add_uvs = false);
+  /// generate the smooth mesh straight into a mesh @c writer, a chunk of trees at a time, so the whole mesh need not
+  /// be held in memory
+  bool generateSmoothMesh(class MeshWriter &writer, int red_id, double red_scale, double green_scale,
+                          double blue_scale, bool add_uvs = false);
   /// reindex the segments to remove any disconnected segments, and order from root to tips
   void reindex();
   std::vector<std::string> comments; // just header comments
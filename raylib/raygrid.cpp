@@ -0,0 +1,83 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raygrid.h"
+
+namespace ray
+{
+PointGrid::PointGrid(const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_max, double voxel_width)
+  : box_min(box_min)
+  , box_max(box_max)
+  , voxel_width(voxel_width)
+{
+  const Eigen::Vector3d diff = (box_max - box_min) / voxel_width;
+  dims = Eigen::Vector3i(diff.array().ceil().cast<int>());
+  column_offsets_.resize(static_cast<size_t>(std::max(dims[0], 0)) * std::max(dims[1], 0) + 1, 0);
+}
+
+void PointGrid::fill(const std::vector<Eigen::Vector3d> &points, const std::vector<RGBA> &colours)
+{
+  // 1. find each point's column and vertical cell, and count the points per column
+  const int num_points = static_cast<int>(points.size());
+  std::vector<int> columns(num_points, -1);
+  std::vector<int> zs(num_points);
+  #pragma omp parallel for
+  for (int i = 0; i < num_points; i++)
+  {
+    if (colours[i].alpha == 0)
+    {
+      continue;
+    }
+    const Eigen::Vector3i ind = index(points[i]);
+    if (ind[0] >= dims[0] || ind[1] >= dims[1] || ind[2] >= dims[2])
+    {
+      continue;
+    }
+    columns[i] = ind[0] * dims[1] + ind[1];
+    zs[i] = ind[2];
+    #pragma omp atomic
+    column_offsets_[columns[i] + 1]++;
+  }
+  for (size_t i = 1; i < column_offsets_.size(); i++)
+  {
+    column_offsets_[i] += column_offsets_[i - 1];
+  }
+
+  // 2. scatter the point ids into their columns
+  std::vector<size_t> ends(column_offsets_.begin(), column_offsets_.end() - 1);
+  std::vector<int> ids(column_offsets_.back());
+  #pragma omp parallel for
+  for (int i = 0; i < num_points; i++)
+  {
+    if (columns[i] == -1)
+    {
+      continue;
+    }
+    size_t slot;
+    #pragma omp atomic capture
+    slot = ends[columns[i]]++;
+    ids[slot] = i;
+  }
+
+  // 3. order each column by vertical cell, then by original order, so the layout is independent of the thread count
+  const int num_columns = static_cast<int>(column_offsets_.size()) - 1;
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int c = 0; c < num_columns; c++)
+  {
+    std::sort(ids.begin() + column_offsets_[c], ids.begin() + column_offsets_[c + 1],
+              [&zs](int a, int b) { return zs[a] < zs[b] || (zs[a] == zs[b] && a < b); });
+  }
+
+  // 4. gather the points into the contiguous layout
+  points_.resize(ids.size());
+  cell_z_.resize(ids.size());
+  #pragma omp parallel for
+  for (int j = 0; j < static_cast<int>(ids.size()); j++)
+  {
+    points_[j] = points[ids[j]];
+    cell_z_[j] = zs[ids[j]];
+  }
+}
+}  // namespace ray
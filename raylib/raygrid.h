@@ -10,6 +10,7 @@
 
 #include "rayutils.h"
 
+#include <algorithm>
 #include <functional>
 
 #if RAYLIB_WITH_TBB
@@ -386,6 +387,46 @@ protected:
   Cell null_cell_;
 };
 
+/// Read-only 3D grid of points, counting-sorted into a compressed sparse row layout. There is one offset per
+/// horizontal column of cells, into a single contiguous array of points, which are ordered by vertical cell within
+/// each column. So any vertical run of cells is a contiguous range of points, with no per-cell allocations
+class RAYLIB_EXPORT PointGrid
+{
+public:
+  PointGrid(const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_max, double voxel_width);
+
+  /// fill the grid with the @c points, in parallel. Points with a zero alpha in @c colours (the ends of unbounded rays)
+  /// are omitted, as are points on the maximum bound. Within a cell, the points keep their order in @c points
+  void fill(const std::vector<Eigen::Vector3d> &points, const std::vector<RGBA> &colours);
+
+  /// cell index of a spatial position, clamped to the grid bounds
+  Eigen::Vector3i index(const Eigen::Vector3d &spatial_pos) const
+  {
+    const Eigen::Vector3d coord = (maxVector(minVector(spatial_pos, box_max), box_min) - box_min) / voxel_width;
+    return coord.cast<int>();
+  }
+
+  /// the points in cells @c z_min to @c z_max inclusive, of column @c x, @c y, as a pointer range
+  std::pair<const Eigen::Vector3d *, const Eigen::Vector3d *> cells(int x, int y, int z_min, int z_max) const
+  {
+    const int column = x * dims[1] + y;
+    const int *z_begin = cell_z_.data() + column_offsets_[column];
+    const int *z_end = cell_z_.data() + column_offsets_[column + 1];
+    const int *first = std::lower_bound(z_begin, z_end, z_min);
+    const int *last = std::upper_bound(first, z_end, z_max);
+    return std::make_pair(points_.data() + (first - cell_z_.data()), points_.data() + (last - cell_z_.data()));
+  }
+
+  Eigen::Vector3d box_min, box_max;
+  double voxel_width;
+  Eigen::Vector3i dims;
+
+private:
+  std::vector<size_t> column_offsets_;  // start of each column's points, plus the end of the last column
+  std::vector<Eigen::Vector3d> points_;
+  std::vector<int> cell_z_;             // vertical cell index of each of points_
+};
+
 }  // namespace ray
 
 #endif  // RAYLIB_RAYGRID_H
@@ -0,0 +1,120 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYHEAPSET_H
+#define RAYLIB_RAYHEAPSET_H
+
+#include "raylib/raylibconfig.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+namespace ray
+{
+/// A priority queue with the semantics of a std::set<T, Compare>: inserting an element that is already present has no
+/// effect, erasing removes exactly the equal element, and top() is the set's first element. It is a binary heap in a
+/// vector, with erased elements left in place and skipped once they reach the top, so it avoids the set's per-element
+/// rebalancing. @c Hash must hash elements that are equivalent under @c Compare equally
+template <class T, class Compare, class Hash>
+class HeapSet
+{
+public:
+  /// insert @c value, if no equivalent element is in the set
+  void insert(const T &value)
+  {
+    auto it = entries_.find(value);
+    if (it == entries_.end())  // not in the heap, so push it
+    {
+      entries_.emplace(value, true);
+      heap_.push_back(value);
+      std::push_heap(heap_.begin(), heap_.end(), Greater());
+      num_live_++;
+    }
+    else if (!it->second)  // an erased copy is still in the heap, so revive it
+    {
+      it->second = true;
+      num_live_++;
+    }
+  }
+
+  /// erase the element equivalent to @c value, if it is in the set
+  void erase(const T &value)
+  {
+    auto it = entries_.find(value);
+    if (it == entries_.end() || !it->second)
+    {
+      return;
+    }
+    it->second = false;
+    num_live_--;
+    removeErasedTop();
+  }
+
+  /// the first element in Compare order. The set must not be empty
+  const T &top() const { return heap_.front(); }
+  /// erase the first element
+  void pop() { erase(heap_.front()); }
+
+  bool empty() const { return num_live_ == 0; }
+  size_t size() const { return num_live_; }
+  void clear()
+  {
+    heap_.clear();
+    entries_.clear();
+    num_live_ = 0;
+  }
+
+  /// the elements, in Compare order, as iterating the std::set would give them
+  std::vector<T> sorted() const
+  {
+    std::vector<T> values;
+    values.reserve(num_live_);
+    for (auto &entry : entries_)
+    {
+      if (entry.second)
+      {
+        values.push_back(entry.first);
+      }
+    }
+    std::sort(values.begin(), values.end(), Compare());
+    return values;
+  }
+
+private:
+  class Greater
+  {
+  public:
+    bool operator()(const T &lhs, const T &rhs) const { return Compare()(rhs, lhs); }
+  };
+  class Equivalent
+  {
+  public:
+    bool operator()(const T &lhs, const T &rhs) const { return !Compare()(lhs, rhs) && !Compare()(rhs, lhs); }
+  };
+
+  // keeps the top of the heap a live element
+  void removeErasedTop()
+  {
+    while (!heap_.empty())
+    {
+      auto it = entries_.find(heap_.front());
+      if (it->second)
+      {
+        return;
+      }
+      entries_.erase(it);
+      std::pop_heap(heap_.begin(), heap_.end(), Greater());
+      heap_.pop_back();
+    }
+  }
+
+  std::vector<T> heap_;                                // every element in the heap, live or erased
+  std::unordered_map<T, bool, Hash, Equivalent> entries_;  // whether each element in the heap is live
+  size_t num_live_ = 0;
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYHEAPSET_H
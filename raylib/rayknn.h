@@ -0,0 +1,40 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYKNN_H
+#define RAYLIB_RAYKNN_H
+
+#include "rayutils.h"
+
+#include <nabo/nabo.h>
+
+namespace ray
+{
+/// Runs the knn search over blocks of query columns @c points_q in parallel, giving the same results as a single
+/// @c nns.knn() call. The search is const so the tree can be shared by the threads
+inline void parallelKnn(const Nabo::NNSearchD &nns, const Eigen::MatrixXd &points_q, Eigen::MatrixXi &indices,
+                        Eigen::MatrixXd &dists2, int search_size, double epsilon, double max_radius)
+{
+  const int num_queries = (int)points_q.cols();
+  indices.resize(search_size, num_queries);
+  dists2.resize(search_size, num_queries);
+  const int block_size = 1024;
+  const int num_blocks = (num_queries + block_size - 1) / block_size;
+  #pragma omp parallel for schedule(dynamic)
+  for (int b = 0; b < num_blocks; b++)
+  {
+    const int start = b * block_size;
+    const int count = std::min(block_size, num_queries - start);
+    Eigen::MatrixXd block_q = points_q.middleCols(start, count);
+    Eigen::MatrixXi block_indices(search_size, count);
+    Eigen::MatrixXd block_dists2(search_size, count);
+    nns.knn(block_q, block_indices, block_dists2, search_size, epsilon, 0, max_radius);
+    indices.middleCols(start, count) = block_indices;
+    dists2.middleCols(start, count) = block_dists2;
+  }
+}
+}  // namespace ray
+
+#endif  // RAYLIB_RAYKNN_H
@@ -15,6 +15,7 @@
 #endif  // RAYLIB_WITH_TBB
 
 #include <algorithm>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <set>
@@ -87,6 +88,167 @@ public:
   }
 };
 
+namespace
+{
+const unsigned int kMergeStateVersion = 1;
+const double kIndexCellScale = 8.0;  // spatial index cell width, in ray grid voxels
+
+/// Calls @c visit on each cell of width @c width that the ray from @c start to @c end passes through
+template <class VisitFunction>
+void walkCells(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double width, VisitFunction visit)
+{
+  Eigen::Vector3d dir = end - start;
+  Eigen::Vector3d dir_sign(sgn(dir[0]), sgn(dir[1]), sgn(dir[2]));
+  Eigen::Vector3d from = start / width;
+  Eigen::Vector3d to = end / width;
+  Eigen::Vector3i start_index((int)floor(from[0]), (int)floor(from[1]), (int)floor(from[2]));
+  Eigen::Vector3i end_index((int)floor(to[0]), (int)floor(to[1]), (int)floor(to[2]));
+  double length_sqr = (end_index - start_index).squaredNorm();
+  Eigen::Vector3i index = start_index;
+  for (;;)
+  {
+    visit(index);
+    if (index == end_index || (index - start_index).squaredNorm() > length_sqr)
+    {
+      break;
+    }
+    Eigen::Vector3d mid = width * Eigen::Vector3d(index[0] + 0.5, index[1] + 0.5, index[2] + 0.5);
+    Eigen::Vector3d next_boundary = mid + 0.5 * width * dir_sign;
+    Eigen::Vector3d delta = next_boundary - start;
+    Eigen::Vector3d d(delta[0] / dir[0], delta[1] / dir[1], delta[2] / dir[2]);
+    if (d[0] < d[1] && d[0] < d[2])
+    {
+      index[0] += int(dir_sign[0]);
+    }
+    else if (d[1] < d[0] && d[1] < d[2])
+    {
+      index[1] += int(dir_sign[1]);
+    }
+    else
+    {
+      index[2] += int(dir_sign[2]);
+    }
+  }
+}
+
+template <class T>
+void sortUnique(std::vector<T> &values)
+{
+  std::sort(values.begin(), values.end());
+  values.erase(std::unique(values.begin(), values.end()), values.end());
+}
+
+void sortUnique(std::vector<Eigen::Vector3i> &cells)
+{
+  std::sort(cells.begin(), cells.end(), Vector3iLess());
+  cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+}
+}  // namespace
+
+bool MergeState::save(const std::string &file_name) const
+{
+  std::ofstream out(file_name, std::ios::binary | std::ios::out);
+  if (!out.is_open())
+  {
+    std::cerr << "Error: cannot open " << file_name << " for writing" << std::endl;
+    return false;
+  }
+  writePlainOldData(out, kMergeStateVersion);
+  writePlainOldData(out, voxel_width);
+  writePlainOldData(out, index_width);
+  writePlainOldDataArray(out, ellipsoids);
+  writePlainOldDataArray(out, index_cells);
+  writePlainOldDataArray(out, index_starts);
+  writePlainOldDataArray(out, index_ids);
+  return out.good();
+}
+
+bool MergeState::load(const std::string &file_name)
+{
+  std::ifstream input(file_name, std::ios::binary | std::ios::in);
+  if (!input.good())
+  {
+    return false;
+  }
+  unsigned int version = 0;
+  readPlainOldData(input, version);
+  if (version != kMergeStateVersion)
+  {
+    return false;
+  }
+  readPlainOldData(input, voxel_width);
+  readPlainOldData(input, index_width);
+  readPlainOldDataArray(input, ellipsoids);
+  readPlainOldDataArray(input, index_cells);
+  readPlainOldDataArray(input, index_starts);
+  readPlainOldDataArray(input, index_ids);
+  return input.good() && index_starts.size() == index_cells.size() + 1 && index_starts.back() == index_ids.size();
+}
+
+void MergeState::cellRays(const Eigen::Vector3i &cell, std::vector<unsigned> &ids) const
+{
+  auto it = std::lower_bound(index_cells.begin(), index_cells.end(), cell, Vector3iLess());
+  if (it == index_cells.end() || *it != cell)
+  {
+    return;
+  }
+  const size_t c = it - index_cells.begin();
+  ids.insert(ids.end(), index_ids.begin() + index_starts[c], index_ids.begin() + index_starts[c + 1]);
+}
+
+void MergeState::reindex(const std::vector<int64_t> &new_ids, const Cloud &cloud, unsigned first_id)
+{
+  std::vector<std::pair<Eigen::Vector3i, unsigned>> added;
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    walkCells(cloud.starts[i], cloud.ends[i], index_width,
+              [&](const Eigen::Vector3i &cell) { added.emplace_back(cell, first_id + (unsigned)i); });
+  }
+  Vector3iLess less;
+  std::sort(added.begin(), added.end(),
+            [&less](const std::pair<Eigen::Vector3i, unsigned> &a, const std::pair<Eigen::Vector3i, unsigned> &b) {
+              if (a.first != b.first)
+                return less(a.first, b.first);
+              return a.second < b.second;
+            });
+
+  // merge the sorted existing cells with the sorted added ones. The existing ids are remapped in order and the added
+  // ids are all larger, so each cell's ids remain sorted
+  std::vector<Eigen::Vector3i> cells;
+  std::vector<unsigned> starts, ids;
+  size_t c = 0, a = 0;
+  while (c < index_cells.size() || a < added.size())
+  {
+    const bool existing = c < index_cells.size() && (a == added.size() || !less(added[a].first, index_cells[c]));
+    const Eigen::Vector3i cell = existing ? index_cells[c] : added[a].first;
+    const size_t start = ids.size();
+    if (c < index_cells.size() && index_cells[c] == cell)
+    {
+      for (unsigned k = index_starts[c]; k < index_starts[c + 1]; k++)
+      {
+        if (new_ids[index_ids[k]] >= 0)
+        {
+          ids.push_back((unsigned)new_ids[index_ids[k]]);
+        }
+      }
+      c++;
+    }
+    while (a < added.size() && added[a].first == cell)
+    {
+      ids.push_back(added[a++].second);
+    }
+    if (ids.size() > start)
+    {
+      cells.push_back(cell);
+      starts.push_back((unsigned)start);
+    }
+  }
+  starts.push_back((unsigned)ids.size());
+  index_cells.swap(cells);
+  index_starts.swap(starts);
+  index_ids.swap(ids);
+}
+
 // TODO: Make config value
 const double test_width = 0.01;  // allows a minor variation when checking for similarity of rays
 
@@ -582,6 +744,183 @@ bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2
   return true;
 }
 
+void Merger::generateMergeState(const Cloud &cloud, MergeState *state, Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
+  {
+    progress = &tracker;
+  }
+  state->voxel_width = voxelSizeForCloud(cloud);
+  state->index_width = kIndexCellScale * state->voxel_width;
+  generateEllipsoids(&ellipsoids_, nullptr, nullptr, cloud, progress);
+  Grid<unsigned> grid(cloud.calcMinBound(), cloud.calcMaxBound(), state->voxel_width);
+  seedRayGrid(&grid, cloud);
+  fillRayGrid(&grid, cloud, progress);
+  std::vector<Bool> transient_ray_marks(cloud.rayCount() MARKER_BOOL_INIT);
+  // just set opacity
+  markIntersectedEllipsoids(cloud, grid, &transient_ray_marks, 0, false, progress);
+  state->ellipsoids.swap(ellipsoids_);
+  ellipsoids_.clear();
+
+  state->index_cells.clear();
+  state->index_starts.clear();
+  state->index_ids.clear();
+  state->reindex(std::vector<int64_t>(), cloud, 0);
+}
+
+bool Merger::mergeIncremental(const Cloud &merged, MergeState *state, const Cloud &cloud, Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
+  {
+    progress = &tracker;
+  }
+
+  clear();
+  if (state->ellipsoids.size() != merged.rayCount())
+  {
+    std::cerr << "Error: the merge state has " << state->ellipsoids.size() << " ellipsoids, but the merged cloud has "
+              << merged.rayCount() << " rays" << std::endl;
+    return false;
+  }
+
+  // find the affected region: the index cells that the new rays pass through, and those containing their end points
+  std::vector<Eigen::Vector3i> ray_cells, end_cells;
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    walkCells(cloud.starts[i], cloud.ends[i], state->index_width,
+              [&ray_cells](const Eigen::Vector3i &cell) { ray_cells.push_back(cell); });
+    end_cells.push_back(state->cellIndex(cloud.ends[i]));
+  }
+  sortUnique(ray_cells);
+  sortUnique(end_cells);
+
+  // the merged cloud's ellipsoids that the new rays may intersect, these are the rays ending in the ray cells
+  std::vector<unsigned> ellipsoid_ids, cell_ids;
+  for (const auto &cell : ray_cells)
+  {
+    cell_ids.clear();
+    state->cellRays(cell, cell_ids);
+    for (const auto &id : cell_ids)
+    {
+      if (state->cellIndex(merged.ends[id]) == cell)
+      {
+        ellipsoid_ids.push_back(id);
+      }
+    }
+  }
+  // and the merged cloud's rays that may intersect the new ellipsoids
+  std::vector<unsigned> ray_ids;
+  for (const auto &cell : end_cells)
+  {
+    state->cellRays(cell, ray_ids);
+  }
+  sortUnique(ray_ids);
+
+  Cloud ellipsoid_cloud, ray_cloud;
+  for (const auto &id : ellipsoid_ids)
+  {
+    ellipsoid_cloud.addRay(merged, id);
+  }
+  for (const auto &id : ray_ids)
+  {
+    ray_cloud.addRay(merged, id);
+  }
+
+  const Eigen::Vector3d box_min = cloud.calcMinBound();
+  const Eigen::Vector3d box_max = cloud.calcMaxBound();
+  const double voxel_size = voxelSizeForCloud(cloud);
+  Grid<unsigned> grid(box_min, box_max, voxel_size);
+  seedRayGrid(&grid, cloud);
+  seedRayGrid(&grid, ellipsoid_cloud);
+  fillRayGrid(&grid, cloud, progress);
+  std::vector<Bool> transient_ray_marks(cloud.rayCount() MARKER_BOOL_INIT);
+  std::vector<bool> merged_removed(merged.rayCount(), false);
+
+  // the merged cloud's ellipsoids against the new rays. The merged cloud is first in order
+  ellipsoids_.resize(ellipsoid_ids.size());
+  for (size_t i = 0; i < ellipsoid_ids.size(); i++)
+  {
+    ellipsoids_[i] = state->ellipsoids[ellipsoid_ids[i]];
+  }
+  markIntersectedEllipsoids(cloud, grid, &transient_ray_marks, config_.num_rays_filter_threshold, false, progress,
+                            true);
+  for (size_t i = 0; i < ellipsoid_ids.size(); i++)
+  {
+    state->ellipsoids[ellipsoid_ids[i]] = ellipsoids_[i];
+    if (ellipsoids_[i].transient)
+    {
+      merged_removed[ellipsoid_ids[i]] = true;
+    }
+  }
+
+  // the new cloud's ellipsoids, first against its own rays to set their opacity, then against the merged cloud's rays
+  generateEllipsoids(&ellipsoids_, nullptr, nullptr, cloud, progress);
+  markIntersectedEllipsoids(cloud, grid, &transient_ray_marks, 0, false, progress);
+  if (ray_cloud.rayCount() > 0)
+  {
+    // only the cells around the new end points are needed, so the grid is bounded by the new cloud
+    Grid<unsigned> merged_grid(box_min, box_max, state->voxel_width);
+    seedRayGrid(&merged_grid, cloud);
+    fillRayGrid(&merged_grid, ray_cloud, progress);
+    std::vector<Bool> merged_ray_marks(ray_cloud.rayCount() MARKER_BOOL_INIT);
+    markIntersectedEllipsoids(ray_cloud, merged_grid, &merged_ray_marks, config_.num_rays_filter_threshold, false,
+                              progress, false);
+    for (size_t i = 0; i < ray_ids.size(); i++)
+    {
+      if (merged_ray_marks[i])
+      {
+        merged_removed[ray_ids[i]] = true;
+      }
+    }
+  }
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    if (ellipsoids_[i].transient)
+    {
+      transient_ray_marks[i] = true;
+    }
+  }
+
+  // the combined cloud is the remaining merged rays then the remaining new rays, and the state follows this order
+  std::vector<int64_t> new_ids(merged.rayCount(), -1);
+  std::vector<Ellipsoid> ellipsoids;
+  ellipsoids.reserve(merged.rayCount() + cloud.rayCount());
+  for (size_t i = 0; i < merged.rayCount(); i++)
+  {
+    if (merged_removed[i])
+    {
+      difference_.addRay(merged, i);
+    }
+    else
+    {
+      new_ids[i] = (int64_t)fixed_.rayCount();
+      fixed_.addRay(merged, i);
+      ellipsoids.push_back(state->ellipsoids[i]);
+    }
+  }
+  const unsigned first_id = (unsigned)fixed_.rayCount();
+  Cloud added;
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    if (transient_ray_marks[i])
+    {
+      difference_.addRay(cloud, i);
+    }
+    else
+    {
+      fixed_.addRay(cloud, i);
+      added.addRay(cloud, i);
+      ellipsoids.push_back(ellipsoids_[i]);
+    }
+  }
+  state->ellipsoids.swap(ellipsoids);
+  state->reindex(new_ids, added, first_id);
+  ellipsoids_.clear();
+  return true;
+}
+
 void Merger::clear()
 {
   difference_.clear();
@@ -692,7 +1031,7 @@ void Merger::markIntersectedEllipsoids(const Cloud &cloud, const Grid<unsigned>
                                        std::vector<Bool> *transient_ray_marks, double num_rays, bool self_transient,
                                        Progress *progress, bool ellipsoid_cloud_first)
 {
-  progress->begin("transient-mark-ellipsoids", cloud.rayCount());
+  progress->begin("transient-mark-ellipsoids", ellipsoids_.size());
 
   // Check each ellipsoid against the ray grid for intersections.
 #if RAYLIB_WITH_TBB
@@ -709,7 +1048,7 @@ void Merger::markIntersectedEllipsoids(const Cloud &cloud, const Grid<unsigned>
                 self_transient, ellipsoid_cloud_first);
     progress->increment();
   };
-  tbb::parallel_for<size_t>(0u, cloud.rayCount(), tbb_process_ellipsoid);
+  tbb::parallel_for<size_t>(0u, ellipsoids_.size(), tbb_process_ellipsoid);
 #else   // RAYLIB_WITH_TBB
   std::vector<bool> ray_tested;
   ray_tested.resize(cloud.rayCount(), false);
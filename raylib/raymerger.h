@@ -13,6 +13,7 @@
 
 #include <atomic>
 #include <limits>
+#include <string>
 #include <vector>
 
 namespace ray
@@ -42,6 +43,38 @@ struct RAYLIB_EXPORT MergerConfig
   bool colour_cloud = true;
 };
 
+/// The persistent state of a merged cloud, saved alongside it so that new clouds can be merged in incrementally.
+/// This is an ellipsoid per ray of the merged cloud, with its opacity and ray counts, and a coarse spatial index of the
+/// rays passing through each index cell
+struct RAYLIB_EXPORT MergeState
+{
+  /// Save to a binary file, typically named cloud_merge.dat
+  bool save(const std::string &file_name) const;
+  /// Load from a binary file. Returns false if the file is missing or of a different version
+  bool load(const std::string &file_name);
+
+  /// The spatial index cell containing @c pos
+  inline Eigen::Vector3i cellIndex(const Eigen::Vector3d &pos) const
+  {
+    return Eigen::Vector3i(int(std::floor(pos[0] / index_width)), int(std::floor(pos[1] / index_width)),
+                           int(std::floor(pos[2] / index_width)));
+  }
+  /// Appends to @c ids the rays passing through index cell @c cell
+  void cellRays(const Eigen::Vector3i &cell, std::vector<unsigned> &ids) const;
+  /// Updates the spatial index after a merge. @c new_ids maps each previously indexed ray to its new id, or -1 if it
+  /// was removed. The rays of @c cloud are then indexed with ids starting at @c first_id
+  void reindex(const std::vector<int64_t> &new_ids, const Cloud &cloud, unsigned first_id);
+
+  std::vector<Ellipsoid> ellipsoids;  ///< one per ray of the merged cloud
+  double voxel_width = 0;             ///< ray grid voxel width of the merged cloud
+  double index_width = 0;             ///< width of the spatial index cells
+  /// The spatial index, in compressed rows: the rays through index_cells[i] are
+  /// index_ids[index_starts[i]] to index_ids[index_starts[i+1]-1]. The cells are sorted by @c Vector3iLess
+  std::vector<Eigen::Vector3i> index_cells;
+  std::vector<unsigned> index_starts;
+  std::vector<unsigned> index_ids;
+};
+
 /// A cloud merger which supports filtering 'transient' rays and merging from a ray clouds. A transient ray is one which
 /// is in conflict with sample observations and rays passing through the observation. For example, transient points are
 /// generated by movable objects in a ray cloud such as people moving through a scan or doors being openned and closed.
@@ -73,6 +106,15 @@ public:
   /// Three way merger
   bool mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2, Progress *progress = nullptr);
 
+  /// Generate the merge @c state of an already merged @c cloud, to allow incremental merging into it
+  void generateMergeState(const Cloud &cloud, MergeState *state, Progress *progress = nullptr);
+
+  /// Incremental merge of @c cloud into the previously merged cloud @c merged, whose merge state is @c state.
+  /// This is a two cloud @c mergeMultiple() with @c merged first, but only the ellipsoids of @c cloud are generated,
+  /// and only the ellipsoids and rays of @c merged within the index cells that @c cloud overlaps are intersected.
+  /// So the cost is proportional to @c cloud rather than @c merged. @c state is updated to match @c fixedCloud()
+  bool mergeIncremental(const Cloud &merged, MergeState *state, const Cloud &cloud, Progress *progress = nullptr);
+
   /// Reset previous results. Memory is retained.
   void clear();
 
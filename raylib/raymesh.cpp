@@ -10,7 +10,14 @@
 #include "raycloudwriter.h"
 #include "rayunused.h"
 
-#include <set>
+#include <atomic>
+
+// the triangle packet tests are also compiled for AVX2, which is chosen at run time when the processor supports it
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define RAYLIB_PACKET_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define RAYLIB_PACKET_TARGETS
+#endif
 
 namespace ray
 {
@@ -20,7 +27,7 @@ public:
   Eigen::Vector3d corners[3];
   Eigen::Vector3d normal;
   bool tested;
-  bool intersectsRay(const Eigen::Vector3d &ray_start, const Eigen::Vector3d &ray_end, double &depth)
+  bool intersectsRay(const Eigen::Vector3d &ray_start, const Eigen::Vector3d &ray_end, double &depth) const
   {
     // 1. plane test:
     double d1 = (ray_start - corners[0]).dot(normal);
@@ -40,31 +47,27 @@ public:
     }
     return true;
   }
-  double distSqrToPoint(const Eigen::Vector3d &point)
+  double distSqrToPoint(const Eigen::Vector3d &point) const
   {
     Eigen::Vector3d pos = point - normal * (point - corners[0]).dot(normal);
-    bool outs[3];
-    double ds[3];
-    Eigen::Vector3d sides[3];
+    bool outside = false;
+    for (int i = 0; i < 3; i++)
+    {
+      Eigen::Vector3d side = (corners[(i + 1) % 3] - corners[i]).cross(normal);
+      if ((pos - corners[i]).dot(side) > 0.0)
+        outside = true;
+    }
+    if (!outside)
+      return (point - pos).squaredNorm();
+    // outside the triangle, so the closest point is on one of its edges
+    double min_dist_sqr = std::numeric_limits<double>::max();
     for (int i = 0; i < 3; i++)
     {
-      sides[i] = (corners[(i + 1) % 3] - corners[i]).cross(normal);
-      ds[i] = (pos - corners[i]).dot(sides[i]);
-      outs[i] = ds[i] > 0.0;
-    }
-    if (outs[0] && outs[1])
-      pos = corners[1];
-    else if (outs[1] && outs[2])
-      pos = corners[2];
-    else if (outs[2] && outs[0])
-      pos = corners[0];
-    else if (outs[0])
-      pos -= sides[0] * ds[0] / sides[0].squaredNorm();
-    else if (outs[1])
-      pos -= sides[1] * ds[1] / sides[1].squaredNorm();
-    else if (outs[2])
-      pos -= sides[2] * ds[2] / sides[2].squaredNorm();
-    return (point - pos).squaredNorm();
+      Eigen::Vector3d edge = corners[(i + 1) % 3] - corners[i];
+      double t = clamped((point - corners[i]).dot(edge) / std::max(edge.squaredNorm(), 1e-20), 0.0, 1.0);
+      min_dist_sqr = std::min(min_dist_sqr, (point - (corners[i] + edge * t)).squaredNorm());
+    }
+    return min_dist_sqr;
   }
   bool intersectsCube(const Eigen::Vector3d &cube_min, double cube_width)
   {
@@ -75,25 +78,578 @@ public:
   }
 };
 
+namespace
+{
+const int kCompactBlockSize = 1 << 16;
+
+/// lower @c value to @c x, if it is larger
+inline void atomicMin(std::atomic<int> &value, int x)
+{
+  int current = value.load();
+  while (x < current && !value.compare_exchange_weak(current, x))
+  {
+  }
+}
+
+/// compacting a list in parallel: the start in the compacted list of each block of kCompactBlockSize items, given
+/// the number of its entries that @c count(item) keeps for each of the @c num_items. The last element is the total
+template <class Count>
+std::vector<int> compactedBlockStarts(int num_items, Count count)
+{
+  const int num_blocks = (num_items + kCompactBlockSize - 1) / kCompactBlockSize;
+  std::vector<int> block_starts(num_blocks + 1, 0);
+  #pragma omp parallel for
+  for (int block = 0; block < num_blocks; block++)
+  {
+    int total = 0;
+    for (int i = block * kCompactBlockSize; i < std::min(num_items, (block + 1) * kCompactBlockSize); i++)
+    {
+      total += count(i);
+    }
+    block_starts[block + 1] = total;
+  }
+  for (int block = 0; block < num_blocks; block++) block_starts[block + 1] += block_starts[block];
+  return block_starts;
+}
+
+/// A packet of triangles in structure-of-arrays form, so that the same test on all of its lanes vectorises.
+/// The tests repeat the arithmetic of the Triangle tests exactly, so give identical results. They return a bit
+/// mask of the lanes, which callers should combine with the lanes() mask, as unused lanes give arbitrary results
+struct TrianglePacket
+{
+  static const int kSize = 8;
+  double corners[3][3][kSize];  // [corner][axis][lane]
+  double normal[3][kSize];
+  double sides[3][3][kSize];
+  double bounds[4][kSize];  // horizontal bounds, min x,y then max x,y
+  double packet_bounds[4];  // the horizontal bounds of all the lanes
+
+  TrianglePacket()
+  {
+    for (int j = 0; j < kSize; j++)
+    {
+      for (int i = 0; i < 3; i++)
+      {
+        for (int k = 0; k < 3; k++)
+        {
+          corners[i][k][j] = sides[i][k][j] = 0.0;
+        }
+        normal[i][j] = 0.0;
+      }
+      bounds[0][j] = bounds[1][j] = std::numeric_limits<double>::max();
+      bounds[2][j] = bounds[3][j] = std::numeric_limits<double>::lowest();
+    }
+    packet_bounds[0] = packet_bounds[1] = std::numeric_limits<double>::max();
+    packet_bounds[2] = packet_bounds[3] = std::numeric_limits<double>::lowest();
+  }
+  void set(int lane, const Triangle &tri, const Eigen::Vector4d &bound)
+  {
+    for (int i = 0; i < 3; i++)
+    {
+      const Eigen::Vector3d side = (tri.corners[(i + 1) % 3] - tri.corners[i]).cross(tri.normal);
+      for (int k = 0; k < 3; k++)
+      {
+        corners[i][k][lane] = tri.corners[i][k];
+        sides[i][k][lane] = side[k];
+      }
+      normal[i][lane] = tri.normal[i];
+    }
+    for (int k = 0; k < 4; k++)
+    {
+      bounds[k][lane] = bound[k];
+    }
+    for (int k = 0; k < 2; k++)
+    {
+      packet_bounds[k] = std::min(packet_bounds[k], bound[k]);
+      packet_bounds[k + 2] = std::max(packet_bounds[k + 2], bound[k + 2]);
+    }
+  }
+
+  /// whether the horizontal bounds of any lane overlap the rectangle @c pos_min,pos_max
+  bool overlaps(const Eigen::Vector2d &pos_min, const Eigen::Vector2d &pos_max) const
+  {
+    return !(pos_max[0] < packet_bounds[0] || pos_max[1] < packet_bounds[1] || pos_min[0] > packet_bounds[2] ||
+             pos_min[1] > packet_bounds[3]);
+  }
+
+  /// bit mask of the used lanes whose horizontal bounds overlap the rectangle @c pos_min,pos_max
+  RAYLIB_PACKET_TARGETS
+  int lanes(const Eigen::Vector2d &pos_min, const Eigen::Vector2d &pos_max) const
+  {
+    int hits[kSize];
+    for (int j = 0; j < kSize; j++)
+    {
+      hits[j] = !((pos_max[0] < bounds[0][j]) | (pos_max[1] < bounds[1][j]) | (pos_min[0] > bounds[2][j]) |
+                  (pos_min[1] > bounds[3][j]));
+    }
+    return laneMask(hits);
+  }
+
+  /// bit mask of the lanes which the ray from @c ray_start to @c ray_end intersects, with the intersection
+  /// @c depths along the ray, as in Triangle::intersectsRay
+  RAYLIB_PACKET_TARGETS
+  int intersectsRay(const Eigen::Vector3d &ray_start, const Eigen::Vector3d &ray_end, double *depths) const
+  {
+    const double dir[3] = { ray_end[0] - ray_start[0], ray_end[1] - ray_start[1], ray_end[2] - ray_start[2] };
+    int hits[kSize];
+    double lane_depths[kSize];
+    for (int j = 0; j < kSize; j++)
+    {
+      const double d1 = (ray_start[0] - corners[0][0][j]) * normal[0][j] +
+                        (ray_start[1] - corners[0][1][j]) * normal[1][j] +
+                        (ray_start[2] - corners[0][2][j]) * normal[2][j];
+      const double d2 = (ray_end[0] - corners[0][0][j]) * normal[0][j] +
+                        (ray_end[1] - corners[0][1][j]) * normal[1][j] + (ray_end[2] - corners[0][2][j]) * normal[2][j];
+      const double depth = d1 / (d1 - d2);
+      lane_depths[j] = depth;
+      const double contact[3] = { ray_start[0] + dir[0] * depth, ray_start[1] + dir[1] * depth,
+                                  ray_start[2] + dir[2] * depth };
+      int hit = !(d1 * d2 > 0.0);
+      for (int i = 0; i < 3; i++)
+      {
+        hit &= !((contact[0] - corners[i][0][j]) * sides[i][0][j] + (contact[1] - corners[i][1][j]) * sides[i][1][j] +
+                   (contact[2] - corners[i][2][j]) * sides[i][2][j] >=
+                 0.0);
+      }
+      hits[j] = hit;
+    }
+    for (int j = 0; j < kSize; j++)
+    {
+      depths[j] = lane_depths[j];
+    }
+    return laneMask(hits);
+  }
+
+  /// bit mask of the lanes which are closer than squared distance @c dist_sqr to @c point, as in
+  /// Triangle::distSqrToPoint
+  RAYLIB_PACKET_TARGETS
+  int closerThan(const Eigen::Vector3d &point, double dist_sqr) const
+  {
+    // the distance to the closest point on the edges, used when the point is not over the triangle
+    double edge_dist_sqr[kSize];
+    for (int j = 0; j < kSize; j++)
+    {
+      edge_dist_sqr[j] = std::numeric_limits<double>::max();
+    }
+    for (int i = 0; i < 3; i++)
+    {
+      const int i2 = (i + 1) % 3;
+      // the closest point's position along the edge, in a separate loop, as clamping within the distance loop
+      // prevents its vectorisation
+      double ts[kSize];
+      for (int j = 0; j < kSize; j++)
+      {
+        const double edge[3] = { corners[i2][0][j] - corners[i][0][j], corners[i2][1][j] - corners[i][1][j],
+                                 corners[i2][2][j] - corners[i][2][j] };
+        const double along = (point[0] - corners[i][0][j]) * edge[0] + (point[1] - corners[i][1][j]) * edge[1] +
+                             (point[2] - corners[i][2][j]) * edge[2];
+        const double length_sqr = edge[0] * edge[0] + edge[1] * edge[1] + edge[2] * edge[2];
+        ts[j] = clamped(along / std::max(length_sqr, 1e-20), 0.0, 1.0);
+      }
+      for (int j = 0; j < kSize; j++)
+      {
+        const double diff[3] = { point[0] - (corners[i][0][j] + (corners[i2][0][j] - corners[i][0][j]) * ts[j]),
+                                 point[1] - (corners[i][1][j] + (corners[i2][1][j] - corners[i][1][j]) * ts[j]),
+                                 point[2] - (corners[i][2][j] + (corners[i2][2][j] - corners[i][2][j]) * ts[j]) };
+        edge_dist_sqr[j] = std::min(edge_dist_sqr[j], diff[0] * diff[0] + diff[1] * diff[1] + diff[2] * diff[2]);
+      }
+    }
+    int hits[kSize];
+    for (int j = 0; j < kSize; j++)
+    {
+      // the distance to the plane, used when the point is over the triangle
+      const double d = (point[0] - corners[0][0][j]) * normal[0][j] + (point[1] - corners[0][1][j]) * normal[1][j] +
+                       (point[2] - corners[0][2][j]) * normal[2][j];
+      const double pos[3] = { point[0] - normal[0][j] * d, point[1] - normal[1][j] * d, point[2] - normal[2][j] * d };
+      int outside = 0;
+      for (int i = 0; i < 3; i++)
+      {
+        outside |= (pos[0] - corners[i][0][j]) * sides[i][0][j] + (pos[1] - corners[i][1][j]) * sides[i][1][j] +
+                     (pos[2] - corners[i][2][j]) * sides[i][2][j] >
+                   0.0;
+      }
+      const double plane_dist_sqr = (point[0] - pos[0]) * (point[0] - pos[0]) +
+                                    (point[1] - pos[1]) * (point[1] - pos[1]) + (point[2] - pos[2]) * (point[2] - pos[2]);
+      hits[j] = (outside & (edge_dist_sqr[j] < dist_sqr)) | (!outside & (plane_dist_sqr < dist_sqr));
+    }
+    return laneMask(hits);
+  }
+
+private:
+  static int laneMask(const int *hits)
+  {
+    int mask = 0;
+    for (int j = 0; j < kSize; j++)
+    {
+      mask |= hits[j] << j;
+    }
+    return mask;
+  }
+};
+
+/// the number of set bits in a lane mask
+inline int popCount(int mask)
+{
+  int count = 0;
+  for (; mask != 0; mask &= mask - 1) count++;
+  return count;
+}
+
+/// A 2D index of triangles over the horizontal plane, for vertical ray and nearby triangle queries.
+/// Each cell stores (in compressed row form) the triangles whose horizontal bounds overlap it, so a query
+/// visits each triangle at most once per cell and needs no de-duplication
+class TriangleIndex2D
+{
+public:
+  TriangleIndex2D(const std::vector<Triangle> &triangles, const Eigen::Vector3d &box_min,
+                  const Eigen::Vector3d &box_max, double width)
+    : min_bound_(box_min[0], box_min[1])
+    , width_(width)
+  {
+    dims_[0] = std::max(1, (int)std::ceil((box_max[0] - box_min[0]) / width_));
+    dims_[1] = std::max(1, (int)std::ceil((box_max[1] - box_min[1]) / width_));
+    bounds_.resize(triangles.size());
+    #pragma omp parallel for
+    for (int i = 0; i < (int)triangles.size(); i++)
+    {
+      const Triangle &tri = triangles[i];
+      Eigen::Vector3d tri_min = minVector(tri.corners[0], minVector(tri.corners[1], tri.corners[2]));
+      Eigen::Vector3d tri_max = maxVector(tri.corners[0], maxVector(tri.corners[1], tri.corners[2]));
+      bounds_[i] << tri_min[0], tri_min[1], tri_max[0], tri_max[1];
+    }
+    // count the triangles per cell, then fill them in order, so the cell lists are deterministic
+    offsets_.assign((size_t)dims_[0] * dims_[1] + 1, 0);
+    for (int pass = 0; pass < 2; pass++)
+    {
+      if (pass == 1)
+      {
+        for (size_t i = 1; i < offsets_.size(); i++) offsets_[i] += offsets_[i - 1];
+        ids_.resize(offsets_.back());
+      }
+      std::vector<int> heads(offsets_.begin(), offsets_.end() - 1);
+      for (int i = 0; i < (int)triangles.size(); i++)
+      {
+        Eigen::Vector2i minI, maxI;
+        cellRange(bounds_[i].head<2>(), bounds_[i].tail<2>(), minI, maxI);
+        for (int x = minI[0]; x <= maxI[0]; x++)
+        {
+          for (int y = minI[1]; y <= maxI[1]; y++)
+          {
+            const size_t cell = (size_t)x + (size_t)dims_[0] * y;
+            if (pass == 0)
+              offsets_[cell + 1]++;
+            else
+              ids_[heads[cell]++] = i;
+          }
+        }
+      }
+    }
+  }
+
+  /// a cell width that keeps several triangles per cell, to fill their packets, yet bounds the number of cells to the
+  /// number of triangles
+  static double cellWidth(const std::vector<Triangle> &triangles, const Eigen::Vector3d &box_min,
+                          const Eigen::Vector3d &box_max)
+  {
+    double mean_size = 0.0;
+    for (const auto &tri : triangles)
+    {
+      Eigen::Vector3d extent = maxVector(tri.corners[0], maxVector(tri.corners[1], tri.corners[2])) -
+                               minVector(tri.corners[0], minVector(tri.corners[1], tri.corners[2]));
+      mean_size += std::max(extent[0], extent[1]);
+    }
+    mean_size /= (double)std::max((size_t)1, triangles.size());
+    const double area = (box_max[0] - box_min[0]) * (box_max[1] - box_min[1]);
+    const double min_width = std::sqrt(area / (double)std::max((size_t)1, triangles.size()));
+    const double width = std::max(4.0 * mean_size, min_width);
+    return width > 0.0 ? width : 1.0;
+  }
+
+  /// call @c func(triangle_id) for every triangle overlapping cell @c x,y, in increasing id order
+  template <class Func>
+  void forEachCellTriangle(int x, int y, Func func) const
+  {
+    const size_t cell = (size_t)x + (size_t)dims_[0] * y;
+    for (int j = offsets_[cell]; j < offsets_[cell + 1]; j++)
+    {
+      func(ids_[j]);
+    }
+  }
+
+  /// store each cell's triangles as packets too, in the same order, for the vectorised tests of forEachPacket
+  void buildPackets(const std::vector<Triangle> &triangles)
+  {
+    packet_offsets_.resize(offsets_.size());
+    packet_offsets_[0] = 0;
+    for (size_t cell = 0; cell < offsets_.size() - 1; cell++)
+    {
+      const int count = offsets_[cell + 1] - offsets_[cell];
+      packet_offsets_[cell + 1] = packet_offsets_[cell] + (count + TrianglePacket::kSize - 1) / TrianglePacket::kSize;
+    }
+    packets_.resize(packet_offsets_.back());
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int cell = 0; cell < (int)offsets_.size() - 1; cell++)
+    {
+      for (int j = offsets_[cell]; j < offsets_[cell + 1]; j++)
+      {
+        const int k = j - offsets_[cell];
+        packets_[packet_offsets_[cell] + k / TrianglePacket::kSize].set(k % TrianglePacket::kSize,
+                                                                        triangles[ids_[j]], bounds_[ids_[j]]);
+      }
+    }
+  }
+
+  /// call @c func(packet) for the packets overlapping the rectangle @c pos_min,pos_max, in the cells that it
+  /// overlaps. A triangle is reported once per cell that it overlaps, and the packets' lanes are not culled by their
+  /// bounds, see TrianglePacket::lanes. Requires buildPackets
+  template <class Func>
+  void forEachPacket(const Eigen::Vector2d &pos_min, const Eigen::Vector2d &pos_max, Func func) const
+  {
+    Eigen::Vector2i minI, maxI;
+    cellRange(pos_min, pos_max, minI, maxI);
+    for (int x = minI[0]; x <= maxI[0]; x++)
+    {
+      for (int y = minI[1]; y <= maxI[1]; y++)
+      {
+        const size_t cell = (size_t)x + (size_t)dims_[0] * y;
+        for (int j = packet_offsets_[cell]; j < packet_offsets_[cell + 1]; j++)
+        {
+          if (packets_[j].overlaps(pos_min, pos_max))
+            func(packets_[j]);
+        }
+      }
+    }
+  }
+
+  const Eigen::Vector2i &dims() const { return dims_; }
+
+private:
+  inline int cellCoord(double pos, int axis) const
+  {
+    return clamped((int)std::floor((pos - min_bound_[axis]) / width_), 0, dims_[axis] - 1);
+  }
+  // the clamped range of cells covering the rectangle. Empty when the rectangle is outside the index
+  void cellRange(const Eigen::Vector2d &pos_min, const Eigen::Vector2d &pos_max, Eigen::Vector2i &minI,
+                 Eigen::Vector2i &maxI) const
+  {
+    for (int axis = 0; axis < 2; axis++)
+    {
+      minI[axis] = cellCoord(pos_min[axis], axis);
+      maxI[axis] = cellCoord(pos_max[axis], axis);
+      if (pos_max[axis] < min_bound_[axis] || pos_min[axis] > min_bound_[axis] + width_ * dims_[axis])
+      {
+        minI[axis] = 0;
+        maxI[axis] = -1;
+      }
+    }
+  }
+
+  Eigen::Vector2d min_bound_;
+  double width_;
+  Eigen::Vector2i dims_;
+  std::vector<Eigen::Vector4d, Eigen::aligned_allocator<Eigen::Vector4d>> bounds_;  // min x,y then max x,y
+  std::vector<int> offsets_;  // start of each cell's triangle list in ids_
+  std::vector<int> ids_;
+  std::vector<int> packet_offsets_;  // start of each cell's packets in packets_
+  std::vector<TrianglePacket> packets_;
+};
+}  // namespace
+
 // remove additional points that are not connected to the mesh
 void Mesh::reduce()
 {
-  std::vector<Eigen::Vector3d> verts;
+  const int num_triangles = (int)index_list_.size();
+  // the position in the index list at which each vertex is first used
+  std::vector<std::atomic<int>> first_uses(vertices_.size());
+  #pragma omp parallel for
+  for (int i = 0; i < (int)vertices_.size(); i++)
+  {
+    first_uses[i] = std::numeric_limits<int>::max();
+  }
+  #pragma omp parallel for
+  for (int t = 0; t < num_triangles; t++)
+  {
+    for (int i = 0; i < 3; i++)
+    {
+      atomicMin(first_uses[index_list_[t][i]], 3 * t + i);
+    }
+  }
+  // the vertices keep the order in which the triangles first use them, as in a serial pass over the index list
+  auto is_first_use = [&](int t, int i) { return first_uses[index_list_[t][i]] == 3 * t + i; };
+  const std::vector<int> block_starts = compactedBlockStarts(num_triangles, [&](int t) {
+    return (int)is_first_use(t, 0) + (int)is_first_use(t, 1) + (int)is_first_use(t, 2);
+  });
+  const bool has_colours = colours_.size() == vertices_.size();
+  std::vector<Eigen::Vector3d> vertices(block_starts.back());
+  std::vector<RGBA> colours(has_colours ? vertices.size() : 0);
   std::vector<int> new_ids(vertices_.size(), -1);
-  // we do this by iterating the index list, and only adding the vertices that are in these triangles
-  for (auto &ind : index_list_)
+  #pragma omp parallel for
+  for (int block = 0; block < (int)block_starts.size() - 1; block++)
+  {
+    int new_id = block_starts[block];
+    for (int t = block * kCompactBlockSize; t < std::min(num_triangles, (block + 1) * kCompactBlockSize); t++)
+    {
+      for (int i = 0; i < 3; i++)
+      {
+        if (!is_first_use(t, i))
+          continue;
+        const int id = index_list_[t][i];
+        new_ids[id] = new_id;
+        vertices[new_id] = vertices_[id];
+        if (has_colours)
+          colours[new_id] = colours_[id];
+        new_id++;
+      }
+    }
+  }
+  #pragma omp parallel for
+  for (int t = 0; t < num_triangles; t++)
+  {
+    for (int i = 0; i < 3; i++)
+    {
+      index_list_[t][i] = new_ids[index_list_[t][i]];
+    }
+  }
+  vertices_.swap(vertices);
+  if (has_colours)
+    colours_.swap(colours);
+}
+
+void Mesh::weld(double epsilon)
+{
+  const int num_vertices = (int)vertices_.size();
+  if (num_vertices == 0)
+    return;
+  Eigen::Vector3d box_min = vertices_[0], box_max = vertices_[0];
+  for (const auto &vertex : vertices_)
+  {
+    box_min = minVector(box_min, vertex);
+    box_max = maxVector(box_max, vertex);
+  }
+  // hash the vertices into cells at least epsilon wide, so that any vertex within epsilon of another is in its cell or
+  // a neighbouring one. Larger cells for sparse vertices keep the number of occupied cells near the number of vertices
+  double width = std::max(epsilon, (box_max - box_min).maxCoeff() / std::sqrt((double)num_vertices));
+  if (!(width > 0.0))
+    width = 1.0;
+  std::vector<Eigen::Vector3i> cells(num_vertices);
+  // and the neighbouring cells (-1, 0 or 1 per axis) that are within epsilon of each vertex
+  std::vector<Eigen::Vector3i> neighbours_min(num_vertices), neighbours_max(num_vertices);
+  const double border = epsilon / width;
+  #pragma omp parallel for
+  for (int i = 0; i < num_vertices; i++)
+  {
+    const Eigen::Vector3d pos = (vertices_[i] - box_min) / width;
+    for (int j = 0; j < 3; j++)
+    {
+      cells[i][j] = (int)std::floor(pos[j]);
+      const double frac = pos[j] - (double)cells[i][j];
+      neighbours_min[i][j] = frac < border ? -1 : 0;
+      neighbours_max[i][j] = frac > 1.0 - border ? 1 : 0;
+    }
+  }
+  int num_buckets = 1;
+  while (num_buckets < num_vertices) num_buckets *= 2;
+  auto bucket_of = [num_buckets](const Eigen::Vector3i &cell) {
+    const unsigned int hash = ((unsigned int)cell[0] * 73856093u) ^ ((unsigned int)cell[1] * 19349663u) ^
+                              ((unsigned int)cell[2] * 83492791u);
+    return (int)(hash & (unsigned int)(num_buckets - 1));
+  };
+  std::vector<int> offsets(num_buckets + 1, 0);
+  #pragma omp parallel for
+  for (int i = 0; i < num_vertices; i++)
+  {
+    const int bucket = bucket_of(cells[i]);
+    #pragma omp atomic
+    offsets[bucket + 1]++;
+  }
+  for (int i = 0; i < num_buckets; i++) offsets[i + 1] += offsets[i];
+  std::vector<int> heads(offsets.begin(), offsets.end() - 1);
+  std::vector<int> ids(num_vertices);
+  #pragma omp parallel for
+  for (int i = 0; i < num_vertices; i++)
+  {
+    const int bucket = bucket_of(cells[i]);
+    int head;
+    #pragma omp atomic capture
+    head = heads[bucket]++;
+    ids[head] = i;
+  }
+
+  // each vertex links to the lowest id vertex within epsilon, so following the links reaches the vertex that the
+  // group is welded to. The order within the buckets does not affect this, so the result is deterministic
+  std::vector<int> links(num_vertices);
+  const double epsilon_sqr = epsilon * epsilon;
+  #pragma omp parallel for
+  for (int i = 0; i < num_vertices; i++)
+  {
+    int link = i;
+    for (int x = neighbours_min[i][0]; x <= neighbours_max[i][0]; x++)
+    {
+      for (int y = neighbours_min[i][1]; y <= neighbours_max[i][1]; y++)
+      {
+        for (int z = neighbours_min[i][2]; z <= neighbours_max[i][2]; z++)
+        {
+          const int bucket = bucket_of(cells[i] + Eigen::Vector3i(x, y, z));
+          for (int j = offsets[bucket]; j < offsets[bucket + 1]; j++)
+          {
+            const int id = ids[j];
+            if (id < link && (vertices_[id] - vertices_[i]).squaredNorm() <= epsilon_sqr)
+              link = id;
+          }
+        }
+      }
+    }
+    links[i] = link;
+  }
+  std::vector<int> welded_ids(num_vertices);
+  #pragma omp parallel for
+  for (int i = 0; i < num_vertices; i++)
+  {
+    int id = links[i];
+    while (links[id] != id) id = links[id];
+    welded_ids[i] = id;
+  }
+
+  // remap the triangles, and remove any that collapse, along with their uvs
+  const int num_triangles = (int)index_list_.size();
+  #pragma omp parallel for
+  for (int t = 0; t < num_triangles; t++)
   {
     for (int i = 0; i < 3; i++)
     {
-      if (new_ids[ind[i]] == -1)
+      index_list_[t][i] = welded_ids[index_list_[t][i]];
+    }
+  }
+  auto is_kept = [&](int t) {
+    const Eigen::Vector3i &tri = index_list_[t];
+    return tri[0] != tri[1] && tri[1] != tri[2] && tri[2] != tri[0];
+  };
+  const std::vector<int> block_starts = compactedBlockStarts(num_triangles, [&](int t) { return (int)is_kept(t); });
+  if (block_starts.back() < num_triangles)
+  {
+    const bool has_uvs = uv_list_.size() == index_list_.size();
+    std::vector<Eigen::Vector3i> index_list(block_starts.back());
+    std::vector<Eigen::Vector3cf> uv_list(has_uvs ? index_list.size() : 0);
+    #pragma omp parallel for
+    for (int block = 0; block < (int)block_starts.size() - 1; block++)
+    {
+      int new_t = block_starts[block];
+      for (int t = block * kCompactBlockSize; t < std::min(num_triangles, (block + 1) * kCompactBlockSize); t++)
       {
-        new_ids[ind[i]] = (int)verts.size();
-        verts.push_back(vertices_[ind[i]]);
+        if (!is_kept(t))
+          continue;
+        index_list[new_t] = index_list_[t];
+        if (has_uvs)
+          uv_list[new_t] = uv_list_[t];
+        new_t++;
       }
-      ind[i] = new_ids[ind[i]];
     }
+    index_list_.swap(index_list);
+    if (has_uvs)
+      uv_list_.swap(uv_list);
   }
-  vertices_ = verts;
+  // lastly remove the vertices that have been welded to others
+  reduce();
 }
 
 // convert the mesh to a height field
@@ -101,7 +657,6 @@ void Mesh::toHeightField(Eigen::ArrayXXd &field, const Eigen::Vector3d &box_min,
                          double width, bool fill_gaps) const
 {
   double top = box_max[2];
-  box_max[2] = box_min[2] + 0.5 * width;  // ensure that the grid is only 1 voxel high
   // first convert the mesh to a list of triangles, with calculated normals
   if (index_list_.empty())
   {
@@ -119,59 +674,68 @@ void Mesh::toHeightField(Eigen::ArrayXXd &field, const Eigen::Vector3d &box_min,
     tri.normal = (tri.corners[1] - tri.corners[0]).cross(tri.corners[2] - tri.corners[0]);
   }
 
-  // put the triangles into a grid
-  Grid<Triangle *> grid(box_min, box_max, width);
-  for (auto &tri : triangles)
-  {
-    Eigen::Vector3d tri_min = (minVector(tri.corners[0], minVector(tri.corners[1], tri.corners[2])) - box_min) / width;
-    Eigen::Vector3d tri_max = (maxVector(tri.corners[0], maxVector(tri.corners[1], tri.corners[2])) - box_min) / width;
-    for (int x = (int)tri_min[0]; x <= (int)tri_max[0]; x++)
-    {
-      for (int y = (int)tri_min[1]; y <= (int)tri_max[1]; y++) 
-      {
-        grid.insert(x, y, 0, &tri);
-      }
-    }
-  }
-  // now look up the triangle for each pixel centre
+  Eigen::Vector3d diff = (box_max - box_min) / width;
+  const Eigen::Vector2i dims((int)std::ceil(diff[0]), (int)std::ceil(diff[1]));
+
+  // bin the triangles into square tiles of pixels, which are then rasterised in parallel
+  const int tile_pixels = 32;
+  const TriangleIndex2D tiles(triangles, box_min, box_max, width * (double)tile_pixels);
   const double unset = std::numeric_limits<double>::lowest();
-  field = Eigen::ArrayXXd::Constant(grid.dims[0], grid.dims[1], unset);
-  std::cout << "dims for low: " << grid.dims.transpose() << ", rows: " << field.rows() << ", cols: " << field.cols()
+  field = Eigen::ArrayXXd::Constant(dims[0], dims[1], unset);
+  std::cout << "dims for low: " << dims.transpose() << ", rows: " << field.rows() << ", cols: " << field.cols()
             << std::endl;
   int num_heights = 0;
-  for (int x = 0; x < grid.dims[0]; x++)
+  #pragma omp parallel for schedule(dynamic) reduction(+:num_heights)
+  for (int t = 0; t < tiles.dims()[0] * tiles.dims()[1]; t++)
   {
-    for (int y = 0; y < grid.dims[1]; y++)
-    {
-      Eigen::Vector3d pos_top = box_min + width * (Eigen::Vector3d((double)x + 0.5, (double)y + 0.5, 0));
-      Eigen::Vector3d pos_base = pos_top;
-      pos_top[2] = top;
-      pos_base[2] = box_min[2];
-      auto &tris = grid.cell(x, y, 0).data;
-      // search the triangles in this cell 'bucket'
-      for (auto &tri : tris)
+    const int tx = t % tiles.dims()[0];
+    const int ty = t / tiles.dims()[0];
+    // pixel range of the tile, the last tiles also cover any pixels beyond the tile grid
+    Eigen::Vector2i tile_min(tx * tile_pixels, ty * tile_pixels);
+    Eigen::Vector2i tile_max(tx == tiles.dims()[0] - 1 ? dims[0] : std::min(dims[0], tile_min[0] + tile_pixels),
+                             ty == tiles.dims()[1] - 1 ? dims[1] : std::min(dims[1], tile_min[1] + tile_pixels));
+    // triangles are visited in id order, and only fill unset pixels, so each pixel takes the height of the first
+    // triangle that its centre ray intersects
+    tiles.forEachCellTriangle(tx, ty, [&](int id) {
+      const Triangle &tri = triangles[id];
+      Eigen::Vector3d tri_min = (minVector(tri.corners[0], minVector(tri.corners[1], tri.corners[2])) - box_min) / width;
+      Eigen::Vector3d tri_max = (maxVector(tri.corners[0], maxVector(tri.corners[1], tri.corners[2])) - box_min) / width;
+      // pixel centres within the triangle's bounds, with a small tolerance for rounding
+      const double eps = 1e-6;
+      const int x0 = std::max(tile_min[0], (int)std::ceil(tri_min[0] - 0.5 - eps));
+      const int x1 = std::min(tile_max[0] - 1, (int)std::floor(tri_max[0] - 0.5 + eps));
+      const int y0 = std::max(tile_min[1], (int)std::ceil(tri_min[1] - 0.5 - eps));
+      const int y1 = std::min(tile_max[1] - 1, (int)std::floor(tri_max[1] - 0.5 + eps));
+      for (int x = x0; x <= x1; x++)
       {
-        double depth;
-        if (tri->intersectsRay(pos_top, pos_base, depth))
+        for (int y = y0; y <= y1; y++)
         {
-          // intersects so interpolate the height
-          double height = pos_top[2] + (pos_base[2] - pos_top[2]) * depth;
-          field(x, y) = height;
-          num_heights++;
-          break;
+          if (field(x, y) != unset)
+            continue;
+          Eigen::Vector3d pos_top = box_min + width * (Eigen::Vector3d((double)x + 0.5, (double)y + 0.5, 0));
+          Eigen::Vector3d pos_base = pos_top;
+          pos_top[2] = top;
+          pos_base[2] = box_min[2];
+          double depth;
+          if (tri.intersectsRay(pos_top, pos_base, depth))
+          {
+            // intersects so interpolate the height
+            field(x, y) = pos_top[2] + (pos_base[2] - pos_top[2]) * depth;
+            num_heights++;
+          }
         }
       }
-    }
+    });
   }
   if (num_heights == 0) 
   {
     std::cout << "warning mesh does not intersect any pixel centres, using nearest triangle centre heights" << std::endl;
     for (auto &tri: triangles)
     {
-      Eigen::Vector3d centre = (tri.corners[0] + tri.corners[1] + tri.corners[3])/3.0;
+      Eigen::Vector3d centre = (tri.corners[0] + tri.corners[1] + tri.corners[2])/3.0;
       Eigen::Vector3d c = (centre - box_min) / width;
-      int X = std::max(0, std::min((int)std::floor(c[0]), grid.dims[0]-1)); // move to nearest inside grid
-      int Y = std::max(0, std::min((int)std::floor(c[0]), grid.dims[1]-1));
+      int X = std::max(0, std::min((int)std::floor(c[0]), dims[0]-1)); // move to nearest inside grid
+      int Y = std::max(0, std::min((int)std::floor(c[1]), dims[1]-1));
       field(X,Y) = centre[2];
       num_heights++;
     }
@@ -187,18 +751,18 @@ void Mesh::toHeightField(Eigen::ArrayXXd &field, const Eigen::Vector3d &box_min,
     while (gaps_remain)
     {
       gaps_remain = false;
-      for (int x = 0; x < grid.dims[0]; x++)
+      for (int x = 0; x < dims[0]; x++)
       {
-        for (int y = 0; y < grid.dims[1]; y++)
+        for (int y = 0; y < dims[1]; y++)
         {
           if (field(x, y) == unset)
           {
             double count = 0;
             double total_height = 0;
             // look at the Moore neighbourhood to obtain a mean neighbour height
-            for (int i = std::max(0, x - 1); i <= std::min(x + 1, grid.dims[0] - 1); i++)
+            for (int i = std::max(0, x - 1); i <= std::min(x + 1, dims[0] - 1); i++)
             {
-              for (int j = std::max(0, y - 1); j <= std::min(y + 1, grid.dims[1] - 1); j++)
+              for (int j = std::max(0, y - 1); j <= std::min(y + 1, dims[1] - 1); j++)
               {
                 if (field(i, j) != unset)
                 {
@@ -222,20 +786,6 @@ void Mesh::toHeightField(Eigen::ArrayXXd &field, const Eigen::Vector3d &box_min,
 
 bool Mesh::splitCloud(const std::string &cloud_name, double offset, const std::string &inside_name, const std::string &outside_name)
 {
-  // Firstly, find the average vertex normals
-  std::vector<Eigen::Vector3d> normals(vertices_.size());
-  for (auto &normal : normals) normal.setZero();
-  for (auto &index : index_list_)
-  {
-    Eigen::Vector3d normal =
-      (vertices_[index[1]] - vertices_[index[0]]).cross(vertices_[index[2]] - vertices_[index[0]]);
-    for (int i = 0; i < 3; i++) normals[index[i]] += normal;
-  }
-  for (auto &normal : normals) 
-  {
-    normal.normalize();
-  }
-
   // convert to separate triangles for convenience
   std::vector<Triangle> triangles(index_list_.size());
   double mx = std::numeric_limits<double>::max();
@@ -254,125 +804,63 @@ bool Mesh::splitCloud(const std::string &cloud_name, double offset, const std::s
     }
   }
 
-  // Thirdly, put the triangles into a grid
-  double voxel_width = 1.0;
-  Grid<Triangle *> grid(box_min, box_max, voxel_width);
-  Grid<Triangle *> expanded_triangle_grid;
+  // Secondly, index the triangles horizontally, since the inside test drops a vertical ray
+  TriangleIndex2D index(triangles, box_min, box_max, TriangleIndex2D::cellWidth(triangles, box_min, box_max));
+  index.buildPackets(triangles);
 
-  for (auto &tri : triangles)
-  {
-    Eigen::Vector3d tri_min =
-      (minVector(tri.corners[0], minVector(tri.corners[1], tri.corners[2])) - box_min) / voxel_width;
-    Eigen::Vector3d tri_max =
-      (maxVector(tri.corners[0], maxVector(tri.corners[1], tri.corners[2])) - box_min) / voxel_width;
-    for (int x = (int)tri_min[0]; x <= (int)tri_max[0]; x++)
-    {
-      for (int y = (int)tri_min[1]; y <= (int)tri_max[1]; y++)
-      {
-        for (int z = (int)tri_min[2]; z <= (int)tri_max[2]; z++)
-        {
-          grid.insert(x, y, z, &tri);
-        }
-      }
-    }
-  }
-  if (offset != 0.0)
-  {
-    // Thirdly, put the triangles into a grid
-    expanded_triangle_grid.init(box_min, box_max, voxel_width);
-    for (int i = 0; i < (int)index_list_.size(); i++)
-    {
-      if (!(i % 100000))
-        std::cout << "filling volumes " << i << "/" << index_list_.size() << std::endl;
-      Triangle &tri = triangles[i];
-      Eigen::Vector3d extruded_corners[3];
-      for (int j = 0; j < 3; j++) 
-      {
-        extruded_corners[j] = tri.corners[j] + normals[index_list_[i][j]] * offset;
-      }
-      Eigen::Vector3d tri_min = minVector(tri.corners[0], minVector(tri.corners[1], tri.corners[2]));
-      Eigen::Vector3d tri_max = maxVector(tri.corners[0], maxVector(tri.corners[1], tri.corners[2]));
-      Eigen::Vector3d tri_min2 = minVector(extruded_corners[0], minVector(extruded_corners[1], extruded_corners[2]));
-      Eigen::Vector3d tri_max2 = maxVector(extruded_corners[0], maxVector(extruded_corners[1], extruded_corners[2]));
-      tri_min = (minVector(tri_min, tri_min2) - box_min) / voxel_width;
-      tri_max = (maxVector(tri_max, tri_max2) - box_min) / voxel_width;
-      for (int x = (int)tri_min[0]; x <= (int)tri_max[0]; x++)
-      {
-        for (int y = (int)tri_min[1]; y <= (int)tri_max[1]; y++)
-        {
-          for (int z = (int)tri_min[2]; z <= (int)tri_max[2]; z++) 
-          {
-            expanded_triangle_grid.insert(x, y, z, &tri);
-          }
-        }
-      }
-    }
-  }
-  // Fourthly, drop each end point downwards to decide whether it is inside or outside..
+  // Thirdly, drop each end point downwards to decide whether it is inside or outside..
   CloudWriter in_cloud, out_cloud;
   in_cloud.begin(inside_name);
   out_cloud.begin(outside_name);
 
   // splitting performed per chunk
-  auto write_chunk = [&in_cloud, &out_cloud, &grid, &expanded_triangle_grid, &box_min, 
-                      &voxel_width, &offset](
+  std::vector<char> insides;
+  auto write_chunk = [&in_cloud, &out_cloud, &index, &offset, &insides](
                     std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                     std::vector<double> &times, std::vector<RGBA> &colours) 
   {
-    Cloud in_chunk, out_chunk;
+    insides.resize(ends.size());
+    const double abs_offset = std::abs(offset);
     #pragma omp parallel for
     for (int i = 0; i < (int)ends.size(); i++)
     {
+      // parity of the number of surfaces below the end point
       int intersections = 0;
-      Eigen::Vector3d start = (ends[i] - box_min) / voxel_width;
-      Eigen::Vector3i index(start.cast<int>());
-      std::set<Triangle *> tri_set;
-      for (int z = clamped(index[2], 0, grid.dims[2] - 1); z >= 0; --z)
-      {
-        auto &tris = grid.cell(index[0], index[1], z).data;
-        for (auto &tri : tris)
-        {
-          const auto &ret = tri_set.insert(tri); // downside: log n lookup, upside: allows parallelisation
-          if (ret.second == false) // already exists
-          {
-            continue;
-          }
-          double depth;
-          if (tri->intersectsRay(ends[i], ends[i] - Eigen::Vector3d(0.0, 0.0, 1e3), depth))
-          {
-            intersections++;
-          }
-        }
-      }
+      const Eigen::Vector2d pos(ends[i][0], ends[i][1]);
+      const Eigen::Vector3d ray_end = ends[i] - Eigen::Vector3d(0.0, 0.0, 1e3);
+      index.forEachPacket(pos, pos, [&](const TrianglePacket &packet) {
+        double depths[TrianglePacket::kSize];
+        intersections += popCount(packet.intersectsRay(ends[i], ray_end, depths) & packet.lanes(pos, pos));
+      });
       bool inside_val = offset >= 0.0;
       bool is_inside = !inside_val; // start off not inside
       if ((intersections % 2) == (int)inside_val)  // inside
       {
         bool in_tri = false;
-        if (offset != 0.0) // check if it is really inside...
+        if (offset != 0.0) // check if it is really inside, by its distance to the nearby triangles
         {
-          Eigen::Vector3d pos = (ends[i] - box_min) / voxel_width;
-          Eigen::Vector3i index(pos.cast<int>());
-          auto &tris = expanded_triangle_grid.cell(index[0], index[1], index[2]).data;
-          for (auto &tri : tris)
-          {
-            if (tri->distSqrToPoint(ends[i]) < offset*offset)
+          const Eigen::Vector2d radius(abs_offset, abs_offset);
+          const Eigen::Vector2d pos_min = pos - radius, pos_max = pos + radius;
+          index.forEachPacket(pos_min, pos_max, [&](const TrianglePacket &packet) {
+            if (!in_tri && (packet.closerThan(ends[i], offset*offset) & packet.lanes(pos_min, pos_max)) != 0)
             {
               in_tri = true;
-              break;
-            };
-          }
+            }
+          });
         }
         if (offset == 0.0 || !in_tri)
         {
           is_inside = inside_val;
         }
       }
-      Cloud &out = is_inside ? in_chunk : out_chunk;
-      #pragma omp critical
-      {
-        out.addRay(starts[i], ends[i], times[i], colours[i]);
-      }      
+      insides[i] = is_inside;
+    }
+    // distribute the rays serially, to keep the file order
+    Cloud in_chunk, out_chunk;
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      Cloud &out = insides[i] ? in_chunk : out_chunk;
+      out.addRay(starts[i], ends[i], times[i], colours[i]);
     }
     in_cloud.writeChunk(in_chunk);
     out_cloud.writeChunk(out_chunk);
@@ -46,9 +46,15 @@ public:
   /// These stats are arranged as the mean vertex location, then the standard deviation in each axis
   Eigen::Array<double, 6, 1> getMoments() const;
 
-  // remove surplus points that are not part of any triangles
+  /// remove surplus points that are not part of any triangles. The vertices keep the order in which the triangles
+  /// first use them, and per-vertex colours are kept with their vertices
   void reduce();
 
+  /// merge the vertices within @c epsilon of each other (or at the same position, for 0) into the lowest id one,
+  /// such as the shared vertices of concatenated meshes. Triangles that collapse are removed, with their uvs, and the
+  /// unused vertices removed as in reduce()
+  void weld(double epsilon = 0.0);
+
   void translate(const Eigen::Vector3d &offset)
   {
     for (auto &vert: vertices_)
@@ -0,0 +1,119 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raymeshwriter.h"
+#include "raymesh.h"
+#include "rayply.h"
+
+#include <cstdio>
+
+namespace ray
+{
+namespace
+{
+// the header's counts are padded to the most digits of any count, so that end() can rewrite the header in place
+const int count_width = std::numeric_limits<unsigned long>::digits10;
+}  // namespace
+
+bool MeshWriter::begin(const std::string &file_name, bool has_uvs, const std::string &texture_name, bool flip_normals)
+{
+  if (file_name.empty())
+  {
+    std::cerr << "Error: mesh writer begin called with empty file name" << std::endl;
+    return false;
+  }
+  file_name_ = file_name;
+  faces_file_name_ = file_name + ".faces.tmp";
+  num_vertices_ = num_faces_ = 0;
+  has_uvs_ = has_uvs;
+  flip_normals_ = flip_normals;
+  ofs_.open(file_name_, std::ios::binary | std::ios::out);
+  faces_ofs_.open(faces_file_name_, std::ios::binary | std::ios::out);
+  if (ofs_.fail() || faces_ofs_.fail())
+  {
+    std::cerr << "Error: cannot open " << file_name_ << " for writing." << std::endl;
+    ofs_.close();
+    faces_ofs_.close();
+    std::remove(faces_file_name_.c_str());
+    return false;
+  }
+  texture_name_ = texture_name;
+  // the same header as writePlyMesh, with placeholder counts
+  ofs_ << plyMeshHeader(0, 0, has_uvs_, texture_name_, count_width);
+  return true;
+}
+
+bool MeshWriter::writeChunk(const Mesh &chunk)
+{
+  if (!ofs_.is_open())
+  {
+    std::cerr << "Error: mesh writer chunk written before begin" << std::endl;
+    return false;
+  }
+  if (has_uvs_ && chunk.uvList().size() != chunk.indexList().size())
+  {
+    std::cerr << "Error: mesh chunk has " << chunk.uvList().size() << " uvs for " << chunk.indexList().size()
+              << " triangles" << std::endl;
+    return false;
+  }
+  // the vertices and faces, with the same row format as writePlyMesh. The faces index into the whole file's vertices
+  packPlyMeshVertices(chunk, 0, chunk.vertices().size(), buffer_);
+  ofs_.write(reinterpret_cast<const char *>(buffer_.data()), static_cast<std::streamsize>(buffer_.size()));
+  packPlyMeshFaces(chunk, 0, chunk.indexList().size(), static_cast<int>(num_vertices_), flip_normals_, has_uvs_,
+                   buffer_);
+  faces_ofs_.write(reinterpret_cast<const char *>(buffer_.data()), static_cast<std::streamsize>(buffer_.size()));
+  num_vertices_ += static_cast<unsigned long>(chunk.vertices().size());
+  num_faces_ += static_cast<unsigned long>(chunk.indexList().size());
+  return ofs_.good() && faces_ofs_.good();
+}
+
+bool MeshWriter::end()
+{
+  if (!ofs_.is_open())  // no effect if begin has not been called
+  {
+    return false;
+  }
+  // append the faces, a block at a time
+  faces_ofs_.close();
+  std::ifstream faces_ifs(faces_file_name_, std::ios::binary | std::ios::in);
+  buffer_.resize(1 << 20);
+  while (faces_ifs)
+  {
+    faces_ifs.read(reinterpret_cast<char *>(buffer_.data()), static_cast<std::streamsize>(buffer_.size()));
+    ofs_.write(reinterpret_cast<const char *>(buffer_.data()), faces_ifs.gcount());
+  }
+  faces_ifs.close();
+  std::remove(faces_file_name_.c_str());
+  std::vector<unsigned char>().swap(buffer_);
+
+  ofs_.seekp(0);
+  ofs_ << plyMeshHeader(num_vertices_, num_faces_, has_uvs_, texture_name_, count_width);
+  const bool success = ofs_.good();
+  ofs_.close();
+  if (!success)
+  {
+    std::cerr << "Error writing to file " << file_name_ << std::endl;
+    std::remove(file_name_.c_str());  // rather than leaving a partial mesh
+    return false;
+  }
+  std::cout << "saved " << file_name_ << ", " << num_vertices_ << " vertices, " << num_faces_ << " triangles."
+            << std::endl;
+  return true;
+}
+
+void MeshWriter::abort()
+{
+  if (!ofs_.is_open())
+  {
+    return;
+  }
+  faces_ofs_.close();
+  ofs_.close();
+  std::remove(faces_file_name_.c_str());
+  std::remove(file_name_.c_str());
+  std::vector<unsigned char>().swap(buffer_);
+}
+
+}  // namespace ray
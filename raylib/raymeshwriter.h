@@ -0,0 +1,62 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYMESHWRITER_H
+#define RAYLIB_RAYMESHWRITER_H
+
+#include "raylib/raylibconfig.h"
+#include "rayutils.h"
+
+namespace ray
+{
+class Mesh;
+
+/// This helper class is for writing a triangle mesh to a .ply file, one chunk at a time, so that large generated
+/// meshes need not be held in memory. The .ply format lists all the vertices before the faces, so the faces are
+/// buffered in a temporary file next to the output, and appended on end()
+class RAYLIB_EXPORT MeshWriter
+{
+public:
+  MeshWriter()
+    : num_vertices_(0)
+    , num_faces_(0)
+    , has_uvs_(false)
+    , flip_normals_(false)
+  {}
+
+  /// Open the file to write to. Set @c has_uvs when the chunks have per-face texture coordinates, for texture
+  /// @c texture_name. The triangle winding is reversed if @c flip_normals, as in @c writePlyMesh
+  bool begin(const std::string &file_name, bool has_uvs = false, const std::string &texture_name = "",
+             bool flip_normals = false);
+
+  /// write a mesh chunk to the file. The chunk's indexList() refers to its own vertices(), these are offset to follow
+  /// the vertices of the previous chunks. Missing colours are written grey, like @c writePlyMesh
+  bool writeChunk(const Mesh &chunk);
+
+  /// finish writing: append the buffered faces, and rewrite the header with the vertex and face counts. The file is
+  /// removed if this fails
+  bool end();
+
+  /// stop writing, and remove the partially written file. Used when a chunk fails to write or generate
+  void abort();
+
+  /// return the stored file name
+  const std::string &fileName() { return file_name_; }
+
+private:
+  std::ofstream ofs_;            // the output file, holding the header and vertices until end()
+  std::ofstream faces_ofs_;      // the temporary file of faces
+  std::string file_name_;        // output file name
+  std::string faces_file_name_;  // temporary faces file name
+  std::string texture_name_;
+  unsigned long num_vertices_, num_faces_;
+  bool has_uvs_;
+  bool flip_normals_;
+  std::vector<unsigned char> buffer_;  // reused between chunks to avoid repeated reallocations
+};
+
+}  // namespace ray
+
+#endif  // RAYLIB_RAYMESHWRITER_H
@@ -6,8 +6,10 @@
 #include "rayply.h"
 #include "raylib/rayprogress.h"
 #include "raylib/rayprogressthread.h"
+#include "rayfilebody.h"
 #include "raymesh.h"
 
+#include <cstring>
 #include <fstream>
 #include <iostream>
 // #define OUTPUT_MOMENTS // useful when setting up unit test expected ray clouds
@@ -730,118 +732,34 @@ bool writePlyMesh(const std::string &file_name, const Mesh &mesh, bool flip_norm
     return false;
   }
 
-#if RAYLIB_DOUBLE_RAYS
-  int row_size = 28;
-  struct Vert
-  {
-    Eigen::Vector3d pos;
-    ray::RGBA colour;
-  };
-#else 
-  int row_size = 16;
-  struct Vert
-  {
-    Eigen::Vector3f pos;
-    ray::RGBA colour;
-  };
-#endif 
-  std::vector<unsigned char> vertices(row_size * mesh.vertices().size());  // 4d to give space for colour
-  for (size_t i = 0; i < mesh.vertices().size(); i++)
-  {
-    Vert vert;
-#if RAYLIB_DOUBLE_RAYS
-    vert.pos = mesh.vertices()[i];
-#else
-    vert.pos = mesh.vertices()[i].cast<float>();
-#endif
-    vert.colour = mesh.colours().empty() ? ray::RGBA(127,127,127,255) : mesh.colours()[i];
-    memcpy(&vertices[row_size * i], &vert, row_size);
-  }
-
   FILE *fid = fopen(file_name.c_str(), "w+");
   if (!fid)
   {
     std::cerr << "error opening file " << file_name << " for writing." << std::endl;
     return false;
   }
-  fprintf(fid, "ply\n");
-  fprintf(fid, "format binary_little_endian 1.0\n");
-  fprintf(fid, "comment SDK generated\n");  // TODO: add version here
-  if (!mesh.uvList().empty())
-  {
-    std::string tex_name = mesh.textureName() == "" ? "wood_texture.png" : mesh.textureName();
-    fprintf(fid, "comment TextureFile %s\n", tex_name.c_str()); 
-  }
-  fprintf(fid, "element vertex %u\n", unsigned(mesh.vertices().size()));
-#if RAYLIB_DOUBLE_RAYS
-  fprintf(fid, "property double x\n");
-  fprintf(fid, "property double y\n");
-  fprintf(fid, "property double z\n");
-#else
-  fprintf(fid, "property float x\n");
-  fprintf(fid, "property float y\n");
-  fprintf(fid, "property float z\n");
-#endif
-  fprintf(fid, "property uchar red\n");
-  fprintf(fid, "property uchar green\n");
-  fprintf(fid, "property uchar blue\n");
-  fprintf(fid, "property uchar alpha\n");
-  fprintf(fid, "element face %u\n", (unsigned)mesh.indexList().size());
-  fprintf(fid, "property list int int vertex_indices\n");
-  if (!mesh.uvList().empty())
-  {
-    fprintf(fid, "property list int float texcoord\n");
-    fprintf(fid, "property int texnumber\n");
-  }
-  fprintf(fid, "end_header\n");
+  const bool has_uvs = !mesh.uvList().empty();
+  const std::string header =
+    plyMeshHeader(mesh.vertices().size(), mesh.indexList().size(), has_uvs, mesh.textureName());
+  bool success = fwrite(header.data(), 1, header.size(), fid) == header.size();
 
-  fwrite(&vertices[0], sizeof(unsigned char), vertices.size(), fid);
-
-  auto &list = mesh.indexList();
-  size_t written;
-  if (mesh.uvList().empty())
+  // the rows are converted and written a block at a time, rather than copying the whole mesh into a buffer first
+  const size_t block_size = 1 << 16;
+  std::vector<unsigned char> buffer;
+  for (size_t first = 0; first < mesh.vertices().size() && success; first += block_size)
   {
-    std::vector<Eigen::Vector4i> triangles(mesh.indexList().size());
-    if (flip_normals)
-      for (size_t i = 0; i < list.size(); i++) triangles[i] = Eigen::Vector4i(3, list[i][2], list[i][1], list[i][0]);
-    else
-      for (size_t i = 0; i < list.size(); i++) triangles[i] = Eigen::Vector4i(3, list[i][0], list[i][1], list[i][2]);
-    written = fwrite(&triangles[0], sizeof(Eigen::Vector4i), triangles.size(), fid);
+    packPlyMeshVertices(mesh, first, std::min(block_size, mesh.vertices().size() - first), buffer);
+    success = fwrite(buffer.data(), 1, buffer.size(), fid) == buffer.size();
   }
-  else
+  for (size_t first = 0; first < mesh.indexList().size() && success; first += block_size)
   {
-    struct Face
-    {
-      int num_corners;
-      Eigen::Vector3i ids;
-      int num_coords;
-      float uvs[6];
-      int texnumber;
-    };
-    auto &uvs = mesh.uvList();
-    std::vector<Face> faces(uvs.size());
-    for (size_t i = 0; i < list.size(); i++) 
-    {
-      faces[i].num_corners = 3;
-      if (flip_normals)
-        faces[i].ids = Eigen::Vector3i(list[i][2], list[i][1], list[i][0]);
-      else
-        faces[i].ids = Eigen::Vector3i(list[i][0], list[i][1], list[i][2]);
-      
-      faces[i].num_coords = 6;
-      faces[i].uvs[0] = uvs[i][0].real();
-      faces[i].uvs[1] = uvs[i][0].imag();
-      faces[i].uvs[2] = uvs[i][1].real();
-      faces[i].uvs[3] = uvs[i][1].imag();
-      faces[i].uvs[4] = uvs[i][2].real();
-      faces[i].uvs[5] = uvs[i][2].imag();
-      faces[i].texnumber = 0;
-    }
-    written = fwrite(&faces[0], sizeof(Face), faces.size(), fid);
+    packPlyMeshFaces(mesh, first, std::min(block_size, mesh.indexList().size() - first), 0, flip_normals, has_uvs,
+                     buffer);
+    success = fwrite(buffer.data(), 1, buffer.size(), fid) == buffer.size();
   }
 
   fclose(fid);
-  if (written == 0)
+  if (!success)
   {
     std::cerr << "Error writing to file " << file_name << std::endl;
     return false;
@@ -859,6 +777,106 @@ bool writePlyMesh(const std::string &file_name, const Mesh &mesh, bool flip_norm
   return true;
 }
 
+std::string plyMeshHeader(unsigned long num_vertices, unsigned long num_faces, bool has_uvs,
+                          const std::string &texture_name, int count_width)
+{
+  // counts are zero-padded to count_width, so that a header can be rewritten in place once the counts are known
+  auto count = [count_width](unsigned long number) {
+    const std::string str = std::to_string(number);
+    return std::string(std::max(0, count_width - static_cast<int>(str.length())), '0') + str;
+  };
+  std::string header = "ply\n";
+  header += "format binary_little_endian 1.0\n";
+  header += "comment SDK generated\n";  // TODO: add version here
+  if (has_uvs)
+  {
+    header += "comment TextureFile " + (texture_name == "" ? std::string("wood_texture.png") : texture_name) + "\n";
+  }
+  header += "element vertex " + count(num_vertices) + "\n";
+#if RAYLIB_DOUBLE_RAYS
+  header += "property double x\n";
+  header += "property double y\n";
+  header += "property double z\n";
+#else
+  header += "property float x\n";
+  header += "property float y\n";
+  header += "property float z\n";
+#endif
+  header += "property uchar red\n";
+  header += "property uchar green\n";
+  header += "property uchar blue\n";
+  header += "property uchar alpha\n";
+  header += "element face " + count(num_faces) + "\n";
+  header += "property list int int vertex_indices\n";
+  if (has_uvs)
+  {
+    header += "property list int float texcoord\n";
+    header += "property int texnumber\n";
+  }
+  header += "end_header\n";
+  return header;
+}
+
+void packPlyMeshVertices(const Mesh &mesh, size_t first, size_t num, std::vector<unsigned char> &buffer)
+{
+#if RAYLIB_DOUBLE_RAYS
+  typedef Eigen::Vector3d VertexPosition;
+#else
+  typedef Eigen::Vector3f VertexPosition;
+#endif
+  const size_t row_size = sizeof(VertexPosition) + sizeof(RGBA);
+  const auto &vertices = mesh.vertices();
+  buffer.resize(row_size * num);
+  for (size_t i = 0; i < num; i++)
+  {
+    const VertexPosition pos = vertices[first + i].cast<VertexPosition::Scalar>();
+    const RGBA colour = mesh.colours().empty() ? ray::RGBA(127,127,127,255) : mesh.colours()[first + i];
+    memcpy(&buffer[row_size * i], &pos, sizeof(VertexPosition));
+    memcpy(&buffer[row_size * i + sizeof(VertexPosition)], &colour, sizeof(RGBA));
+  }
+}
+
+void packPlyMeshFaces(const Mesh &mesh, size_t first, size_t num, int index_offset, bool flip_normals, bool has_uvs,
+                      std::vector<unsigned char> &buffer)
+{
+  auto &list = mesh.indexList();
+  auto &uvs = mesh.uvList();
+  struct Face
+  {
+    int num_corners;
+    Eigen::Vector3i ids;
+    int num_coords;
+    float uvs[6];
+    int texnumber;
+  };
+  const size_t face_size = has_uvs ? sizeof(Face) : sizeof(Eigen::Vector4i);
+  buffer.resize(face_size * num);
+  for (size_t i = 0; i < num; i++)
+  {
+    const Eigen::Vector3i &tri = list[first + i];
+    const Eigen::Vector3i ids = (flip_normals ? Eigen::Vector3i(tri[2], tri[1], tri[0]) : tri).array() + index_offset;
+    if (!has_uvs)
+    {
+      const Eigen::Vector4i triangle(3, ids[0], ids[1], ids[2]);
+      memcpy(&buffer[face_size * i], &triangle, face_size);
+      continue;
+    }
+    const Eigen::Vector3cf &uv = uvs[first + i];
+    Face face;
+    face.num_corners = 3;
+    face.ids = ids;
+    face.num_coords = 6;
+    face.uvs[0] = uv[0].real();
+    face.uvs[1] = uv[0].imag();
+    face.uvs[2] = uv[1].real();
+    face.uvs[3] = uv[1].imag();
+    face.uvs[4] = uv[2].real();
+    face.uvs[5] = uv[2].imag();
+    face.texnumber = 0;
+    memcpy(&buffer[face_size * i], &face, face_size);
+  }
+}
+
 bool readPlyMesh(const std::string &file, Mesh &mesh)
 {
   std::ifstream input(file.c_str(), std::ios::in | std::ios::binary);
@@ -943,65 +961,81 @@ bool readPlyMesh(const std::string &file, Mesh &mesh)
     return false;
   }
 
+  const size_t vertex_row_size = row_size;
+  const size_t face_row_size = order_size + 3*vertex_index_size + uv_order_size + 6*uv_size + texnumber_size;
+  std::cout << "row size: " << vertex_row_size << std::endl;
+  FileBody body;
+  const size_t body_size = (size_t)number_of_vertices * vertex_row_size + (size_t)number_of_faces * face_row_size;
+  if (!body.open(file, (size_t)input.tellg(), body_size))
+  {
+    return false;
+  }
+  input.close();
+  const unsigned char *vertices = body.data();
+  const unsigned char *triangles = vertices + (size_t)number_of_vertices * vertex_row_size;
+
   mesh.vertices().resize(number_of_vertices);
-  std::vector<unsigned char> vertices(row_size);
-  std::cout << "row size: " << row_size << std::endl;
-  for (unsigned int i = 0; i<number_of_vertices; i++)
+  #pragma omp parallel for
+  for (int i = 0; i < (int)number_of_vertices; i++)
   {
-    input.read((char *)&vertices[0], row_size);
+    const unsigned char *row = vertices + vertex_row_size * i + pos_offset;
     if (pos_is_float)
     {
-      Eigen::Vector3f e = (Eigen::Vector3f &)vertices[pos_offset];
+      float e[3];
+      memcpy(e, row, sizeof(e));
       mesh.vertices()[i] = Eigen::Vector3d(e[0], e[1], e[2]);
     }
     else
     {
-      mesh.vertices()[i] = (Eigen::Vector3d &)vertices[pos_offset];
+      double e[3];
+      memcpy(e, row, sizeof(e));
+      mesh.vertices()[i] = Eigen::Vector3d(e[0], e[1], e[2]);
     }
   }
-  row_size = order_size + 3*vertex_index_size + uv_order_size + 6*uv_size + texnumber_size;
-  std::vector<unsigned char> triangles(number_of_faces * row_size);
-  input.read((char *)&triangles[0], triangles.size());
 
   mesh.indexList().resize(number_of_faces);
   if (uv_size > 0)
   {
     mesh.uvList().resize(number_of_faces);
   }
-  for (unsigned int i = 0; i < number_of_faces; i++)
+  #pragma omp parallel for
+  for (int i = 0; i < (int)number_of_faces; i++)
   {
+    const unsigned char *row = triangles + face_row_size * i;
     for (int j = 0; j<3; j++)
     {
+      const unsigned char *index = row + order_size + j*vertex_index_size;
       if (vertex_index_size == int(sizeof(unsigned char))) 
       {
-        unsigned char index = (unsigned char &)triangles[row_size*i + order_size + j*vertex_index_size];
-        mesh.indexList()[i][j] = int(index);
+        mesh.indexList()[i][j] = int(*index);
       }
       else if (vertex_index_size == int(sizeof(unsigned short))) 
       {
-        unsigned short index = (unsigned short &)triangles[row_size*i + order_size + j*vertex_index_size];
-        mesh.indexList()[i][j] = int(index);
+        unsigned short value;
+        memcpy(&value, index, sizeof(value));
+        mesh.indexList()[i][j] = int(value);
       }
       else if (vertex_index_size == int(sizeof(int))) 
       {
-        mesh.indexList()[i][j] = (int &)triangles[row_size*i + order_size + j*vertex_index_size];
+        memcpy(&mesh.indexList()[i][j], index, sizeof(int));
       }
     }
     if (uv_size > 0)
     {
+      const unsigned char *coords = row + order_size + 3*vertex_index_size + uv_order_size;
       for (int j = 0; j<3; j++)
       {
         if (uv_size == 4)
         {
-          float u = (float &)triangles[row_size*i + order_size + 3*vertex_index_size + uv_order_size + 2*j*uv_size];
-          float v = (float &)triangles[row_size*i + order_size + 3*vertex_index_size + uv_order_size + (2*j + 1)*uv_size];
-          mesh.uvList()[i][j] = std::complex<float>(u, v);
+          float uv[2];
+          memcpy(uv, coords + 2*j*uv_size, sizeof(uv));
+          mesh.uvList()[i][j] = std::complex<float>(uv[0], uv[1]);
         }
         else // uv_size == 8
         {
-          double u = (double &)triangles[row_size*i + order_size + 3*vertex_index_size + uv_order_size + 2*j*uv_size];
-          double v = (double &)triangles[row_size*i + order_size + 3*vertex_index_size + uv_order_size + (2*j + 1)*uv_size];
-          mesh.uvList()[i][j] = std::complex<float>((float)u, (float)v);
+          double uv[2];
+          memcpy(uv, coords + 2*j*uv_size, sizeof(uv));
+          mesh.uvList()[i][j] = std::complex<float>((float)uv[0], (float)uv[1]);
         }      
       }
     }
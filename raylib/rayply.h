@@ -34,6 +34,18 @@ bool RAYLIB_EXPORT readPlyMesh(const std::string &file, class Mesh &mesh);
 /// write a .ply file representing a triangular mesh
 bool RAYLIB_EXPORT writePlyMesh(const std::string &file_name, const class Mesh &mesh, bool flip_normals = false);
 
+/// The parts of a triangular mesh .ply file, shared by writePlyMesh and the chunked MeshWriter.
+/// The header, with its element counts zero-padded to at least @c count_width digits. A texture file comment and
+/// per-face texture coordinates are declared when @c has_uvs
+std::string RAYLIB_EXPORT plyMeshHeader(unsigned long num_vertices, unsigned long num_faces, bool has_uvs,
+                                        const std::string &texture_name, int count_width = 0);
+/// packs @c num vertex rows of @c mesh from index @c first into @c buffer. Missing colours are written grey
+void RAYLIB_EXPORT packPlyMeshVertices(const class Mesh &mesh, size_t first, size_t num,
+                                       std::vector<unsigned char> &buffer);
+/// packs @c num face rows of @c mesh from index @c first into @c buffer, with @c index_offset added to the vertex ids
+void RAYLIB_EXPORT packPlyMeshFaces(const class Mesh &mesh, size_t first, size_t num, int index_offset,
+                                    bool flip_normals, bool has_uvs, std::vector<unsigned char> &buffer);
+
 /// ready in a ray cloud or point cloud .ply file, and call the @c apply function one chunk at a time,
 /// @c chunk_size is the number of rays to read at one time. This method can be used on large clouds where
 /// the full set of rays is not required to be in memory at one time.
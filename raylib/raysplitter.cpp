@@ -305,7 +305,7 @@ bool splitGrid(const std::string &file_name, const std::string &cloud_name_stub,
 {
   overlap /= 2.0;  // it now means overlap relative to grid edge
   Cloud::Info info;
-  Cloud::getInfo(cloud_name_stub + ".ply", info);
+  Cloud::getInfo(file_name, info);
   const Eigen::Vector3d &min_bound = info.rays_bound.min_bound_;
   const Eigen::Vector3d &max_bound = info.rays_bound.max_bound_;
 
@@ -4,21 +4,129 @@
 //
 // Author: Thomas Lowe
 #include "raytrajectory.h"
+#include "rayfilebody.h"
+
+#include <cstring>
 
 namespace ray
 {
+namespace
+{
+/// The same index as std::lower_bound of @c time in the ordered @c times, found by galloping forwards from @c cursor,
+/// the index of the previous, earlier time. This is fast for nearly time-ordered points, and out of order times fall
+/// back to a binary search of the whole list
+size_t lowerBoundFrom(const std::vector<double> &times, double time, size_t cursor)
+{
+  if (cursor > 0 && !(times[cursor - 1] < time))
+    return std::lower_bound(times.begin(), times.end(), time) - times.begin();
+  // all the times before lower are earlier than @c time, and the result is at most upper
+  size_t lower = cursor, upper = cursor;
+  for (size_t step = 1; upper < times.size() && times[upper] < time; step *= 2)
+  {
+    lower = upper + 1;
+    upper = cursor + step;
+  }
+  upper = std::min(upper, times.size());
+  return std::lower_bound(times.begin() + lower, times.begin() + upper, time) - times.begin();
+}
+
+// the binary trajectory format is this identifier, then the number of nodes as a uint64_t, then each node's time and
+// x, y, z position as little endian doubles
+const char binary_trajectory_id[8] = { 'r', 'a', 'y', 't', 'r', 'a', 'j', '\n' };
+const size_t binary_node_size = 4 * sizeof(double);
+
+bool isBinaryTrajectoryFile(const std::string &file_name)
+{
+  return file_name.size() >= 4 && file_name.substr(file_name.size() - 4) == ".bin";
+}
+
+/// write the @c num_nodes nodes of a trajectory in binary, where @c node(i, values) sets the time and position of
+/// node i into @c values
+template <class GetNode>
+bool saveBinaryTrajectory(const std::string &file_name, size_t num_nodes, GetNode node)
+{
+  std::ofstream ofs(file_name.c_str(), std::ios::out | std::ios::binary);
+  if (ofs.fail())
+  {
+    std::cerr << "error: cannot open file " << file_name << " for writing" << std::endl;
+    return false;
+  }
+  const uint64_t count = num_nodes;
+  ofs.write(binary_trajectory_id, sizeof(binary_trajectory_id));
+  ofs.write(reinterpret_cast<const char *>(&count), sizeof(count));
+  // the nodes are written a block at a time
+  std::vector<double> buffer;
+  const size_t block_size = 1 << 16;
+  for (size_t begin = 0; begin < num_nodes; begin += block_size)
+  {
+    const size_t end = std::min(num_nodes, begin + block_size);
+    buffer.resize(4 * (end - begin));
+    for (size_t i = begin; i < end; i++)
+    {
+      node(i, &buffer[4 * (i - begin)]);
+    }
+    ofs.write(reinterpret_cast<const char *>(buffer.data()),
+              static_cast<std::streamsize>(buffer.size() * sizeof(double)));
+  }
+  if (ofs.fail())
+  {
+    std::cerr << "error writing to file " << file_name << std::endl;
+    return false;
+  }
+  return true;
+}
+}  // namespace
+
 void Trajectory::calculateStartPoints(const std::vector<double> &times, std::vector<Eigen::Vector3d> &starts)
 {
   if (points_.empty() || times_.empty())
     std::cout << "Warning: can only calculate start points when a trajectory is available" << std::endl;
 
   starts.resize(times.size());
-  for (size_t i = 0; i < times.size(); i++) starts[i] = linear(times[i]);
+  if (points_.size() < 2)
+  {
+    for (size_t i = 0; i < times.size(); i++) starts[i] = linear(times[i]);
+    return;
+  }
+  // the times are interpolated a block at a time, each with its own search cursor, so the blocks run in parallel
+  const int block_size = 4096;
+  const int num_blocks = static_cast<int>((times.size() + block_size - 1) / block_size);
+  #pragma omp parallel for
+  for (int block = 0; block < num_blocks; block++)
+  {
+    const size_t begin = static_cast<size_t>(block) * block_size;
+    const size_t end = std::min(times.size(), begin + block_size);
+    size_t indices[block_size];
+    double blends[block_size];
+    size_t cursor = 0;
+    for (size_t i = begin; i < end; i++)
+    {
+      cursor = lowerBoundFrom(times_, times[i], cursor);
+      // as in getIndexAndNormaliseTime
+      const size_t index = std::min(std::max(cursor, static_cast<size_t>(1)), times_.size() - 1) - 1;
+      indices[i - begin] = index;
+      blends[i - begin] = (times[i] - times_[index]) / (times_[index + 1] - times_[index]);
+    }
+    // then the linear blend as in linear(), in a separate pass without the search's branches
+    for (size_t i = begin; i < end; i++)
+    {
+      const size_t index = indices[i - begin];
+      const double blend = blends[i - begin];
+      starts[i] = points_[index] * (1 - blend) + points_[index + 1] * blend;
+    }
+  }
 }
 
 bool Trajectory::save(const std::string &file_name)
 {
   std::cout << "saving trajectory " << file_name << std::endl;
+  if (isBinaryTrajectoryFile(file_name))
+  {
+    return saveBinaryTrajectory(file_name, points_.size(), [this](size_t i, double *values) {
+      values[0] = times_[i];
+      memcpy(values + 1, points_[i].data(), 3 * sizeof(double));
+    });
+  }
   std::ofstream ofs(file_name.c_str(), std::ios::out);
   if (ofs.fail())
   {
@@ -39,6 +147,13 @@ bool Trajectory::save(const std::string &file_name)
 bool saveTrajectory(const std::vector<TrajectoryNode> &nodes, const std::string &file_name)
 {
   std::cout << "saving trajectory " << file_name << std::endl;
+  if (isBinaryTrajectoryFile(file_name))
+  {
+    return saveBinaryTrajectory(file_name, nodes.size(), [&nodes](size_t i, double *values) {
+      values[0] = nodes[i].time;
+      memcpy(values + 1, nodes[i].point.data(), 3 * sizeof(double));
+    });
+  }
   std::ofstream ofs(file_name.c_str(), std::ios::out);
   if (ofs.fail())
   {
@@ -55,96 +170,104 @@ bool saveTrajectory(const std::vector<TrajectoryNode> &nodes, const std::string
   return true;
 }
 
-
 /**Loads the trajectory into the supplied vector and returns if successful*/
 bool Trajectory::load(const std::string &file_name)
 {
   std::cout << "loading trajectory " << file_name << std::endl;
-  std::string line;
-  int size = 0;
-  {
-    std::ifstream ifs(file_name.c_str(), std::ios::in);
-    if (!ifs)
-    {
-      std::cerr << "Failed to open trajectory file: " << file_name << std::endl;
-      return false;
-    }
-    ASSERT(!ifs.fail());
-
-    while (getline(ifs, line))
-    {
-      if (line.length() == 0 || line[0] == '%')
-        continue;
-      size++;
-    }
-  }
-  std::ifstream ifs(file_name.c_str(), std::ios::in);
+  std::ifstream ifs(file_name.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
   if (!ifs)
   {
     std::cerr << "Failed to open trajectory file: " << file_name << std::endl;
     return false;
   }
-  points_.resize(size);
-  times_.resize(size);
-  bool ordered = true;
-  int i = 0; // index along trajectory
-  while (i < size)
-  {
-    if (ifs.fail())
-    {
-      std::cerr << "Invalid stream when loading trajectory file: " << file_name << std::endl;
-      return false;
-    }
-    getline(ifs, line);
-    if (line.length() == 0 || line[0] == '%')
-      continue;
+  const size_t file_size = static_cast<size_t>(ifs.tellg());
+  ifs.close();
+  // the whole file is parsed in one pass, straight from memory
+  FileBody file;
+  if (!file.open(file_name, 0, file_size))
+    return false;
+  const char *data = reinterpret_cast<const char *>(file.data());
+  points_.clear();
+  times_.clear();
 
-    std::istringstream iss(line);
-    iss >> times_[i] >> points_[i][0] >> points_[i][1] >> points_[i][2];
-    if (iss.fail())
+  if (file_size >= sizeof(binary_trajectory_id) + sizeof(uint64_t) &&
+      memcmp(data, binary_trajectory_id, sizeof(binary_trajectory_id)) == 0)
+  {
+    uint64_t size;
+    memcpy(&size, data + sizeof(binary_trajectory_id), sizeof(size));
+    const char *nodes = data + sizeof(binary_trajectory_id) + sizeof(size);
+    if (size > (file_size - static_cast<size_t>(nodes - data)) / binary_node_size)
     {
-      std::cerr << "Invalid fields at line " << i << " of " << file_name << std::endl;
+      std::cerr << "Error: trajectory file " << file_name << " is shorter than its header specifies" << std::endl;
       return false;
     }
-    if (i > 0 && times_[i] < times_[i - 1])
+    points_.resize(size);
+    times_.resize(size);
+    for (size_t i = 0; i < size; i++)
     {
-      ordered = false;
+      memcpy(&times_[i], nodes + binary_node_size * i, sizeof(double));
+      memcpy(points_[i].data(), nodes + binary_node_size * i + sizeof(double), 3 * sizeof(double));
     }
-    i++;
   }
-  if (ifs.fail())
+  else
   {
-    std::cerr << "Invalid stream when loading trajectory file: " << file_name << std::endl;
-    return false;
+    const char *end = data + file_size;
+    // numbers are copied out of each line, so that they are parsed from a null-terminated string. Longer lines are
+    // an error, rather than being parsed in part
+    const size_t max_line_length = 255;
+    char line[max_line_length + 1];
+    for (const char *line_start = data; line_start < end;)
+    {
+      const char *line_end = static_cast<const char *>(memchr(line_start, '\n', static_cast<size_t>(end - line_start)));
+      if (!line_end)
+        line_end = end;
+      const size_t length = static_cast<size_t>(line_end - line_start);
+      if (length > 0 && line_start[0] != '%')
+      {
+        if (length > max_line_length)
+        {
+          std::cerr << "Error: line " << times_.size() << " of " << file_name << " is longer than "
+                    << max_line_length << " characters" << std::endl;
+          return false;
+        }
+        memcpy(line, line_start, length);
+        line[length] = '\0';
+        double values[4];
+        char *pos = line;
+        for (int j = 0; j < 4; j++)
+        {
+          char *next;
+          values[j] = std::strtod(pos, &next);
+          if (next == pos)
+          {
+            std::cerr << "Invalid fields at line " << times_.size() << " of " << file_name << std::endl;
+            return false;
+          }
+          pos = next;
+        }
+        times_.push_back(values[0]);
+        points_.push_back(Eigen::Vector3d(values[1], values[2], values[3]));
+      }
+      line_start = line_end + 1;
+    }
   }
-  if (!ordered)
+
+  if (!std::is_sorted(times_.begin(), times_.end()))
   {
     std::cout << "Warning: trajectory times not ordered. Ordering them now." << std::endl;
-
-    struct Temp
-    {
-      double time;
-      size_t index;
-    };
-    std::vector<Temp> time_list(times_.size());
-    for (size_t i = 0; i < time_list.size(); i++)
+    std::vector<TrajectoryNode> nodes(times_.size());
+    for (size_t i = 0; i < nodes.size(); i++)
     {
-      time_list[i].time = times_[i];
-      time_list[i].index = i;
+      nodes[i].time = times_[i];
+      nodes[i].point = points_[i];
     }
-    sort(time_list.begin(), time_list.end(), [](const Temp &a, const Temp &b) { return a.time < b.time; });
-
-    std::vector<Eigen::Vector3d> new_points(points_.size());
-    std::vector<double> new_times(times_.size());
-    for (size_t i = 0; i < points_.size(); i++)
+    std::sort(nodes.begin(), nodes.end(),
+              [](const TrajectoryNode &a, const TrajectoryNode &b) { return a.time < b.time; });
+    for (size_t i = 0; i < nodes.size(); i++)
     {
-      new_points[i] = points_[time_list[i].index];
-      new_times[i] = times_[time_list[i].index];
-      if (!(i % 100))
-        std::cout << "time: " << new_times[i] - new_times[0] << std::endl;
+      times_[i] = nodes[i].time;
+      points_[i] = nodes[i].point;
     }
-    points_ = std::move(new_points);
-    times_ = std::move(new_times);
     std::cout << "finished sorting" << std::endl;
   }
 
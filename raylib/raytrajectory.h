@@ -22,13 +22,15 @@ public:
   inline std::vector<double> &times() { return times_; }
   inline const std::vector<double> &times() const { return times_; }
 
-  /// Save trajectory to a text file. One line per Node
+  /// Save trajectory to a text file. One line per Node. A .bin @c file_name is saved in the binary trajectory format
   bool save(const std::string &file_name);
 
-  /// Load trajectory from file. The file is expected to be a text file, with one Node entry per line
+  /// Load trajectory from file. The file is expected to be a text file, with one Node entry per line of at most 255
+  /// characters, or a binary trajectory file, as saved to .bin files
   bool load(const std::string &file_name);
 
-  /// Interpolation of the set @c starts based on the @c times_ of the trajectory
+  /// Interpolation of the set @c starts based on the @c times_ of the trajectory, the same as linear() at each of the
+  /// @c times. This is fastest when the times are nearly in order, as they are for most scanners
   void calculateStartPoints(const std::vector<double> &times, std::vector<Eigen::Vector3d> &starts);
 
   /// Nearest position node on the trajectory to the given @c time
@@ -60,7 +62,8 @@ struct RAYLIB_EXPORT TrajectoryNode
   Eigen::Vector3d point;
   double time;
 };
-/// Save a trajectory, using the alternate, node representation
+/// Save a trajectory, using the alternate, node representation. A .bin @c file_name is saved in binary, as in
+/// Trajectory::save
 bool RAYLIB_EXPORT saveTrajectory(const std::vector<TrajectoryNode> &nodes, const std::string &file_name);
 }  // namespace ray
 
@@ -295,7 +295,7 @@ void writePlainOldDataArray(std::ofstream &out, const std::vector<T> &array)
 template <typename T>
 void readPlainOldDataArray(std::ifstream &in, std::vector<T> &array)
 {
-  unsigned int size;
+  unsigned int size = 0;  // stays empty if the stream has ended
   in.read(reinterpret_cast<char *>(&size), sizeof(unsigned int));
   array.resize(size);
   for (unsigned int i = 0; i < size; i++) readPlainOldData(in, array[i]);
@@ -0,0 +1,22 @@
+# times rayalign on generated room and forest scenes, scaled up by tiling $1 x $1 copies of each scene.
+# Each tiled scene is aligned to a rotated and translated copy of itself, so the FFT grid grows with the tile count.
+# ./rayalign_benchmark.sh 4
+source "$(dirname "$0")/tiled_scene.sh"
+set -x
+n=${1:-4}
+rm -rf benchmark_align
+mkdir benchmark_align
+cd benchmark_align
+
+for scene in room forest;
+do
+  tiled_scene $scene $n ${scene}_large.ply
+  cp ${scene}_large.ply ${scene}_moved.ply
+  rayrotate ${scene}_moved.ply 0,0,25
+  raytranslate ${scene}_moved.ply 3,2,0
+  time rayalign ${scene}_large.ply ${scene}_moved.ply
+  rayinfo ${scene}_large.ply
+done
+
+cd ..
+set +x
@@ -0,0 +1,26 @@
+# times rayextract terrain on an undecimated generated forest, scaled up by tiling $1 x $1 copies of the scene.
+# Optionally $2 is the bin directory of a baseline build, which is timed on the same input, and its mesh compared.
+# ./rayextract_terrain_benchmark.sh 4 ~/raycloudtools_baseline/build/bin
+source "$(dirname "$0")/tiled_scene.sh"
+set -x
+n=${1:-4}
+baseline=$2
+rm -rf benchmark_terrain
+mkdir benchmark_terrain
+cd benchmark_terrain
+
+tiled_scene forest $n forest_large.ply
+rayinfo forest_large.ply
+
+time rayextract terrain forest_large.ply
+if [ -n "$baseline" ]; then
+  mkdir baseline
+  cp forest_large.ply baseline
+  cd baseline
+  time $baseline/rayextract terrain forest_large.ply
+  cd ..
+  cmp forest_large_mesh.ply baseline/forest_large_mesh.ply && echo "terrain meshes match the baseline"
+fi
+
+cd ..
+set +x
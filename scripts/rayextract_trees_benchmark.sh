@@ -0,0 +1,28 @@
+# times rayextract trees on a generated forest, scaled up by tiling $1 x $1 copies of the scene.
+# Optionally $2 is the bin directory of a baseline build, which is timed on the same input, and its outputs compared.
+# ./rayextract_trees_benchmark.sh 4 ~/raycloudtools_baseline/build/bin
+source "$(dirname "$0")/tiled_scene.sh"
+set -x
+n=${1:-4}
+baseline=$2
+rm -rf benchmark_trees
+mkdir benchmark_trees
+cd benchmark_trees
+
+tiled_scene forest $n forest_large.ply
+rayextract terrain forest_large.ply
+rayinfo forest_large.ply
+
+time rayextract trees forest_large.ply forest_large_mesh.ply
+if [ -n "$baseline" ]; then
+  mkdir baseline
+  cp forest_large.ply forest_large_mesh.ply baseline
+  cd baseline
+  time $baseline/rayextract trees forest_large.ply forest_large_mesh.ply
+  cd ..
+  cmp forest_large_trees.txt baseline/forest_large_trees.txt && echo "trees match the baseline"
+  cmp forest_large_segmented.ply baseline/forest_large_segmented.ply && echo "segmented clouds match the baseline"
+fi
+
+cd ..
+set +x
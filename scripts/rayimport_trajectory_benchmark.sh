@@ -0,0 +1,38 @@
+# times rayimport of a generated forest, scaled up by tiling $1 x $1 copies of the scene, against its trajectory
+# exported at 10 Hz and at 200 Hz, and reports the points imported per second. Optionally $2 is the bin directory of a
+# baseline build, which is timed on the same input, and its ray clouds compared.
+# ./rayimport_trajectory_benchmark.sh 4 ~/raycloudtools_baseline/build/bin
+source "$(dirname "$0")/tiled_scene.sh"
+set -x
+n=${1:-4}
+baseline=$2
+rm -rf benchmark_import
+mkdir benchmark_import
+cd benchmark_import
+
+tiled_scene forest $n forest_large.ply
+rayexport forest_large.ply points.ply trajectory_10hz.txt --traj_delta 0.1
+rayexport forest_large.ply points.ply trajectory_200hz.txt --traj_delta 0.005
+num_points=$(rayinfo forest_large.ply | grep "number of rays" | awk '{print $4}')
+set +x
+
+# import with the bin directory $1 (empty for the path), against trajectory file $2
+import() {
+  start=$(date +%s%N)
+  ${1:+$1/}rayimport points.ply $2 > /dev/null
+  ms=$(( ($(date +%s%N) - start) / 1000000 ))
+  echo "$2: $ms ms, $(( num_points * 1000 / (ms > 0 ? ms : 1) )) points per second"
+}
+
+for trajectory in trajectory_10hz.txt trajectory_200hz.txt;
+do
+  import "" $trajectory
+  if [ -n "$baseline" ]; then
+    mv points_raycloud.ply raycloud.ply
+    echo "baseline:"
+    import $baseline $trajectory
+    cmp raycloud.ply points_raycloud.ply && echo "import matches the baseline"
+  fi
+done
+
+cd ..
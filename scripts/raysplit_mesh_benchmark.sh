@@ -0,0 +1,59 @@
+# times raysplit against the extracted tree mesh of a generated forest, scaled up by tiling $1 x $1 copies of the
+# scene, and reports the rays split per second. Offset 0 times the vertical ray tests, the other offsets add the
+# triangle distance tests. Optionally $2 is the bin directory of a baseline build, which is timed on the same input,
+# and its split clouds compared.
+# When raytest is built (RAYCLOUD_BUILD_TESTS) next to raysplit, it then reports the triangle tests per second on a
+# stack of 1024 triangles that every ray tests, both in raytest and through raysplit of each build.
+# ./raysplit_mesh_benchmark.sh 4 ~/raycloudtools_baseline/build/bin
+source "$(dirname "$0")/tiled_scene.sh"
+set -x
+n=${1:-4}
+baseline=$2
+rm -rf benchmark_split
+mkdir benchmark_split
+cd benchmark_split
+
+tiled_scene forest $n forest_large.ply
+rayextract terrain forest_large.ply
+rayextract trees forest_large.ply forest_large_mesh.ply
+num_rays=$(rayinfo forest_large.ply | grep "number of rays" | awk '{print $4}')
+set +x
+
+# split with the bin directory $1 (empty for the path), at offset $2
+split() {
+  start=$(date +%s%N)
+  ${1:+$1/}raysplit forest_large.ply forest_large_trees_mesh.ply distance $2 > /dev/null
+  ms=$(( ($(date +%s%N) - start) / 1000000 ))
+  echo "offset $2: $ms ms, $(( num_rays * 1000 / (ms > 0 ? ms : 1) )) rays per second"
+}
+
+for offset in 0 0.2 -0.2;
+do
+  split "" $offset
+  if [ -n "$baseline" ]; then
+    mv forest_large_inside.ply inside.ply
+    mv forest_large_outside.ply outside.ply
+    echo "baseline:"
+    split $baseline $offset
+    cmp inside.ply forest_large_inside.ply && cmp outside.ply forest_large_outside.ply && echo "split matches the baseline"
+  fi
+done
+
+raytest=$(dirname "$(command -v raysplit)")/raytest
+if [ -x "$raytest" ]; then
+  "$raytest" --gtest_also_run_disabled_tests --gtest_filter=Basic.DISABLED_MeshSplitThroughput | grep "per second"
+  num_tests=$(( 1024 * 20000 ))
+  # offset 0 runs a vertical ray test per triangle, and offset -0.5 a distance test too
+  for offset in 0 -0.5;
+  do
+    for bin in "" $baseline;
+    do
+      start=$(date +%s%N)
+      ${bin:+$bin/}raysplit split_kernel_cloud.ply split_kernel_mesh.ply distance $offset > /dev/null
+      ms=$(( ($(date +%s%N) - start) / 1000000 ))
+      echo "${bin:-raysplit} offset $offset: $ms ms, $(( num_tests / 1000 / (ms > 0 ? ms : 1) )) million triangles per second"
+    done
+  done
+fi
+
+cd ..
@@ -0,0 +1,54 @@
+# times raywrap, with and without --full, on generated terrain, room and forest scenes, in every direction and at
+# several curvatures. Optionally $1 is the bin directory of a baseline build, which is timed on the same input, and its
+# --full meshes compared. Both builds need WITH_QHULL. Without --full only the hull candidates are passed to qhull, so
+# the vertex order differs from a build without the candidate filter; the ConvexHullCandidates unit test checks that
+# the triangles are the same.
+# ./raywrap_benchmark.sh ~/raycloudtools_baseline/build/bin
+baseline=$1
+rm -rf benchmark_wrap
+mkdir benchmark_wrap
+cd benchmark_wrap
+
+for scene in terrain room forest;
+do
+  raycreate $scene 1 > /dev/null
+done
+
+# wrap with the bin directory $1 (empty for the path), of scene $2, in direction $3, curvature $4 and flag $5
+wrap() {
+  start=$(date +%s%N)
+  ${1:+$1/}raywrap $2.ply $3 $4 $5 > /dev/null
+  ms=$(( ($(date +%s%N) - start) / 1000000 ))
+  echo "$2 $3 $4 $5: $ms ms"
+}
+
+num_matches=0
+num_runs=0
+for scene in terrain room forest;
+do
+  for direction in upwards downwards inwards outwards;
+  do
+    for curvature in 0.1 1.0 5.0;
+    do
+      for flag in "" --full;
+      do
+        wrap "" $scene $direction $curvature $flag
+        if [ -n "$baseline" ] && [ -n "$flag" ]; then
+          mv ${scene}_mesh.ply mesh.ply
+          wrap $baseline $scene $direction $curvature $flag
+          num_runs=$((num_runs + 1))
+          if cmp -s mesh.ply ${scene}_mesh.ply; then
+            num_matches=$((num_matches + 1))
+          else
+            echo "mesh differs from the baseline"
+          fi
+        fi
+      done
+    done
+  done
+done
+if [ -n "$baseline" ]; then
+  echo "$num_matches of $num_runs full meshes match the baseline"
+fi
+
+cd ..
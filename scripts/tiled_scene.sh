@@ -0,0 +1,19 @@
+# shared by the benchmark scripts, which source it before changing directory:
+# source "$(dirname "$0")/tiled_scene.sh"
+# tiled_scene forest 4 forest_large.ply
+# generates scene $1 (room or forest) $2 x $2 times, with a different seed per tile, translates the copies onto a
+# 20 m grid and combines them into the single ray cloud $3. The tiles are kept as ${1}_i_j.ply
+tiled_scene() {
+  local scene=$1 n=$2 output=$3 tiles="" i j
+  for i in $(seq 1 $n);
+  do
+    for j in $(seq 1 $n);
+    do
+      raycreate $scene $((i * 100 + j))
+      mv $scene.ply ${scene}_${i}_${j}.ply
+      raytranslate ${scene}_${i}_${j}.ply $((i * 20)),$((j * 20)),0
+      tiles="$tiles ${scene}_${i}_${j}.ply"
+    done
+  done
+  raycombine all $tiles --output $output
+}
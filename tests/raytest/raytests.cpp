@@ -4,10 +4,23 @@
 //
 // Author: Thomas Lowe
 
+#include "rayalignment.h"
 #include "raycloud.h"
+#include "rayconvexhull.h"
+#include "rayfft.h"
+#include "extraction/rayclusters.h"
+#include "extraction/raygrid2d.h"
+#include "extraction/raytiles.h"
+#include "extraction/raytrees.h"
+#include "rayheapset.h"
+#include "raymerger.h"
 #include "raymesh.h"
 #include "rayply.h"
 #include "rayforeststructure.h"
+#include "raytrajectory.h"
+#include <array>
+#include <chrono>
+#include <set>
 #include <vector>
 #include <gtest/gtest.h>
 #include <cstdlib>
@@ -93,6 +106,59 @@ namespace raytest
     compareMoments(cloud.getMoments(), {-0.0867714, -0.0679941, 0.546619, 0.0215326, 0.0272819, 0.499969, -0.305657, -0.186353, 0.582642, 2.95777, 2.47531, 1.63323, 17.4967, 10.1789, 0.305355, 0.763356, 0.427376, 0.979005, 0.318409, 0.225661, 0.389366, 0.143369});
   }
   
+  /// Merges a room with a transformed copy incrementally, then merges a third copy in using the saved merge state, and
+  /// compares each result to the one-shot merge of the same clouds. Stale and truncated merge states must be rejected
+  TEST(Basic, RayCombineIncremental)
+  {
+    EXPECT_EQ(command("./raycreate room 1"), 0);
+    EXPECT_EQ(copy("room.ply room2.ply"), 0);
+    EXPECT_EQ(command("./raytranslate room2.ply 0,0,1"), 0);
+    EXPECT_EQ(command("./rayrotate room2.ply 0,0,35"), 0);
+    EXPECT_EQ(copy("room.ply room3.ply"), 0);
+    EXPECT_EQ(command("./raytranslate room3.ply 0.5,0.3,0"), 0);
+    EXPECT_EQ(command("./rayrotate room3.ply 0,0,-20"), 0);
+    EXPECT_EQ(copy("room.ply inc.ply"), 0);
+    std::remove("inc_merge.dat");
+    auto compareClouds = [](const std::string &file_name, const std::string &expected_file_name, double eps) {
+      ray::Cloud cloud, expected;
+      EXPECT_TRUE(cloud.load(file_name));
+      EXPECT_TRUE(expected.load(expected_file_name));
+      EXPECT_NEAR((double)cloud.rayCount(), (double)expected.rayCount(), eps * (double)expected.rayCount());
+      const Eigen::ArrayXd moments = expected.getMoments();
+      compareMoments(cloud.getMoments(), std::vector<double>(moments.data(), moments.data() + moments.size()), eps);
+    };
+
+    // with no merge state, it is generated from the first cloud
+    EXPECT_EQ(command("./raycombine min room.ply room2.ply 1 rays"), 0);
+    EXPECT_EQ(command("./raycombine min inc.ply room2.ply 1 rays --incremental"), 0);
+    compareClouds("inc_combined.ply", "room_combined.ply", 1e-6);
+
+    // the saved merge state of the result is used for the next merge. Its ellipsoids were fitted to the rays'
+    // neighbours in their original clouds, whereas the one-shot merge refits them in the merged cloud, so the results
+    // are close rather than equal
+    ray::MergeState state;
+    ray::Cloud merged;
+    EXPECT_TRUE(state.load("inc_combined_merge.dat"));
+    EXPECT_TRUE(merged.load("inc_combined.ply"));
+    EXPECT_EQ(state.ellipsoids.size(), merged.rayCount());
+    EXPECT_EQ(command("./raycombine min room_combined.ply room3.ply 1 rays"), 0);
+    EXPECT_EQ(command("./raycombine min inc_combined.ply room3.ply 1 rays --incremental"), 0);
+    compareClouds("inc_combined_combined.ply", "room_combined_combined.ply", 0.01);
+
+    // a stale state, from before the last merge, is regenerated rather than used
+    EXPECT_EQ(copy("inc_combined_merge.dat inc_merge.dat"), 0);
+    EXPECT_EQ(command("./raycombine min inc.ply room2.ply 1 rays --incremental"), 0);
+    compareClouds("inc_combined.ply", "room_combined.ply", 1e-6);
+
+    // a truncated state fails to load
+    std::ifstream input("inc_combined_merge.dat", std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    input.close();
+    std::ofstream("inc_truncated_merge.dat", std::ios::binary) << bytes.substr(0, bytes.size() / 2);
+    EXPECT_FALSE(state.load("inc_truncated_merge.dat"));
+    EXPECT_FALSE(state.load("no_such_merge.dat"));
+  }
+
   /// Creates a building with random seed 1, and compares to the expected results
   TEST(Basic, RayCreate)
   {
@@ -189,6 +255,881 @@ namespace raytest
     compareMoments(cloud.getMoments(), {9.66298, 21.3454, 31.7177, 6.0926, 5.75511, 0.56438, 9.69155, 21.3605, 33.0883, 6.10555, 5.82564, 3.20507, 62.683, 36.1903, 0.514327, 0.504407, 0.413534, 1, 0.372377, 0.365965, 0.391709, 0});
   }
 
+  /// Direct discrete Fourier transform of @c data, with the same sign convention and normalisation as ray::FFTPlan
+  std::vector<std::complex<double>> directDFT(const std::vector<std::complex<double>> &data, bool inverse)
+  {
+    const double pi = 3.14159265358979323846;
+    const int n = (int)data.size();
+    std::vector<std::complex<double>> result(n);
+    for (int k = 0; k < n; k++)
+    {
+      for (int j = 0; j < n; j++)
+      {
+        result[k] += data[j] * std::polar(1.0, (inverse ? 2.0 : -2.0) * pi * (double)((k * j) % n) / (double)n);
+      }
+      if (inverse)
+        result[k] /= (double)n;
+    }
+    return result;
+  }
+
+  /// Compares the forward and inverse transforms of batched complex sequences against a direct DFT, for mixed radix
+  /// lengths of the form 2^a 3^b 5^c and for lengths with other prime factors
+  TEST(Basic, FFTPlan)
+  {
+    ray::srand(1);
+    const int batch = 3;
+    const int lengths[] = { 1, 2, 3, 4, 5, 6, 8, 9, 10, 12, 15, 16, 18, 20, 24, 25, 27, 30, 32, 36, 45, 60, 64, 75, 90, 7, 14, 22 };
+    for (int length : lengths)
+    {
+      std::vector<std::complex<double>> data((size_t)length * batch), work(data.size());
+      for (auto &value : data)
+        value = std::complex<double>(ray::random(-1.0, 1.0), ray::random(-1.0, 1.0));
+      ray::FFTPlan plan(length);
+      for (bool inverse : {false, true})
+      {
+        std::vector<std::complex<double>> transformed = data;
+        plan.transform(transformed.data(), work.data(), batch, inverse);
+        for (int b = 0; b < batch; b++)
+        {
+          std::vector<std::complex<double>> sequence(length);
+          for (int i = 0; i < length; i++) sequence[i] = data[b + batch * i];
+          std::vector<std::complex<double>> expected = directDFT(sequence, inverse);
+          for (int i = 0; i < length; i++)
+            EXPECT_NEAR(std::abs(transformed[b + batch * i] - expected[i]), 0.0, 1e-10 * length) << "length " << length;
+        }
+      }
+      // the inverse transform undoes the forward one
+      std::vector<std::complex<double>> round_trip = data;
+      plan.transform(round_trip.data(), work.data(), batch, false);
+      plan.transform(round_trip.data(), work.data(), batch, true);
+      for (size_t i = 0; i < data.size(); i++) EXPECT_NEAR(std::abs(round_trip[i] - data[i]), 0.0, 1e-12 * length);
+    }
+  }
+
+  /// Compares the real-to-complex 3D transform of random grids against a direct 3D DFT of the half spectrum, and
+  /// checks that the inverse transform recovers the grid
+  TEST(Basic, RealFFT3D)
+  {
+    const double pi = 3.14159265358979323846;
+    ray::srand(2);
+    for (const Eigen::Vector3i &dims : {Eigen::Vector3i(2, 1, 1), Eigen::Vector3i(6, 5, 3), Eigen::Vector3i(10, 9, 4),
+                                        Eigen::Vector3i(12, 8, 15), Eigen::Vector3i(14, 3, 2)})
+    {
+      ray::RealFFT3D transform(dims);
+      const int width = transform.spectrumWidth();
+      const size_t num_rows = (size_t)dims[1] * dims[2];
+      std::vector<double> grid((size_t)dims[0] * num_rows);
+      for (auto &value : grid) value = ray::random(-1.0, 1.0);
+      // the padded layout has each real row of dims[0] values in 2*width doubles
+      std::vector<std::complex<double>> data(num_rows * width);
+      for (size_t row = 0; row < num_rows; row++)
+      {
+        double *values = reinterpret_cast<double *>(&data[row * width]);
+        for (int x = 0; x < dims[0]; x++) values[x] = grid[row * dims[0] + x];
+      }
+      transform.forward(data.data());
+      for (int z = 0; z < dims[2]; z++)
+      {
+        for (int y = 0; y < dims[1]; y++)
+        {
+          for (int u = 0; u < width; u++)
+          {
+            std::complex<double> expected(0.0, 0.0);
+            for (int k = 0; k < dims[2]; k++)
+            {
+              for (int j = 0; j < dims[1]; j++)
+              {
+                for (int i = 0; i < dims[0]; i++)
+                {
+                  const double phase = (double)(u * i % dims[0]) / dims[0] + (double)(y * j % dims[1]) / dims[1] +
+                                       (double)(z * k % dims[2]) / dims[2];
+                  expected += grid[((size_t)k * dims[1] + j) * dims[0] + i] * std::polar(1.0, -2.0 * pi * phase);
+                }
+              }
+            }
+            const std::complex<double> &result = data[((size_t)z * dims[1] + y) * width + u];
+            EXPECT_NEAR(std::abs(result - expected), 0.0, 1e-9) << "dims " << dims.transpose();
+          }
+        }
+      }
+      transform.inverse(data.data());
+      for (size_t row = 0; row < num_rows; row++)
+      {
+        const double *values = reinterpret_cast<const double *>(&data[row * width]);
+        for (int x = 0; x < dims[0]; x++) EXPECT_NEAR(values[x], grid[row * dims[0] + x], 1e-12);
+      }
+    }
+  }
+
+  /// An element of the HeapSet test, ordered by priority then id, as the concave hull's growth front is
+  struct HeapKey
+  {
+    double priority;
+    int id;
+  };
+  struct HeapKeyComp
+  {
+    bool operator()(const HeapKey &lhs, const HeapKey &rhs) const
+    {
+      return lhs.priority == rhs.priority ? lhs.id < rhs.id : lhs.priority < rhs.priority;
+    }
+  };
+  struct HeapKeyHash
+  {
+    size_t operator()(const HeapKey &key) const { return std::hash<double>()(key.priority) ^ (size_t)key.id; }
+  };
+
+  /// Applies the same random inserts, erases and pops to a HeapSet and a std::set, including repeated inserts,
+  /// erases of absent elements and ids with several priorities at once, and checks they always have the same contents
+  TEST(Basic, HeapSet)
+  {
+    ray::srand(3);
+    ray::HeapSet<HeapKey, HeapKeyComp, HeapKeyHash> heap;
+    std::set<HeapKey, HeapKeyComp> set;
+    for (int i = 0; i < 20000; i++)
+    {
+      // few priorities and ids, so that equal elements and equal priorities are common
+      const HeapKey key = { (double)(ray::rand() % 20), (int)(ray::rand() % 30) };
+      const unsigned int operation = ray::rand() % 10;
+      if (operation < 5)
+      {
+        heap.insert(key);
+        set.insert(key);
+      }
+      else if (operation < 8)
+      {
+        heap.erase(key);
+        set.erase(key);
+      }
+      else if (!set.empty())
+      {
+        heap.pop();
+        set.erase(set.begin());
+      }
+      ASSERT_EQ(heap.size(), set.size());
+      ASSERT_EQ(heap.empty(), set.empty());
+      if (!set.empty())
+      {
+        EXPECT_EQ(heap.top().priority, set.begin()->priority);
+        EXPECT_EQ(heap.top().id, set.begin()->id);
+      }
+      if (i % 1000 == 999)
+      {
+        std::vector<HeapKey> sorted = heap.sorted();
+        ASSERT_EQ(sorted.size(), set.size());
+        size_t j = 0;
+        for (auto &element : set)
+        {
+          EXPECT_EQ(sorted[j].priority, element.priority);
+          EXPECT_EQ(sorted[j++].id, element.id);
+        }
+      }
+    }
+    heap.clear();
+    EXPECT_TRUE(heap.empty());
+  }
+
+  /// The agglomeration rules of generateClusters, applied by copying point id lists between clusters, over the
+  /// neighbouring point @c pairs in order of distance
+  std::vector<std::vector<int>> referenceClusters(const std::vector<Eigen::Vector3d> &points,
+                                                  std::vector<std::pair<double, std::pair<int, int>>> pairs,
+                                                  double max_diameter)
+  {
+    std::sort(pairs.begin(), pairs.end());
+    std::vector<std::vector<int>> ids(points.size());
+    std::vector<Eigen::Vector3d> min_bounds = points, max_bounds = points;
+    std::vector<int> cluster_ids(points.size());
+    for (size_t i = 0; i < points.size(); i++)
+    {
+      ids[i].push_back((int)i);
+      cluster_ids[i] = (int)i;
+    }
+    for (auto &pair : pairs)
+    {
+      const int cl1 = cluster_ids[pair.second.first], cl2 = cluster_ids[pair.second.second];
+      if (cl1 == cl2)
+        continue;
+      const Eigen::Vector3d minb = ray::minVector(min_bounds[cl1], min_bounds[cl2]);
+      const Eigen::Vector3d maxb = ray::maxVector(max_bounds[cl1], max_bounds[cl2]);
+      if ((maxb - minb).maxCoeff() >= max_diameter)
+        continue;
+      const int first = std::min(cl1, cl2), last = std::max(cl1, cl2);
+      min_bounds[first] = minb;
+      max_bounds[first] = maxb;
+      ids[first].insert(ids[first].begin(), ids[last].begin(), ids[last].end());
+      for (auto &id : ids[last]) cluster_ids[id] = first;
+      ids[last].clear();
+    }
+    std::vector<std::vector<int>> clusters;
+    for (auto &cluster : ids)
+    {
+      if (!cluster.empty())
+        clusters.push_back(cluster);
+    }
+    return clusters;
+  }
+
+  /// Clusters shuffled blobs of up to 9 points, which are farther apart than the neighbour search radius, so each
+  /// point's neighbours are exactly the rest of its blob. Blobs wider than the maximum diameter are only partly
+  /// agglomerated. The union-find clustering must give the same clusters, in the same order, as the reference
+  TEST(Basic, Clusters)
+  {
+    ray::srand(4);
+    const double min_diameter = 3.2, max_diameter = 1.0;
+    std::vector<Eigen::Vector3d> points;
+    std::vector<int> blobs;
+    for (int b = 0; b < 200; b++)
+    {
+      const int size = 1 + (int)(ray::rand() % 9);
+      const double width = ray::random(0.2, 0.9);
+      const Eigen::Vector3d centre(10.0 * (b % 20), 10.0 * (b / 20), 0.0);
+      for (int i = 0; i < size; i++)
+      {
+        points.push_back(centre + Eigen::Vector3d(ray::random(-width, width), ray::random(-width, width),
+                                                  ray::random(-width, width)));
+        blobs.push_back(b);
+      }
+    }
+    for (size_t i = points.size() - 1; i > 0; i--)
+    {
+      const size_t j = ray::rand() % (i + 1);
+      std::swap(points[i], points[j]);
+      std::swap(blobs[i], blobs[j]);
+    }
+    std::vector<std::pair<double, std::pair<int, int>>> pairs;
+    for (int i = 0; i < (int)points.size(); i++)
+    {
+      for (int j = i + 1; j < (int)points.size(); j++)
+      {
+        if (blobs[i] == blobs[j])
+          pairs.push_back({ (points[i] - points[j]).squaredNorm(), { i, j } });
+      }
+    }
+    std::vector<std::vector<int>> clusters;
+    ray::generateClusters(clusters, points, min_diameter, max_diameter);
+    std::vector<std::vector<int>> expected = referenceClusters(points, pairs, max_diameter);
+    EXPECT_GT(expected.size(), 200u);  // some blobs are split
+    EXPECT_TRUE(clusters == expected);
+
+    // the corner cases
+    clusters.clear();
+    ray::generateClusters(clusters, std::vector<Eigen::Vector3d>(), min_diameter, max_diameter);
+    EXPECT_TRUE(clusters.empty());
+    ray::generateClusters(clusters, std::vector<Eigen::Vector3d>(1, Eigen::Vector3d(1, 2, 3)), min_diameter,
+                          max_diameter);
+    EXPECT_TRUE(clusters == std::vector<std::vector<int>>(1, std::vector<int>(1, 0)));
+  }
+
+  /// Aligns a scan of one side of a larger reference onto it through the reference pyramid. The finest level's cached
+  /// window on the reference's centre holds none of the scan, so must be replaced by a window on the overlap
+  TEST(Basic, AlignmentReferenceOffCentre)
+  {
+    // a 64 m square of ground with walls of random lengths, heights and orientations
+    ray::srand(3);
+    ray::Cloud reference;
+    auto add_point = [&reference](const Eigen::Vector3d &end) {
+      reference.addRay(end + Eigen::Vector3d(0, 0, 10), end, (double)reference.ends.size(), ray::RGBA::white());
+    };
+    for (int i = 0; i < 20000; i++)
+    {
+      const double x = ray::random(0.0, 64.0), y = ray::random(0.0, 64.0);
+      add_point(Eigen::Vector3d(x, y, 0.3 * std::sin(x / 3.0) * std::cos(y / 5.0)));
+    }
+    for (int i = 0; i < 80; i++)
+    {
+      const Eigen::Vector3d base(ray::random(0.0, 64.0), ray::random(0.0, 64.0), 0.0);
+      const double angle = ray::random(0.0, ray::kPi), length = ray::random(2.0, 8.0), height = ray::random(1.0, 4.0);
+      const Eigen::Vector3d side(length * std::cos(angle), length * std::sin(angle), 0.0);
+      for (int j = 0; j < 200; j++)
+        add_point(base + ray::random(0.0, 1.0) * side + Eigen::Vector3d(0, 0, ray::random(0.0, height)));
+    }
+    // the scan is the reference's side, up to 2 m short of the finest window, displaced by a known offset
+    const Eigen::Vector3d offset(0.6, -0.4, 0.1);
+    ray::Cloud scan, original;
+    for (size_t i = 0; i < reference.ends.size(); i++)
+    {
+      if (reference.ends[i][0] < 22.0)
+      {
+        original.addRay(reference, i);
+        scan.addRay(reference.starts[i] + offset, reference.ends[i] + offset, reference.times[i],
+                    reference.colours[i]);
+      }
+    }
+
+    // the pyramid runs from 4 m voxels, down to 0.5 m voxels in a 16 m window on the reference's centre
+    ray::AlignmentReference aligner(reference, 0.5, 32);
+    aligner.align(scan);
+    double mean_error = 0.0;
+    for (size_t i = 0; i < scan.ends.size(); i++) mean_error += (scan.ends[i] - original.ends[i]).norm();
+    mean_error /= (double)scan.ends.size();
+    EXPECT_LT(mean_error, 0.5 * offset.norm());  // finite, and most of the offset removed
+  }
+
+  /// Extracts trees and trunks from a generated forest whole and in tiles. The tiles must find the same trees, with
+  /// globally unique section ids, keep every ray in the segmented cloud, and find each trunk once
+  TEST(Basic, RayExtractTreesTiles)
+  {
+    EXPECT_EQ(command("raycreate forest 3"), 0);
+    EXPECT_EQ(copy("forest.ply forest_tiled.ply"), 0);
+    // the generated forest's ground is flat, so a ground mesh is given rather than extracted, which requires qhull
+    ray::Mesh ground;
+    const int width = 30;  // metres, in 1 m squares centred on the forest
+    for (int y = 0; y <= width; y++)
+    {
+      for (int x = 0; x <= width; x++)
+      {
+        ground.vertices().push_back(Eigen::Vector3d(x - 0.5 * width, y - 0.5 * width, 0.0));
+        if (x < width && y < width)
+        {
+          const int i = y * (width + 1) + x;
+          ground.indexList().push_back(Eigen::Vector3i(i, i + 1, i + width + 2));
+          ground.indexList().push_back(Eigen::Vector3i(i, i + width + 2, i + width + 1));
+        }
+      }
+    }
+    EXPECT_TRUE(ray::writePlyMesh("forest_ground.ply", ground));
+    EXPECT_EQ(command("rayextract trees forest.ply forest_ground.ply"), 0);
+    EXPECT_EQ(command("rayextract trees forest_tiled.ply forest_ground.ply --tiles 8,2"), 0);
+
+    ray::ForestStructure forest, tiled;
+    EXPECT_TRUE(forest.load("forest_trees.txt"));
+    EXPECT_TRUE(tiled.load("forest_tiled_trees.txt"));
+    EXPECT_GT(forest.trees.size(), 1u);
+    EXPECT_EQ(tiled.trees.size(), forest.trees.size());
+    std::set<int> section_ids;
+    size_t num_sections = 0;
+    for (const auto &tree : tiled.trees)
+    {
+      const auto &names = tree.attributeNames();
+      const int id_index = (int)(std::find(names.begin(), names.end(), "section_id") - names.begin());
+      EXPECT_LT(id_index, (int)names.size());
+      for (const auto &segment : tree.segments())
+      {
+        section_ids.insert((int)segment.attributes[id_index]);
+        num_sections++;
+      }
+    }
+    EXPECT_EQ(section_ids.size(), num_sections);
+
+    // the segmented clouds have the same rays, coloured by the same number of trees
+    ray::Cloud segmented, tiled_segmented;
+    EXPECT_TRUE(segmented.load("forest_segmented.ply"));
+    EXPECT_TRUE(tiled_segmented.load("forest_tiled_segmented.ply"));
+    EXPECT_EQ(tiled_segmented.rayCount(), segmented.rayCount());
+    auto treeIds = [](const ray::Cloud &cloud) {
+      std::set<int> ids;
+      for (const auto &colour : cloud.colours) ids.insert(ray::convertColourToInt(colour));
+      ids.erase(-1);  // unsegmented
+      return ids;
+    };
+    EXPECT_EQ(treeIds(tiled_segmented).size(), treeIds(segmented).size());
+
+    // each trunk is kept by only the tile owning its base, so each tiled trunk matches one untiled trunk. The tiles'
+    // differing rays move the fitted trunks slightly, mostly in height
+    EXPECT_EQ(command("rayextract trunks forest.ply"), 0);
+    EXPECT_EQ(command("rayextract trunks forest_tiled.ply --tiles 8,2"), 0);
+    ray::ForestStructure trunks, tiled_trunks;
+    EXPECT_TRUE(trunks.load("forest_trunks.txt"));
+    EXPECT_TRUE(tiled_trunks.load("forest_tiled_trunks.txt"));
+    EXPECT_GT(trunks.trees.size(), 1u);
+    EXPECT_EQ(tiled_trunks.trees.size(), trunks.trees.size());
+    for (const auto &tiled_trunk : tiled_trunks.trees)
+    {
+      int num_matches = 0;
+      for (const auto &trunk : trunks.trees)
+      {
+        if ((tiled_trunk.segments()[0].tip - trunk.segments()[0].tip).head<2>().norm() < 0.2)
+          num_matches++;
+      }
+      EXPECT_EQ(num_matches, 1);
+    }
+  }
+
+  /// Stitches per-tile meshes of a known height field, each covering its tile's overlap, as rayextract terrain --tiles
+  /// does. The result must be the single mesh of the whole height field, with each triangle and vertex once
+  TEST(Basic, StitchTerrain)
+  {
+    ray::srand(7);
+    ray::Cloud cloud;
+    for (int i = 0; i < 5000; i++)
+    {
+      const Eigen::Vector3d end(ray::random(-10.0, 10.0), ray::random(-10.0, 10.0), 0.0);
+      cloud.addRay(end + Eigen::Vector3d(0, 0, 2), end, (double)i, ray::RGBA::white());
+    }
+    cloud.save("stitch.ply");
+    std::vector<ray::CloudTile> tiles;
+    const double overlap = 2.0;
+    EXPECT_TRUE(ray::splitIntoTiles("stitch.ply", "stitch_tile", 8.0, overlap, tiles));
+    EXPECT_GT(tiles.size(), 1u);
+
+    // a mesh of the height field on a 0.5 m lattice within the bounds, so vertices in the overlaps coincide
+    auto heightFieldMesh = [](const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_max) {
+      const double spacing = 0.5;
+      const Eigen::Vector2i min_index(std::ceil(std::max(box_min[0], -10.0) / spacing),
+                                      std::ceil(std::max(box_min[1], -10.0) / spacing));
+      const Eigen::Vector2i max_index(std::floor(std::min(box_max[0], 10.0) / spacing),
+                                      std::floor(std::min(box_max[1], 10.0) / spacing));
+      const Eigen::Vector2i dims = max_index - min_index + Eigen::Vector2i(1, 1);
+      ray::Mesh mesh;
+      for (int y = 0; y < dims[1]; y++)
+      {
+        for (int x = 0; x < dims[0]; x++)
+        {
+          const double px = spacing * (double)(min_index[0] + x), py = spacing * (double)(min_index[1] + y);
+          mesh.vertices().push_back(Eigen::Vector3d(px, py, 0.3 * std::sin(px) + 0.05 * py));
+          if (x < dims[0] - 1 && y < dims[1] - 1)
+          {
+            const int i = y * dims[0] + x;
+            mesh.indexList().push_back(Eigen::Vector3i(i, i + 1, i + dims[0] + 1));
+            mesh.indexList().push_back(Eigen::Vector3i(i, i + dims[0] + 1, i + dims[0]));
+          }
+        }
+      }
+      return mesh;
+    };
+    const Eigen::Vector3d expand(overlap, overlap, 0.0);
+    for (const auto &tile : tiles)
+    {
+      EXPECT_TRUE(ray::writePlyMesh(tile.stub + "_mesh.ply", heightFieldMesh(tile.min_bound - expand,
+                                                                             tile.max_bound + expand)));
+    }
+    const ray::Mesh whole = heightFieldMesh(Eigen::Vector3d(-10, -10, 0), Eigen::Vector3d(10, 10, 0));
+    EXPECT_EQ(ray::stitchTerrain(tiles, "stitch_mesh.ply"), (int)whole.indexList().size());
+    ray::removeTileFiles(tiles, { "_mesh.ply" });
+
+    ray::Mesh stitched;
+    EXPECT_TRUE(ray::readPlyMesh("stitch_mesh.ply", stitched));
+    EXPECT_EQ(stitched.vertices().size(), whole.vertices().size());
+    const Eigen::Array<double, 6, 1> moments = whole.getMoments();
+    compareMoments(stitched.getMoments(), std::vector<double>(moments.data(), moments.data() + moments.size()), 1e-6);
+  }
+
+  /// Saves an occupancy grid filled from a generated cloud, then checks that it loads back only for the same cloud,
+  /// ground heights, height window, bounds and pixel width, and not when the file is truncated or of another format
+  TEST(Basic, OccupancyGridCache)
+  {
+    ray::srand(5);
+    ray::Cloud cloud;
+    for (int i = 0; i < 2000; i++)
+    {
+      const Eigen::Vector3d start(ray::random(0.0, 10.0), ray::random(0.0, 10.0), 2.0);
+      const Eigen::Vector3d end(ray::random(0.0, 10.0), ray::random(0.0, 10.0), 0.5);
+      cloud.addRay(start, end, (double)i, ray::RGBA::white());
+    }
+    cloud.save("occupancy.ply");
+    const Eigen::Vector3d min_bound(0, 0, 0), max_bound(10, 10, 3);
+    const double width = 0.5, clip_min = 0.0, clip_max = 3.0;
+    ray::OccupancyGrid2D grid;
+    grid.init(min_bound, max_bound, width);
+    const Eigen::ArrayXXd lows = Eigen::ArrayXXd::Zero(grid.dims()[0], grid.dims()[1]);
+    grid.fillDensities("occupancy.ply", lows, clip_min, clip_max);
+    grid.save("occupancy.dat");
+
+    auto same_pixels = [](const ray::OccupancyGrid2D &grid1, const ray::OccupancyGrid2D &grid2) {
+      int num_filled = 0;
+      for (int x = 0; x < grid1.dims()[0]; x++)
+      {
+        for (int y = 0; y < grid1.dims()[1]; y++)
+        {
+          const Eigen::Vector3i index(x, y, 0);
+          if (grid1.pixel(index).bits != grid2.pixel(index).bits)
+            return false;
+          num_filled += grid1.pixel(index).bits != 0;
+        }
+      }
+      return num_filled > 0;
+    };
+    ray::OccupancyGrid2D loaded;
+    loaded.init(min_bound, max_bound, width);
+    EXPECT_TRUE(loaded.load("occupancy.dat", "occupancy.ply", lows, clip_min, clip_max));
+    EXPECT_TRUE(same_pixels(grid, loaded));
+
+    // a stale or mismatched file is rejected and leaves the grid unchanged
+    ray::OccupancyGrid2D empty;
+    empty.init(min_bound, max_bound, width);
+    EXPECT_FALSE(empty.load("missing.dat", "occupancy.ply", lows, clip_min, clip_max));
+    EXPECT_FALSE(empty.load("occupancy.dat", "occupancy.ply", lows, clip_min, clip_max + 1.0));
+    EXPECT_FALSE(empty.load("occupancy.dat", "occupancy.ply", lows, clip_min - 1.0, clip_max));
+    Eigen::ArrayXXd other_lows = lows;
+    other_lows(1, 2) = 0.1;
+    EXPECT_FALSE(empty.load("occupancy.dat", "occupancy.ply", other_lows, clip_min, clip_max));
+    EXPECT_FALSE(same_pixels(grid, empty));
+    ray::OccupancyGrid2D other_width, other_bounds;
+    other_width.init(min_bound, max_bound, 0.25);
+    EXPECT_FALSE(other_width.load("occupancy.dat", "occupancy.ply", lows, clip_min, clip_max));
+    other_bounds.init(min_bound - Eigen::Vector3d(0.5, 0, 0), max_bound, width);
+    EXPECT_FALSE(other_bounds.load("occupancy.dat", "occupancy.ply", lows, clip_min, clip_max));
+
+    // a truncated file, and a file with another format tag
+    std::ifstream input("occupancy.dat", std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    input.close();
+    std::ofstream("truncated.dat", std::ios::binary) << bytes.substr(0, bytes.size() - 1);
+    EXPECT_FALSE(empty.load("truncated.dat", "occupancy.ply", lows, clip_min, clip_max));
+    std::string retagged = bytes;
+    retagged[7] = 'x';
+    std::ofstream("retagged.dat", std::ios::binary) << retagged;
+    EXPECT_FALSE(empty.load("retagged.dat", "occupancy.ply", lows, clip_min, clip_max));
+
+    // changing the cloud invalidates the file
+    cloud.addRay(Eigen::Vector3d(1, 1, 2), Eigen::Vector3d(2, 2, 0.5), 2000.0, ray::RGBA::white());
+    cloud.save("occupancy.ply");
+    EXPECT_FALSE(empty.load("occupancy.dat", "occupancy.ply", lows, clip_min, clip_max));
+  }
+
+  /// Splits a cloud by a closed box mesh, with a finely divided top, two large bottom triangles and divided sides, so
+  /// that the 2D triangle index holds triangles of very different sizes. Compares each split against the box itself
+  TEST(Basic, MeshSplitCloud)
+  {
+    const Eigen::Vector3d box_min(0, 0, 0), box_max(4, 4, 2);
+    ray::Mesh mesh;
+    // adds the quad with corner @c a and sides @c u and @c v, divided into @c nu by @c nv pairs of triangles
+    auto add_quad = [&mesh](const Eigen::Vector3d &a, const Eigen::Vector3d &u, const Eigen::Vector3d &v, int nu,
+                            int nv) {
+      const int first = (int)mesh.vertices().size();
+      for (int j = 0; j <= nv; j++)
+      {
+        for (int i = 0; i <= nu; i++) mesh.vertices().push_back(a + u * (double)i / nu + v * (double)j / nv);
+      }
+      for (int j = 0; j < nv; j++)
+      {
+        for (int i = 0; i < nu; i++)
+        {
+          const int v00 = first + j * (nu + 1) + i, v10 = v00 + 1, v01 = v00 + nu + 1, v11 = v01 + 1;
+          mesh.indexList().push_back(Eigen::Vector3i(v00, v10, v11));
+          mesh.indexList().push_back(Eigen::Vector3i(v00, v11, v01));
+        }
+      }
+    };
+    const Eigen::Vector3d x(4, 0, 0), y(0, 4, 0), z(0, 0, 2);
+    add_quad(box_min + z, x, y, 40, 40);
+    add_quad(box_min, y, x, 1, 1);
+    add_quad(box_min, x, z, 8, 4);
+    add_quad(box_min + y, z, x, 4, 8);
+    add_quad(box_min, z, y, 4, 8);
+    add_quad(box_min + x, y, z, 8, 4);
+
+    ray::srand(11);
+    ray::Cloud cloud;
+    for (int i = 0; i < 20000; i++)
+    {
+      const Eigen::Vector3d end(ray::random(-1.0, 5.0), ray::random(-1.0, 5.0), ray::random(-1.0, 3.0));
+      cloud.addRay(end + Eigen::Vector3d(0.1, 0.2, 1.0), end, (double)i, ray::RGBA::white());
+    }
+    cloud.save("splitbox.ply");
+
+    for (double offset : { 0.0, 0.3, -0.3 })
+    {
+      // the inside rays in file order, by the box's signed distance. Rays within a hair of the offset are not checked
+      std::vector<double> expected_times;
+      std::set<double> ambiguous_times;
+      for (size_t i = 0; i < cloud.ends.size(); i++)
+      {
+        const Eigen::Vector3d &p = cloud.ends[i];
+        const Eigen::Vector3d below = box_min - p, above = p - box_max;
+        const double outside_dist = below.cwiseMax(above).cwiseMax(Eigen::Vector3d::Zero()).norm();
+        const double inside_dist = std::max(0.0, -below.cwiseMax(above).maxCoeff());
+        const double distance = outside_dist > 0.0 ? -outside_dist : inside_dist;  // positive inside
+        if (std::abs(distance - offset) < 1e-6)
+          ambiguous_times.insert(cloud.times[i]);
+        else if (distance > offset)
+          expected_times.push_back(cloud.times[i]);
+      }
+      EXPECT_TRUE(ambiguous_times.empty());
+      ASSERT_TRUE(mesh.splitCloud("splitbox.ply", offset, "splitbox_inside.ply", "splitbox_outside.ply"));
+      ray::Cloud inside, outside;
+      ASSERT_TRUE(inside.load("splitbox_inside.ply", true, 0));
+      ASSERT_TRUE(outside.load("splitbox_outside.ply", true, 0));
+      EXPECT_EQ(inside.ends.size() + outside.ends.size(), cloud.ends.size());
+      EXPECT_GT(expected_times.size(), 1000u);
+      EXPECT_TRUE(inside.times == expected_times);
+      EXPECT_TRUE(std::is_sorted(outside.times.begin(), outside.times.end()));
+    }
+  }
+
+  /// Not a unit test: a throughput harness for the triangle tests of Mesh::splitCloud, run by
+  /// scripts/raysplit_mesh_benchmark.sh with --gtest_also_run_disabled_tests. The mesh is a stack of identical
+  /// triangles, so every ray's vertical ray test and distance test covers every triangle, and the triangle tests per
+  /// second are the rays per second times the number of triangles. Offset 0 runs only the vertical ray tests, and the
+  /// negative offset adds a distance test to each triangle, as the rays end above the stack and further than the offset
+  /// from it. The mesh and cloud are left in split_kernel_mesh.ply and split_kernel_cloud.ply for timing raysplit
+  TEST(Basic, DISABLED_MeshSplitThroughput)
+  {
+    const int num_triangles = 1024, num_rays = 20000;
+    ray::Mesh mesh;
+    for (int i = 0; i < num_triangles; i++)
+    {
+      const double z = 0.001 * (double)i;
+      mesh.vertices().push_back(Eigen::Vector3d(0, 0, z));
+      mesh.vertices().push_back(Eigen::Vector3d(10, 0, z));
+      mesh.vertices().push_back(Eigen::Vector3d(0, 10, z));
+      mesh.indexList().push_back(Eigen::Vector3i(3 * i, 3 * i + 1, 3 * i + 2));
+    }
+    ASSERT_TRUE(ray::writePlyMesh("split_kernel_mesh.ply", mesh));
+    ray::srand(41);
+    ray::Cloud cloud;
+    for (int i = 0; i < num_rays; i++)
+    {
+      const double x = ray::random(0.5, 4.5), y = ray::random(0.5, 4.5);
+      cloud.addRay(Eigen::Vector3d(x, y, 5), Eigen::Vector3d(x, y, ray::random(2.0, 3.0)), (double)i,
+                   ray::RGBA::white());
+    }
+    cloud.save("split_kernel_cloud.ply");
+
+    // the time to split at @c offset, in seconds
+    auto split_time = [&mesh](double offset) {
+      const auto start = std::chrono::steady_clock::now();
+      EXPECT_TRUE(
+        mesh.splitCloud("split_kernel_cloud.ply", offset, "split_kernel_inside.ply", "split_kernel_outside.ply"));
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    const double ray_time = split_time(0.0);
+    const double distance_time = split_time(-0.5);
+    const double num_tests = (double)num_triangles * (double)num_rays;
+    std::cout << "vertical ray tests: " << num_tests / ray_time / 1e6 << " million per second" << std::endl;
+    std::cout << "distance tests: " << num_tests / std::max(distance_time - ray_time, 1e-9) / 1e6
+              << " million per second" << std::endl;
+  }
+
+  /// Whether two meshes have the same vertices, triangles, uvs and colours
+  bool sameMesh(const ray::Mesh &mesh1, const ray::Mesh &mesh2)
+  {
+    if (mesh1.colours().size() != mesh2.colours().size())
+      return false;
+    for (size_t i = 0; i < mesh1.colours().size(); i++)
+    {
+      const ray::RGBA &c1 = mesh1.colours()[i], &c2 = mesh2.colours()[i];
+      if (c1.red != c2.red || c1.green != c2.green || c1.blue != c2.blue || c1.alpha != c2.alpha)
+        return false;
+    }
+    return mesh1.vertices() == mesh2.vertices() && mesh1.indexList() == mesh2.indexList() &&
+           mesh1.uvList() == mesh2.uvList();
+  }
+
+  /// A serial reference for Mesh::reduce: the used vertices, with their colours, in the order of first use
+  ray::Mesh referenceReduce(const ray::Mesh &mesh)
+  {
+    ray::Mesh result = mesh;
+    result.vertices().clear();
+    result.colours().clear();
+    const bool has_colours = mesh.colours().size() == mesh.vertices().size();
+    std::vector<int> new_ids(mesh.vertices().size(), -1);
+    for (auto &tri : result.indexList())
+    {
+      for (int i = 0; i < 3; i++)
+      {
+        if (new_ids[tri[i]] == -1)
+        {
+          new_ids[tri[i]] = (int)result.vertices().size();
+          result.vertices().push_back(mesh.vertices()[tri[i]]);
+          if (has_colours)
+            result.colours().push_back(mesh.colours()[tri[i]]);
+        }
+        tri[i] = new_ids[tri[i]];
+      }
+    }
+    return result;
+  }
+
+  /// A brute force reference for Mesh::weld
+  ray::Mesh referenceWeld(const ray::Mesh &mesh, double epsilon)
+  {
+    const std::vector<Eigen::Vector3d> &vertices = mesh.vertices();
+    std::vector<int> links(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++)
+    {
+      links[i] = (int)i;
+      for (size_t j = 0; j < i && links[i] == (int)i; j++)
+      {
+        if ((vertices[j] - vertices[i]).norm() <= epsilon)
+          links[i] = (int)j;
+      }
+    }
+    ray::Mesh welded = mesh;
+    welded.indexList().clear();
+    welded.uvList().clear();
+    const bool has_uvs = mesh.uvList().size() == mesh.indexList().size();
+    for (size_t t = 0; t < mesh.indexList().size(); t++)
+    {
+      Eigen::Vector3i tri;
+      for (int i = 0; i < 3; i++)
+      {
+        int id = mesh.indexList()[t][i];
+        while (links[id] != id) id = links[id];
+        tri[i] = id;
+      }
+      if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0])
+        continue;
+      welded.indexList().push_back(tri);
+      if (has_uvs)
+        welded.uvList().push_back(mesh.uvList()[t]);
+    }
+    return referenceReduce(welded);
+  }
+
+  /// Checks the parallel Mesh::reduce against a serial pass, on a mesh spanning several compaction blocks with unused
+  /// vertices, with and without per-vertex colours
+  TEST(Basic, MeshReduce)
+  {
+    ray::srand(21);
+    ray::Mesh mesh;
+    for (int i = 0; i < 300000; i++)
+    {
+      mesh.vertices().push_back(Eigen::Vector3d(ray::random(0.0, 1.0), ray::random(0.0, 1.0), (double)i));
+      mesh.colours().push_back(ray::RGBA((uint8_t)i, (uint8_t)(i >> 8), (uint8_t)(i >> 16), 255));
+    }
+    for (int t = 0; t < 150000; t++)  // uses about two thirds of the vertices
+    {
+      mesh.indexList().push_back(
+        Eigen::Vector3i((int)(ray::rand() % 300000), (int)(ray::rand() % 300000), (int)(ray::rand() % 300000)));
+    }
+    ray::Mesh reduced = mesh;
+    reduced.reduce();
+    EXPECT_LT(reduced.vertices().size(), mesh.vertices().size());
+    EXPECT_TRUE(sameMesh(reduced, referenceReduce(mesh)));
+
+    mesh.colours().clear();
+    reduced = mesh;
+    reduced.reduce();
+    EXPECT_TRUE(reduced.colours().empty());
+    EXPECT_TRUE(sameMesh(reduced, referenceReduce(mesh)));
+
+    ray::Mesh empty;
+    empty.reduce();
+    EXPECT_TRUE(empty.vertices().empty() && empty.indexList().empty());
+  }
+
+  /// Checks Mesh::weld against a brute force weld, on a mesh of vertex clusters, some of them exact copies, with
+  /// colours and uvs
+  TEST(Basic, MeshWeld)
+  {
+    ray::srand(22);
+    ray::Mesh mesh;
+    for (int site = 0; site < 1500; site++)
+    {
+      const Eigen::Vector3d pos(ray::random(0.0, 3.0), ray::random(0.0, 3.0), ray::random(0.0, 3.0));
+      const int num_copies = 1 + (int)(ray::rand() % 3);
+      for (int i = 0; i < num_copies; i++)
+      {
+        const Eigen::Vector3d jitter(ray::random(-0.002, 0.002), ray::random(-0.002, 0.002),
+                                     ray::random(-0.002, 0.002));
+        mesh.vertices().push_back(ray::rand() % 2 ? pos : Eigen::Vector3d(pos + jitter));
+      }
+    }
+    const int num_vertices = (int)mesh.vertices().size();
+    for (int i = num_vertices - 1; i > 0; i--) std::swap(mesh.vertices()[i], mesh.vertices()[ray::rand() % (i + 1)]);
+    for (int i = 0; i < num_vertices; i++) mesh.colours().push_back(ray::RGBA((uint8_t)i, (uint8_t)(i >> 8), 0, 255));
+    for (int t = 0; t < 4000; t++)
+    {
+      mesh.indexList().push_back(Eigen::Vector3i((int)(ray::rand() % num_vertices), (int)(ray::rand() % num_vertices),
+                                                 (int)(ray::rand() % num_vertices)));
+      const std::complex<float> uv((float)t, (float)-t);
+      mesh.uvList().push_back(Eigen::Vector3cf(uv, uv + 1.0f, uv + 2.0f));
+    }
+
+    for (double epsilon : { 0.0, 0.01, 0.2 })
+    {
+      ray::Mesh welded = mesh;
+      welded.weld(epsilon);
+      const ray::Mesh expected = referenceWeld(mesh, epsilon);
+      EXPECT_LT(expected.vertices().size(), mesh.vertices().size());
+      EXPECT_TRUE(sameMesh(welded, expected));
+    }
+
+    // welding two copies of a grid that share an edge, without colours or uvs
+    ray::Mesh grids;
+    for (int copy = 0; copy < 2; copy++)
+    {
+      for (int y = 0; y <= 4; y++)
+      {
+        for (int x = 0; x <= 4; x++) grids.vertices().push_back(Eigen::Vector3d(x + 4 * copy, y, 0));
+      }
+      for (int y = 0; y < 4; y++)
+      {
+        for (int x = 0; x < 4; x++)
+        {
+          const int v = 25 * copy + 5 * y + x;
+          grids.indexList().push_back(Eigen::Vector3i(v, v + 1, v + 6));
+          grids.indexList().push_back(Eigen::Vector3i(v, v + 6, v + 5));
+        }
+      }
+    }
+    grids.weld();
+    EXPECT_EQ(grids.vertices().size(), 45u);
+    EXPECT_EQ(grids.indexList().size(), 64u);
+    EXPECT_TRUE(grids.colours().empty() && grids.uvList().empty());
+  }
+
+  /// Saves a trajectory in the binary and text formats and loads it back, then checks the edge cases of both formats:
+  /// unordered times, empty and truncated files, comments, CRLF line ends, malformed and over-long lines
+  TEST(Basic, TrajectoryFiles)
+  {
+    ray::srand(31);
+    ray::Trajectory trajectory;
+    std::vector<ray::TrajectoryNode> nodes(1000);
+    double time = 1.6e9;
+    for (auto &node : nodes)
+    {
+      time += ray::random(0.001, 0.1);
+      node.time = time;
+      node.point = Eigen::Vector3d(ray::random(-100.0, 100.0), ray::random(-100.0, 100.0), ray::random(0.0, 10.0));
+      trajectory.times().push_back(node.time);
+      trajectory.points().push_back(node.point);
+    }
+    // binary is exact, and text is to 15 significant digits
+    ASSERT_TRUE(trajectory.save("trajectory.bin"));
+    ASSERT_TRUE(trajectory.save("trajectory.txt"));
+    ray::Trajectory binary, text;
+    ASSERT_TRUE(binary.load("trajectory.bin"));
+    EXPECT_TRUE(binary.times() == trajectory.times());
+    EXPECT_TRUE(binary.points() == trajectory.points());
+    ASSERT_TRUE(text.load("trajectory.txt"));
+    ASSERT_EQ(text.times().size(), trajectory.times().size());
+    for (size_t i = 0; i < text.times().size(); i++)
+    {
+      EXPECT_NEAR(text.times()[i], trajectory.times()[i], 1e-5);
+      EXPECT_LT((text.points()[i] - trajectory.points()[i]).norm(), 1e-12);
+    }
+
+    // the node list saves the same files, and unordered times are sorted on loading
+    std::swap(nodes[10], nodes[500]);
+    ASSERT_TRUE(ray::saveTrajectory(nodes, "nodes.bin"));
+    ASSERT_TRUE(binary.load("nodes.bin"));
+    EXPECT_TRUE(binary.times() == trajectory.times());
+    EXPECT_TRUE(binary.points() == trajectory.points());
+
+    // an empty trajectory, and binary files cut short
+    ASSERT_TRUE(ray::saveTrajectory(std::vector<ray::TrajectoryNode>(), "empty.bin"));
+    ASSERT_TRUE(binary.load("empty.bin"));
+    EXPECT_TRUE(binary.times().empty() && binary.points().empty());
+    std::ifstream input("trajectory.bin", std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    input.close();
+    std::ofstream("truncated.bin", std::ios::binary) << bytes.substr(0, bytes.size() - 1);
+    EXPECT_FALSE(binary.load("truncated.bin"));
+    std::ofstream("header.bin", std::ios::binary) << bytes.substr(0, 12);
+    EXPECT_FALSE(binary.load("header.bin"));
+    EXPECT_FALSE(binary.load("missing.bin"));
+
+    // text comments, blank lines and CRLF line ends, without a final line end
+    std::ofstream("comments.txt", std::ios::binary) << "%time x y z\r\n2 4 5 6\r\n% more\n1 1 2 3 extra\n\n"
+                                                    << "3 7 8 9";
+    ASSERT_TRUE(text.load("comments.txt"));
+    EXPECT_TRUE(text.times() == std::vector<double>({ 1, 2, 3 }));
+    EXPECT_TRUE(text.points()[0] == Eigen::Vector3d(1, 2, 3) && text.points()[2] == Eigen::Vector3d(7, 8, 9));
+    std::ofstream("malformed.txt", std::ios::binary) << "1 2 3 4\n2 3 x 5\n";
+    EXPECT_FALSE(text.load("malformed.txt"));
+
+    // lines of up to 255 characters load, and longer lines are an error rather than being cut short
+    const std::string line = "1 2 3 4";
+    std::ofstream("long_line.txt", std::ios::binary) << line << std::string(255 - line.size(), ' ') << "\n";
+    ASSERT_TRUE(text.load("long_line.txt"));
+    EXPECT_EQ(text.times().size(), 1u);
+    std::ofstream("too_long_line.txt", std::ios::binary) << line << std::string(256 - line.size(), ' ') << "\n";
+    EXPECT_FALSE(text.load("too_long_line.txt"));
+  }
+
 #if RAYLIB_WITH_QHULL
   /// Creates a terrain ray cloud, then wraps it from below, comparing the mesh to the expected results
   TEST(Basic, RayWrap)
@@ -200,6 +1141,73 @@ namespace raytest
     compareMoments(mesh.getMoments(), {0.0386662, -1.52168, -0.139079, 3.30621, 3.35391, 0.705937});
   }  
 
+  /// The triangles of @c mesh as their corner positions, starting at the least corner so that the winding is kept,
+  /// in sorted order. This compares meshes independently of their vertex and triangle order
+  std::vector<std::array<double, 9>> orientedTriangles(const ray::Mesh &mesh)
+  {
+    std::vector<std::array<double, 9>> triangles;
+    for (auto &tri : mesh.indexList())
+    {
+      int first = 0;
+      for (int i = 1; i < 3; i++)
+      {
+        const Eigen::Vector3d &a = mesh.vertices()[tri[i]], &b = mesh.vertices()[tri[first]];
+        if (std::lexicographical_compare(a.data(), a.data() + 3, b.data(), b.data() + 3))
+          first = i;
+      }
+      std::array<double, 9> triangle;
+      for (int i = 0; i < 3; i++)
+      {
+        for (int j = 0; j < 3; j++) triangle[3 * i + j] = mesh.vertices()[tri[(first + i) % 3]][j];
+      }
+      triangles.push_back(triangle);
+    }
+    std::sort(triangles.begin(), triangles.end());
+    return triangles;
+  }
+
+  /// Wraps generated scenes in every direction and at several curvatures, checking that the hull of only the points
+  /// kept by ConvexHull::loadCandidates has the same triangles as the hull of the whole cloud
+  TEST(Basic, ConvexHullCandidates)
+  {
+    auto grow = [](ray::ConvexHull &hull, const std::string &direction, double curvature) {
+      if (direction == "inwards")
+        hull.growInwards(curvature);
+      else if (direction == "outwards")
+        hull.growOutwards(curvature);
+      else if (direction == "upwards")
+        hull.growUpwards(curvature);
+      else
+        hull.growDownwards(curvature);
+      hull.mesh().reduce();
+    };
+    for (const std::string scene : { "terrain", "room", "forest" })
+    {
+      EXPECT_EQ(command("raycreate " + scene + " 1"), 0);
+      ray::Cloud cloud;
+      EXPECT_TRUE(cloud.load(scene + ".ply"));
+      cloud.removeUnboundedRays();
+      const Eigen::Vector3d cloud_offset = cloud.removeStartPos();
+      for (const std::string direction : { "upwards", "downwards", "inwards", "outwards" })
+      {
+        for (double curvature : { 0.1, 1.0, 5.0 })
+        {
+          ray::ConvexHull full_hull(cloud.ends);
+          grow(full_hull, direction, curvature);
+          std::vector<Eigen::Vector3d> candidates;
+          Eigen::Vector3d offset, centre;
+          EXPECT_TRUE(
+            ray::ConvexHull::loadCandidates(scene + ".ply", direction, curvature, candidates, offset, centre));
+          EXPECT_EQ(offset, cloud_offset);
+          ray::ConvexHull hull(candidates, centre);
+          grow(hull, direction, curvature);
+          EXPECT_TRUE(orientedTriangles(hull.mesh()) == orientedTriangles(full_hull.mesh()))
+            << scene << " " << direction << " " << curvature;
+        }
+      }
+    }
+  }
+
   /// Tests extraction of terrain and extraction of trees
   TEST(Basic, RayExtract)
   {
@@ -226,5 +1234,31 @@ namespace raytest
     EXPECT_TRUE(forest3.load("forest_trunks.txt"));
     compareMoments(forest3.getMoments(), {21, 20.0797, 1124.61, 1.60427, 0.135159, 0, 0, 0, 0});
   }  
+
+  /// Extracts terrain from a generated cloud whole and in tiles, and compares the height fields of the two meshes
+  TEST(Basic, RayExtractTerrainTiles)
+  {
+    EXPECT_EQ(command("raycreate terrain 1"), 0);
+    EXPECT_EQ(copy("terrain.ply terrain_tiled.ply"), 0);
+    EXPECT_EQ(command("rayextract terrain terrain.ply"), 0);
+    EXPECT_EQ(command("rayextract terrain terrain_tiled.ply --tiles 6,2"), 0);
+    ray::Mesh mesh, tiled_mesh;
+    EXPECT_TRUE(ray::readPlyMesh("terrain_mesh.ply", mesh));
+    EXPECT_TRUE(ray::readPlyMesh("terrain_tiled_mesh.ply", tiled_mesh));
+
+    Eigen::Vector3d box_min(1e10, 1e10, 1e10), box_max(-1e10, -1e10, -1e10);
+    for (const auto &vertex : mesh.vertices())
+    {
+      box_min = box_min.cwiseMin(vertex);
+      box_max = box_max.cwiseMax(vertex);
+    }
+    Eigen::ArrayXXd heights, tiled_heights;
+    mesh.toHeightField(heights, box_min, box_max, 0.5);
+    tiled_mesh.toHeightField(tiled_heights, box_min, box_max, 0.5);
+    ASSERT_EQ(tiled_heights.rows(), heights.rows());
+    ASSERT_EQ(tiled_heights.cols(), heights.cols());
+    // the tiles triangulate the same ground points, so the meshes only differ in some triangles along the seams
+    EXPECT_LT((tiled_heights - heights).abs().mean(), 0.05);
+  }
 #endif  // RAYLIB_WITH_QHULL
 } // raytest